@@ -0,0 +1,719 @@
+// ===============================================================================================
+// Evacuation Solver: Micro benchmarks implementation
+// Description: Synthetic workloads to compare the solver data structures against each other
+//
+// Copyright (C) 2014 Kaveh Shahabi
+// Distributed under the Apache Software License, Version 2.0. (See accompanying file LICENSE.txt)
+//
+// Author: Kaveh Shahabi
+// URL: http://github.com/spatial-computing/CASPER
+// ===============================================================================================
+
+#include "StdAfx.h"
+#include "Benchmark.h"
+#include "NetworkGraph.h"
+#include "FibonacciHeap.h"
+#include "IndexedHeap.h"
+#include "NAEdge.h"
+#include "DeltaStepping.h"
+#include "ContractionHierarchy.h"
+
+#ifdef BENCHMARK
+
+// Builds 'grids' disconnected side by side grids with two-way roads. Junction and edge EIDs start from one just like a network dataset.
+static void BuildGridGraph(size_t side, CSRNetworkGraph & graph, size_t grids = 1)
+{
+	std::vector<CSRNetworkGraph::EdgeRecord> records;
+	CSRNetworkGraph::EdgeRecord r;
+	unsigned int seed = 12345;
+	long eid = 0;
+
+	records.reserve(side * side * 4 * grids);
+	r.SourceID = r.SourceOID = -1;
+	r.FromPosition = 0.0;
+	r.ToPosition = 1.0;
+	r.Capacity = 1.0f;
+
+	for (size_t g = 0; g < grids; ++g)
+		for (size_t row = 0; row < side; ++row)
+			for (size_t col = 0; col < side; ++col)
+			{
+				long j = (long)((g * side + row) * side + col + 1);
+				long neighbors[2] = { col + 1 < side ? j + 1 : -1, row + 1 < side ? j + (long)side : -1 };
+				for (long n : neighbors)
+				{
+					if (n < 0) continue;
+					seed = seed * 1103515245 + 12345;
+					r.EID = ++eid;
+					r.Cost = 1.0 + (seed >> 16) % 10;
+					r.Dir = 1; r.FromJunction = j; r.ToJunction = n; records.push_back(r);
+					r.Dir = 2; r.FromJunction = n; r.ToJunction = j; records.push_back(r);
+				}
+			}
+	graph.Build(records);
+}
+
+struct BenchmarkSearchState
+{
+	double GVal;
+	bool   Closed;
+	BenchmarkSearchState() : GVal(FLT_MAX), Closed(false) { }
+};
+
+// one hash table per direction, which is how NAEdgeCache and NAVertexCache used to look up their items
+class HashedStateStore
+{
+private:
+	std::unordered_map<long, BenchmarkSearchState> along, against;
+
+public:
+	HashedStateStore(size_t) { }
+	BenchmarkSearchState & At(long eid, unsigned char dir) { return dir == 1 ? along[eid] : against[eid]; }
+};
+
+class DenseStateStore
+{
+private:
+	std::vector<BenchmarkSearchState> table;
+
+public:
+	DenseStateStore(size_t slots) : table(slots) { }
+	BenchmarkSearchState & At(long eid, unsigned char dir) { return table[(size_t)eid * 2 + dir - 1]; }
+};
+
+// Edge based Dijkstra (same shape as the CASPER search loop) from one junction to the whole graph. Returns the number of heap extracts.
+template <class Store> size_t BenchmarkEdgeSearch(const CSRNetworkGraph & graph, long source)
+{
+	Store store(graph.EdgeSlotCount());
+	MyFibonacciHeap<size_t> heap([&store](const size_t & i) { return store.At((long)(i / 2), (unsigned char)(i % 2 + 1)).GVal; });
+	const GraphArc * first = nullptr, * last = nullptr;
+	long from, to;
+	double cost;
+	float capacity;
+	size_t extracts = 0, i;
+
+	graph.GetAdjacencies(source, true, first, last);
+	for (const GraphArc * a = first; a != last; ++a)
+	{
+		graph.GetEdge(a->EID, a->Dir, from, to, cost, capacity);
+		store.At(a->EID, a->Dir).GVal = cost;
+		heap.Insert((size_t)a->EID * 2 + a->Dir - 1);
+	}
+
+	while (!heap.empty())
+	{
+		i = heap.DeleteMin();
+		++extracts;
+		BenchmarkSearchState & current = store.At((long)(i / 2), (unsigned char)(i % 2 + 1));
+		current.Closed = true;
+		graph.GetEdge((long)(i / 2), (unsigned char)(i % 2 + 1), from, to, cost, capacity);
+		graph.GetAdjacencies(to, true, first, last);
+
+		for (const GraphArc * a = first; a != last; ++a)
+		{
+			BenchmarkSearchState & next = store.At(a->EID, a->Dir);
+			if (next.Closed) continue;
+			graph.GetEdge(a->EID, a->Dir, from, to, cost, capacity);
+			if (current.GVal + cost >= next.GVal) continue;
+			bool inHeap = next.GVal < FLT_MAX;
+			next.GVal = current.GVal + cost;
+			if (inHeap) heap.UpdateKey((size_t)a->EID * 2 + a->Dir - 1);
+			else heap.Insert((size_t)a->EID * 2 + a->Dir - 1);
+		}
+	}
+	return extracts;
+}
+
+void BenchmarkEdgeStore(size_t gridSide)
+{
+	CSRNetworkGraph graph;
+	std::wostringstream os;
+	long source = (long)(gridSide * (gridSide / 2) + gridSide / 2 + 1);
+
+	BuildGridGraph(gridSide, graph);
+
+	auto start = std::chrono::high_resolution_clock::now();
+	size_t hashedExtracts = BenchmarkEdgeSearch<HashedStateStore>(graph, source);
+	auto middle = std::chrono::high_resolution_clock::now();
+	size_t denseExtracts = BenchmarkEdgeSearch<DenseStateStore>(graph, source);
+	auto end = std::chrono::high_resolution_clock::now();
+
+	double hashedSec = std::chrono::duration<double>(middle - start).count();
+	double denseSec = std::chrono::duration<double>(end - middle).count();
+	os.precision(4);
+	os << L"Edge store benchmark: " << graph.EdgeCount() << L" directed edges" << std::endl;
+	os << L"  hashed: " << hashedExtracts << L" extracts in " << hashedSec << L" sec (" << hashedExtracts / max(hashedSec, 1e-9) << L" per sec)" << std::endl;
+	os << L"  dense:  " << denseExtracts  << L" extracts in " << denseSec  << L" sec (" << denseExtracts  / max(denseSec, 1e-9)  << L" per sec)" << std::endl;
+	OutputDebugStringW(os.str().c_str());
+}
+
+// An isolated junction (or any junction past the highest one used by an edge) has to look like a junction with no neighbors
+// so the search just skips it instead of failing the whole solve. Checks both the in-memory build and the text file loader.
+void CheckNetworkGraphLoader()
+{
+	std::vector<CSRNetworkGraph::EdgeRecord> records;
+	CSRNetworkGraph::EdgeRecord r = { 1, 1, 1, 2, 10.0, 1.0f, -1, -1, 0.0, 1.0 };
+	CSRNetworkGraph graph;
+	FileNetworkGraph fileGraph;
+	const GraphArc * first = nullptr, * last = nullptr;
+	CHAR tempFolder[MAX_PATH + 1] = { 0 };
+	std::string path;
+	std::wostringstream os;
+	bool passed = true;
+
+	records.push_back(r);
+	r.Dir = 2; r.FromJunction = 2; r.ToJunction = 1; records.push_back(r);
+	graph.Build(records, 5);
+
+	passed &= graph.JunctionCount() == 6;
+	passed &= graph.GetAdjacencies(1, true, first, last) && last - first == 1 && first->Junction == 2;
+	passed &= graph.GetAdjacencies(5, true, first, last) && first == last;
+	passed &= graph.GetAdjacencies(5, false, first, last) && first == last;
+	passed &= graph.GetAdjacencies(9, true, first, last) && first == last;
+	passed &= !graph.GetAdjacencies(-1, true, first, last);
+
+	GetTempPathA(MAX_PATH, tempFolder);
+	path = std::string(tempFolder) + "CASPER_graphcheck.txt";
+	{
+		std::ofstream f(path);
+		f << "# EID Dir FromJunction ToJunction Cost Capacity" << std::endl << "1 1 1 2 10 1" << std::endl << "1 2 2 1 10 1" << std::endl;
+	}
+	passed &= fileGraph.Load(path);
+	passed &= fileGraph.GetAdjacencies(2, false, first, last) && last - first == 1 && first->Junction == 1;
+	passed &= fileGraph.GetAdjacencies(7, false, first, last) && first == last;
+	DeleteFileA(path.c_str());
+
+	_ASSERT_EXPR(passed, L"Network graph loader check failed");
+	os << L"Network graph loader check: " << (passed ? L"passed" : L"failed") << std::endl;
+	OutputDebugStringW(os.str().c_str());
+}
+
+// The parent arc of every junction has to lead to the next junction towards the targets and add up to the same distance,
+// no matter how many threads applied the relax requests.
+void CheckDeltaSteppingTree(size_t gridSide)
+{
+	CSRNetworkGraph graph;
+	DeltaStepping search(std::shared_ptr<ThreadPool>(new DEBUG_NEW_PLACEMENT ThreadPool(4)));
+	std::vector<double> cost, dist;
+	std::vector<GraphArc> parents;
+	std::vector<std::pair<long, double>> targets;
+	std::wostringstream os;
+	long from, to;
+	double c;
+	float capacity;
+	size_t badArcs = 0;
+
+	BuildGridGraph(gridSide, graph);
+	cost.assign(graph.EdgeSlotCount(), CASPER_INFINITY);
+	for (long eid = 0; (size_t)eid * 2 + 1 < cost.size(); ++eid)
+		for (unsigned char d = 1; d <= 2; ++d)
+			if (graph.GetEdge(eid, d, from, to, c, capacity)) cost[eid * 2 + d - 1] = c;
+	targets.push_back(std::pair<long, double>(1, 0.0));
+	targets.push_back(std::pair<long, double>((long)(gridSide * gridSide), 2.0));
+	search.QueryToTargets(graph, cost, targets, dist, CASPER_INFINITY, &parents);
+
+	for (long j = 1; (size_t)j < dist.size(); ++j)
+	{
+		const GraphArc & p = parents[j];
+		if (p.EID < 0)
+		{
+			if (j != targets[0].first && j != targets[1].first) ++badArcs;
+			continue;
+		}
+		if (!graph.GetEdge(p.EID, p.Dir, from, to, c, capacity) || from != j || to != p.Junction || std::fabs(dist[p.Junction] + c - dist[j]) > 1e-9) ++badArcs;
+	}
+
+	_ASSERT_EXPR(badArcs == 0, L"Delta-stepping tree check failed");
+	os << L"Delta-stepping tree check: " << (badArcs == 0 ? L"passed" : L"failed") << L" (" << badArcs << L" bad parent arcs)" << std::endl;
+	OutputDebugStringW(os.str().c_str());
+}
+
+// The hierarchy sweeps have to answer the same distances as the delta-stepping search, on a network with more than one
+// connected component, both after the first customization and after some edges changed cost.
+void CheckContractionHierarchy(size_t gridSide)
+{
+	CSRNetworkGraph graph;
+	ContractionHierarchy hierarchy;
+	DeltaStepping search(std::shared_ptr<ThreadPool>(new DEBUG_NEW_PLACEMENT ThreadPool(4)));
+	std::vector<double> cost, dist, expected;
+	std::vector<std::pair<long, double>> targets;
+	std::wostringstream os;
+	long from, to;
+	double c;
+	float capacity;
+	size_t badDists = 0;
+	unsigned int seed = 54321;
+
+	BuildGridGraph(gridSide, graph, 3);
+	cost.assign(graph.EdgeSlotCount(), CASPER_INFINITY);
+	for (long eid = 0; (size_t)eid * 2 + 1 < cost.size(); ++eid)
+		for (unsigned char d = 1; d <= 2; ++d)
+			if (graph.GetEdge(eid, d, from, to, c, capacity)) cost[eid * 2 + d - 1] = c;
+
+	// targets in the first two grids only. the third grid can not reach any of them.
+	targets.push_back(std::pair<long, double>(1, 0.0));
+	targets.push_back(std::pair<long, double>((long)(gridSide * gridSide * 2), 3.0));
+
+	hierarchy.Build(graph);
+	if (hierarchy.JunctionCount() != graph.JunctionCount()) ++badDists;
+	auto costOf = [&cost](long eid, unsigned char dir) -> double
+	{
+		size_t i = (size_t)eid * 2 + dir - 1;
+		return i < cost.size() ? cost[i] : CASPER_INFINITY;
+	};
+
+	for (int round = 0; round < 2; ++round)
+	{
+		if (round == 0) hierarchy.Customize(costOf, CASPER_INFINITY);
+		else
+		{
+			// congest every seventh edge and close a few
+			for (size_t i = 0; i < cost.size(); i += 7)
+			{
+				if (cost[i] >= CASPER_INFINITY) continue;
+				seed = seed * 1103515245 + 12345;
+				cost[i] = (seed >> 16) % 50 == 0 ? CASPER_INFINITY : cost[i] * (1.0 + (seed >> 16) % 5);
+				hierarchy.UpdateEdgeCost((long)(i / 2), (unsigned char)(i % 2 + 1), cost[i], CASPER_INFINITY);
+			}
+			hierarchy.Recustomize();
+		}
+		hierarchy.QueryToTargets(targets, dist, CASPER_INFINITY);
+		search.QueryToTargets(graph, cost, targets, expected, CASPER_INFINITY);
+		for (size_t j = 1; j < expected.size(); ++j)
+			if (j >= dist.size() || std::fabs(dist[j] - expected[j]) > 1e-9) ++badDists;
+	}
+
+	_ASSERT_EXPR(badDists == 0, L"Contraction hierarchy check failed");
+	os << L"Contraction hierarchy check: " << (badDists == 0 ? L"passed" : L"failed") << L" (" << badDists << L" wrong distances, "
+		<< hierarchy.ArcCount() << L" arcs)" << std::endl;
+	OutputDebugStringW(os.str().c_str());
+}
+
+std::wstring GetHeapTracePath(const wchar_t * traceName)
+{
+	WCHAR tempFolder[MAX_PATH + 1] = { 0 };
+	std::wostringstream os;
+	GetTempPathW(MAX_PATH, tempFolder);
+	os << tempFolder << L"CASPER_" << traceName << L".heaptrace";
+	return os.str();
+}
+
+struct TraceHeapKey
+{
+	const std::vector<double> * keys;
+	TraceHeapKey(const std::vector<double> * _keys = nullptr) : keys(_keys) { }
+	inline double operator()(const unsigned int & i) const { return (*keys)[i]; }
+};
+
+struct TraceHeapIndex
+{
+	inline size_t operator()(const unsigned int & i) const { return i; }
+};
+
+template<class Heap> double ReplayHeapTrace(const std::vector<HeapTraceOp> & ops, std::vector<double> & keys, Heap & heap, size_t & extracts)
+{
+	auto start = std::chrono::high_resolution_clock::now();
+	extracts = 0;
+	for (const auto & o : ops)
+	{
+		switch (o.Op)
+		{
+		case 'I': keys[o.Index] = o.Key; heap.Insert(o.Index);    break;
+		case 'U': keys[o.Index] = o.Key; heap.UpdateKey(o.Index); break;
+		case 'D': heap.DeleteMin(); ++extracts;                   break;
+		case 'C': heap.Clear();                                   break;
+		}
+	}
+	return std::chrono::duration<double>(std::chrono::high_resolution_clock::now() - start).count();
+}
+
+void BenchmarkHeapTrace(const wchar_t * traceName, bool monotone)
+{
+	std::wstring path = GetHeapTracePath(traceName);
+	std::ifstream f(path, std::ios_base::in | std::ios_base::binary);
+	std::vector<HeapTraceOp> ops;
+	std::vector<double> keys;
+	std::wostringstream os;
+	HeapTraceOp o;
+	size_t extracts = 0, maxIndex = 0;
+
+	if (!f.is_open()) return;
+	while (f.read((char *)&o, sizeof(HeapTraceOp)))
+	{
+		ops.push_back(o);
+		maxIndex = max(maxIndex, (size_t)o.Index);
+	}
+	f.close();
+	if (ops.empty()) return;
+	keys.assign(maxIndex + 1, 0.0);
+	TraceHeapKey traceKey(&keys);
+
+	os.precision(4);
+	os << L"Heap trace benchmark (" << traceName << L"): " << ops.size() << L" operations" << std::endl;
+	{
+		MyFibonacciHeap<unsigned int> heap([&keys](const unsigned int & i) { return keys[i]; });
+		double sec = ReplayHeapTrace(ops, keys, heap, extracts);
+		os << L"  fibonacci:   " << sec << L" sec, " << extracts / max(sec, 1e-9) << L" extracts per sec" << std::endl;
+	}
+	{
+		QuaternaryHeap<unsigned int, TraceHeapKey, TraceHeapIndex> heap(traceKey);
+		double sec = ReplayHeapTrace(ops, keys, heap, extracts);
+		os << L"  4-ary:       " << sec << L" sec, " << extracts / max(sec, 1e-9) << L" extracts per sec" << std::endl;
+	}
+	{
+		LazyBinaryHeap<unsigned int, TraceHeapKey, TraceHeapIndex> heap(traceKey);
+		double sec = ReplayHeapTrace(ops, keys, heap, extracts);
+		os << L"  lazy binary: " << sec << L" sec, " << extracts / max(sec, 1e-9) << L" extracts per sec" << std::endl;
+	}
+	if (monotone)
+	{
+		RadixHeap<unsigned int, TraceHeapKey, TraceHeapIndex> heap(traceKey);
+		double sec = ReplayHeapTrace(ops, keys, heap, extracts);
+		os << L"  radix:       " << sec << L" sec, " << extracts / max(sec, 1e-9) << L" extracts per sec" << std::endl;
+	}
+	OutputDebugStringW(os.str().c_str());
+}
+
+// The reservation vector as it was before it got indexed. Without 'MarkDirty' it is the vector from before the paths kept their
+// costs (nothing to mark, every pass recalculates every path). With it, every add and remove marks all the paths on the edge dirty.
+template <bool MarkDirty> class VectorReservations : private std::vector<EvcPathPtr>
+{
+private:
+	double ReservedPop;
+	void MarkPathCostsDirty() const { if (MarkDirty) for (const auto & p : *this) p->MarkCostDirty(); }
+
+public:
+	VectorReservations() : ReservedPop(0.0) { }
+
+	void AddReservation(double newFlow, EvcPathPtr path)
+	{
+		push_back(path);
+		ReservedPop += newFlow;
+		MarkPathCostsDirty();
+	}
+
+	void RemoveReservation(double flow, EvcPathPtr path)
+	{
+		size_t orgSize = size();
+		erase(std::remove_if(begin(), end(), [&path](const EvcPathPtr & myPath)->bool { return *path == *myPath; }), end());
+		size_t removedCount = orgSize - size();
+		ReservedPop = max(0.0, ReservedPop - flow * removedCount);
+		if (removedCount > 0) MarkPathCostsDirty();
+	}
+
+	void SwapReservation(const EvcPathPtr oldPath, const EvcPathPtr newPath)
+	{
+		for (auto & p : *this) if (*oldPath == *p) p = newPath;
+	}
+
+	void GetUniquePaths(std::vector<EvcPathPtr> & paths)
+	{
+		std::sort(begin(), end(), EvcPath::LessThanPathOrder2);
+		for (const auto & p : *this) if (paths.empty() || *p != *paths.back()) paths.push_back(p);
+	}
+
+	void PathCostCleaned() { }
+};
+
+// The hottest edge: all paths get reserved in order, then the iterative passes keep detaching a path and attaching it back at the
+// end, the dynamic steps split some paths into a new one, and every so often the crossing paths are enumerated and their costs
+// are recalculated. Returns the total number of crossings seen so both structures can be checked against each other.
+template <class Reservations> size_t BenchmarkReservationWorkload(Reservations & reservations, std::vector<EvcPathPtr> & paths, size_t pathCount, size_t ops)
+{
+	std::vector<EvcPathPtr> crossings;
+	unsigned int seed = 12345;
+	size_t crossingCount = 0, i;
+
+	for (i = 0; i < pathCount; ++i) reservations.AddReservation(1.0, paths[i]);
+	for (size_t op = 1; op <= ops; ++op)
+	{
+		seed = seed * 1103515245 + 12345;
+		i = (seed >> 8) % pathCount;
+		if (op % 8 == 0)
+		{
+			reservations.SwapReservation(paths[i], paths[pathCount + op / 8 - 1]);
+			std::swap(paths[i], paths[pathCount + op / 8 - 1]);
+		}
+		else
+		{
+			reservations.RemoveReservation(1.0, paths[i]);
+			reservations.AddReservation(1.0, paths[i]);
+		}
+		if (op % 64 == 0)
+		{
+			crossings.clear();
+			reservations.GetUniquePaths(crossings);
+			crossingCount += crossings.size();
+			reservations.PathCostCleaned();
+		}
+	}
+	return crossingCount;
+}
+
+void BenchmarkEdgeReservations(size_t pathCount)
+{
+	VARIANT name;
+	VariantInit(&name);
+	Evacuee evc(name, 1.0, 0);
+	std::vector<EvcPathPtr> paths, plainPaths, oldPaths, newPaths;
+	TrafficModel model(EvcTrafficModel::POWERModel, 10.0, 500.0, 0.0);
+	VectorReservations<false> plainReservations;
+	VectorReservations<true> eagerReservations;
+	EdgeReservations newReservations(1.0f, &model);
+	std::wostringstream os;
+	size_t ops = pathCount / 4;
+
+	for (size_t i = 0; i < pathCount + ops / 8; ++i) paths.push_back(new DEBUG_NEW_PLACEMENT EvcPath(0.0, 1.0, (int)i + 1, &evc, nullptr));
+	plainPaths = paths;
+	oldPaths = paths;
+	newPaths = paths;
+
+	auto start = std::chrono::high_resolution_clock::now();
+	size_t plainCrossings = BenchmarkReservationWorkload(plainReservations, plainPaths, pathCount, ops);
+	auto first = std::chrono::high_resolution_clock::now();
+	size_t oldCrossings = BenchmarkReservationWorkload(eagerReservations, oldPaths, pathCount, ops);
+	auto middle = std::chrono::high_resolution_clock::now();
+	size_t newCrossings = BenchmarkReservationWorkload(newReservations, newPaths, pathCount, ops);
+	auto end = std::chrono::high_resolution_clock::now();
+
+	double plainSec = std::chrono::duration<double>(first - start).count();
+	double oldSec = std::chrono::duration<double>(middle - first).count();
+	double newSec = std::chrono::duration<double>(end - middle).count();
+	os.precision(4);
+	os << L"Edge reservation benchmark: " << pathCount << L" paths, " << ops << L" operations" << std::endl;
+	os << L"  vector:       " << plainSec << L" sec (" << ops / max(plainSec, 1e-9) << L" per sec), " << plainCrossings << L" crossings" << std::endl;
+	os << L"  vector+dirty: " << oldSec << L" sec (" << ops / max(oldSec, 1e-9) << L" per sec), " << oldCrossings << L" crossings" << std::endl;
+	os << L"  indexed:      " << newSec << L" sec (" << ops / max(newSec, 1e-9) << L" per sec), " << newCrossings << L" crossings" << std::endl;
+	OutputDebugStringW(os.str().c_str());
+	for (auto p : paths) delete p;
+}
+
+// The two directions of a two-way road share one reservation object, so a route on one direction raises the cost of the other one
+// too. The repaired searches must see both directions as changed, while a one-way pair of edges has nothing to do with each other.
+void CheckSharedCapacityChanges()
+{
+	VARIANT name;
+	VariantInit(&name);
+	Evacuee evc(name, 200.0, 0);
+	TrafficModel model(EvcTrafficModel::POWERModel, 10.0, 500.0, 0.0);
+	std::list<EdgeReservationsPtr> resTable;
+	std::vector<std::pair<NAEdgePtr, double>> oldCosts;
+	std::vector<NAEdgePtr> changed;
+	std::wostringstream os;
+	bool passed = true;
+
+	NAEdgePtr along    = new DEBUG_NEW_PLACEMENT NAEdge(nullptr, 1, esriNEDAlongDigitized,   10.0, 1.0f, nullptr, nullptr, true, resTable, &model);
+	NAEdgePtr against  = new DEBUG_NEW_PLACEMENT NAEdge(nullptr, 1, esriNEDAgainstDigitized, 10.0, 1.0f, nullptr, along,   true, resTable, &model);
+	NAEdgePtr oneWay   = new DEBUG_NEW_PLACEMENT NAEdge(nullptr, 2, esriNEDAlongDigitized,   10.0, 1.0f, nullptr, nullptr, false, resTable, &model);
+	NAEdgePtr otherWay = new DEBUG_NEW_PLACEMENT NAEdge(nullptr, 2, esriNEDAgainstDigitized, 10.0, 1.0f, nullptr, oneWay,  false, resTable, &model);
+	EvcPathPtr path    = new DEBUG_NEW_PLACEMENT EvcPath(0.0, 200.0, 1, &evc, nullptr);
+	const double againstCost = against->GetCost(1.0, EvcSolverMethod::CASPERSolver), otherWayCost = otherWay->GetCost(1.0, EvcSolverMethod::CASPERSolver);
+	auto twinOf = [&](NAEdgePtr e) -> NAEdgePtr { return e == along ? against : e == oneWay ? otherWay : nullptr; };
+
+	oldCosts.push_back(std::pair<NAEdgePtr, double>(along,  along->GetCost(1.0, EvcSolverMethod::CASPERSolver)));
+	oldCosts.push_back(std::pair<NAEdgePtr, double>(oneWay, oneWay->GetCost(1.0, EvcSolverMethod::CASPERSolver)));
+	along->AddReservation(path, EvcSolverMethod::CASPERSolver);
+	oneWay->AddReservation(path, EvcSolverMethod::CASPERSolver);
+	NAEdge::GetChangedEdges(oldCosts, 1.0, EvcSolverMethod::CASPERSolver, false, twinOf, changed);
+
+	passed &= along->SharesReservations(against) && !oneWay->SharesReservations(otherWay);
+	passed &= against->GetCost(1.0, EvcSolverMethod::CASPERSolver) > againstCost;
+	passed &= otherWay->GetCost(1.0, EvcSolverMethod::CASPERSolver) == otherWayCost;
+	passed &= changed.size() == 3 && changed[0] == along && changed[1] == against && changed[2] == oneWay;
+
+	_ASSERT_EXPR(passed, L"Shared capacity change check failed");
+	os << L"Shared capacity change check: " << (passed ? L"passed" : L"failed") << std::endl;
+	OutputDebugStringW(os.str().c_str());
+	delete along;
+	delete against;
+	delete oneWay;
+	delete otherWay;
+	delete path;
+	for (auto r : resTable) delete r;
+}
+
+static const wchar_t * TrafficModelNames[] = { L"flat:  ", L"step:  ", L"linear:", L"power: ", L"exp:   " };
+
+// edges with no geometry and a mix of capacities and costs that all share the given traffic model
+static void BuildBenchmarkEdges(size_t edgeCount, TrafficModel * model, std::vector<NAEdgePtr> & edges, std::list<EdgeReservationsPtr> & resTable)
+{
+	unsigned int seed = 12345;
+	for (size_t i = 0; i < edgeCount; ++i)
+	{
+		seed = seed * 1103515245 + 12345;
+		edges.push_back(new DEBUG_NEW_PLACEMENT NAEdge(nullptr, (long)i + 1, esriNEDAlongDigitized, 1.0 + (seed >> 8) % 10, 1.0f + (seed >> 16) % 20,
+			nullptr, nullptr, false, resTable, model));
+	}
+}
+
+void BenchmarkTrafficModels(size_t edgeCount, size_t rounds)
+{
+	std::wostringstream os;
+
+	os.precision(4);
+	os << L"Traffic model benchmark: " << edgeCount << L" edges, " << rounds << L" rounds" << std::endl;
+	for (unsigned char m = 0; m < 5; ++m)
+	{
+		TrafficModel model((EvcTrafficModel)m, 10.0, 500.0, 0.01);
+		std::list<EdgeReservationsPtr> resTable;
+		std::vector<NAEdgePtr> edges;
+		double checksum = 0.0;
+
+		BuildBenchmarkEdges(edgeCount, &model, edges, resTable);
+		auto start = std::chrono::high_resolution_clock::now();
+		for (size_t r = 0; r < rounds; ++r)
+			for (size_t i = 0; i < edgeCount; ++i) checksum += edges[i]->GetCost((double)((r * 37 + i) % 400), EvcSolverMethod::CASPERSolver);
+		double sec = std::chrono::duration<double>(std::chrono::high_resolution_clock::now() - start).count();
+
+		os << L"  " << TrafficModelNames[m] << L" " << sec * 1e9 / max(edgeCount * rounds, (size_t)1) << L" ns per call (checksum " << checksum << L")" << std::endl;
+		for (auto e : edges) delete e;
+		for (auto r : resTable) delete r;
+	}
+	OutputDebugStringW(os.str().c_str());
+}
+
+void BenchmarkBatchEdgeCosts(size_t edgeCount, size_t rounds)
+{
+	const UINT8 blockSize = 4;
+	std::wostringstream os;
+
+	os.precision(4);
+	os << L"Batch edge cost benchmark: " << edgeCount << L" edges in blocks of " << blockSize << L", " << rounds << L" rounds, AVX2 "
+		<< (TrafficModel::IsAVX2Supported() ? L"on" : L"off") << std::endl;
+	for (unsigned char m = 0; m < 5; ++m)
+	{
+		TrafficModel model((EvcTrafficModel)m, 10.0, 500.0, 0.01);
+		std::list<EdgeReservationsPtr> resTable;
+		std::vector<NAEdgePtr> edges;
+		std::vector<ArrayList<NAEdgePtr> *> blocks;
+		TrafficBatch batch;
+		TrafficModel::BatchCostFunction kernel = TrafficModel::GetBatchCostFunction(EvcSolverMethod::CASPERSolver, (EvcTrafficModel)m);
+		double pop, delta = 0.0, scalarSum = 0.0, batchSum = 0.0, worst = 0.0;
+
+		BuildBenchmarkEdges(edgeCount - edgeCount % blockSize, &model, edges, resTable);
+		for (size_t b = 0; b < edges.size(); b += blockSize)
+		{
+			blocks.push_back(new DEBUG_NEW_PLACEMENT ArrayList<NAEdgePtr>(blockSize));
+			for (UINT8 j = 0; j < blockSize; ++j) blocks.back()->at(j, edges[b + j]);
+		}
+
+		auto start = std::chrono::high_resolution_clock::now();
+		for (size_t r = 0; r < rounds; ++r)
+		{
+			pop = (double)((r * 37) % 400);
+			for (const auto & e : edges) scalarSum += e->GetCost(pop, EvcSolverMethod::CASPERSolver, &delta) + delta;
+		}
+		auto middle = std::chrono::high_resolution_clock::now();
+		for (size_t r = 0; r < rounds; ++r)
+		{
+			pop = (double)((r * 37) % 400);
+			for (const auto & b : blocks)
+			{
+				NAEdge::GetCosts(*b, pop, kernel, batch, true);
+				for (UINT8 j = 0; j < blockSize; ++j) batchSum += batch.Cost[j] + batch.GlobalDeltaCost[j];
+			}
+		}
+		auto end = std::chrono::high_resolution_clock::now();
+
+		// the largest relative difference between the two paths over one round
+		for (size_t b = 0; b < blocks.size(); ++b)
+		{
+			NAEdge::GetCosts(*(blocks[b]), 199.0, kernel, batch, true);
+			for (UINT8 j = 0; j < blockSize; ++j) worst = max(worst, abs(batch.Cost[j] / edges[b * blockSize + j]->GetCost(199.0, EvcSolverMethod::CASPERSolver) - 1.0));
+		}
+
+		double scalarNs = std::chrono::duration<double>(middle - start).count() * 1e9 / max(edges.size() * rounds, (size_t)1);
+		double batchNs  = std::chrono::duration<double>(end - middle).count()   * 1e9 / max(edges.size() * rounds, (size_t)1);
+		os << L"  " << TrafficModelNames[m] << L" scalar " << scalarNs << L" ns, batch " << batchNs << L" ns per edge, max relative difference " << worst
+			<< L" (checksums " << scalarSum << L" / " << batchSum << L")" << std::endl;
+		for (auto b : blocks) delete b;
+		for (auto e : edges) delete e;
+		for (auto r : resTable) delete r;
+	}
+	OutputDebugStringW(os.str().c_str());
+}
+
+void BenchmarkSpecializedCosts(size_t edgeCount, size_t rounds)
+{
+	const wchar_t * methodNames[] = { L"SP    ", L"CCRP  ", L"CASPER" };
+	std::wostringstream os;
+	TrafficBatch batch;
+	TrafficCoefficients c;
+	unsigned int seed = 12345;
+
+	os.precision(4);
+	os << L"Specialized edge cost benchmark: " << edgeCount << L" edges, " << rounds << L" rounds (ns per edge: run-time branches / specialized / specialized AVX2)" << std::endl;
+	for (unsigned char m = 0; m < 5; ++m)
+	{
+		TrafficModel model((EvcTrafficModel)m, 10.0, 500.0, 0.01);
+
+		batch.Resize(edgeCount);
+		for (size_t i = 0; i < edgeCount; ++i)
+		{
+			seed = seed * 1103515245 + 12345;
+			c = model.GetCoefficients(1.0 + (seed >> 16) % 20);
+			batch.OriginalCost[i] = 1.0 + (seed >> 8) % 10;
+			batch.ReservedPop[i]  = (seed >> 4) % 300;
+			batch.Flow[i]         = batch.ReservedPop[i] + (seed >> 12) % 100;
+			batch.CriticalFlow[i] = c.CriticalFlow;
+			batch.ModelRatio[i]   = c.ModelRatio;
+			batch.ExpGamma[i]     = c.ExpGamma;
+		}
+
+		for (unsigned char s = 0; s < 3; ++s)
+		{
+			EvcSolverMethod method = (EvcSolverMethod)s;
+			TrafficModel::BatchCostFunction kernel = TrafficModel::GetBatchCostFunction(method, (EvcTrafficModel)m);
+			double speed, checksum = 0.0, sec[3];
+
+			// what the search loops did before: every edge goes through the method and model branches
+			auto start = std::chrono::high_resolution_clock::now();
+			for (size_t r = 0; r < rounds; ++r)
+				for (size_t i = 0; i < edgeCount; ++i)
+				{
+					c.CriticalFlow = batch.CriticalFlow[i];
+					c.ModelRatio   = batch.ModelRatio[i];
+					c.ExpGamma     = batch.ExpGamma[i];
+					speed = model.GetSpeedRatio(c, batch.Flow[i], method);
+					batch.Cost[i] = batch.OriginalCost[i] / speed;
+					batch.GlobalDeltaCost[i] = batch.OriginalCost[i] * (model.GetSpeedRatio(c, batch.ReservedPop[i], method) - speed);
+				}
+			sec[0] = std::chrono::duration<double>(std::chrono::high_resolution_clock::now() - start).count();
+			checksum += batch.Cost[edgeCount / 2];
+
+			for (int simd = 0; simd < 2; ++simd)
+			{
+				start = std::chrono::high_resolution_clock::now();
+				for (size_t r = 0; r < rounds; ++r) kernel(batch, true, simd == 1);
+				sec[simd + 1] = std::chrono::duration<double>(std::chrono::high_resolution_clock::now() - start).count();
+				checksum += batch.Cost[edgeCount / 2];
+			}
+
+			for (auto & t : sec) t *= 1e9 / max(edgeCount * rounds, (size_t)1);
+			os << L"  " << methodNames[s] << L" " << TrafficModelNames[m] << L" " << sec[0] << L" / " << sec[1] << L" / " << sec[2]
+				<< L" (" << sec[0] / max(sec[1], 1e-9) << L"x, " << sec[0] / max(sec[2], 1e-9) << L"x, checksum " << checksum << L")" << std::endl;
+		}
+	}
+	OutputDebugStringW(os.str().c_str());
+}
+
+// Heap traces are recorded during a solve, so each solve replays the traces of the previous one
+// and then deletes them to make room for its own.
+void RunSolverBenchmarks()
+{
+	CheckNetworkGraphLoader();
+	CheckSharedCapacityChanges();
+	CheckDeltaSteppingTree();
+	CheckContractionHierarchy();
+	BenchmarkEdgeStore();
+	BenchmarkEdgeReservations();
+	BenchmarkTrafficModels();
+	BenchmarkBatchEdgeCosts();
+	BenchmarkSpecializedCosts();
+	BenchmarkHeapTrace(L"casper", false);
+	BenchmarkHeapTrace(L"carma", true);
+	DeleteFileW(GetHeapTracePath(L"casper").c_str());
+	DeleteFileW(GetHeapTracePath(L"carma").c_str());
+}
+
+#endif
@@ -0,0 +1,106 @@
+// ===============================================================================================
+// Evacuation Solver: Micro benchmarks
+// Description: Synthetic workloads to compare the solver data structures against each other.
+// Only compiled in when BENCHMARK is defined; results go to the debugger output window.
+//
+// Copyright (C) 2014 Kaveh Shahabi
+// Distributed under the Apache Software License, Version 2.0. (See accompanying file LICENSE.txt)
+//
+// Author: Kaveh Shahabi
+// URL: http://github.com/spatial-computing/CASPER
+// ===============================================================================================
+
+#pragma once
+
+#include "StdAfx.h"
+
+#ifdef BENCHMARK
+
+// one recorded heap operation: 'I'nsert, 'U'pdateKey, 'D'eleteMin, or 'C'lear
+struct HeapTraceOp
+{
+	unsigned char Op;
+	unsigned int  Index;
+	double        Key;
+};
+
+std::wstring GetHeapTracePath(const wchar_t * traceName);
+
+// Wraps one of the solver heaps and records every operation along with the index and key of the item.
+// The trace is appended to a file in the temp folder (named by the key functor) when the heap goes out of scope.
+template<class Heap>
+class HeapTraceRecorder : public Heap
+{
+private:
+	typedef typename Heap::value_type T;
+	std::vector<HeapTraceOp>      ops;
+	typename Heap::key_func       key;
+	typename Heap::index_func     index;
+
+	inline void Record(unsigned char op, const T & value)
+	{
+		HeapTraceOp o = { op, (unsigned int)index(value), key(value) };
+		ops.push_back(o);
+	}
+
+public:
+	HeapTraceRecorder(void) { }
+
+	virtual ~HeapTraceRecorder(void)
+	{
+		std::ofstream f(GetHeapTracePath(Heap::key_func::TraceName()), std::ios_base::out | std::ios_base::binary | std::ios_base::app);
+		if (f.is_open() && !ops.empty()) f.write((const char *)ops.data(), ops.size() * sizeof(HeapTraceOp));
+	}
+
+	void Insert(const T & value)    { Record('I', value); Heap::Insert(value);    }
+	void UpdateKey(const T & value) { Record('U', value); Heap::UpdateKey(value); }
+
+	T DeleteMin()
+	{
+		HeapTraceOp o = { 'D', 0, 0.0 };
+		ops.push_back(o);
+		return Heap::DeleteMin();
+	}
+
+	void Clear()
+	{
+		HeapTraceOp o = { 'C', 0, 0.0 };
+		ops.push_back(o);
+		Heap::Clear();
+	}
+};
+
+// isolated and out of range junctions have empty adjacency slices in both the in-memory graph and the text file loader
+void CheckNetworkGraphLoader();
+
+// a route on one direction of a two-way road that shares its capacity changes the cost of both directions
+void CheckSharedCapacityChanges();
+
+// the parent arcs of a parallel delta-stepping search form a shortest path tree towards the targets
+void CheckDeltaSteppingTree(size_t gridSide = 100);
+
+// the contraction hierarchy answers the same distances as the delta-stepping search before and after a re-customization
+void CheckContractionHierarchy(size_t gridSide = 40);
+
+// heap extract throughput of an edge based search when the per-edge state is looked up from hash tables vs. a dense EID table
+void BenchmarkEdgeStore(size_t gridSide = 500);
+
+// replays a recorded heap trace on every heap engine. The radix heap only runs on monotone traces.
+void BenchmarkHeapTrace(const wchar_t * traceName, bool monotone);
+
+// add, remove, swap, and crossing enumeration on one very busy edge with the old vector of paths (with and without marking the
+// reserved paths dirty on every change) vs. the indexed reservations
+void BenchmarkEdgeReservations(size_t pathCount = 20000);
+
+// ns per NAEdge::GetCost call with each traffic model over edges of mixed capacity and flows on both sides of the critical density
+void BenchmarkTrafficModels(size_t edgeCount = 4096, size_t rounds = 200);
+
+// ns per edge of NAEdge::GetCost one edge at a time vs. NAEdge::GetCosts over adjacency sized blocks, for each traffic model
+void BenchmarkBatchEdgeCosts(size_t edgeCount = 4096, size_t rounds = 200);
+
+// ns per edge cost for every solver method and traffic model pair: branching at run time for each edge vs. the specialized batch kernels
+void BenchmarkSpecializedCosts(size_t edgeCount = 4096, size_t rounds = 200);
+
+void RunSolverBenchmarks();
+
+#endif
@@ -0,0 +1,368 @@
+// ===============================================================================================
+// Evacuation Solver: Customizable contraction hierarchy implementation
+// Description: Elimination ordering, customization, and the all-to-targets sweeps
+//
+// Copyright (C) 2014 Kaveh Shahabi
+// Distributed under the Apache Software License, Version 2.0. (See accompanying file LICENSE.txt)
+//
+// Author: Kaveh Shahabi
+// URL: http://github.com/spatial-computing/CASPER
+// ===============================================================================================
+
+#include "StdAfx.h"
+#include "ContractionHierarchy.h"
+
+void ContractionHierarchy::Build(const NetworkGraph & graph)
+{
+	const size_t n = graph.JunctionCount();
+	std::vector<std::vector<long>> adj(n), up(n);
+	std::vector<long> heads, fill, nodes(n);
+	const GraphArc * first = nullptr, * last = nullptr;
+	InputEdge input;
+	long tail, head;
+
+	rank.assign(n, -1);
+	order.clear();
+	order.reserve(n);
+	inputs.clear();
+	arcs.clear();
+	triangleCount = 0;
+	customized = false;
+
+	// undirected topology without self loops. both directions of an edge map to the same supergraph arc.
+	for (long j = 0; j < (long)n; ++j)
+	{
+		if (!graph.GetAdjacencies(j, true, first, last)) continue;
+		for (; first != last; ++first)
+		{
+			if (first->Junction == j || first->Junction < 0 || (size_t)first->Junction >= n) continue;
+			adj[j].push_back(first->Junction);
+			adj[first->Junction].push_back(j);
+			input.EID = first->EID;
+			input.Dir = first->Dir;
+			input.Downward = false;
+			input.Arc = (size_t)j; // from-junction for now. resolved to the arc index once the order is known
+			inputs.push_back(input);
+			heads.push_back(first->Junction);
+		}
+	}
+	for (auto & a : adj)
+	{
+		std::sort(a.begin(), a.end());
+		a.erase(std::unique(a.begin(), a.end()), a.end());
+	}
+
+	// eliminate in nested dissection order. the remaining neighbors of each junction become a clique (fill-in) and its upward arcs.
+	stamp.assign(n, 0);
+	level.assign(n, 0);
+	stampCounter = 0;
+	for (long j = 0; j < (long)n; ++j) nodes[j] = j;
+	Dissect(adj, nodes);
+	for (long r = 0; r < (long)n; ++r) rank[order[r]] = r;
+	for (auto u : order)
+	{
+		up[u].swap(adj[u]);
+		for (auto v : up[u])
+		{
+			fill.clear();
+			std::set_union(adj[v].begin(), adj[v].end(), up[u].begin(), up[u].end(), std::back_inserter(fill));
+			fill.erase(std::remove_if(fill.begin(), fill.end(), [u, v](long w) { return w == u || w == v; }), fill.end());
+			adj[v].swap(fill);
+		}
+	}
+	stamp.clear();
+	level.clear();
+	stamp.shrink_to_fit();
+	level.shrink_to_fit();
+
+	// upward arcs in CSR form, sorted by rank so a triangle's third arc can be found with a binary search
+	upOffset.assign(n + 1, 0);
+	for (size_t j = 0; j < n; ++j)
+	{
+		std::sort(up[j].begin(), up[j].end(), [this](long a, long b) { return rank[a] < rank[b]; });
+		upOffset[j + 1] = upOffset[j] + up[j].size();
+	}
+	arcs.reserve(upOffset[n]);
+	for (size_t j = 0; j < n; ++j)
+		for (auto h : up[j])
+		{
+			Arc a = { h, Infinity(), Infinity() };
+			arcs.push_back(a);
+		}
+
+	for (size_t i = 0; i < inputs.size(); ++i)
+	{
+		tail = (long)inputs[i].Arc;
+		head = heads[i];
+		inputs[i].Downward = rank[tail] > rank[head];
+		inputs[i].Arc = inputs[i].Downward ? FindArc(head, tail) : FindArc(tail, head);
+	}
+
+	// lower arcs of each junction. filled in rank order so each list is sorted by the rank of the tail.
+	downOffset.assign(n + 1, 0);
+	for (const auto & a : arcs) ++downOffset[a.Head + 1];
+	for (size_t j = 0; j < n; ++j) downOffset[j + 1] += downOffset[j];
+	downArcs.resize(arcs.size());
+	fill.assign(downOffset.begin(), downOffset.end() - 1);
+	for (auto u : order)
+		for (size_t k = upOffset[u]; k < upOffset[u + 1]; ++k)
+		{
+			DownArc d = { u, k };
+			downArcs[fill[arcs[k].Head]++] = d;
+		}
+
+	// input edges of each arc and of each EdgeIndex for the incremental customization
+	long maxEID = -1;
+	for (const auto & e : inputs) maxEID = (std::max)(maxEID, e.EID);
+	inputIndex.assign((size_t)(maxEID + 1) * 2, (size_t)NoArc);
+	firstInput.assign(arcs.size(), (size_t)NoArc);
+	nextInput.assign(inputs.size(), (size_t)NoArc);
+	inputCost.assign(inputs.size(), Infinity());
+	inputArcs.assign(arcs.begin(), arcs.end());
+	queued.assign(arcs.size(), false);
+	for (size_t i = 0; i < inputs.size(); ++i)
+	{
+		inputIndex[inputs[i].EID * 2 + inputs[i].Dir - 1] = i;
+		nextInput[i] = firstInput[inputs[i].Arc];
+		firstInput[inputs[i].Arc] = i;
+	}
+	while (!dirtyArcs.empty()) dirtyArcs.pop();
+}
+
+// Breadth first search inside the part (junctions stamped with 'mark') from 'source'. Fills 'level' and returns the junctions in visit order.
+void ContractionHierarchy::LevelSearch(const std::vector<std::vector<long>> & adj, long source, unsigned int mark, std::vector<long> & visited)
+{
+	visited.clear();
+	visited.push_back(source);
+	stamp[source] = mark + 1;
+	level[source] = 0;
+	for (size_t i = 0; i < visited.size(); ++i)
+		for (auto v : adj[visited[i]])
+		{
+			if (stamp[v] != mark) continue;
+			stamp[v] = mark + 1;
+			level[v] = level[visited[i]] + 1;
+			visited.push_back(v);
+		}
+	for (auto v : visited) stamp[v] = mark;
+}
+
+// Nested dissection with breadth first level separators: start from a pseudo-peripheral junction and cut the part at the
+// level that splits it in half. Both halves are ordered first and the separator goes on top of them. The connected components
+// of a part are dissected one after the other in the same call so only the halves of a separator recurse, and small
+// components are appended as they are.
+void ContractionHierarchy::Dissect(const std::vector<std::vector<long>> & adj, std::vector<long> & nodes)
+{
+	std::vector<long> component, lower, upper, separator;
+	unsigned int mark;
+	long cut;
+
+	if (nodes.size() <= DissectionLeafSize)
+	{
+		order.insert(order.end(), nodes.begin(), nodes.end());
+		nodes.clear();
+		return;
+	}
+
+	stampCounter += 2;
+	mark = stampCounter;
+	for (auto v : nodes) stamp[v] = mark;
+
+	for (auto source : nodes)
+	{
+		// junctions of the components that are already ordered no longer carry this mark
+		if (stamp[source] != mark) continue;
+		LevelSearch(adj, source, mark, component);
+		if (component.size() > DissectionLeafSize) LevelSearch(adj, component.back(), mark, component);
+		for (auto v : component) stamp[v] = 0;
+		if (component.size() <= DissectionLeafSize)
+		{
+			order.insert(order.end(), component.begin(), component.end());
+			continue;
+		}
+
+		cut = level[component[component.size() / 2]];
+		lower.clear();
+		upper.clear();
+		separator.clear();
+		for (auto v : component)
+		{
+			if      (level[v] < cut) lower.push_back(v);
+			else if (level[v] > cut) upper.push_back(v);
+			else                     separator.push_back(v);
+		}
+		Dissect(adj, lower);
+		Dissect(adj, upper);
+		order.insert(order.end(), separator.begin(), separator.end());
+	}
+	nodes.clear();
+}
+
+size_t ContractionHierarchy::FindArc(long tail, long head) const
+{
+	const long r = rank[head];
+	auto first = arcs.begin() + upOffset[tail], last = arcs.begin() + upOffset[tail + 1];
+	auto i = std::lower_bound(first, last, r, [this](const Arc & a, long value) { return rank[a.Head] < value; });
+	if (i == last || i->Head != head) return NoArc;
+	return (size_t)(i - arcs.begin());
+}
+
+// Basic customization: a lower triangle {u, v, w} with u ranked below v and w gives a path v -> u -> w for the arc (v, w).
+// Junctions are processed in rank order so the arcs of u are final before they are used.
+void ContractionHierarchy::CustomizeTriangles()
+{
+	size_t i, j, k, last;
+	long u;
+	triangleCount = 0;
+
+	for (size_t r = 0; r < order.size(); ++r)
+	{
+		u = order[r];
+		last = upOffset[u + 1];
+		for (i = upOffset[u]; i < last; ++i)
+			for (j = i + 1; j < last; ++j)
+			{
+				k = FindArc(arcs[i].Head, arcs[j].Head);
+				if (k == NoArc) continue;
+				Arc & vw = arcs[k];
+				if (arcs[i].Down + arcs[j].Up < vw.Up  ) vw.Up   = arcs[i].Down + arcs[j].Up;
+				if (arcs[j].Down + arcs[i].Up < vw.Down) vw.Down = arcs[j].Down + arcs[i].Up;
+				++triangleCount;
+			}
+	}
+}
+
+// the cheapest input edge in each direction of an arc
+void ContractionHierarchy::LoadInputArc(size_t arc)
+{
+	Arc & a = inputArcs[arc];
+	a.Up = a.Down = Infinity();
+	for (size_t i = firstInput[arc]; i != NoArc; i = nextInput[i])
+	{
+		double & w = inputs[i].Downward ? a.Down : a.Up;
+		if (inputCost[i] < w) w = inputCost[i];
+	}
+}
+
+long ContractionHierarchy::TailOf(size_t arc) const
+{
+	return (long)(std::upper_bound(upOffset.begin(), upOffset.end(), arc) - upOffset.begin()) - 1;
+}
+
+void ContractionHierarchy::QueueArc(long tail, size_t arc)
+{
+	if (queued[arc]) return;
+	queued[arc] = true;
+	dirtyArcs.push(QueuedArc(rank[tail], arc));
+}
+
+bool ContractionHierarchy::UpdateEdgeCost(long eid, unsigned char dir, double cost, double infinity)
+{
+	size_t index = (size_t)eid * 2 + dir - 1, i, arc;
+	if (!customized || eid < 0 || index >= inputIndex.size() || (i = inputIndex[index]) == NoArc) return false;
+	if (cost >= infinity) cost = Infinity();
+	if (cost == inputCost[i]) return false;
+
+	inputCost[i] = cost;
+	arc = inputs[i].Arc;
+	Arc old = inputArcs[arc];
+	LoadInputArc(arc);
+	if (old.Up == inputArcs[arc].Up && old.Down == inputArcs[arc].Down) return false;
+	QueueArc(TailOf(arc), arc);
+	return true;
+}
+
+// Recomputes the arc (v, w) from its input weight and every lower triangle {u, v, w}. The lower arcs of v and w are both sorted
+// by tail rank so the common tails come out of a merge. Returns true if the weight changed.
+bool ContractionHierarchy::RecustomizeArc(long v, size_t arc)
+{
+	const long w = arcs[arc].Head;
+	size_t i = downOffset[v], j = downOffset[w], lastV = downOffset[v + 1], lastW = downOffset[w + 1];
+	Arc a = inputArcs[arc];
+	long ri, rj;
+
+	while (i < lastV && j < lastW)
+	{
+		ri = rank[downArcs[i].Tail];
+		rj = rank[downArcs[j].Tail];
+		if      (ri < rj) ++i;
+		else if (rj < ri) ++j;
+		else
+		{
+			const Arc & uv = arcs[downArcs[i++].Arc], & uw = arcs[downArcs[j++].Arc];
+			if (uv.Down + uw.Up < a.Up  ) a.Up   = uv.Down + uw.Up;
+			if (uw.Down + uv.Up < a.Down) a.Down = uw.Down + uv.Up;
+		}
+	}
+	if (a.Up == arcs[arc].Up && a.Down == arcs[arc].Down) return false;
+	arcs[arc].Up = a.Up;
+	arcs[arc].Down = a.Down;
+	return true;
+}
+
+size_t ContractionHierarchy::Recustomize()
+{
+	size_t count = 0, arc, k, last;
+	long u, v, w;
+
+	while (!dirtyArcs.empty())
+	{
+		arc = dirtyArcs.top().second;
+		u = order[dirtyArcs.top().first];
+		dirtyArcs.pop();
+		queued[arc] = false;
+		++count;
+		if (!RecustomizeArc(u, arc)) continue;
+
+		// every other upward arc of u closes an upper triangle {u, v, w} with this one
+		v = arcs[arc].Head;
+		last = upOffset[u + 1];
+		for (k = upOffset[u]; k < last; ++k)
+		{
+			if (k == arc) continue;
+			w = arcs[k].Head;
+			if (rank[v] < rank[w]) QueueArc(v, FindArc(v, w));
+			else                   QueueArc(w, FindArc(w, v));
+		}
+	}
+	return count;
+}
+
+size_t ContractionHierarchy::QueryToTargets(const std::vector<std::pair<long, double>> & targets, std::vector<double> & dist, double infinity) const
+{
+	size_t i, last, reached = 0;
+	long u;
+	double d;
+
+	dist.assign(order.size(), Infinity());
+	for (const auto & t : targets)
+		if (t.first >= 0 && (size_t)t.first < dist.size() && t.second < dist[t.first]) dist[t.first] = t.second;
+
+	// upward: dist[head] through a path that only goes down from head to a target
+	for (size_t r = 0; r < order.size(); ++r)
+	{
+		u = order[r];
+		if (dist[u] == Infinity()) continue;
+		last = upOffset[u + 1];
+		for (i = upOffset[u]; i < last; ++i)
+		{
+			d = arcs[i].Down + dist[u];
+			if (d < dist[arcs[i].Head]) dist[arcs[i].Head] = d;
+		}
+	}
+
+	// downward: every junction goes up to a higher junction whose distance is already final
+	for (size_t r = order.size(); r-- > 0;)
+	{
+		u = order[r];
+		last = upOffset[u + 1];
+		for (i = upOffset[u]; i < last; ++i)
+		{
+			d = arcs[i].Up + dist[arcs[i].Head];
+			if (d < dist[u]) dist[u] = d;
+		}
+		if (dist[u] < infinity) ++reached;
+		else dist[u] = infinity;
+	}
+	return reached;
+}
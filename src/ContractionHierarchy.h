@@ -0,0 +1,137 @@
+// ===============================================================================================
+// Evacuation Solver: Customizable contraction hierarchy
+// Description: Metric-independent contraction of the preloaded road network graph. The junction
+// order and the chordal supergraph only depend on the topology so they are built once per solve.
+// Customize then takes the current (congested) edge costs and a pair of linear sweeps answers the
+// distance from every junction to the nearest safe zone, which is all CARMA needs for its h-values.
+// Like NetworkGraph.h, this header does not depend on ArcObjects.
+//
+// Copyright (C) 2014 Kaveh Shahabi
+// Distributed under the Apache Software License, Version 2.0. (See accompanying file LICENSE.txt)
+//
+// Author: Kaveh Shahabi
+// URL: http://github.com/spatial-computing/CASPER
+// ===============================================================================================
+
+#pragma once
+
+#include <vector>
+#include <queue>
+#include <functional>
+#include <limits>
+#include <algorithm>
+#include "NetworkGraph.h"
+
+class ContractionHierarchy
+{
+public:
+	// Upward arc of the chordal supergraph. Each junction owns the arcs to its higher ranked neighbors.
+	struct Arc
+	{
+		long   Head; // the higher ranked junction
+		double Up;   // cost from the owner junction to the head
+		double Down; // cost from the head to the owner junction
+	};
+
+	// one directed edge of the network and the supergraph arc it maps to
+	struct InputEdge
+	{
+		long          EID;
+		unsigned char Dir;
+		bool          Downward;
+		size_t        Arc;
+	};
+
+private:
+	// lower arc of a junction: the arc from 'Tail' up to this junction
+	struct DownArc
+	{
+		long   Tail;
+		size_t Arc;
+	};
+
+	typedef std::pair<long, size_t> QueuedArc; // tail rank and arc index
+
+	std::vector<long>      rank;      // elimination position of each junction
+	std::vector<long>      order;     // junction at each rank
+	std::vector<size_t>    upOffset;  // CSR offsets into arcs indexed by junction EID
+	std::vector<Arc>       arcs;      // upward arcs of each junction sorted by the rank of their head
+	std::vector<size_t>    downOffset;  // CSR offsets into downArcs indexed by junction EID
+	std::vector<DownArc>   downArcs;    // lower arcs of each junction sorted by the rank of their tail
+	std::vector<InputEdge> inputs;
+	size_t                 triangleCount;
+	bool                   customized;
+
+	// state of the incremental customization
+	std::vector<double>    inputCost;   // last cost of each input edge
+	std::vector<size_t>    nextInput;   // next input edge of the same arc (parallel edges)
+	std::vector<size_t>    firstInput;  // first input edge of each arc
+	std::vector<size_t>    inputIndex;  // input edge of each EdgeIndex (EID * 2 + Dir - 1)
+	std::vector<Arc>       inputArcs;   // arc weights that only come from the input edges
+	std::vector<bool>      queued;
+	std::priority_queue<QueuedArc, std::vector<QueuedArc>, std::greater<QueuedArc>> dirtyArcs;
+
+	// scratch space of the ordering
+	std::vector<unsigned int> stamp;
+	std::vector<long>         level;
+	unsigned int              stampCounter;
+
+	static const size_t NoArc = (size_t)-1;
+	static const size_t DissectionLeafSize = 16;
+	static double Infinity() { return std::numeric_limits<double>::infinity(); }
+
+	void LevelSearch(const std::vector<std::vector<long>> & adj, long source, unsigned int mark, std::vector<long> & visited);
+	void Dissect(const std::vector<std::vector<long>> & adj, std::vector<long> & nodes);
+	size_t FindArc(long tail, long head) const;
+	void CustomizeTriangles();
+	long TailOf(size_t arc) const;
+	void LoadInputArc(size_t arc);
+	void QueueArc(long tail, size_t arc);
+	bool RecustomizeArc(long tail, size_t arc);
+
+public:
+	ContractionHierarchy(void) : triangleCount(0), customized(false), stampCounter(0) { }
+	ContractionHierarchy(const ContractionHierarchy & that) = delete;
+	ContractionHierarchy & operator=(const ContractionHierarchy &) = delete;
+
+	bool   IsBuilt()       const { return !order.empty(); }
+	bool   IsCustomized()  const { return customized;     }
+	size_t JunctionCount() const { return order.size();   }
+	size_t ArcCount()      const { return arcs.size();    }
+	size_t TriangleCount() const { return triangleCount;  }
+
+	// Orders the junctions by nested dissection of the undirected network and eliminates them in that order.
+	// Every eliminated junction turns its remaining neighbors into a clique (fill-in) and those neighbors become its upward arcs.
+	void Build(const NetworkGraph & graph);
+
+	// Loads 'cost(EID, Dir)' of every directed edge into the arcs (parallel edges keep the cheaper one) and then
+	// relaxes every lower triangle in rank order. Costs at or above 'infinity' block the edge.
+	template<class CostFunc> void Customize(CostFunc cost, double infinity)
+	{
+		double c;
+		for (size_t i = 0; i < inputs.size(); ++i)
+		{
+			c = cost(inputs[i].EID, inputs[i].Dir);
+			inputCost[i] = c < infinity ? c : Infinity();
+		}
+		for (size_t k = 0; k < arcs.size(); ++k) LoadInputArc(k);
+		arcs = inputArcs;
+		CustomizeTriangles();
+		while (!dirtyArcs.empty()) dirtyArcs.pop();
+		queued.assign(arcs.size(), false);
+		customized = true;
+	}
+
+	// Records a new cost for one directed edge and queues its arc if the input weight changed. Returns false if nothing changed.
+	bool UpdateEdgeCost(long eid, unsigned char dir, double cost, double infinity);
+
+	// Re-customizes the queued arcs after a round of UpdateEdgeCost calls. Arcs are recomputed from their input weight and
+	// their lower triangles in the order of their tail rank, and a changed arc queues the arcs of the upper triangles it is part of.
+	// Returns the number of recomputed arcs.
+	size_t Recustomize();
+
+	// Distance from every junction to the nearest target. Each target comes with its own starting cost.
+	// An upward sweep in rank order collects the down paths into the targets and a downward sweep adds the up paths on top.
+	// Unreachable junctions get 'infinity'. Returns the number of junctions that can reach a target.
+	size_t QueryToTargets(const std::vector<std::pair<long, double>> & targets, std::vector<double> & dist, double infinity) const;
+};
@@ -0,0 +1,159 @@
+// ===============================================================================================
+// Evacuation Solver: Parallel delta-stepping search implementation
+// Description: Bucket rounds and the all-to-targets search
+//
+// Copyright (C) 2014 Kaveh Shahabi
+// Distributed under the Apache Software License, Version 2.0. (See accompanying file LICENSE.txt)
+//
+// Author: Kaveh Shahabi
+// URL: http://github.com/spatial-computing/CASPER
+// ===============================================================================================
+
+#include "StdAfx.h"
+#include "DeltaStepping.h"
+
+DeltaStepping::DeltaStepping(std::shared_ptr<ThreadPool> _pool) : pool(_pool), parents(nullptr),
+	frontierCounter(0), settledCounter(0), changedCounter(0), delta(1.0), phaseCount(0), bucketCount(0), queryCount(0)
+{
+	requests.resize(pool->ThreadCount());
+	changed.resize(pool->ThreadCount());
+}
+
+void DeltaStepping::Insert(long junction, double dist)
+{
+	buckets[Bucket(dist)].push_back(junction);
+}
+
+// One round: every thread turns its slice of 'nodes' into relax requests, then every thread applies the requests of the
+// junctions it owns (junction modulo thread count). The labels that went down are bucketed again on the calling thread.
+void DeltaStepping::Relax(const NetworkGraph & graph, const std::vector<double> & cost, const std::vector<long> & nodes, bool light, std::vector<double> & dist, double infinity)
+{
+	const unsigned int threads = ThreadCount();
+	size_t work = 0;
+
+	std::function<void(unsigned int)> generate = [&](unsigned int id)
+	{
+		const GraphArc * first = nullptr, * last = nullptr;
+		size_t from = nodes.size() * id / threads, to = nodes.size() * (id + 1) / threads, i;
+		double c, d;
+		auto & out = requests[id];
+
+		out.clear();
+		for (; from < to; ++from)
+		{
+			if (!graph.GetAdjacencies(nodes[from], false, first, last) || !first) continue;
+			for (; first != last; ++first)
+			{
+				i = (size_t)first->EID * 2 + first->Dir - 1;
+				c = i < cost.size() ? cost[i] : infinity;
+				if (c >= infinity || (c <= delta) != light) continue;
+				d = dist[nodes[from]] + c;
+				if (d < infinity && d < dist[first->Junction])
+				{
+					Request r = { first->Junction, d, first->EID, nodes[from], first->Dir };
+					out.push_back(r);
+				}
+			}
+		}
+	};
+
+	std::function<void(unsigned int)> apply = [&](unsigned int id)
+	{
+		auto & out = changed[id];
+
+		out.clear();
+		for (const auto & list : requests)
+			for (const auto & r : list)
+			{
+				if ((size_t)r.Junction % threads != id || !(r.Dist < dist[r.Junction])) continue;
+				dist[r.Junction] = r.Dist;
+				if (parents)
+				{
+					GraphArc & p = (*parents)[r.Junction];
+					p.EID = r.EID;
+					p.Junction = r.Next;
+					p.Dir = r.Dir;
+				}
+				if (changedStamp[r.Junction] == changedCounter) continue;
+				changedStamp[r.Junction] = changedCounter;
+				out.push_back(r.Junction);
+			}
+	};
+
+	++phaseCount;
+	pool->RunOnAll(nodes.size(), generate);
+	for (const auto & list : requests) work += list.size();
+	if (work == 0) return;
+
+	++changedCounter;
+	pool->RunOnAll(work, apply);
+	for (const auto & list : changed) for (const auto j : list) Insert(j, dist[j]);
+}
+
+size_t DeltaStepping::QueryToTargets(const NetworkGraph & graph, const std::vector<double> & cost, const std::vector<std::pair<long, double>> & targets,
+	std::vector<double> & dist, double infinity, std::vector<GraphArc> * tree)
+{
+	const size_t n = graph.JunctionCount();
+	const GraphArc noArc = { -1, -1, 0 };
+	size_t reached = 0, count = 0, b;
+	double sum = 0.0;
+
+	dist.assign(n, Infinity());
+	parents = tree;
+	if (parents) parents->assign(n, noArc);
+	frontierStamp.assign(n, 0);
+	settledStamp.assign(n, 0);
+	changedStamp.assign(n, 0);
+	frontierCounter = settledCounter = changedCounter = 0;
+	buckets.clear();
+	++queryCount;
+
+	// the mean edge cost as the bucket width keeps the light rounds short without making too many buckets
+	for (const auto c : cost) if (c > 0.0 && c < infinity) { sum += c; ++count; }
+	delta = count > 0 ? sum / count : 1.0;
+
+	for (const auto & t : targets)
+		if (t.first >= 0 && (size_t)t.first < n && t.second < infinity && t.second < dist[t.first])
+		{
+			dist[t.first] = t.second;
+			Insert(t.first, t.second);
+		}
+
+	while (!buckets.empty())
+	{
+		b = buckets.begin()->first;
+		++bucketCount;
+		++settledCounter;
+		settled.clear();
+
+		// light arcs can put junctions back into the current bucket so it is relaxed until it stays empty.
+		// entries whose label has moved on to a lower bucket since they were inserted are stale and skipped.
+		while (!buckets.empty() && buckets.begin()->first == b)
+		{
+			++frontierCounter;
+			frontier.clear();
+			for (const auto u : buckets.begin()->second)
+			{
+				if (Bucket(dist[u]) != b || frontierStamp[u] == frontierCounter) continue;
+				frontierStamp[u] = frontierCounter;
+				frontier.push_back(u);
+				if (settledStamp[u] == settledCounter) continue;
+				settledStamp[u] = settledCounter;
+				settled.push_back(u);
+			}
+			buckets.erase(buckets.begin());
+			if (!frontier.empty()) Relax(graph, cost, frontier, true, dist, infinity);
+		}
+
+		// heavy arcs always land in a later bucket so one round over everything settled in this bucket is enough
+		if (!settled.empty()) Relax(graph, cost, settled, false, dist, infinity);
+	}
+
+	for (auto & d : dist)
+	{
+		if (d < infinity) ++reached;
+		else d = infinity;
+	}
+	parents = nullptr;
+	return reached;
+}
@@ -0,0 +1,87 @@
+// ===============================================================================================
+// Evacuation Solver: Parallel delta-stepping search
+// Description: Label-correcting shortest path search that settles the junctions in buckets of
+// width delta. Light arcs (cost up to delta) are relaxed in rounds until the current bucket stops
+// changing and heavy arcs once per bucket. Each round is spread over a thread pool: the
+// workers first generate relax requests from their slice of the bucket and then apply the requests
+// of the junctions they own, so no two threads ever write the same label (or parent arc). The answer
+// is the same as a Dijkstra search regardless of the thread count. Like NetworkGraph.h, this header
+// does not depend on ArcObjects.
+//
+// Copyright (C) 2014 Kaveh Shahabi
+// Distributed under the Apache Software License, Version 2.0. (See accompanying file LICENSE.txt)
+//
+// Author: Kaveh Shahabi
+// URL: http://github.com/spatial-computing/CASPER
+// ===============================================================================================
+
+#pragma once
+
+#include <vector>
+#include <map>
+#include <memory>
+#include <functional>
+#include <limits>
+#include <algorithm>
+#include "NetworkGraph.h"
+#include "ThreadPool.h"
+
+class DeltaStepping
+{
+private:
+	struct Request
+	{
+		long          Junction;
+		double        Dist;
+		long          EID;  // the arc that leads from the junction towards the targets
+		long          Next; // the other end of that arc
+		unsigned char Dir;
+	};
+
+	std::shared_ptr<ThreadPool>                pool;
+
+	// search state
+	std::map<size_t, std::vector<long>>        buckets;
+	std::vector<std::vector<Request>>          requests; // relax requests generated by each thread
+	std::vector<std::vector<long>>             changed;  // junctions whose label went down, collected by their owner thread
+	std::vector<GraphArc>                    * parents;  // parent arc of each junction when the caller asked for the tree
+	std::vector<long>                          frontier;
+	std::vector<long>                          settled;
+	std::vector<unsigned int>                  frontierStamp;
+	std::vector<unsigned int>                  settledStamp;
+	std::vector<unsigned int>                  changedStamp;
+	unsigned int                               frontierCounter;
+	unsigned int                               settledCounter;
+	unsigned int                               changedCounter;
+	double                                     delta;
+	size_t                                     phaseCount;
+	size_t                                     bucketCount;
+	size_t                                     queryCount;
+
+	static double Infinity() { return std::numeric_limits<double>::infinity(); }
+	inline size_t Bucket(double dist) const { return (size_t)(std::min)(dist / delta, 1e18); }
+
+	void Insert(long junction, double dist);
+	void Relax(const NetworkGraph & graph, const std::vector<double> & cost, const std::vector<long> & nodes, bool light, std::vector<double> & dist, double infinity);
+
+public:
+	// the workers of the pool run the rounds. The pool can be shared with other parallel steps of the solve.
+	DeltaStepping(std::shared_ptr<ThreadPool> _pool);
+	virtual ~DeltaStepping(void) { }
+	DeltaStepping(const DeltaStepping & that) = delete;
+	DeltaStepping & operator=(const DeltaStepping &) = delete;
+
+	unsigned int ThreadCount() const { return pool->ThreadCount(); }
+	size_t       PhaseCount()  const { return phaseCount;  } // relax rounds of all queries so far
+	size_t       BucketCount() const { return bucketCount; } // buckets of all queries so far
+	size_t       QueryCount()  const { return queryCount;  }
+	double       Delta()       const { return delta;       } // bucket width of the last query
+
+	// Distance from every junction to the nearest target over the backward slices of the graph. 'cost' holds the cost of each
+	// directed edge at EID * 2 + Dir - 1 and costs at or above 'infinity' block the edge. Each target comes with its own starting
+	// cost. Unreachable junctions get 'infinity'. Returns the number of junctions that can reach a target. If 'tree' is given it
+	// gets the first arc of the shortest path from each junction ('Junction' is the other end of the arc). Targets that kept their
+	// own starting cost and unreachable junctions get an arc with EID -1.
+	size_t QueryToTargets(const NetworkGraph & graph, const std::vector<double> & cost, const std::vector<std::pair<long, double>> & targets,
+		std::vector<double> & dist, double infinity, std::vector<GraphArc> * tree = nullptr);
+};
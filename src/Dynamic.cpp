@@ -102,21 +102,16 @@ DynamicDisaster::DynamicDisaster(ITablePtr DynamicChangesTable, DynamicMode dyna
 	if (myDynamicMode == DynamicMode::Simple)
 	{
 		// if we are in simp[le mode, we ignore all times and apply all changes at time 0, untill infinity
-		for (const auto & p : allChanges)
-		{
-			fr.first->AddIntersectedChange(p);
-			bc.first->AddIntersectedChange(p);
-		}
+		for (const auto & p : allChanges) fr.first->AddStartingChange(p);
 	}
 	else if (myDynamicMode == DynamicMode::Smart || myDynamicMode == DynamicMode::Full)
 	{
 		for (const auto & p : allChanges)
 		{
-			auto i = dynamicTimeFrame.emplace(CriticalTime(p->StartTime));
-			dynamicTimeFrame.emplace(CriticalTime(p->EndTime));
-			i.first->AddIntersectedChange(p);
+			dynamicTimeFrame.emplace(CriticalTime(p->StartTime)).first->AddStartingChange(p);
+			auto i = dynamicTimeFrame.emplace(CriticalTime(p->EndTime));
+			if (p->EndTime < CASPER_INFINITY) i.first->AddEndingChange(p);
 		}
-		CriticalTime::MergeWithPreviousTimeFrame(dynamicTimeFrame);
 
 		// check if we can downgrade the time frame to Simple mode
 		if (dynamicTimeFrame.size() == 2) myDynamicMode = DynamicMode::Simple;
@@ -133,20 +128,37 @@ END_OF_FUNC:
 
 size_t DynamicDisaster::ResetDynamicChanges()
 {
+	// the time frame only carries deltas so a restart has to begin from the original edges
+	for (auto & pair : OriginalEdgeSettings)
+	{
+		pair.second.ResetRatios();
+		pair.second.ApplyNewOriginalCostAndCapacity(pair.first);
+	}
+	OriginalEdgeSettings.clear();
 	currentTime = dynamicTimeFrame.begin();
 	return dynamicTimeFrame.size() - 1;
 }
 
-void CriticalTime::MergeWithPreviousTimeFrame(std::set<CriticalTime> & dynamicTimeFrame)
+void CriticalTime::ApplyDelta(const SingleDynamicChangePtr change, bool starting, std::shared_ptr<NAEdgeCache> ecache, EdgeOriginalDataTable & OriginalEdgeSettings,
+	std::unordered_set<NAEdgePtr, NAEdgePtrHasher, NAEdgePtrEqual> & touchedEdges)
 {
-	auto thisTime = dynamicTimeFrame.cbegin();
-	std::vector<SingleDynamicChangePtr> * previousTimeFrame = &(thisTime->Intersected);
-	
-	for (++thisTime; thisTime != dynamicTimeFrame.cend(); ++thisTime)
+	NAEdgePtr edge = nullptr;
+	EdgeOriginalDataTable::_Pairib i;
+	const std::pair<EdgeDirection, esriNetworkEdgeDirection> dirs[] = {
+		std::pair<EdgeDirection, esriNetworkEdgeDirection>(EdgeDirection::Along,   esriNetworkEdgeDirection::esriNEDAlongDigitized),
+		std::pair<EdgeDirection, esriNetworkEdgeDirection>(EdgeDirection::Against, esriNetworkEdgeDirection::esriNEDAgainstDigitized) };
+
+	for (const auto & dir : dirs)
 	{
-		for (auto prevChange : *previousTimeFrame) 
-			if (prevChange->EndTime > thisTime->Time || prevChange->EndTime >= CASPER_INFINITY) thisTime->AddIntersectedChange(prevChange);
-		previousTimeFrame = &(thisTime->Intersected);
+		if (!CheckFlag(change->DisasterDirection, dir.first)) continue;
+		for (auto EID : change->EnclosedEdges)
+		{
+			edge = ecache->New(EID, dir.second);
+			i = OriginalEdgeSettings.emplace(std::pair<NAEdgePtr, EdgeOriginalData>(edge, EdgeOriginalData(edge)));
+			if (starting) i.first->second.StartChange(change->AffectedCostRate, change->AffectedCapacityRate);
+			else i.first->second.EndChange(change->AffectedCostRate, change->AffectedCapacityRate);
+			touchedEdges.insert(edge);
+		}
 	}
 }
 
@@ -161,46 +173,21 @@ size_t DynamicDisaster::NextDynamicChange(std::shared_ptr<EvacueeList> AllEvacue
 }
 
 size_t CriticalTime::ProcessAllChanges(std::shared_ptr<EvacueeList> AllEvacuees, std::shared_ptr<NAEdgeCache> ecache, double & EvcStartTime,
-	std::unordered_map<NAEdgePtr, EdgeOriginalData, NAEdgePtrHasher, NAEdgePtrEqual> & OriginalEdgeSettings, DynamicMode myDynamicMode, EvcSolverMethod solverMethod, int & pathGenerationCount) const
+	EdgeOriginalDataTable & OriginalEdgeSettings, DynamicMode myDynamicMode, EvcSolverMethod solverMethod, int & pathGenerationCount) const
 {
 	size_t CountPaths = max(1, AllEvacuees->size());
 	EvcStartTime = this->Time;
+	std::unordered_set<NAEdgePtr, NAEdgePtrHasher, NAEdgePtrEqual> touchedEdges, DynamicallyAffectedEdges;
 
-	// first undo previous changes using the backup map 'OriginalEdgeSettings'
-	for (auto & pair : OriginalEdgeSettings) pair.second.ResetRatios();
+	// only the changes that end or start at this time move the ratios. The backup map 'OriginalEdgeSettings' keeps the
+	// original settings of the edges under an active change, so the edges it does not touch now are already up to date.
+	for (auto polygon : this->Ending)   ApplyDelta(polygon, false, ecache, OriginalEdgeSettings, touchedEdges);
+	for (auto polygon : this->Starting) ApplyDelta(polygon, true,  ecache, OriginalEdgeSettings, touchedEdges);
 
-	// next apply new changes to enclosed edges. backup original settings into the 'OriginalEdgeSettings' map
-	NAEdgePtr edge = nullptr;
-	std::unordered_map<NAEdgePtr, EdgeOriginalData, NAEdgePtrHasher, NAEdgePtrEqual>::_Pairib i;
-	std::unordered_set<NAEdgePtr, NAEdgePtrHasher, NAEdgePtrEqual> DynamicallyAffectedEdges;
-
-	for (auto polygon : this->Intersected)
-	{
-		if (CheckFlag(polygon->DisasterDirection, EdgeDirection::Along))
-		{
-			for (auto EID : polygon->EnclosedEdges)
-			{
-				edge = ecache->New(EID, esriNetworkEdgeDirection::esriNEDAlongDigitized);
-				i = OriginalEdgeSettings.emplace(std::pair<NAEdgePtr, EdgeOriginalData>(edge, EdgeOriginalData(edge)));
-				i.first->second.CapacityRatio *= polygon->AffectedCapacityRate;
-				i.first->second.CostRatio     *= polygon->AffectedCostRate;
-			}
-		}
-		if (CheckFlag(polygon->DisasterDirection, EdgeDirection::Against))
-		{
-			for (auto EID : polygon->EnclosedEdges)
-			{
-				edge = ecache->New(EID, esriNetworkEdgeDirection::esriNEDAgainstDigitized);
-				i = OriginalEdgeSettings.emplace(std::pair<NAEdgePtr, EdgeOriginalData>(edge, EdgeOriginalData(edge)));
-				i.first->second.CapacityRatio *= polygon->AffectedCapacityRate;
-				i.first->second.CostRatio     *= polygon->AffectedCostRate;
-			}
-		}
-	}
 	if (this->Time < CASPER_INFINITY)
 	{
 		// extract affected edges and use it to identify affected evacuee paths
-		for (auto & pair : OriginalEdgeSettings) if (pair.second.IsAffectedEdge(pair.first)) DynamicallyAffectedEdges.insert(pair.first);
+		for (auto edge : touchedEdges) if (OriginalEdgeSettings.at(edge).IsAffectedEdge(edge)) DynamicallyAffectedEdges.insert(edge);
 
 		// for each evacuee, find the edge that the evacuee is likely to be their based on the time of this event
 		// now it's time to move all evacuees along their paths based on current time of this event and evacuee stuck policy
@@ -220,7 +207,7 @@ size_t CriticalTime::ProcessAllChanges(std::shared_ptr<EvacueeList> AllEvacuees,
 				AffectedPaths.reserve(min(AllEvacuees->size(), DynamicallyAffectedEdges.size()));
 				NAEdge::DynamicStep_ExtractAffectedPaths(AffectedPaths, DynamicallyAffectedEdges);
 			}
-			CountPaths  = EvcPath::DynamicStep_MoveOnPath(AffectedPaths, allPaths, DynamicallyAffectedEdges, this->Time, solverMethod, ecache->GetNetworkQuery(), pathGenerationCount);
+			CountPaths  = EvcPath::DynamicStep_MoveOnPath(AffectedPaths, allPaths, DynamicallyAffectedEdges, this->Time, solverMethod, ecache->GetNetworkQuery(), *(ecache->GetThreadPool()), pathGenerationCount);
 			CountPaths += EvcPath::DynamicStep_UnreachableEvacuees(AllEvacuees, this->Time);
 
 			// what if all paths are OK and non are affected and there are no unreachable evacuees?
@@ -230,7 +217,7 @@ size_t CriticalTime::ProcessAllChanges(std::shared_ptr<EvacueeList> AllEvacuees,
 		}
 	}
 	// now apply changes to the graph
-	for (auto & pair : OriginalEdgeSettings) pair.second.ApplyNewOriginalCostAndCapacity(pair.first);
+	for (auto edge : touchedEdges) OriginalEdgeSettings.at(edge).ApplyNewOriginalCostAndCapacity(edge);
 
 	if (this->Time >= CASPER_INFINITY)
 	{
@@ -244,10 +231,12 @@ size_t CriticalTime::ProcessAllChanges(std::shared_ptr<EvacueeList> AllEvacuees,
 		// re-calculate edges' dirtyness state
 		NAEdge::HowDirtyExhaustive(DynamicallyAffectedEdges.begin(), DynamicallyAffectedEdges.end(), solverMethod, 1.0);
 
-		// then clean the edges from backup map only if they are no longer affected
-		std::unordered_map<NAEdgePtr, EdgeOriginalData, NAEdgePtrHasher, NAEdgePtrEqual> clone(OriginalEdgeSettings);
-		OriginalEdgeSettings.clear();
-		for (const auto pair : clone) if (pair.second.IsRatiosNonOne()) OriginalEdgeSettings.insert(pair);
+		// then drop the edges that are back to their original settings from the backup map
+		for (auto edge : touchedEdges)
+		{
+			auto i = OriginalEdgeSettings.find(edge);
+			if (i != OriginalEdgeSettings.end() && i->second.ActiveChanges == 0) OriginalEdgeSettings.erase(i);
+		}
 	}
 	return CountPaths;
 }
@@ -25,6 +25,7 @@ struct EdgeOriginalData
 	double OriginalCapacity;
 	double CostRatio;
 	double CapacityRatio;
+	unsigned int ActiveChanges; // active dynamic changes that enclose this edge. The ratios are their product.
 
 	// constants for range of valid ratio
 	static const double MaxCostRatio;
@@ -38,15 +39,34 @@ struct EdgeOriginalData
 		OriginalCapacity = edge->OriginalCapacity();
 		CostRatio = 1.0;
 		CapacityRatio = 1.0;
+		ActiveChanges = 0;
 	}
 
 	void ResetRatios()
 	{
 		CostRatio = 1.0;
 		CapacityRatio = 1.0;
+		ActiveChanges = 0;
 	}
 
-	bool IsRatiosNonOne() const { return CostRatio != 1.0 || CapacityRatio != 1.0; }
+	// the ratios are set back to exactly one when the last change ends so no rounding is left behind
+	void StartChange(double costRate, double capacityRate)
+	{
+		CostRatio     *= costRate;
+		CapacityRatio *= capacityRate;
+		++ActiveChanges;
+	}
+
+	void EndChange(double costRate, double capacityRate)
+	{
+		if (ActiveChanges == 0) return;
+		if (--ActiveChanges == 0) ResetRatios();
+		else
+		{
+			CostRatio     /= costRate;
+			CapacityRatio /= capacityRate;
+		}
+	}
 
 	inline double AdjustedCost()     const { return CostRatio     < MaxCostRatio     ? (CostRatio     > MinCostRatio     ? OriginalCost     * CostRatio : OriginalCost * MinCostRatio) : CASPER_INFINITY; }
 	inline double AdjustedCapacity() const { return CapacityRatio < MaxCapacityRatio ? (CapacityRatio > MinCapacityRatio ? OriginalCapacity * CapacityRatio : 0.0) : OriginalCapacity * MaxCapacityRatio; }
@@ -85,20 +105,28 @@ struct SingleDynamicChange
 
 typedef SingleDynamicChange * SingleDynamicChangePtr;
 
+typedef std::unordered_map<NAEdgePtr, EdgeOriginalData, NAEdgePtrHasher, NAEdgePtrEqual> EdgeOriginalDataTable;
+
+// The time frame is an index over the end points of the change intervals. Each critical time only lists the changes that start or
+// end there, so stepping through the times in order applies the deltas and the backup map carries the changes that are still active.
 class CriticalTime
 {
 private:
 	double Time;
-	mutable std::vector<SingleDynamicChangePtr> Intersected;
+	mutable std::vector<SingleDynamicChangePtr> Starting;
+	mutable std::vector<SingleDynamicChangePtr> Ending; // changes that last until infinity never end
+
+	static void ApplyDelta(const SingleDynamicChangePtr change, bool starting, std::shared_ptr<NAEdgeCache> ecache, EdgeOriginalDataTable & OriginalEdgeSettings,
+		std::unordered_set<NAEdgePtr, NAEdgePtrHasher, NAEdgePtrEqual> & touchedEdges);
 
 public:
 	CriticalTime(double time) : Time(time) { }
-	void AddIntersectedChange(const SingleDynamicChangePtr & item) const { Intersected.push_back(item); }
+	void AddStartingChange(const SingleDynamicChangePtr & item) const { Starting.push_back(item); }
+	void AddEndingChange  (const SingleDynamicChangePtr & item) const { Ending.push_back(item);   }
 	size_t ProcessAllChanges(std::shared_ptr<EvacueeList> AllEvacuees, std::shared_ptr<NAEdgeCache> ecache, double & EvcStartTime,
-		std::unordered_map<NAEdgePtr, EdgeOriginalData, NAEdgePtrHasher, NAEdgePtrEqual> & OriginalEdgeSettings, DynamicMode myDynamicMode, EvcSolverMethod solverMethod, int & pathGenerationCount) const;
+		EdgeOriginalDataTable & OriginalEdgeSettings, DynamicMode myDynamicMode, EvcSolverMethod solverMethod, int & pathGenerationCount) const;
 
 	bool friend operator< (const CriticalTime & lhs, const CriticalTime & rhs) { return lhs.Time <  rhs.Time; }
-	static void MergeWithPreviousTimeFrame(std::set<CriticalTime> & dynamicTimeFrame);
 };
 
 class DynamicDisaster
@@ -107,7 +135,7 @@ private:
 	std::vector<SingleDynamicChangePtr> allChanges;
 	std::set<CriticalTime> dynamicTimeFrame;
 	std::set<CriticalTime>::const_iterator currentTime;
-	std::unordered_map<NAEdgePtr, EdgeOriginalData, NAEdgePtrHasher, NAEdgePtrEqual> OriginalEdgeSettings;
+	EdgeOriginalDataTable OriginalEdgeSettings;
 	DynamicMode myDynamicMode;
 	EvcSolverMethod SolverMethod;
 
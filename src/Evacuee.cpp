@@ -15,6 +15,8 @@
 #include "NAVertex.h"
 #include "NAEdge.h"
 #include "Dynamic.h"
+#include "NetworkClustering.h"
+#include "ThreadPool.h"
 
 HRESULT PathSegment::GetGeometry(INetworkDatasetPtr ipNetworkDataset, IFeatureClassContainerPtr ipFeatureClassContainer, bool & sourceNotFoundFlag, IGeometryPtr & geometry)
 {
@@ -32,7 +34,7 @@ HRESULT PathSegment::GetGeometry(INetworkDatasetPtr ipNetworkDataset, IFeatureCl
 }
 
 EvcPath::EvcPath(double initDelayCostPerPop, double routedPop, int order, Evacuee * evc, SafeZone * mySafeZone) :
-	baselist(), MySafeZone(mySafeZone), RoutedPop(routedPop), Status(PathStatus::ActiveComplete)
+	baselist(), MySafeZone(mySafeZone), RoutedPop(routedPop), Status(PathStatus::ActiveComplete), costDirty(true), timelineDirty(true)
 {
 	PathStartCost = evc->StartingCost;
 	FinalEvacuationCost = RoutedPop * initDelayCostPerPop + PathStartCost;
@@ -42,7 +44,7 @@ EvcPath::EvcPath(double initDelayCostPerPop, double routedPop, int order, Evacue
 	myEvc = evc;
 }
 
-EvcPath::EvcPath(const EvcPath & that) : baselist(), MySafeZone(that.MySafeZone), RoutedPop(that.RoutedPop), Status(that.Status)
+EvcPath::EvcPath(const EvcPath & that) : baselist(), MySafeZone(that.MySafeZone), RoutedPop(that.RoutedPop), Status(that.Status), costDirty(true), timelineDirty(true)
 {
 	PathStartCost = that.PathStartCost;
 	FinalEvacuationCost = that.FinalEvacuationCost;
@@ -56,35 +58,79 @@ double PathSegment::GetCurrentCost(EvcSolverMethod method) const { return Edge->
 bool EvcPath::MoreThanPathOrder1(const Evacuee * e1, const Evacuee * e2) { return e1->Paths->front()->Order > e2->Paths->front()->Order; }
 bool EvcPath::LessThanPathOrder1(const Evacuee * e1, const Evacuee * e2) { return e1->Paths->front()->Order < e2->Paths->front()->Order; }
 
+// The time at the end of each segment, summed the same way the move step used to walk the path. The reservation lists of the edges
+// mark the path dirty whenever one of their costs changes, so the timeline is only summed again after that.
+const std::vector<double> & EvcPath::GetTimeline(EvcSolverMethod method)
+{
+	if (timelineDirty)
+	{
+		double pathCost = PathStartCost;
+		timeline.resize(size());
+		for (size_t i = 0; i < size(); ++i) timeline[i] = pathCost += at(i)->GetCurrentCost(method);
+		timelineDirty = false;
+	}
+	return timeline;
+}
+
+// finds the segment this path is on at 'CurrentTime' and the time at the end of that segment
+void EvcPath::LocateOnTimeline(double CurrentTime, EvcSolverMethod method, size_t & segment, double & pathCost)
+{
+	if (FinalEvacuationCost > CurrentTime)
+	{
+		const auto & t = GetTimeline(method);
+		segment = (std::min)((size_t)(std::lower_bound(t.cbegin(), t.cend(), CurrentTime) - t.cbegin()), t.size() - 1);
+		pathCost = t[segment];
+	}
+	else
+	{
+		pathCost = FinalEvacuationCost;
+		segment = size() - 1;
+	}
+}
+
 // first i have to move the evacuee. then cut the path and back it up. mark the evacuee to be processed again.
 size_t EvcPath::DynamicStep_MoveOnPath(const std::unordered_set<EvcPath *, EvcPath::PtrHasher, EvcPath::PtrEqual> & AffectedPaths, std::vector<EvcPath *> & allPaths,
-	std::unordered_set<NAEdge *, NAEdgePtrHasher, NAEdgePtrEqual> & DynamicallyAffectedEdges, double CurrentTime, EvcSolverMethod method, INetworkQueryPtr ipNetworkQuery, int & pathGenerationCount)
+	std::unordered_set<NAEdge *, NAEdgePtrHasher, NAEdgePtrEqual> & DynamicallyAffectedEdges, double CurrentTime, EvcSolverMethod method, INetworkQueryPtr ipNetworkQuery, ThreadPool & pool, int & pathGenerationCount)
 {
 	size_t count = 0, segment = 0, activeCompleteCount = 0;
 	double pathCost = 0.0, edgeRatio = 0.0, edgeCost = 0.0;
 	std::vector<std::pair<NAEdgePtr, EvcPathPtr>> RemoveReservations;
+	std::vector<std::pair<size_t, double>> positions;
+	std::vector<bool> moving, summed;
 
 	if (CurrentTime > 0.0)
 	{
 		std::sort(allPaths.begin(), allPaths.end(), EvcPath::MoreThanPathOrder2);
-		for (auto path : allPaths)
+
+		// Locating the paths only reads the edge costs and writes to each path's own timeline so it runs on all the threads.
+		// Nothing below changes an edge cost before the reservations are removed at the end, so the positions stay valid.
+		positions.resize(allPaths.size());
+		moving.resize(allPaths.size());
+		summed.resize(allPaths.size());
+		for (size_t i = 0; i < allPaths.size(); ++i)
 		{
-			if (path->myEvc->Status != EvacueeStatus::Unreachable && !path->empty() && path->Status == PathStatus::ActiveComplete)
-			{
-				// find the segment where we need to cut the path
-				if (path->FinalEvacuationCost > CurrentTime)
-				{
-					for (pathCost = path->PathStartCost, segment = 0; pathCost < CurrentTime && segment < path->size(); ++segment)
-						pathCost += path->at(segment)->GetCurrentCost(method);
+			const auto path = allPaths[i];
+			moving[i] = path->myEvc->Status != EvacueeStatus::Unreachable && !path->empty() && path->Status == PathStatus::ActiveComplete;
+			summed[i] = moving[i] && path->timelineDirty && path->FinalEvacuationCost > CurrentTime;
+		}
+		pool.RunOnSlices(allPaths.size(), [&](size_t from, size_t to)
+		{
+			for (size_t i = from; i < to; ++i)
+				if (moving[i]) allPaths[i]->LocateOnTimeline(CurrentTime, method, positions[i].first, positions[i].second);
+		});
 
-					// segment is always moving one step ahead of pathCost and segCost.
-					--segment;
-				}
-				else
-				{
-					pathCost = path->FinalEvacuationCost;
-					segment = path->size() - 1;
-				}
+		// the edges have to mark these paths again the next time their cost changes
+		for (size_t i = 0; i < allPaths.size(); ++i)
+			if (summed[i]) for (const auto & s : *allPaths[i]) s->Edge->ReservedPathCostCleaned();
+
+		for (size_t k = 0; k < allPaths.size(); ++k)
+		{
+			const auto path = allPaths[k];
+			if (moving[k])
+			{
+				// the segment where we need to cut the path
+				segment  = positions[k].first;
+				pathCost = positions[k].second;
 
 				// this is the case where the head of population has reached the safe zone but the tail of it
 				// is not. Because the initDelayPerPop is non-zero. We will consider this a path that cannot be splited.
@@ -102,6 +148,7 @@ size_t EvcPath::DynamicStep_MoveOnPath(const std::unordered_set<EvcPath *, EvcPa
 				path->myEvc->DynamicMove(path->at(segment)->Edge, edgeRatio, ipNetworkQuery, CurrentTime);
 				path->at(segment)->SetToRatio(edgeRatio);
 				path->Status = PathStatus::FrozenSplitted;
+				path->MarkCostDirty();
 				
 				// this path is not affected by this round of dynamic changes so no need to count it to be proccessed again.
 				// simply split into two paths and mark last one as active
@@ -227,6 +274,7 @@ void EvcPath::DynamicStep_MergePaths(std::shared_ptr<EvacueeList> AllEvacuees)
 
 			// leave the main path as the only path for this evacuee
 			mainPath->PathStartCost = 0.0;
+			mainPath->MarkCostDirty();
 			evc->Paths->clear();
 			evc->Paths->push_front(mainPath);
 		}
@@ -330,37 +378,46 @@ void EvcPath::DoesItNeedASecondChance(double ThreasholdForCost, double Threashol
 	}
 }
 
-void EvcPath::AddSegment(EvcSolverMethod method, PathSegmentPtr segment)
+void EvcPath::AddSegment(EvcSolverMethod method, PathSegmentPtr segment, bool delayedDirtyState)
 {
 	this->push_front(segment);
-	segment->Edge->AddReservation(this, method);
+	segment->Edge->AddReservation(this, method, delayedDirtyState);
 	double p = abs(segment->GetEdgePortion());
 	ReserveEvacuationCost += segment->Edge->GetCurrentCost(method) * p;
 	OrginalCost += segment->Edge->OriginalCost * p;
 }
 
+// The edge reservation lists mark every path on an edge whose reservations or original cost changed, so a clean path
+// still has the cost it got last time and only the marked ones have to walk their segments again.
 void EvcPath::CalculateFinalEvacuationCost(double initDelayCostPerPop, EvcSolverMethod method)
 {
-	FinalEvacuationCost = RoutedPop * initDelayCostPerPop + this->PathStartCost;
-	for (const auto & pathSegment : *this) FinalEvacuationCost += pathSegment->GetCurrentCost(method);
+	if (costDirty)
+	{
+		FinalEvacuationCost = RoutedPop * initDelayCostPerPop + this->PathStartCost;
+		for (const auto & pathSegment : *this)
+		{
+			FinalEvacuationCost += pathSegment->GetCurrentCost(method);
+			pathSegment->Edge->ReservedPathCostCleaned();
+		}
+		costDirty = false;
+	}
 	myEvc->FinalCost = max(myEvc->FinalCost, FinalEvacuationCost);
 }
 
-HRESULT EvcPath::AddPathToFeatureBuffers(ITrackCancel * pTrackCancel, INetworkDatasetPtr ipNetworkDataset, IFeatureClassContainerPtr ipFeatureClassContainer, bool & sourceNotFoundFlag,
-	IStepProgressorPtr ipStepProgressor, double & globalEvcCost, IFeatureBufferPtr ipFeatureBufferR, IFeatureCursorPtr ipFeatureCursorR,
-	long evNameFieldIndex, long evacTimeFieldIndex, long orgTimeFieldIndex, long popFieldIndex, long zoneNameFieldIndex)
+// Appends the shape of each segment to 'pline'. The last point of a segment is the first point of the next one so it is only
+// added once at the end.
+static HRESULT AppendSegmentShapes(ITrackCancel * pTrackCancel, INetworkDatasetPtr ipNetworkDataset, IFeatureClassContainerPtr ipFeatureClassContainer,
+	bool & sourceNotFoundFlag, const std::vector<PathSegmentPtr> & segments, IPointCollectionPtr pline)
 {
 	HRESULT hr = S_OK;
-	IPointCollectionPtr pline = IPointCollectionPtr(CLSID_Polyline);
 	long pointCount = -1;
 	VARIANT_BOOL keepGoing;
 	IGeometryPtr ipGeometry;
 	esriGeometryType type;
 	IPointCollectionPtr pcollect;
 	IPointPtr p;
-	VARIANT RouteOID;
 
-	for (const auto & pathSegment : *this)
+	for (const auto & pathSegment : segments)
 	{
 		// Check to see if the user wishes to continue or cancel the solve (i.e., check whether or not the user has hit the ESC key to stop processing)
 		if (pTrackCancel)
@@ -401,22 +458,126 @@ HRESULT EvcPath::AddPathToFeatureBuffers(ITrackCancel * pTrackCancel, INetworkDa
 		pcollect->get_Point(pointCount, &p);
 		pline->AddPoint(p);
 	}
+	return hr;
+}
+
+// The route of a clustered member is not the route of its leader: the member drives its own free-flow path to the nearest junction
+// of this route ('prefix', owned by the caller) and follows the route from segment 'join' on. Returns false if the member can not
+// reach this route over the preloaded graph.
+bool EvcPath::JoinMember(const Evacuee * member, NAEdgeCache * ecache, std::vector<PathSegmentPtr> & prefix, size_t & join) const
+{
+	std::vector<NetworkClustering::Start> starts;
+	std::unordered_map<long, size_t> joins;
+	std::unordered_set<long> targets;
+	std::vector<GraphArc> arcs;
+	size_t start = 0;
+	long from, to, junction;
+	double cost;
+	float capacity;
+	NAEdgePtr edge = nullptr;
+	const NetworkGraph * graph = ecache && ecache->IsGraphLoaded() ? ecache->GetGraph() : nullptr;
+
+	prefix.clear();
+	join = 0;
+	if (!graph || member->VerticesAndRatio->empty()) return false;
+
+	// the junctions at the end of each whole segment. a junction the route passes twice joins at the later pass.
+	for (size_t i = 0; i < size(); ++i)
+		if (at(i)->GetToRatio() == 1.0 && graph->GetEdge(at(i)->Edge->EID, (unsigned char)at(i)->Edge->Direction, from, to, cost, capacity))
+		{
+			joins[to] = i + 1;
+			targets.insert(to);
+		}
+	for (const auto & v : *(member->VerticesAndRatio))
+	{
+		edge = v->GetBehindEdge();
+		NetworkClustering::Start s = { v->EID, edge ? v->GVal * edge->OriginalCost : 0.0 };
+		starts.push_back(s);
+	}
+	if ((junction = NetworkClustering::JoinPath(*graph, starts, targets, arcs, start)) < 0) return false;
+
+	// special case for the first edge just like GenerateTreePath: only the part from the member point to its junction
+	NAVertexPtr evcVertex = member->VerticesAndRatio->at(start);
+	if (evcVertex->GetBehindEdge() && evcVertex->GVal > 0.0) prefix.push_back(new DEBUG_NEW_PLACEMENT PathSegment(evcVertex->GetBehindEdge(), 1.0 - evcVertex->GVal, 1.0));
+	for (const auto & a : arcs)
+	{
+		if (!(edge = ecache->New(a.EID, (esriNetworkEdgeDirection)a.Dir)))
+		{
+			for (auto s : prefix) delete s;
+			prefix.clear();
+			return false;
+		}
+		prefix.push_back(new DEBUG_NEW_PLACEMENT PathSegment(edge));
+	}
+	join = joins[junction];
+	return true;
+}
+
+HRESULT EvcPath::AddPathToFeatureBuffers(ITrackCancel * pTrackCancel, INetworkDatasetPtr ipNetworkDataset, IFeatureClassContainerPtr ipFeatureClassContainer, bool & sourceNotFoundFlag,
+	IStepProgressorPtr ipStepProgressor, double & globalEvcCost, IFeatureBufferPtr ipFeatureBufferR, IFeatureCursorPtr ipFeatureCursorR,
+	long evNameFieldIndex, long evacTimeFieldIndex, long orgTimeFieldIndex, long popFieldIndex, long zoneNameFieldIndex, NAEdgeCache * ecache, EvcSolverMethod method)
+{
+	HRESULT hr = S_OK;
+	IPointCollectionPtr pline = IPointCollectionPtr(CLSID_Polyline);
+	VARIANT_BOOL keepGoing;
+	VARIANT RouteOID, MemberOID;
+	std::vector<PathSegmentPtr> segments(cbegin(), cend()), prefix;
+	size_t join = 0;
+	double memberCost, memberOrgCost, ownPop = myEvc->Population;
+
+	if (FAILED(hr = AppendSegmentShapes(pTrackCancel, ipNetworkDataset, ipFeatureClassContainer, sourceNotFoundFlag, segments, pline))) return hr;
 
 	// add the initial delay cost
 	/// FinalEvacuationCost += RoutedPop * initDelayCostPerPop; // we no longer calculate Final cost since the dynamic step is doing it more accurately
 	globalEvcCost = max(globalEvcCost, FinalEvacuationCost);
 
 	// Store the feature values on the feature buffer
+	for (const auto & m : *(myEvc->Members)) ownPop -= m->Population;
 	if (FAILED(hr = ipFeatureBufferR->putref_Shape((IPolylinePtr)pline))) return hr;
-	if (FAILED(hr = ipFeatureBufferR->put_Value(evNameFieldIndex, myEvc->Name))) return hr;
 	if (FAILED(hr = ipFeatureBufferR->put_Value(evacTimeFieldIndex, ATL::CComVariant(FinalEvacuationCost)))) return hr;
 	if (FAILED(hr = ipFeatureBufferR->put_Value(orgTimeFieldIndex, ATL::CComVariant(OrginalCost)))) return hr;
-	if (FAILED(hr = ipFeatureBufferR->put_Value(popFieldIndex, ATL::CComVariant(RoutedPop)))) return hr;
 	if (zoneNameFieldIndex >= 0 && MySafeZone != nullptr) { if (FAILED(hr = ipFeatureBufferR->put_Value(zoneNameFieldIndex, ATL::CComVariant(MySafeZone->Name)))) return hr; }
+	if (FAILED(hr = ipFeatureBufferR->put_Value(evNameFieldIndex, myEvc->Name))) return hr;
+	if (FAILED(hr = ipFeatureBufferR->put_Value(popFieldIndex, ATL::CComVariant(myEvc->Members->empty() ? RoutedPop : RoutedPop * ownPop / myEvc->Population)))) return hr;
 
 	// Insert the feature buffer in the insert cursor
 	if (FAILED(hr = ipFeatureCursorR->InsertFeature(ipFeatureBufferR, &RouteOID))) return hr;
 
+	// a clustered evacuee writes one route per member with its share of the routed population. The member route is its own way to
+	// this route and the rest of this route, so its cost swaps the segments before the join for the member's own segments.
+	for (const auto & m : *(myEvc->Members))
+	{
+		if (!JoinMember(m, ecache, prefix, join)) join = 0;
+		memberCost = FinalEvacuationCost;
+		memberOrgCost = OrginalCost;
+		for (size_t i = 0; i < join; ++i)
+		{
+			memberCost -= at(i)->GetCurrentCost(method);
+			memberOrgCost -= at(i)->Edge->OriginalCost * abs(at(i)->GetEdgePortion());
+		}
+		for (const auto & s : prefix)
+		{
+			memberCost += s->GetCurrentCost(method);
+			memberOrgCost += s->Edge->OriginalCost * abs(s->GetEdgePortion());
+		}
+		segments.assign(prefix.begin(), prefix.end());
+		segments.insert(segments.end(), cbegin() + join, cend());
+		globalEvcCost = max(globalEvcCost, memberCost);
+
+		pline = IPointCollectionPtr(CLSID_Polyline);
+		hr = AppendSegmentShapes(pTrackCancel, ipNetworkDataset, ipFeatureClassContainer, sourceNotFoundFlag, segments, pline);
+		for (auto s : prefix) delete s;
+		prefix.clear();
+		if (FAILED(hr)) return hr;
+
+		if (FAILED(hr = ipFeatureBufferR->putref_Shape((IPolylinePtr)pline))) return hr;
+		if (FAILED(hr = ipFeatureBufferR->put_Value(evacTimeFieldIndex, ATL::CComVariant(memberCost)))) return hr;
+		if (FAILED(hr = ipFeatureBufferR->put_Value(orgTimeFieldIndex, ATL::CComVariant(memberOrgCost)))) return hr;
+		if (FAILED(hr = ipFeatureBufferR->put_Value(evNameFieldIndex, m->Name))) return hr;
+		if (FAILED(hr = ipFeatureBufferR->put_Value(popFieldIndex, ATL::CComVariant(RoutedPop * m->Population / myEvc->Population)))) return hr;
+		if (FAILED(hr = ipFeatureCursorR->InsertFeature(ipFeatureBufferR, &MemberOID))) return hr;
+	}
+
 	#ifdef DEBUG
 	std::wostringstream os_;
 	os_.precision(3);
@@ -449,10 +610,13 @@ Evacuee::Evacuee(VARIANT name, double pop, UINT32 objectID)
 	Name = name;
 	VerticesAndRatio = new DEBUG_NEW_PLACEMENT std::vector<NAVertexPtr>();
 	Paths = new DEBUG_NEW_PLACEMENT std::list<EvcPathPtr>();
+	Members = new DEBUG_NEW_PLACEMENT std::vector<Evacuee *>();
 	Population = pop;
 	PredictedCost = CASPER_INFINITY;
 	Status = EvacueeStatus::Unprocessed;
 	ProcessOrder = -1;
+	SearchExtractCount = 0;
+	RepairedExtracts = 0;
 	FinalCost = CASPER_INFINITY;
 	DiscoveryLeaf = nullptr;
 }
@@ -461,10 +625,13 @@ Evacuee::~Evacuee(void)
 {
 	for (auto & p : *Paths) delete p;
 	for (auto v : *VerticesAndRatio) delete v;
+	for (auto m : *Members) delete m;
 	Paths->clear();
 	VerticesAndRatio->clear();
+	Members->clear();
 	delete VerticesAndRatio;
 	delete Paths;
+	delete Members;
 }
 
 void Evacuee::DynamicMove(NAEdgePtr edge, double toRatio, INetworkQueryPtr ipNetworkQuery, double startTime)
@@ -491,33 +658,41 @@ EvacueeList::~EvacueeList()
 	clear();
 }
 
-void MergeEvacueeClusters(std::unordered_map<long, std::list<EvacueePtr>> & EdgeEvacuee, std::vector<EvacueePtr> & ToErase, double OKDistance)
+// an evacuee mapped to an edge and what groups it with its neighbors: the edge, the side of the street, and the position along the edge
+struct EdgeEvacueeKey
 {
-	EvacueePtr left = nullptr;
-	NAEdgePtr edge = nullptr;
-	for (const auto & l : EdgeEvacuee)
+	long       EID;
+	int        Side; // 0 against digitized, 1 along digitized, 2 both sides of the street
+	double     Position;
+	size_t     Order; // position in the evacuee list so ties merge into the first evacuee
+	EvacueePtr Evacuee;
+
+	bool operator<(const EdgeEvacueeKey & rhs) const
 	{
-		left = nullptr;
-		edge = l.second.front()->VerticesAndRatio->front()->GetBehindEdge();
-		for (const auto & i : l.second)
-		{
-			if (left && abs(i->VerticesAndRatio->front()->GVal - left->VerticesAndRatio->front()->GVal) <= OKDistance / edge->OriginalCost)
-			{
-				// merge i with left
-				ToErase.push_back(i);
-				left->Population += i->Population;
-			}
-			else left = i;
-		}
+		if (EID != rhs.EID) return EID < rhs.EID;
+		if (Side != rhs.Side) return Side < rhs.Side;
+		if (Position != rhs.Position) return Position < rhs.Position;
+		return Order < rhs.Order;
 	}
-}
+};
 
-void SortedInsertIntoMapOfLists(std::unordered_map<long, std::list<EvacueePtr>> & EdgeEvacuee, long eid, EvacueePtr evc)
+// One sort brings the evacuees of each edge side together in the order of their position. Then each run is merged into its first evacuee
+// as long as the next one is within 'OKDistance' of it.
+void MergeEvacueeRuns(std::vector<EdgeEvacueeKey> & keys, std::vector<EvacueePtr> & ToErase, double OKDistance)
 {
-	auto i = EdgeEvacuee.insert(std::pair<long, std::list<EvacueePtr>>(eid, std::list<EvacueePtr>()));
-	auto j = i.first->second.begin();
-	while (j != i.first->second.end() && evc->VerticesAndRatio->front()->GVal > (*j)->VerticesAndRatio->front()->GVal) ++j;
-	i.first->second.insert(j, evc);
+	const EdgeEvacueeKey * left = nullptr;
+	std::sort(keys.begin(), keys.end());
+
+	for (const auto & i : keys)
+	{
+		if (left && left->EID == i.EID && left->Side == i.Side && i.Position - left->Position <= OKDistance / left->Evacuee->VerticesAndRatio->front()->GetBehindEdge()->OriginalCost)
+		{
+			// merge i with left
+			ToErase.push_back(i.Evacuee);
+			left->Evacuee->Population += i.Evacuee->Population;
+		}
+		else left = &i;
+	}
 }
 
 void EvacueeList::FinilizeGroupings(double OKDistance, DynamicMode DynamicCASPEREnabled)
@@ -532,13 +707,17 @@ void EvacueeList::FinilizeGroupings(double OKDistance, DynamicMode DynamicCASPER
 	if (CheckFlag(groupingOption, EvacueeGrouping::Merge))
 	{
 		std::unordered_map<long, EvacueePtr> VertexEvacuee;
-		std::unordered_map<long, std::list<EvacueePtr>> EdgeAlongEvacuee, EdgeAgainstEvacuee, DoubleEdgeEvacuee;
+		std::vector<EdgeEvacueeKey> EdgeEvacuee;
 		std::vector<EvacueePtr> ToErase;
+		std::unordered_set<EvacueePtr> merged;
 		NAVertexPtr v1;
 		NAEdgePtr e1;
-		
-		for (const auto & evc : *this)
+		EvacueePtr evc;
+
+		EdgeEvacuee.reserve(size());
+		for (size_t k = 0; k < size(); ++k)
 		{
+			evc = at(k);
 			v1 = evc->VerticesAndRatio->front();
 			e1 = v1->GetBehindEdge();
 			if (!e1) // evacuee mapped to intersection
@@ -551,22 +730,91 @@ void EvacueeList::FinilizeGroupings(double OKDistance, DynamicMode DynamicCASPER
 					i->second->Population += evc->Population;
 				}
 			}
-			else if (evc->VerticesAndRatio->size() == 2) SortedInsertIntoMapOfLists(DoubleEdgeEvacuee, e1->EID, evc);  // evacuee mapped to both side of the street segment
-			else if (e1->Direction == esriNetworkEdgeDirection::esriNEDAlongDigitized) SortedInsertIntoMapOfLists(EdgeAlongEvacuee, e1->EID, evc);
-			else SortedInsertIntoMapOfLists(EdgeAgainstEvacuee, e1->EID, evc);
+			else
+			{
+				EdgeEvacueeKey key = { e1->EID, 0, v1->GVal, k, evc };
+				if (evc->VerticesAndRatio->size() == 2) key.Side = 2; // evacuee mapped to both side of the street segment
+				else if (e1->Direction == esriNetworkEdgeDirection::esriNEDAlongDigitized) key.Side = 1;
+				EdgeEvacuee.push_back(key);
+			}
 		}
+		MergeEvacueeRuns(EdgeEvacuee, ToErase, OKDistance);
 
-		MergeEvacueeClusters(EdgeAgainstEvacuee, ToErase, OKDistance);
-		MergeEvacueeClusters(EdgeAlongEvacuee,   ToErase, OKDistance);
-		MergeEvacueeClusters(DoubleEdgeEvacuee,  ToErase, OKDistance);
+		// the merged evacuees are compacted out of the list in one sweep
+		merged.insert(ToErase.begin(), ToErase.end());
+		remove_if([&merged](const EvacueePtr & e)->bool { return merged.find(e) != merged.end(); });
+		for (const auto & e : ToErase) delete e;
+	}
+	shrink_to_fit();
+}
 
-		for (const auto & e : ToErase)
+// Clusters the evacuees that can meet within 'maxCost' of free-flow travel into one routed group. The most populated evacuee of a
+// group is routed for the whole group and the others ride along as its members until the routes are written out. Coarse groups are
+// remembered so ExpandCoarseGroupings can give their members back to the list for the refinement pass.
+size_t EvacueeList::ClusterGroupings(const NetworkGraph & graph, double maxCost, bool coarse)
+{
+	std::vector<EvacueePtr> points;
+	std::vector<std::vector<NetworkClustering::Start>> starts;
+	std::vector<size_t> leaders;
+	std::vector<bool> recorded;
+	std::unordered_set<EvacueePtr> clustered;
+	NetworkClustering clustering;
+	NAEdgePtr e1;
+
+	if (!(maxCost > 0.0) || size() < 2) return 0;
+	points.reserve(size());
+	for (size_t k = 0; k < size(); ++k) if (at(k)->Population > 0.0) points.push_back(at(k));
+	std::stable_sort(points.begin(), points.end(), [](const EvacueePtr & e1, const EvacueePtr & e2)->bool { return e1->Population > e2->Population; });
+
+	starts.resize(points.size());
+	for (size_t i = 0; i < points.size(); ++i)
+		for (const auto & v : *(points[i]->VerticesAndRatio))
 		{
-			unordered_erase(e, [&](const EvacueePtr & evc1, const EvacueePtr & evc2)->bool { return evc1->ObjectID == evc2->ObjectID; });
-			delete e;
+			e1 = v->GetBehindEdge();
+			NetworkClustering::Start s = { v->EID, e1 ? v->GVal * e1->OriginalCost : 0.0 };
+			starts[i].push_back(s);
 		}
+	clustering.Cluster(graph, starts, maxCost, leaders);
+	recorded.resize(points.size(), false);
+
+	for (size_t i = 0; i < points.size(); ++i)
+	{
+		if (leaders[i] == i) continue;
+		if (coarse && !recorded[leaders[i]])
+		{
+			recorded[leaders[i]] = true;
+			coarseGroups.push_back(std::pair<EvacueePtr, size_t>(points[leaders[i]], points[leaders[i]]->Members->size()));
+		}
+		points[leaders[i]]->Population += points[i]->Population;
+		points[leaders[i]]->Members->push_back(points[i]);
+		clustered.insert(points[i]);
 	}
-	shrink_to_fit();
+	if (!clustered.empty()) remove_if([&clustered](const EvacueePtr & e)->bool { return clustered.find(e) != clustered.end(); });
+	return clustered.size();
+}
+
+// Takes the coarse members out of their leaders and puts them back in the list. The leaders keep their population share and their
+// routes, which still carry the whole group until the caller splits them.
+size_t EvacueeList::ExpandCoarseGroupings(std::vector<std::pair<EvacueePtr, std::vector<EvacueePtr>>> & groups)
+{
+	size_t count = 0;
+
+	groups.clear();
+	groups.reserve(coarseGroups.size());
+	for (const auto & g : coarseGroups)
+	{
+		auto members = g.first->Members;
+		groups.push_back(std::pair<EvacueePtr, std::vector<EvacueePtr>>(g.first, std::vector<EvacueePtr>(members->begin() + g.second, members->end())));
+		members->erase(members->begin() + g.second, members->end());
+		for (const auto & m : groups.back().second)
+		{
+			g.first->Population -= m->Population;
+			push_back(m);
+		}
+		count += groups.back().second.size();
+	}
+	coarseGroups.clear();
+	return count;
 }
 
 void NAEvacueeVertexTable::InsertReachable(std::shared_ptr<EvacueeList> list, CARMASort sortDir, std::shared_ptr<NAEdgeContainer> leafs)
@@ -642,6 +890,39 @@ void NAEvacueeVertexTable::RemoveDiscoveredEvacuees(NAVertexPtr myVertex, NAEdge
 	}
 }
 
+// Discovers evacuees from the junction distances of a contraction hierarchy sweep. Junctions are visited nearest first just
+// like the CARMA Dijkstra would pop them so an evacuee with more than one vertex is discovered through the closest one.
+void NAEvacueeVertexTable::RemoveDiscoveredEvacuees(const std::vector<double> & dist, std::shared_ptr<std::vector<EvacueePtr>> SortedEvacuees, double pop, EvcSolverMethod method)
+{
+	std::vector<long> junctions;
+	NAVertex junction;
+	junctions.reserve(size());
+
+	for (const auto & pair : *this)
+		if (pair.first >= 0 && (size_t)pair.first < dist.size() && dist[pair.first] < CASPER_INFINITY) junctions.push_back(pair.first);
+	std::sort(junctions.begin(), junctions.end(), [&dist](long a, long b) { return dist[a] < dist[b]; });
+
+	for (auto j : junctions)
+	{
+		junction.EID = j;
+		junction.GVal = dist[j];
+		RemoveDiscoveredEvacuees(&junction, nullptr, SortedEvacuees, pop, method);
+	}
+}
+
+// The table is empty once the search has settled all of its junctions, so a search in the order of 'dist' empties it at
+// the farthest one. Infinity if one of the junctions cannot be reached at all.
+double NAEvacueeVertexTable::DiscoveryRadius(const std::vector<double> & dist) const
+{
+	double radius = 0.0;
+	for (const auto & pair : *this)
+	{
+		if (pair.first < 0 || (size_t)pair.first >= dist.size() || dist[pair.first] >= CASPER_INFINITY) return CASPER_INFINITY;
+		radius = max(radius, dist[pair.first]);
+	}
+	return radius;
+}
+
 void NAEvacueeVertexTable::LoadSortedEvacuees(std::shared_ptr<std::vector<EvacueePtr>> SortedEvacuees) const
 {
 	#ifdef TRACE
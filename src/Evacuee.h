@@ -25,6 +25,8 @@ struct NAEdgePtrHasher;
 struct NAEdgePtrEqual;
 class SafeZone;
 struct EdgeOriginalData;
+class NetworkGraph;
+class ThreadPool;
 typedef NAVertex * NAVertexPtr;
 
 class PathSegment
@@ -81,8 +83,15 @@ private:
 	double     PathStartCost;
 	double     FinalEvacuationCost;
 	double     OrginalCost;
+	bool       costDirty; // set when the cost of one of the edges or the shape of the path changed since the last CalculateFinalEvacuationCost
+	bool       timelineDirty; // same as costDirty but for the timeline
+	std::vector<double> timeline; // time at the end of each segment
 	typedef    std::deque<PathSegmentPtr> baselist;
 
+	const std::vector<double> & GetTimeline(EvcSolverMethod method);
+	void LocateOnTimeline(double CurrentTime, EvcSolverMethod method, size_t & segment, double & pathCost);
+	bool JoinMember(const Evacuee * member, NAEdgeCache * ecache, std::vector<PathSegment *> & prefix, size_t & join) const;
+
 public:
 	using baselist::shrink_to_fit;
 	using baselist::front;
@@ -95,8 +104,11 @@ public:
 	inline double GetRoutedPop()             const { return RoutedPop;             }
 	inline double GetReserveEvacuationCost() const { return ReserveEvacuationCost; }
 	inline double GetFinalEvacuationCost()   const { return FinalEvacuationCost; }
+	inline SafeZone * GetSafeZone()          const { return MySafeZone;            }
 	inline bool   IsActive()                 const { return Status == PathStatus::ActiveComplete; }
 	inline bool   IsComplete()               const { return Status == PathStatus::ActiveComplete || Status == PathStatus::FrozenComplete; }
+	inline bool   IsCostDirty()              const { return costDirty; }
+	inline void   MarkCostDirty()                  { costDirty = timelineDirty = true; }
 	void CalculateFinalEvacuationCost(double initDelayCostPerPop, EvcSolverMethod method);
 
 	EvcPath(double initDelayCostPerPop, double routedPop, int order, Evacuee * evc, SafeZone * mySafeZone);
@@ -111,9 +123,12 @@ public:
 
 	double GetMinCostRatio(double MaxEvacuationCost = 0.0) const;
 	double GetAvgCostRatio(double MaxEvacuationCost = 0.0) const;
-	void AddSegment(EvcSolverMethod method, PathSegmentPtr segment);
+	void AddSegment(EvcSolverMethod method, PathSegmentPtr segment, bool delayedDirtyState = false);
+
+	// only for a detached path: its reservations are taken with the routed population so it has to change while they are off the edges
+	inline void ScaleRoutedPop(double ratio) { RoutedPop *= ratio; MarkCostDirty(); }
 	HRESULT AddPathToFeatureBuffers(ITrackCancel *, INetworkDatasetPtr, IFeatureClassContainerPtr, bool &,
-		IStepProgressorPtr, double &, IFeatureBufferPtr, IFeatureCursorPtr, long, long, long, long, long);
+		IStepProgressorPtr, double &, IFeatureBufferPtr, IFeatureCursorPtr, long, long, long, long, long, NAEdgeCache *, EvcSolverMethod);
 	void ReattachToEvacuee(EvcSolverMethod method, std::unordered_set<NAEdge *, NAEdgePtrHasher, NAEdgePtrEqual> & touchedEdges);
 	inline void CleanYourEvacueePaths(EvcSolverMethod method, std::unordered_set<NAEdge *, NAEdgePtrHasher, NAEdgePtrEqual> & touchedEdges) { EvcPath::DetachPathsFromEvacuee(myEvc, method, touchedEdges); }
 	void DoesItNeedASecondChance(double ThreasholdForCost, double ThreasholdForPathOverlap, std::vector<Evacuee *> & AffectingList, double ThisIterationMaxCost, EvcSolverMethod method);
@@ -129,6 +144,7 @@ public:
 	static size_t DynamicStep_UnreachableEvacuees(std::shared_ptr<EvacueeList> AllEvacuees, double StartCost);
 	
 	static bool MoreThanFinalCost (const EvcPath * p1, const EvcPath * p2) { return p1->FinalEvacuationCost > p2->FinalEvacuationCost; }
+	static bool LessThanFinalCost (const EvcPath * p1, const EvcPath * p2) { return p1->FinalEvacuationCost < p2->FinalEvacuationCost; }
 	static bool MoreThanPathOrder1(const Evacuee * e1, const Evacuee * e2);
 	static bool LessThanPathOrder1(const Evacuee * e1, const Evacuee * e2);
 	static bool MoreThanPathOrder2(const EvcPath * p1, const EvcPath * p2) { return p1->Order > p2->Order; }
@@ -147,7 +163,8 @@ public:
 	};
 
 	static size_t DynamicStep_MoveOnPath(const std::unordered_set<EvcPath *, EvcPath::PtrHasher, EvcPath::PtrEqual> & AffectedPaths, std::vector<EvcPath *> & allPaths,
-		std::unordered_set<NAEdge *, NAEdgePtrHasher, NAEdgePtrEqual> & DynamicallyAffectedEdges, double CurrentTime, EvcSolverMethod method, INetworkQueryPtr ipNetworkQuerys, int & pathGenerationCount);
+		std::unordered_set<NAEdge *, NAEdgePtrHasher, NAEdgePtrEqual> & DynamicallyAffectedEdges, double CurrentTime, EvcSolverMethod method, INetworkQueryPtr ipNetworkQuerys, ThreadPool & pool,
+		int & pathGenerationCount);
 };
 
 typedef EvcPath * EvcPathPtr;
@@ -157,6 +174,7 @@ class Evacuee
 public:
 	std::vector<NAVertexPtr> * VerticesAndRatio;
 	std::list<EvcPathPtr>    * Paths;
+	std::vector<Evacuee *>   * Members; // evacuees clustered into this one. They keep their own population and get their share of its routes
 	NAEdge                   * DiscoveryLeaf;
 	VARIANT                  Name;
 	double                   Population;
@@ -166,6 +184,8 @@ public:
 	UINT32                   ObjectID;
 	EvacueeStatus            Status;
 	int                      ProcessOrder;
+	size_t                   SearchExtractCount; // CASPER heap extracts over all the searches made for this evacuee
+	size_t                   RepairedExtracts;   // extracts of earlier searches that were kept when the next route was repaired instead of searched again
 
 	Evacuee(VARIANT name, double pop, UINT32 objectID);
 	virtual ~Evacuee(void);
@@ -199,6 +219,7 @@ class EvacueeList : private DoubleGrowingArrayList<EvacueePtr, size_t>
 private:
 	EvacueeGrouping groupingOption;
 	bool SeperationDisabledForDynamicCASPER;
+	std::vector<std::pair<Evacuee *, size_t>> coarseGroups; // coarse group leaders and where their coarse members start in the member list
 
 public:
 	using DoubleGrowingArrayList<EvacueePtr, size_t>::empty;
@@ -209,6 +230,9 @@ public:
 	EvacueeList(EvacueeGrouping GroupingOption, size_t capacity = 0) : groupingOption(GroupingOption), SeperationDisabledForDynamicCASPER(false), DoubleGrowingArrayList<EvacueePtr, size_t>(capacity) { }
 	virtual ~EvacueeList();
 	void FinilizeGroupings(double OKDistance, DynamicMode DynamicCASPEREnabled);
+	size_t ClusterGroupings(const NetworkGraph & graph, double maxCost, bool coarse = false);
+	size_t ExpandCoarseGroupings(std::vector<std::pair<Evacuee *, std::vector<Evacuee *>>> & groups);
+	bool HasCoarseGroupings() const { return !coarseGroups.empty(); }
 
 	EvacueeList(const EvacueeList & that) = delete;
 	EvacueeList & operator=(const EvacueeList &) = delete;
@@ -225,6 +249,8 @@ public:
 
 	void InsertReachable(std::shared_ptr<EvacueeList> list, CARMASort sortDir, std::shared_ptr<NAEdgeContainer> leafs);
 	void RemoveDiscoveredEvacuees(NAVertex * myVertex, NAEdge * myEdge, std::shared_ptr<std::vector<EvacueePtr>> SortedEvacuees, double pop, EvcSolverMethod method);
+	void RemoveDiscoveredEvacuees(const std::vector<double> & dist, std::shared_ptr<std::vector<EvacueePtr>> SortedEvacuees, double pop, EvcSolverMethod method);
+	double DiscoveryRadius(const std::vector<double> & dist) const;
 	void LoadSortedEvacuees(std::shared_ptr<std::vector<EvacueePtr>>) const;
 };
 
@@ -262,6 +288,7 @@ public:
 	using std::unordered_map<long, SafeZonePtr>::const_iterator;
 	using std::unordered_map<long, SafeZonePtr>::begin;
 	using std::unordered_map<long, SafeZonePtr>::end;
+	using std::unordered_map<long, SafeZonePtr>::find;
 
 	SafeZoneTable(size_t capacity) :std::unordered_map<long, SafeZonePtr>(capacity) { }
 	SafeZoneTable(const SafeZoneTable & that) = delete;
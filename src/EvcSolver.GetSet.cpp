@@ -234,6 +234,58 @@ STDMETHODIMP EvcSolver::get_ThreeGenCARMA(VARIANT_BOOL * value)
 	return S_OK;
 }
 
+STDMETHODIMP EvcSolver::put_PreloadNetworkGraph(VARIANT_BOOL value)
+{
+	preloadNetworkGraph = value;
+	m_bPersistDirty = true;
+	return S_OK;
+}
+
+STDMETHODIMP EvcSolver::get_PreloadNetworkGraph(VARIANT_BOOL * value)
+{
+	*value = preloadNetworkGraph;
+	return S_OK;
+}
+
+STDMETHODIMP EvcSolver::put_LandmarkHeuristic(VARIANT_BOOL value)
+{
+	landmarkHeuristic = value;
+	m_bPersistDirty = true;
+	return S_OK;
+}
+
+STDMETHODIMP EvcSolver::get_LandmarkHeuristic(VARIANT_BOOL * value)
+{
+	*value = landmarkHeuristic;
+	return S_OK;
+}
+
+STDMETHODIMP EvcSolver::put_HierarchyCARMA(VARIANT_BOOL value)
+{
+	hierarchyCARMA = value;
+	m_bPersistDirty = true;
+	return S_OK;
+}
+
+STDMETHODIMP EvcSolver::get_HierarchyCARMA(VARIANT_BOOL * value)
+{
+	*value = hierarchyCARMA;
+	return S_OK;
+}
+
+STDMETHODIMP EvcSolver::put_ParallelCARMA(VARIANT_BOOL value)
+{
+	parallelCARMA = value;
+	m_bPersistDirty = true;
+	return S_OK;
+}
+
+STDMETHODIMP EvcSolver::get_ParallelCARMA(VARIANT_BOOL * value)
+{
+	*value = parallelCARMA;
+	return S_OK;
+}
+
 STDMETHODIMP EvcSolver::put_TwoWayShareCapacity(VARIANT_BOOL value)
 {
 	twoWayShareCapacity = value;
@@ -355,6 +407,55 @@ STDMETHODIMP EvcSolver::put_IterativeRatio(BSTR value)
 	return S_OK;
 }
 
+STDMETHODIMP EvcSolver::get_EvacueeClusterTime(BSTR * value)
+{
+	if (value)
+	{
+		*value = new DEBUG_NEW_PLACEMENT WCHAR[100];
+		swprintf_s(*value, 100, L"%.2f", evacueeClusterTime);
+	}
+	return S_OK;
+}
+
+STDMETHODIMP EvcSolver::put_EvacueeClusterTime(BSTR value)
+{
+	swscanf_s(value, L"%f", &evacueeClusterTime);
+	evacueeClusterTime = min(max(evacueeClusterTime, 0.0f), 3600.0f);
+	m_bPersistDirty = true;
+	return S_OK;
+}
+
+STDMETHODIMP EvcSolver::get_CoarseClusterTime(BSTR * value)
+{
+	if (value)
+	{
+		*value = new DEBUG_NEW_PLACEMENT WCHAR[100];
+		swprintf_s(*value, 100, L"%.2f", coarseClusterTime);
+	}
+	return S_OK;
+}
+
+STDMETHODIMP EvcSolver::put_CoarseClusterTime(BSTR value)
+{
+	swscanf_s(value, L"%f", &coarseClusterTime);
+	coarseClusterTime = min(max(coarseClusterTime, 0.0f), 3600.0f);
+	m_bPersistDirty = true;
+	return S_OK;
+}
+
+STDMETHODIMP EvcSolver::put_BucketTreeSearch(VARIANT_BOOL value)
+{
+	bucketTreeSearch = value;
+	m_bPersistDirty = true;
+	return S_OK;
+}
+
+STDMETHODIMP EvcSolver::get_BucketTreeSearch(VARIANT_BOOL * value)
+{
+	*value = bucketTreeSearch;
+	return S_OK;
+}
+
 STDMETHODIMP EvcSolver::get_SelfishRatio(BSTR * value)
 {
 	if (value)
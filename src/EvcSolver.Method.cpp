@@ -14,39 +14,46 @@
 #include "EvcSolver.h"
 #include "FibonacciHeap.h"
 
+// evacuee order of each CARMASort value
+static const std::function<bool(EvacueePtr, EvacueePtr)> CARMASortFunctions[7] =
+	{ Evacuee::LessThanObjectID, Evacuee::LessThan, Evacuee::LessThan, Evacuee::MoreThan, Evacuee::MoreThan, Evacuee::ReverseFinalCost, Evacuee::ReverseEvacuationCost };
+
 HRESULT EvcSolver::SolveMethod(INetworkQueryPtr ipNetworkQuery, IGPMessages* pMessages, ITrackCancel* pTrackCancel, IStepProgressorPtr ipStepProgressor, std::shared_ptr<EvacueeList> AllEvacuees,
 	std::shared_ptr<NAVertexCache> vcache, std::shared_ptr<NAEdgeCache> ecache, std::shared_ptr<SafeZoneTable> safeZoneList, double & carmaSec, std::vector<unsigned int> & CARMAExtractCounts,
 	INetworkDatasetPtr ipNetworkDataset, unsigned int & EvacueesWithRestrictedSafezone, std::vector<double> & GlobalEvcCostAtIteration,
-	std::vector<size_t> & EffectiveIterationCount, std::shared_ptr<DynamicDisaster> dynamicDisasters)
+	std::vector<size_t> & EffectiveIterationCount, std::shared_ptr<DynamicDisaster> dynamicDisasters, CoarseToFineStats & coarseStats)
 {
 	// creating the heap for the Dijkstra search
-	MyFibonacciHeap<NAEdgePtr, NAEdgePtrHasher, NAEdgePtrEqual> heap(NAEdge::GetHeapKeyHur);
+	CASPERHeap heap;
 	NAEdgeMap closedList;
 	auto carmaClosedList = std::shared_ptr<NAEdgeMapTwoGen>(new DEBUG_NEW_PLACEMENT NAEdgeMapTwoGen());
-	NAVertexPtr neighbor = nullptr, finalVertex = nullptr, myVertex = nullptr;
+	NAVertexPtr finalVertex = nullptr;
 	SafeZonePtr BetterSafeZone = nullptr;
-	NAEdgePtr myEdge = nullptr;
 	HRESULT hr = S_OK;
 	VARIANT_BOOL keepGoing;
-	double populationLeft, population2Route, TimeToBeat = 0.0f, newCost, globalMinPop2Route = 0.0, minPop2Route = -1.0, globalDeltaCost = 0.0, MaxPathCostSoFar = 0.0, addedCostAsPenalty = 0.0, EvcStartTime = 0.0;
+	double populationLeft, population2Route, globalMinPop2Route = 0.0, minPop2Route = -1.0, MaxPathCostSoFar = 0.0, EvcStartTime = 0.0;
 	std::vector<NAVertexPtr>::const_iterator vit;
 	INetworkJunctionPtr ipCurrentJunction = nullptr;
 	INetworkElementPtr ipJunctionElement = nullptr;
-	bool separationRequired, foundRestrictedSafezone;
+	bool separationRequired, foundRestrictedSafezone, singleTree, bucketSearch, repairTree, routed, repairRoute = false;
+	double searchMaxPathCost = 0.0;
 	auto sortedEvacuees = std::shared_ptr<std::vector<EvacueePtr>>(new DEBUG_NEW_PLACEMENT std::vector<EvacueePtr>());
-	unsigned int countEvacueesInOneBucket = 0, countCASPERLoops = 0, sumVisitedDirtyEdge = 0;
+	unsigned int countEvacueesInOneBucket = 0, countCASPERLoops = 0, sumVisitedDirtyEdge = 0, visitedDirtyEdge = 0;
 	int pathGenerationCount = -1, EvacueeProcessOrder = -1;
-	size_t CARMAClosedSize = 0, sumVisitedEdge = 0, NumberOfEvacueesInIteration = 0, LocalIteration = 0;
+	size_t CARMAClosedSize = 0, sumVisitedEdge = 0, visitedEdge = 0, NumberOfEvacueesInIteration = 0, LocalIteration = 0;
 	long progressBaseValue = 0l;
 	auto leafs = std::shared_ptr<NAEdgeContainer>(new DEBUG_NEW_PLACEMENT NAEdgeContainer(200));
-	std::vector<NAEdgePtr> readyEdges;
 	HANDLE proc = GetCurrentProcess();
 	BOOL dummy;
 	FILETIME cpuTimeS, cpuTimeE, sysTimeS, sysTimeE, createTime, exitTime;
-	ArrayList<NAEdgePtr> * adj = nullptr;
 	ATL::CString statusMsg, AlgName;
 	CARMASort RevisedCarmaSortCriteria = this->CarmaSortCriteria;
 	auto detachedPaths = std::shared_ptr<std::vector<EvcPathPtr>>(new DEBUG_NEW_PLACEMENT std::vector<EvcPathPtr>());
+	std::vector<long> safeZoneJunctions;
+	std::vector<NAVertexPtr> prunedVertices;
+	std::vector<NAEdgePtr> changedPathEdges;
+	std::vector<std::pair<NAEdgePtr, double>> pathEdgeCosts;
+	BucketTree bucketTree;
 	CARMAExtractCounts.clear();
 
 	switch (solverMethod)
@@ -65,6 +72,20 @@ HRESULT EvcSolver::SolveMethod(INetworkQueryPtr ipNetworkQuery, IGPMessages* pMe
 		break;
 	}
 
+	// the only place the solver method and the traffic model are looked at for the search loops. They get a kernel with both built in.
+	batchCostKernel = TrafficModel::GetBatchCostFunction(solverMethod, trafficModel);
+
+	// SP routes only interact through the safe zone capacities. Without a density cost all of them come from one tree.
+	singleTree = solverMethod == EvcSolverMethod::SPSolver && costPerDensity <= 0.0;
+
+	// The evacuees of a CARMA bucket are close together so one backward tree from the safe zones serves all of them. It is off unless
+	// asked for. The tree is only exact without the selfish penalty, which depends on the route so far.
+	bucketSearch = bucketTreeSearch == VARIANT_TRUE && !singleTree && selfishRatio <= 0.0;
+
+	// CCRP routes one path at a time up to its bottleneck and separable CASPER evacuees are routed in chunks. Between two routes of the same
+	// evacuee only the edges of the last path changed so the next route repairs the last search tree instead of searching from scratch.
+	repairTree = !bucketSearch && solverMethod != EvcSolverMethod::SPSolver;
+
 	// initialize all dynamic changes and prepare for loop
 	size_t countDynamic = dynamicDisasters->ResetDynamicChanges();
 
@@ -83,6 +104,7 @@ HRESULT EvcSolver::SolveMethod(INetworkQueryPtr ipNetworkQuery, IGPMessages* pMe
 	ipCurrentJunction = ipJunctionElement;
 
 	if (FAILED(hr = DeterminMinimumPop2Route(AllEvacuees, ipNetworkDataset, globalMinPop2Route, separationRequired))) goto END_OF_FUNC;
+	if (landmarkHeuristic == VARIANT_TRUE) for (const auto & z : *safeZoneList) safeZoneJunctions.push_back(z.first);
 
 	// dynamic CASPER loop
 	for (NumberOfEvacueesInIteration = dynamicDisasters->NextDynamicChange(AllEvacuees, ecache, EvcStartTime, pathGenerationCount); NumberOfEvacueesInIteration > 0;
@@ -90,6 +112,12 @@ HRESULT EvcSolver::SolveMethod(INetworkQueryPtr ipNetworkQuery, IGPMessages* pMe
 	{
 		LocalIteration = 0;
 		minPop2Route = -1.0; // this will insure that the first CARMA after each dynamic change will be FullSPT
+
+		// a dynamic change may lower the original cost of some edges so the free-flow lower bounds are rebuilt after each one
+		if (landmarkHeuristic == VARIANT_TRUE && ecache->IsGraphLoaded())
+		{
+			if (FAILED(hr = vcache->LoadLowerBounds(ecache, safeZoneJunctions))) goto END_OF_FUNC;
+		}
 		/// Let's do an experiment and see if this is needed
 		RevisedCarmaSortCriteria = this->CarmaSortCriteria;
 		do // iteration loop
@@ -99,6 +127,16 @@ HRESULT EvcSolver::SolveMethod(INetworkQueryPtr ipNetworkQuery, IGPMessages* pMe
 				if (FAILED(hr = ipStepProgressor->put_Position(progressBaseValue + (long)(AllEvacuees->size() - NumberOfEvacueesInIteration)))) goto END_OF_FUNC;
 				statusMsg.Format(_T("Performing %s search (time %.2f, pass %d)"), AlgName, EvcStartTime, GlobalEvcCostAtIteration.size() + 1);
 			}
+
+			// the single tree routes every evacuee that is left so the CARMA loop below finds an empty bucket and falls through
+			if (singleTree)
+			{
+				dummy = GetProcessTimes(proc, &createTime, &exitTime, &sysTimeS, &cpuTimeS);
+				if (FAILED(hr = SingleTreeLoop(ipNetworkQuery, ipStepProgressor, pMessages, pTrackCancel, AllEvacuees, RevisedCarmaSortCriteria, vcache, ecache, safeZoneList,
+					CARMAExtractCounts, pathGenerationCount, EvacueeProcessOrder, MaxPathCostSoFar))) goto END_OF_FUNC;
+				dummy = GetProcessTimes(proc, &createTime, &exitTime, &sysTimeE, &cpuTimeE);
+				carmaSec += (*((__int64 *)&cpuTimeE)) - (*((__int64 *)&cpuTimeS)) + (*((__int64 *)&sysTimeE)) - (*((__int64 *)&sysTimeS));
+			}
 			do
 			{
 				// Indexing all the population by their surrounding vertices this will be used to sort them by network distance to safe zone. Also time the carma loops.
@@ -138,108 +176,72 @@ HRESULT EvcSolver::SolveMethod(INetworkQueryPtr ipNetworkQuery, IGPMessages* pMe
 
 					while (populationLeft > 0.0)
 					{
-						// It's now safe to collect-n-clean on the graph (ecache & vcache).
-						// clean used-up vertices from GC
-						vcache->CollectAndRelease();
-
-						// the next 'if' is a distinctive feature by CASPER that CCRP does not have
-						// and can actually improve routes even with a STEP traffic model
-						if (this->solverMethod == EvcSolverMethod::CCRPSolver) population2Route = 1.0;
-						else if (this->solverMethod == EvcSolverMethod::CASPERSolver && separationRequired)
-						{
-							if (populationLeft - globalMinPop2Route < globalMinPop2Route) population2Route = populationLeft;
-							else population2Route = globalMinPop2Route;
-						}
-						else population2Route = populationLeft;
-
-						// populate the heap with vertices associated with the current evacuee
-						readyEdges.clear();
-						for (auto const & v : *(currentEvacuee->VerticesAndRatio))
-							if (FAILED(hr = PrepareVerticesForHeap(v, vcache, ecache, &closedList, readyEdges, population2Route, solverMethod, selfishRatio, MaxPathCostSoFar, QueryDirection::Backward))) goto END_OF_FUNC;
-						for (const auto & e : readyEdges) heap.Insert(e);
-
-						TimeToBeat = CASPER_INFINITY;
-						BetterSafeZone = nullptr;
-						finalVertex = nullptr;
-						foundRestrictedSafezone = false;
+						population2Route = GetPopulation2Route(populationLeft, globalMinPop2Route, separationRequired);
 
 						// reduce the effect of previous CASPER loop heap extract for the purpose of dirty edge ratio. This will encourage more CARMA loops.
 						sumVisitedDirtyEdge = (unsigned int)(sumVisitedDirtyEdge * 0.9);
 						sumVisitedEdge = (size_t)(sumVisitedEdge * 0.9);
 
-						// Continue traversing the network while the heap has remaining junctions in it
-						// this is the actual Dijkstra code with the Fibonacci Heap
-						while (!heap.empty())
+						// the bucket tree serves this route and is repaired behind it right away
+						if (bucketSearch)
 						{
-							// Remove the next junction EID from the top of the stack
-							myEdge = heap.DeleteMin();
-							myVertex = myEdge->ToVertex;
-							_ASSERT_EXPR(!closedList.Exist(myEdge), L"closedList violation happened");
-							if (FAILED(hr = closedList.Insert(myEdge)))
-							{
-								// closedList violation happened
-								pMessages->AddError(-myEdge->EID, ATL::CComBSTR(L"ClosedList Violation Error."));
-								hr = ATL::AtlReportError(this->GetObjectCLSID(), _T("ClosedList Violation Error."), IID_INASolver);
-								goto END_OF_FUNC;
-							}
-
-							if (myEdge->GetDirtyState() != EdgeDirtyState::CleanState) sumVisitedDirtyEdge++;
-
-							// Check for destinations. If a new destination has been found then we should
-							// first flag this so later we can use to generate route. Also we should
-							// update the new TimeToBeat value for proper termination.
-							if (safeZoneList->CheckDiscoveredSafePoint(ecache, myVertex, myEdge, finalVertex, TimeToBeat, BetterSafeZone, costPerDensity,
-								population2Route, solverMethod, globalDeltaCost, foundRestrictedSafezone)) UpdatePeakMemoryUsage();
-
-							if (FAILED(hr = ecache->QueryAdjacencies(myVertex, myEdge, QueryDirection::Forward, &adj))) goto END_OF_FUNC;
-
-							for (const auto & currentEdge : *adj)
-							{
-								// if edge has already been discovered then no need to heap it
-								if (closedList.Exist(currentEdge)) continue;
-
-								newCost = myVertex->GVal + currentEdge->GetCost(population2Route, this->solverMethod, &globalDeltaCost);
-								if (newCost >= CASPER_INFINITY) continue;
-
-								if (heap.IsVisited(currentEdge)) // edge has been visited before. update edge and decrease key.
-								{
-									neighbor = currentEdge->ToVertex;
-									addedCostAsPenalty = currentEdge->MaxAddedCostOnReservedPathsWithNewFlow(globalDeltaCost, MaxPathCostSoFar, newCost + neighbor->GetMinHOrZero(), this->selfishRatio);
-									if (neighbor->GVal + neighbor->GlobalPenaltyCost > newCost + addedCostAsPenalty + myVertex->GlobalPenaltyCost)
-									{
-										neighbor->SetBehindEdge(currentEdge);
-										neighbor->GVal = newCost;
-										neighbor->GlobalPenaltyCost = myVertex->GlobalPenaltyCost + addedCostAsPenalty;
-										neighbor->Previous = myVertex;
-										heap.UpdateKey(currentEdge);
-									}
-								}
-								else // unvisited edge. create new and insert in heap
-								{
-									if (FAILED(hr = currentEdge->NetEdge->QueryJunctions(nullptr, ipCurrentJunction))) goto END_OF_FUNC;
-									neighbor = vcache->New(ipCurrentJunction, ipNetworkQuery);
-									neighbor->SetBehindEdge(currentEdge);
-									addedCostAsPenalty = currentEdge->MaxAddedCostOnReservedPathsWithNewFlow(globalDeltaCost, MaxPathCostSoFar, newCost + neighbor->GetMinHOrZero(), this->selfishRatio);
-									neighbor->GlobalPenaltyCost = myVertex->GlobalPenaltyCost + addedCostAsPenalty;
-									neighbor->GVal = newCost;
-									neighbor->Previous = myVertex;
+							if (FAILED(hr = RouteFromBucketTree(ipNetworkQuery, pMessages, currentEvacuee, vcache, ecache, safeZoneList, bucketTree, ipCurrentJunction, populationLeft,
+								pathGenerationCount, population2Route, separationRequired, visitedDirtyEdge, visitedEdge, routed))) goto END_OF_FUNC;
+							sumVisitedDirtyEdge += visitedDirtyEdge;
+							sumVisitedEdge += visitedEdge;
+							if (routed) MaxPathCostSoFar = max(MaxPathCostSoFar, currentEvacuee->Paths->front()->GetReserveEvacuationCost());
+							else currentEvacuee->Status = EvacueeStatus::Unreachable;
+							continue;
+						}
 
-									// Termination Condition: If the new vertex does have a chance to beat the already discovered safe node then add it to the heap.
-									if (NAEdge::GetHeapKeyHur(currentEdge) <= TimeToBeat) heap.Insert(currentEdge);
-								}
-							}
+						if (repairRoute)
+						{
+							// the last search of this evacuee is still in the closed-list and its vertices are still alive
+							if (FAILED(hr = RepairEvacueeRoute(ipNetworkQuery, pMessages, currentEvacuee, vcache, ecache, safeZoneList, heap, closedList, ipCurrentJunction,
+								population2Route, MaxPathCostSoFar, changedPathEdges, prunedVertices, finalVertex, BetterSafeZone, foundRestrictedSafezone, visitedDirtyEdge))) goto END_OF_FUNC;
 						}
+						else
+						{
+							// It's now safe to collect-n-clean on the graph (ecache & vcache).
+							// clean used-up vertices from GC
+							vcache->CollectAndRelease();
+							if (FAILED(hr = FindEvacueeRoute(ipNetworkQuery, pMessages, currentEvacuee, vcache, ecache, safeZoneList, heap, closedList, ipCurrentJunction,
+								population2Route, MaxPathCostSoFar, finalVertex, BetterSafeZone, foundRestrictedSafezone, visitedDirtyEdge, repairTree ? &prunedVertices : nullptr))) goto END_OF_FUNC;
+						}
+						visitedEdge = closedList.Size();
 
 						// collect info for Carma
-						sumVisitedEdge += closedList.Size();
+						sumVisitedDirtyEdge += visitedDirtyEdge;
+						sumVisitedEdge += visitedEdge;
 
 						// Find a path despite the fact that a safe zone (restricted) was found
 						// Address issue number 4: http://github.com/spatial-computing/CASPER/issues/4
 						if (!BetterSafeZone && foundRestrictedSafezone) ++EvacueesWithRestrictedSafezone;
 
+						// remember the cost of the edges of the route so we know which ones the new path changes
+						pathEdgeCosts.clear();
+						if (repairTree)
+							for (NAVertexPtr v = BetterSafeZone ? finalVertex : nullptr; v; v = v->Previous)
+								if (v->GetBehindEdge()) pathEdgeCosts.push_back(std::pair<NAEdgePtr, double>(v->GetBehindEdge(), v->GetBehindEdge()->GetCost(population2Route, solverMethod)));
+
 						// Generate path for this evacuee if any found
+						repairRoute = false;
+						searchMaxPathCost = MaxPathCostSoFar;
 						if (GeneratePath(BetterSafeZone, finalVertex, populationLeft, pathGenerationCount, currentEvacuee, population2Route, separationRequired))
+						{
 							MaxPathCostSoFar = max(MaxPathCostSoFar, currentEvacuee->Paths->front()->GetReserveEvacuationCost());
+
+							// the next route can repair this search if it routes the same population and the selfish penalty of the edges off this path
+							// did not change with the longest path. The penalty of the edges on this path changes with their reservations.
+							if (!pathEdgeCosts.empty() && populationLeft > 0.0 && GetPopulation2Route(populationLeft, globalMinPop2Route, separationRequired) == population2Route
+								&& (selfishRatio <= 0.0 || MaxPathCostSoFar == searchMaxPathCost))
+							{
+								changedPathEdges.clear();
+								NAEdge::GetChangedEdges(pathEdgeCosts, population2Route, solverMethod, selfishRatio > 0.0, [&ecache](NAEdgePtr e) { return ecache->GetTwin(e); },
+									changedPathEdges);
+								repairRoute = true;
+							}
+						}
  						else currentEvacuee->Status = EvacueeStatus::Unreachable;
 
 						#ifdef DEBUG
@@ -256,10 +258,14 @@ HRESULT EvcSolver::SolveMethod(INetworkQueryPtr ipNetworkQuery, IGPMessages* pMe
 						f.close();
 						#endif
 
-						// cleanup search heap and closed-list
+						// cleanup search heap and closed-list unless the next route of this evacuee repairs them
 						UpdatePeakMemoryUsage();
-						heap.Clear();
-						closedList.Clear();
+						if (!repairRoute)
+						{
+							heap.Clear();
+							closedList.Clear();
+							prunedVertices.clear();
+						}
 					} // end of while loop for multiple routes single evacuee
 
 					if (currentEvacuee->Status == EvacueeStatus::Unprocessed) currentEvacuee->Status = EvacueeStatus::Processed;
@@ -268,6 +274,9 @@ HRESULT EvcSolver::SolveMethod(INetworkQueryPtr ipNetworkQuery, IGPMessages* pMe
 					if (this->solverMethod == EvcSolverMethod::CASPERSolver && sumVisitedDirtyEdge > this->CARMAPerformanceRatio * sumVisitedEdge) break;
 
 				} // end of for loop over sortedEvacuees
+
+				// the CARMA loop before the next bucket takes the vertex cache and the edges over
+				bucketTree.Clear();
 			} while (!sortedEvacuees->empty());
 
 			UpdatePeakMemoryUsage();
@@ -279,6 +288,16 @@ HRESULT EvcSolver::SolveMethod(INetworkQueryPtr ipNetworkQuery, IGPMessages* pMe
 				RevisedCarmaSortCriteria = CARMASort::ReverseFinalCost;
 				EffectiveIterationCount.push_back(NumberOfEvacueesInIteration);
 			}
+
+			// once the coarse groups are done the refinement pass starts a fresh round of iterations over the pooled evacuees that left the group route
+			else if (AllEvacuees->HasCoarseGroupings() && ecache->IsGraphLoaded())
+			{
+				NumberOfEvacueesInIteration = RefineCoarseGroups(AllEvacuees, *(ecache->GetGraph()), pathGenerationCount, coarseStats);
+				LocalIteration = 0;
+				minPop2Route = -1.0;
+				RevisedCarmaSortCriteria = this->CarmaSortCriteria;
+				if (FAILED(hr = DeterminMinimumPop2Route(AllEvacuees, ipNetworkDataset, globalMinPop2Route, separationRequired))) goto END_OF_FUNC;
+			}
 		} while (NumberOfEvacueesInIteration > 0);
 		progressBaseValue += (long)AllEvacuees->size();
 	}
@@ -296,6 +315,241 @@ END_OF_FUNC:
 	return hr;
 }
 
+double EvcSolver::GetPopulation2Route(double populationLeft, double globalMinPop2Route, bool separationRequired) const
+{
+	// the next 'if' is a distinctive feature by CASPER that CCRP does not have
+	// and can actually improve routes even with a STEP traffic model
+	if (this->solverMethod == EvcSolverMethod::CCRPSolver) return 1.0;
+	else if (this->solverMethod == EvcSolverMethod::CASPERSolver && separationRequired)
+	{
+		if (populationLeft - globalMinPop2Route < globalMinPop2Route) return populationLeft;
+		else return globalMinPop2Route;
+	}
+	else return populationLeft;
+}
+
+// One CASPER search from the evacuee vertices to the best safe zone. Nothing is reserved here so the search only reads the reservations.
+// The caller generates the path from 'finalVertex' and clears the heap and the closed-list afterwards. If 'prunedVertices' is given the
+// edges that were cut off by the best safe zone are kept there so RepairEvacueeRoute can resume the search.
+HRESULT EvcSolver::FindEvacueeRoute(INetworkQueryPtr ipNetworkQuery, IGPMessages* pMessages, EvacueePtr currentEvacuee, std::shared_ptr<NAVertexCache> vcache,
+	std::shared_ptr<NAEdgeCache> ecache, std::shared_ptr<SafeZoneTable> safeZoneList, CASPERHeap & heap, NAEdgeMap & closedList, INetworkJunctionPtr ipCurrentJunction,
+	double population2Route, double MaxPathCostSoFar, NAVertexPtr & finalVertex, SafeZonePtr & BetterSafeZone, bool & foundRestrictedSafezone, unsigned int & visitedDirtyEdge,
+	std::vector<NAVertexPtr> * prunedVertices)
+{
+	HRESULT hr = S_OK;
+	double TimeToBeat = CASPER_INFINITY;
+	std::vector<NAEdgePtr> readyEdges;
+
+	BetterSafeZone = nullptr;
+	finalVertex = nullptr;
+	foundRestrictedSafezone = false;
+	visitedDirtyEdge = 0;
+
+	// populate the heap with vertices associated with the current evacuee
+	for (auto const & v : *(currentEvacuee->VerticesAndRatio))
+		if (FAILED(hr = PrepareVerticesForHeap(v, vcache, ecache, &closedList, readyEdges, population2Route, solverMethod, selfishRatio, MaxPathCostSoFar, QueryDirection::Backward))) return hr;
+	for (const auto & e : readyEdges) heap.Insert(e);
+
+	return ExpandEvacueeRoute(ipNetworkQuery, pMessages, currentEvacuee, vcache, ecache, safeZoneList, heap, closedList, ipCurrentJunction, population2Route, MaxPathCostSoFar,
+		TimeToBeat, finalVertex, BetterSafeZone, foundRestrictedSafezone, visitedDirtyEdge, prunedVertices);
+}
+
+// The next route of an evacuee starts from the last search tree, like an LPA* search. Only the edges of the last path changed their cost so
+// the part of the tree that does not go through them is still exact. The rest is taken out of the closed-list and searched again from its
+// valid neighbors and from the frontier that the last search cut off, which plays the role of the open list since the heap was drained.
+// The vertices of the last search are still alive.
+HRESULT EvcSolver::RepairEvacueeRoute(INetworkQueryPtr ipNetworkQuery, IGPMessages* pMessages, EvacueePtr currentEvacuee, std::shared_ptr<NAVertexCache> vcache,
+	std::shared_ptr<NAEdgeCache> ecache, std::shared_ptr<SafeZoneTable> safeZoneList, CASPERHeap & heap, NAEdgeMap & closedList, INetworkJunctionPtr ipCurrentJunction,
+	double population2Route, double MaxPathCostSoFar, const std::vector<NAEdgePtr> & changedEdges, std::vector<NAVertexPtr> & prunedVertices,
+	NAVertexPtr & finalVertex, SafeZonePtr & BetterSafeZone, bool & foundRestrictedSafezone, unsigned int & visitedDirtyEdge)
+{
+	HRESULT hr = S_OK;
+	double TimeToBeat = CASPER_INFINITY, newCost, edgeCost, globalDeltaCost = 0.0;
+	std::vector<NAEdgePtr> closedEdges, invalidEdges, readyEdges;
+	std::vector<NAVertexPtr> oldPruned, chain;
+	std::unordered_set<NAEdgePtr, NAEdgePtrHasher, NAEdgePtrEqual> changed(changedEdges.begin(), changedEdges.end());
+	std::unordered_map<NAVertexPtr, bool> valid;
+	ArrayList<NAEdgePtr> * adj = nullptr;
+	NAVertexPtr myVertex = nullptr;
+
+	BetterSafeZone = nullptr;
+	finalVertex = nullptr;
+	foundRestrictedSafezone = false;
+	visitedDirtyEdge = 0;
+
+	// a tree vertex is still exact if no edge on its way back to the evacuee has changed
+	auto isValid = [&valid, &changed, &chain](NAVertexPtr vertex) -> bool
+	{
+		bool result = true;
+		chain.clear();
+		for (NAVertexPtr v = vertex; v; v = v->Previous)
+		{
+			const auto m = valid.find(v);
+			if (m != valid.end())
+			{
+				result = m->second;
+				break;
+			}
+			chain.push_back(v);
+			if (v->GetBehindEdge() && changed.find(v->GetBehindEdge()) != changed.end())
+			{
+				result = false;
+				break;
+			}
+		}
+		for (const auto & v : chain) valid[v] = result;
+		return result;
+	};
+
+	closedList.GetEdges(closedEdges);
+	for (const auto & e : closedEdges) if (!isValid(e->ToVertex)) invalidEdges.push_back(e);
+	for (const auto & e : invalidEdges) closedList.Erase(e);
+	currentEvacuee->RepairedExtracts += closedEdges.size() - invalidEdges.size();
+
+	// the start edges of the evacuee that are no longer closed are seeded again
+	for (auto const & v : *(currentEvacuee->VerticesAndRatio))
+	{
+		if (v->GetBehindEdge() && closedList.Exist(v->GetBehindEdge())) continue;
+		if (FAILED(hr = PrepareVerticesForHeap(v, vcache, ecache, &closedList, readyEdges, population2Route, solverMethod, selfishRatio, MaxPathCostSoFar, QueryDirection::Backward))) return hr;
+	}
+	for (const auto & e : readyEdges) heap.Insert(e);
+
+	// the safe zones in the valid part of the tree are checked again. Their cost may have changed with the last reservation.
+	for (const auto & e : closedEdges)
+	{
+		if (!closedList.Exist(e)) continue;
+		globalDeltaCost = 0.0;
+		safeZoneList->CheckDiscoveredSafePoint(ecache, e->ToVertex, e, finalVertex, TimeToBeat, BetterSafeZone, costPerDensity, population2Route, solverMethod, globalDeltaCost, foundRestrictedSafezone);
+	}
+
+	// relax the invalid edges again from the valid edges that lead into them
+	oldPruned.swap(prunedVertices);
+	for (const auto & h : invalidEdges)
+	{
+		myVertex = h->ToVertex->Previous;
+		if (!myVertex) continue; // start edge of the evacuee
+		edgeCost = h->GetCost(population2Route, solverMethod, &globalDeltaCost);
+		if (edgeCost >= CASPER_INFINITY) continue;
+		if (FAILED(hr = ecache->QueryAdjacencies(myVertex, h, QueryDirection::Backward, &adj))) return hr;
+		for (const auto & g : *adj)
+		{
+			if (!closedList.Exist(g) || !g->ToVertex) continue;
+			newCost = g->ToVertex->GVal + edgeCost;
+			if (FAILED(hr = RelaxEvacueeEdge(ipNetworkQuery, vcache, heap, ipCurrentJunction, g->ToVertex, h, newCost, globalDeltaCost, MaxPathCostSoFar, TimeToBeat, &prunedVertices))) return hr;
+		}
+	}
+
+	// and resume the frontier that the last search cut off
+	for (const auto & p : oldPruned)
+	{
+		if (closedList.Exist(p->GetBehindEdge()) || !p->Previous || !isValid(p->Previous)) continue;
+		edgeCost = p->GetBehindEdge()->GetCost(population2Route, solverMethod, &globalDeltaCost);
+		if (edgeCost >= CASPER_INFINITY) continue;
+		newCost = p->Previous->GVal + edgeCost;
+		if (FAILED(hr = RelaxEvacueeEdge(ipNetworkQuery, vcache, heap, ipCurrentJunction, p->Previous, p->GetBehindEdge(), newCost, globalDeltaCost, MaxPathCostSoFar, TimeToBeat, &prunedVertices))) return hr;
+	}
+
+	return ExpandEvacueeRoute(ipNetworkQuery, pMessages, currentEvacuee, vcache, ecache, safeZoneList, heap, closedList, ipCurrentJunction, population2Route, MaxPathCostSoFar,
+		TimeToBeat, finalVertex, BetterSafeZone, foundRestrictedSafezone, visitedDirtyEdge, &prunedVertices);
+}
+
+// The Dijkstra loop of FindEvacueeRoute and RepairEvacueeRoute. Continues from whatever is in the heap and the closed-list.
+HRESULT EvcSolver::ExpandEvacueeRoute(INetworkQueryPtr ipNetworkQuery, IGPMessages* pMessages, EvacueePtr currentEvacuee, std::shared_ptr<NAVertexCache> vcache,
+	std::shared_ptr<NAEdgeCache> ecache, std::shared_ptr<SafeZoneTable> safeZoneList, CASPERHeap & heap, NAEdgeMap & closedList, INetworkJunctionPtr ipCurrentJunction,
+	double population2Route, double MaxPathCostSoFar, double & TimeToBeat, NAVertexPtr & finalVertex, SafeZonePtr & BetterSafeZone, bool & foundRestrictedSafezone,
+	unsigned int & visitedDirtyEdge, std::vector<NAVertexPtr> * prunedVertices)
+{
+	HRESULT hr = S_OK;
+	NAVertexPtr myVertex = nullptr;
+	NAEdgePtr myEdge = nullptr;
+	double newCost, globalDeltaCost = 0.0;
+	ArrayList<NAEdgePtr> * adj = nullptr;
+	TrafficBatch costBatch;
+	size_t batchIndex = 0;
+
+	// Continue traversing the network while the heap has remaining junctions in it
+	// this is the actual Dijkstra code with the Fibonacci Heap
+	while (!heap.empty())
+	{
+		// Remove the next junction EID from the top of the stack
+		myEdge = heap.DeleteMin();
+		myVertex = myEdge->ToVertex;
+		currentEvacuee->SearchExtractCount++;
+		_ASSERT_EXPR(!closedList.Exist(myEdge), L"closedList violation happened");
+		if (FAILED(hr = closedList.Insert(myEdge)))
+		{
+			// closedList violation happened
+			pMessages->AddError(-myEdge->EID, ATL::CComBSTR(L"ClosedList Violation Error."));
+			return ATL::AtlReportError(this->GetObjectCLSID(), _T("ClosedList Violation Error."), IID_INASolver);
+		}
+
+		if (myEdge->GetDirtyState() != EdgeDirtyState::CleanState) visitedDirtyEdge++;
+
+		// Check for destinations. If a new destination has been found then we should
+		// first flag this so later we can use to generate route. Also we should
+		// update the new TimeToBeat value for proper termination.
+		if (safeZoneList->CheckDiscoveredSafePoint(ecache, myVertex, myEdge, finalVertex, TimeToBeat, BetterSafeZone, costPerDensity,
+			population2Route, solverMethod, globalDeltaCost, foundRestrictedSafezone)) UpdatePeakMemoryUsage();
+
+		if (FAILED(hr = ecache->QueryAdjacencies(myVertex, myEdge, QueryDirection::Forward, &adj))) return hr;
+		NAEdge::GetCosts(*adj, population2Route, batchCostKernel, costBatch, true);
+		batchIndex = 0;
+
+		for (const auto & currentEdge : *adj)
+		{
+			const size_t i = batchIndex++;
+
+			// if edge has already been discovered then no need to heap it
+			if (closedList.Exist(currentEdge)) continue;
+
+			newCost = myVertex->GVal + costBatch.Cost[i];
+			globalDeltaCost = costBatch.GlobalDeltaCost[i];
+			if (newCost >= CASPER_INFINITY) continue;
+			if (FAILED(hr = RelaxEvacueeEdge(ipNetworkQuery, vcache, heap, ipCurrentJunction, myVertex, currentEdge, newCost, globalDeltaCost, MaxPathCostSoFar, TimeToBeat, prunedVertices))) return hr;
+		}
+	}
+	return hr;
+}
+
+// Relaxes one edge of the CASPER search. Edges that cannot beat the best safe zone found so far are not heaped. They are kept in
+// 'prunedVertices' instead if the caller wants to resume the search later.
+HRESULT EvcSolver::RelaxEvacueeEdge(INetworkQueryPtr ipNetworkQuery, std::shared_ptr<NAVertexCache> vcache, CASPERHeap & heap, INetworkJunctionPtr ipCurrentJunction,
+	NAVertexPtr myVertex, NAEdgePtr currentEdge, double newCost, double globalDeltaCost, double MaxPathCostSoFar, double TimeToBeat, std::vector<NAVertexPtr> * prunedVertices) const
+{
+	HRESULT hr = S_OK;
+	NAVertexPtr neighbor = nullptr;
+	double addedCostAsPenalty = 0.0;
+
+	if (heap.IsVisited(currentEdge)) // edge has been visited before. update edge and decrease key.
+	{
+		neighbor = currentEdge->ToVertex;
+		addedCostAsPenalty = currentEdge->MaxAddedCostOnReservedPathsWithNewFlow(globalDeltaCost, MaxPathCostSoFar, newCost + neighbor->GetMinHOrZero(), this->selfishRatio);
+		if (neighbor->GVal + neighbor->GlobalPenaltyCost > newCost + addedCostAsPenalty + myVertex->GlobalPenaltyCost)
+		{
+			neighbor->SetBehindEdge(currentEdge);
+			neighbor->GVal = newCost;
+			neighbor->GlobalPenaltyCost = myVertex->GlobalPenaltyCost + addedCostAsPenalty;
+			neighbor->Previous = myVertex;
+			heap.UpdateKey(currentEdge);
+		}
+	}
+	else // unvisited edge. create new and insert in heap
+	{
+		if (FAILED(hr = currentEdge->NetEdge->QueryJunctions(nullptr, ipCurrentJunction))) return hr;
+		neighbor = vcache->New(ipCurrentJunction, ipNetworkQuery);
+		neighbor->SetBehindEdge(currentEdge);
+		addedCostAsPenalty = currentEdge->MaxAddedCostOnReservedPathsWithNewFlow(globalDeltaCost, MaxPathCostSoFar, newCost + neighbor->GetMinHOrZero(), this->selfishRatio);
+		neighbor->GlobalPenaltyCost = myVertex->GlobalPenaltyCost + addedCostAsPenalty;
+		neighbor->GVal = newCost;
+		neighbor->Previous = myVertex;
+
+		// Termination Condition: If the new vertex does have a chance to beat the already discovered safe node then add it to the heap.
+		if (NAEdge::GetHeapKeyHur(currentEdge) <= TimeToBeat) heap.Insert(currentEdge);
+		else if (prunedVertices) prunedVertices->push_back(neighbor);
+	}
+	return hr;
+}
+
 size_t EvcSolver::FindPathsThatNeedToBeProcessedInIteration(std::shared_ptr<EvacueeList> AllEvacuees, std::shared_ptr<std::vector<EvcPathPtr>> detachedPaths,
 	std::vector<double> & GlobalEvcCostAtIteration, size_t & LocalIteration) const
 {
@@ -303,7 +557,8 @@ size_t EvcSolver::FindPathsThatNeedToBeProcessedInIteration(std::shared_ptr<Evac
 	std::vector<EvacueePtr> EvacueesForNextIteration;
 	std::unordered_set<NAEdgePtr, NAEdgePtrHasher, NAEdgePtrEqual> touchededges;
 
-	// Recalculate all path costs and then list them in a sorted manner by descending final cost
+	// Recalculate the path costs that changed since the last pass and then heap them by final cost.
+	// The paths only come out of the heap in descending order as long as we are looking for 'bad' paths.
 	for (const auto & evc : *AllEvacuees)
 		if (evc->Status != EvacueeStatus::Unreachable)
 		{
@@ -317,7 +572,7 @@ size_t EvcSolver::FindPathsThatNeedToBeProcessedInIteration(std::shared_ptr<Evac
 		}
 
 	if (allPaths.empty()) return 0;
-	std::sort(allPaths.begin(), allPaths.end(), EvcPath::MoreThanFinalCost);
+	std::make_heap(allPaths.begin(), allPaths.end(), EvcPath::LessThanFinalCost);
 
 	// setting up the best ratios
 	const double minRatioOfLongestPath = allPaths.front()->GetMinCostRatio();
@@ -355,10 +610,11 @@ size_t EvcSolver::FindPathsThatNeedToBeProcessedInIteration(std::shared_ptr<Evac
 
 	// And the next step is to find 'bad' paths and detach them so that the next iteration can find new paths for these evacuees.
 	// If no `bad` paths where found then we leave `EvacueesForNextIteration` empty so that the solver terminates and returns.
-	for (const auto & path : allPaths)
+	for (auto last = allPaths.end(); last != allPaths.begin(); --last)
 	{
 		if (EvacueesForNextIteration.size() >= MaxEvacueesInIteration) break;
-		path->DoesItNeedASecondChance(ThreasholdForCost, ThreasholdForPathOverlap, EvacueesForNextIteration, GlobalEvcCostAtIteration[GolbalIteration - 1], solverMethod);
+		std::pop_heap(allPaths.begin(), last, EvcPath::LessThanFinalCost);
+		(*(last - 1))->DoesItNeedASecondChance(ThreasholdForCost, ThreasholdForPathOverlap, EvacueesForNextIteration, GlobalEvcCostAtIteration[GolbalIteration - 1], solverMethod);
 	}
 
 	// Now that we know which evacuees are going to be processed again, let's reset their values and detach their paths.
@@ -369,6 +625,100 @@ size_t EvcSolver::FindPathsThatNeedToBeProcessedInIteration(std::shared_ptr<Evac
 	return EvacueesForNextIteration.size();
 }
 
+// Refinement pass of the coarse-to-fine solve. Each coarse group was routed as one evacuee so its routes reserve the edges for the
+// whole group. A pooled evacuee with a junction on every route of its group keeps its share of them from that junction on. The share
+// of the others is released and they are left unprocessed for a full search. Returns the number of evacuees left to search.
+size_t EvcSolver::RefineCoarseGroups(std::shared_ptr<EvacueeList> AllEvacuees, const NetworkGraph & graph, int & pathGenerationCount, CoarseToFineStats & stats) const
+{
+	std::vector<std::pair<EvacueePtr, std::vector<EvacueePtr>>> groups;
+	auto detachedPaths = std::shared_ptr<std::vector<EvcPathPtr>>(new DEBUG_NEW_PLACEMENT std::vector<EvcPathPtr>());
+	std::unordered_set<NAEdgePtr, NAEdgePtrHasher, NAEdgePtrEqual> touchedEdges;
+	std::vector<std::vector<long>> routeJunctions;
+	std::vector<std::vector<NAEdgePtr>> routeEdges;
+	std::vector<std::pair<NAVertexPtr, size_t>> joins; // where the pooled evacuee joins each route of its group
+	std::vector<NAEdgePtr> treeEdges;
+	size_t searched = 0, k;
+	long from, to;
+	double cost, groupPop, share, populationLeft;
+	float capacity;
+	bool routed;
+
+	AllEvacuees->ExpandCoarseGroupings(groups);
+	for (const auto & g : groups)
+	{
+		const auto leader = g.first;
+		groupPop = leader->Population;
+		for (const auto & m : g.second) groupPop += m->Population;
+
+		detachedPaths->clear();
+		if (leader->Status != EvacueeStatus::Unreachable) EvcPath::DetachPathsFromEvacuee(leader, solverMethod, touchedEdges, detachedPaths);
+
+		// the junctions each route reaches. The partial edge into the safe zone does not reach one.
+		routeJunctions.assign(detachedPaths->size(), std::vector<long>());
+		routeEdges.assign(detachedPaths->size(), std::vector<NAEdgePtr>());
+		for (k = 0; k < detachedPaths->size(); ++k)
+		{
+			const auto path = (*detachedPaths)[k];
+			for (auto s = path->cbegin(); s != path->cend(); ++s)
+			{
+				if (s + 1 == path->cend() && path->GetSafeZone()->getBehindEdge() && (*s)->GetToRatio() < 1.0) break;
+				if (!graph.GetEdge((*s)->Edge->EID, (unsigned char)(*s)->Edge->Direction, from, to, cost, capacity)) to = -1;
+				routeJunctions[k].push_back(to);
+				routeEdges[k].push_back((*s)->Edge);
+			}
+		}
+
+		for (const auto & m : g.second)
+		{
+			joins.clear();
+			for (k = 0; k < detachedPaths->size() && joins.size() == k; ++k)
+				for (const auto & v : *(m->VerticesAndRatio))
+				{
+					auto j = std::find(routeJunctions[k].begin(), routeJunctions[k].end(), v->EID);
+					if (j == routeJunctions[k].end()) continue;
+					joins.push_back(std::pair<NAVertexPtr, size_t>(v, (size_t)(j - routeJunctions[k].begin())));
+					break;
+				}
+
+			routed = !detachedPaths->empty() && joins.size() == detachedPaths->size();
+			for (k = 0; routed && k < detachedPaths->size(); ++k)
+			{
+				const auto path = (*detachedPaths)[k];
+				treeEdges.assign(routeEdges[k].begin() + joins[k].second + 1, routeEdges[k].end());
+				share = path->GetRoutedPop() * m->Population / groupPop;
+				populationLeft = share;
+				routed = GenerateTreePath(path->GetSafeZone(), treeEdges, joins[k].first, populationLeft, pathGenerationCount, m, share, false, true);
+			}
+			for (const auto & p : *(m->Paths)) for (auto s = p->cbegin(); s != p->cend(); ++s) touchedEdges.insert((*s)->Edge);
+
+			if (routed)
+			{
+				m->Status = EvacueeStatus::Processed;
+				m->ProcessOrder = leader->ProcessOrder;
+				m->PredictedCost = leader->PredictedCost;
+				++stats.Followed;
+			}
+			else
+			{
+				EvcPath::DetachPathsFromEvacuee(m, solverMethod, touchedEdges);
+				++searched;
+			}
+		}
+
+		// the leader keeps its own share of the group routes
+		for (auto p = detachedPaths->rbegin(); p != detachedPaths->rend(); ++p)
+		{
+			(*p)->ScaleRoutedPop(leader->Population / groupPop);
+			(*p)->ReattachToEvacuee(solverMethod, touchedEdges);
+		}
+	}
+	NAEdge::HowDirtyExhaustive(touchedEdges.begin(), touchedEdges.end(), solverMethod, 1.0);
+
+	stats.Groups += groups.size();
+	stats.Searched += searched;
+	return searched;
+}
+
 HRESULT EvcSolver::CARMALoop(INetworkQueryPtr ipNetworkQuery, IStepProgressorPtr ipStepProgressor, IGPMessages* pMessages, ITrackCancel* pTrackCancel, std::shared_ptr<EvacueeList> Evacuees, CARMASort RevisedCarmaSortCriteria,
 	std::shared_ptr<std::vector<EvacueePtr>> SortedEvacuees, std::shared_ptr<NAVertexCache> vcache, std::shared_ptr<NAEdgeCache> ecache, std::shared_ptr<SafeZoneTable> safeZoneList, size_t & closedSize,
 	std::shared_ptr<NAEdgeMapTwoGen> closedList, std::shared_ptr<NAEdgeContainer> leafs, std::vector<unsigned int> & CARMAExtractCounts, double globalMinPop2Route, double & minPop2Route, bool separationRequired)
@@ -377,7 +727,7 @@ HRESULT EvcSolver::CARMALoop(INetworkQueryPtr ipNetworkQuery, IStepProgressorPtr
 
 	// performing pre-process: Here we will mark each vertex/junction with a heuristic value indicating
 	// true distance to closest safe zone using backward traversal and Dijkstra
-	MyFibonacciHeap<NAEdgePtr, NAEdgePtrHasher, NAEdgePtrEqual> heap(NAEdge::GetHeapKeyNonHur);	// creating the heap for the dijkstra search
+	CARMAHeap heap;	// creating the heap for the dijkstra search
 	NAVertexPtr neighbor = nullptr;
 	INetworkElementPtr ipElementEdge = nullptr;
 	VARIANT val;
@@ -392,11 +742,11 @@ HRESULT EvcSolver::CARMALoop(INetworkQueryPtr ipNetworkQuery, IStepProgressorPtr
 	readyEdges.reserve(safeZoneList->size());
 	unsigned int CARMAExtractCount = 0;
 	ArrayList<NAEdgePtr> * adj = nullptr;
+	TrafficBatch costBatch;
+	size_t batchIndex = 0;
 	ATL::CString statusMsg;
-	bool ShouldCARMACheckForDecreasedCost = false, FullSPTSelected = false;
+	bool ShouldCARMACheckForDecreasedCost = false, FullSPTSelected = false, useHierarchy = false, useParallel = false;
 	std::vector<NAEdgePtr> removedDirty; removedDirty.reserve(10000);
-	const std::function<bool(EvacueePtr, EvacueePtr)> SortFunctions[7] =
-		{ Evacuee::LessThanObjectID, Evacuee::LessThan, Evacuee::LessThan, Evacuee::MoreThan, Evacuee::MoreThan, Evacuee::ReverseFinalCost, Evacuee::ReverseEvacuationCost };
 
 	// keeping reachable evacuees in a new hashtable for better access
 	// also keep unreachable ones in the redundant list
@@ -439,173 +789,224 @@ HRESULT EvcSolver::CARMALoop(INetworkQueryPtr ipNetworkQuery, IStepProgressorPtr
 		}
 		minPop2Route = max(minPop2Route, 1.0);
 
+		// The contraction hierarchy backend: one search from all safe zones over the clean cost of every edge gives the exact h-value of every
+		// junction. There is no CARMA tree to maintain so the closed list and the leafs are dropped.
+		useHierarchy = hierarchyCARMA == VARIANT_TRUE && ecache->IsHierarchyBuilt();
+
 		// generally speaking we use FullSPT if the user wants it or if the mimPop2Route has changed.
 		// if the minPop has changed it means pretty much all edges are dirty and there is no point checking them or do DSPT.
 		// later in the code we also check if there are too many dirty edges and in that case we also revert back to FullSPT.
 		FullSPTSelected = ThreeGenCARMA == VARIANT_FALSE || minPop2Route != prevMinPop2Route /*|| CARMAExtractCounts.empty()*/;
-		if (FullSPTSelected) closedList->Clear(NAEdgeMapGeneration::AllGens); // Full SPT
-		else closedList->MarkAllAsOldGen(); // DSPT option
 
-		// This is where the new dynamic CARMA starts. At this point you have to clear the dirty section of the carma tree.
-		// also keep the previous leafs only if they are still in closedList. They help re-discover EvacueePairs
-		MarkDirtyEdgesAsUnVisited(closedList->oldGen, leafs, removedDirty, ShouldCARMACheckForDecreasedCost);
+		// The parallel delta-stepping backend builds the same tree as a Full SPT so the dynamic SPT rounds after it can repair it
+		useParallel = !useHierarchy && FullSPTSelected && parallelCARMA == VARIANT_TRUE && ecache->IsParallelSearchReady();
 
-		if (ipStepProgressor)
+		if (useHierarchy)
 		{
-			if (FullSPTSelected) statusMsg.Format(_T("CARMA Loop %d: Full SPT"), CARMAExtractCounts.size() + 1);
-			else if (ShouldCARMACheckForDecreasedCost) statusMsg.Format(_T("CARMA Loop %d: Fully-Dynamic SPT"), CARMAExtractCounts.size() + 1);
-			else statusMsg.Format(_T("CARMA Loop %d: Semi-Dynamic SPT"), CARMAExtractCounts.size() + 1);
-			if (FAILED(hr = ipStepProgressor->put_Message(ATL::CComBSTR(statusMsg)))) return hr;
-		}
-		#ifdef DEBUG
-		std::wostringstream os_;
-		os_ << statusMsg.GetBuffer(statusMsg.GetLength()) << std::endl;
-		OutputDebugStringW(os_.str().c_str());
-		statusMsg.ReleaseBuffer();
-		#endif
-
-		// pre-add dirty edges to heap with their old clean parents instead of checking it during loop
-		if (FAILED(hr = FindDirtyEdgesWithACleanParent(ecache, vcache, ipNetworkQuery, closedList, leafs, removedDirty))) return hr;
-
-		// prepare and insert safe zone vertices into the heap
-		for (const auto & z : *safeZoneList)
-		{
-			if (FAILED(hr = PrepareVerticesForHeap(z.second->VertexAndRatio, vcache, ecache, closedList->oldGen, readyEdges, minPop2Route, solverMethod, 0.0, 0.0, QueryDirection::Forward))) return hr;
+			if (ipStepProgressor)
+			{
+				statusMsg.Format(_T("CARMA Loop %d: Contraction Hierarchy"), CARMAExtractCounts.size() + 1);
+				if (FAILED(hr = ipStepProgressor->put_Message(ATL::CComBSTR(statusMsg)))) return hr;
+			}
+			closedList->Clear(NAEdgeMapGeneration::AllGens, true);
+			leafs->Clear();
+			ecache->CustomizeHierarchy(minPop2Route, solverMethod);
+
+			std::vector<std::pair<long, double>> targets;
+			std::vector<double> dist;
+			targets.reserve(safeZoneList->size());
+			for (const auto & z : *safeZoneList)
+			{
+				myEdge = z.second->VertexAndRatio->GetBehindEdge();
+				newCost = myEdge ? myEdge->GetCost(minPop2Route, solverMethod) : 0.0;
+				if (newCost >= CASPER_INFINITY) continue;
+				targets.push_back(std::pair<long, double>(z.first, z.second->VertexAndRatio->GVal * newCost));
+			}
+			CARMAExtractCount = (unsigned int)ecache->GetHierarchy()->QueryToTargets(targets, dist, CASPER_INFINITY);
+			vcache->LoadHierarchyHeuristic(dist);
+			EvacueePairs.RemoveDiscoveredEvacuees(dist, SortedEvacuees, minPop2Route, solverMethod);
+			CARMAExtractCounts.push_back(CARMAExtractCount);
 		}
-		for (const auto & h : readyEdges)
+		else
 		{
-			// since this turns out to be a safe zone edge we should force the previous edge to be null in the tree
-			h->TreePrevious = nullptr;
-			heap.Insert(h);
-		}
+			if (FullSPTSelected) closedList->Clear(NAEdgeMapGeneration::AllGens); // Full SPT
+			else closedList->MarkAllAsOldGen(); // DSPT option
 
-		// Now insert leaf edges in heap like the destination edges
-		// do I have to insert leafs even if DSPT is off? It does not matter cause closedList is cleaned and hence all leafs will be removed anyway.
-		if (FAILED(hr = InsertLeafEdgesToHeap(ipNetworkQuery, vcache, ecache, heap, leafs))) return hr;
+			// This is where the new dynamic CARMA starts. At this point you have to clear the dirty section of the carma tree.
+			// also keep the previous leafs only if they are still in closedList. They help re-discover EvacueePairs
+			MarkDirtyEdgesAsUnVisited(closedList->oldGen, leafs, removedDirty, ShouldCARMACheckForDecreasedCost);
 
-		// we're done with all these leafs. let's clean up and collect new ones for the next round.
-		leafs->Clear();
-		SearchRadius = CASPER_INFINITY;
-
-		// Continue traversing the network while the heap has remaining junctions in it
-		// this is the actual Dijkstra code with backward network traversal. it will only update h value.
-		while (!heap.empty())
-		{
-			// Remove the next junction EID from the top of the queue
-			myEdge = heap.DeleteMin();
-			_ASSERT_EXPR(!closedList->Exist(myEdge), L"CARMA closedList violation");
-			if (FAILED(hr = closedList->Insert(myEdge)))
+			if (ipStepProgressor)
 			{
-				// closedList violation happened
-				pMessages->AddError(-myEdge->EID, ATL::CComBSTR(L"CARMA ClosedList Violation."));
-				return ATL::AtlReportError(this->GetObjectCLSID(), _T("CARMA ClosedList Violation."), IID_INASolver);
+				if (useParallel) statusMsg.Format(_T("CARMA Loop %d: Parallel Delta-Stepping"), CARMAExtractCounts.size() + 1);
+				else if (FullSPTSelected) statusMsg.Format(_T("CARMA Loop %d: Full SPT"), CARMAExtractCounts.size() + 1);
+				else if (ShouldCARMACheckForDecreasedCost) statusMsg.Format(_T("CARMA Loop %d: Fully-Dynamic SPT"), CARMAExtractCounts.size() + 1);
+				else statusMsg.Format(_T("CARMA Loop %d: Semi-Dynamic SPT"), CARMAExtractCounts.size() + 1);
+				if (FAILED(hr = ipStepProgressor->put_Message(ATL::CComBSTR(statusMsg)))) return hr;
 			}
-			myVertex = myEdge->ToVertex;
-
-			// Check to see if the user wishes to continue or cancel the solve
-			if (pTrackCancel)
+			#ifdef DEBUG
+			std::wostringstream os_;
+			os_ << statusMsg.GetBuffer(statusMsg.GetLength()) << std::endl;
+			OutputDebugStringW(os_.str().c_str());
+			statusMsg.ReleaseBuffer();
+			#endif
+
+			// the parallel search settles every junction at once and hands back the tree a Full SPT would have built
+			if (useParallel)
 			{
-				if (FAILED(hr = pTrackCancel->Continue(&keepGoing))) return hr;
-				if (keepGoing == VARIANT_FALSE) return E_ABORT;
+				leafs->Clear();
+				SearchRadius = CASPER_INFINITY;
+				if (FAILED(hr = BuildParallelCARMATree(ipNetworkQuery, pMessages, vcache, ecache, safeZoneList, closedList, leafs, EvacueePairs, SortedEvacuees, minPop2Route,
+					CARMAExtractCount, SearchRadius))) return hr;
 			}
+			else
+			{
+				// pre-add dirty edges to heap with their old clean parents instead of checking it during loop
+				if (FAILED(hr = FindDirtyEdgesWithACleanParent(ecache, vcache, ipNetworkQuery, closedList, leafs, removedDirty))) return hr;
 
-			// check if this edge decreased its cost
-			CARMAExtractCount++;
+				// prepare and insert safe zone vertices into the heap
+				for (const auto & z : *safeZoneList)
+				{
+					if (FAILED(hr = PrepareVerticesForHeap(z.second->VertexAndRatio, vcache, ecache, closedList->oldGen, readyEdges, minPop2Route, solverMethod, 0.0, 0.0, QueryDirection::Forward))) return hr;
+				}
+				for (const auto & h : readyEdges)
+				{
+					// since this turns out to be a safe zone edge we should force the previous edge to be null in the tree
+					h->TreePrevious = nullptr;
+					heap.Insert(h);
+				}
 
-			// Code to build the CARMA Tree
-			if (myVertex->Previous)
-			{
-				if (myEdge->TreePrevious) myEdge->TreePrevious->TreeNext.unordered_erase(myEdge, NAEdge::IsEqualNAEdgePtr);
-				myEdge->TreePrevious = myVertex->Previous->GetBehindEdge();
-				myEdge->TreePrevious->TreeNext.push_back(myEdge);
-			}
+				// Now insert leaf edges in heap like the destination edges
+				// do I have to insert leafs even if DSPT is off? It does not matter cause closedList is cleaned and hence all leafs will be removed anyway.
+				if (FAILED(hr = InsertLeafEdgesToHeap(ipNetworkQuery, vcache, ecache, heap, leafs))) return hr;
 
-			// part to check if this branch of DJ tree needs expanding to update heuristics. This update should know if this is the first time this vertex is coming out
-			// in this 'CARMALoop' round. Only then we can be sure whether to update to min or update absolutely to this new value.
-			myVertex->UpdateYourHeuristic();
-			myEdge->SetClean(this->solverMethod, minPop2Route);
+				// we're done with all these leafs. let's clean up and collect new ones for the next round.
+				leafs->Clear();
+				SearchRadius = CASPER_INFINITY;
 
-			// termination condition and evacuee discovery
-			// if we've found all evacuees and we're beyond the search radius then instead of adding to the heap, we add it to the leafs list so that the next carma
-			// loop we can use it to expand the rest of the tree ... if this branch was needed. Not adding the edge to the heap will basically render this edge invisible to the
-			// future carma loops and can cause problems / inconsistancies. This is an attempt to solve the bug in issue 8: http://github.com/spatial-computing/CASPER/issues/8
-			if (EvacueePairs.empty())
-			{
-				UpdatePeakMemoryUsage();
-				leafs->Insert(myEdge);
-				SearchRadius = min(SearchRadius, myVertex->GVal);
-				continue;
-			}
+				// Continue traversing the network while the heap has remaining junctions in it
+				// this is the actual Dijkstra code with backward network traversal. it will only update h value.
+				while (!heap.empty())
+				{
+					// Remove the next junction EID from the top of the queue
+					myEdge = heap.DeleteMin();
+					_ASSERT_EXPR(!closedList->Exist(myEdge), L"CARMA closedList violation");
+					if (FAILED(hr = closedList->Insert(myEdge)))
+					{
+						// closedList violation happened
+						pMessages->AddError(-myEdge->EID, ATL::CComBSTR(L"CARMA ClosedList Violation."));
+						return ATL::AtlReportError(this->GetObjectCLSID(), _T("CARMA ClosedList Violation."), IID_INASolver);
+					}
+					myVertex = myEdge->ToVertex;
+
+					// Check to see if the user wishes to continue or cancel the solve
+					if (pTrackCancel)
+					{
+						if (FAILED(hr = pTrackCancel->Continue(&keepGoing))) return hr;
+						if (keepGoing == VARIANT_FALSE) return E_ABORT;
+					}
 
-			EvacueePairs.RemoveDiscoveredEvacuees(myVertex, myEdge, SortedEvacuees, minPop2Route, solverMethod);
+					// check if this edge decreased its cost
+					CARMAExtractCount++;
 
-			if (FAILED(hr = ecache->QueryAdjacencies(myVertex, myEdge, QueryDirection::Backward, &adj))) return hr;
+					// Code to build the CARMA Tree
+					if (myVertex->Previous)
+					{
+						if (myEdge->TreePrevious) myEdge->TreePrevious->TreeNext.unordered_erase(myEdge, NAEdge::IsEqualNAEdgePtr);
+						myEdge->TreePrevious = myVertex->Previous->GetBehindEdge();
+						myEdge->TreePrevious->TreeNext.push_back(myEdge);
+					}
 
-			for (const auto & currentEdge : *adj)
-			{
-				if (FAILED(hr = currentEdge->NetEdge->QueryJunctions(ipCurrentJunction, nullptr))) return hr;
-				newCost = myVertex->GVal + currentEdge->GetCost(minPop2Route, solverMethod);
-				if (newCost >= CASPER_INFINITY) continue;
+					// part to check if this branch of DJ tree needs expanding to update heuristics. This update should know if this is the first time this vertex is coming out
+					// in this 'CARMALoop' round. Only then we can be sure whether to update to min or update absolutely to this new value.
+					myVertex->UpdateYourHeuristic();
+					myEdge->SetClean(this->solverMethod, minPop2Route);
 
-				if (closedList->Exist(currentEdge, NAEdgeMapGeneration::OldGen))
-				{
-					if (ShouldCARMACheckForDecreasedCost)
+					// termination condition and evacuee discovery
+					// if we've found all evacuees and we're beyond the search radius then instead of adding to the heap, we add it to the leafs list so that the next carma
+					// loop we can use it to expand the rest of the tree ... if this branch was needed. Not adding the edge to the heap will basically render this edge invisible to the
+					// future carma loops and can cause problems / inconsistancies. This is an attempt to solve the bug in issue 8: http://github.com/spatial-computing/CASPER/issues/8
+					if (EvacueePairs.empty())
 					{
-						neighbor = vcache->New(ipCurrentJunction, ipNetworkQuery);
-						if (newCost < neighbor->GetH(currentEdge->EID))
-						{
-							neighbor->SetBehindEdge(currentEdge);
-							neighbor->GVal = newCost;
-							neighbor->Previous = myVertex;
-							closedList->Erase(currentEdge, NAEdgeMapGeneration::OldGen);
-							heap.Insert(currentEdge);
-						}
+						UpdatePeakMemoryUsage();
+						leafs->Insert(myEdge);
+						SearchRadius = min(SearchRadius, myVertex->GVal);
+						continue;
 					}
-				}
-				else
-				{
-					if (!closedList->Exist(currentEdge, NAEdgeMapGeneration::NewGen))
+
+					EvacueePairs.RemoveDiscoveredEvacuees(myVertex, myEdge, SortedEvacuees, minPop2Route, solverMethod);
+
+					if (FAILED(hr = ecache->QueryAdjacencies(myVertex, myEdge, QueryDirection::Backward, &adj))) return hr;
+					NAEdge::GetCosts(*adj, minPop2Route, batchCostKernel, costBatch, false);
+					batchIndex = 0;
+
+					for (const auto & currentEdge : *adj)
 					{
-						if (heap.IsVisited(currentEdge)) // vertex has been visited before. update vertex and decrease key.
+						if (FAILED(hr = currentEdge->NetEdge->QueryJunctions(ipCurrentJunction, nullptr))) return hr;
+						newCost = myVertex->GVal + costBatch.Cost[batchIndex++];
+						if (newCost >= CASPER_INFINITY) continue;
+
+						if (closedList->Exist(currentEdge, NAEdgeMapGeneration::OldGen))
 						{
-							neighbor = currentEdge->ToVertex;
-							if (neighbor->GVal > newCost)
+							if (ShouldCARMACheckForDecreasedCost)
 							{
-								neighbor->SetBehindEdge(currentEdge);
-								neighbor->GVal = newCost;
-								neighbor->Previous = myVertex;
-								heap.UpdateKey(currentEdge);
+								neighbor = vcache->New(ipCurrentJunction, ipNetworkQuery);
+								if (newCost < neighbor->GetH(currentEdge->EID))
+								{
+									neighbor->SetBehindEdge(currentEdge);
+									neighbor->GVal = newCost;
+									neighbor->Previous = myVertex;
+									closedList->Erase(currentEdge, NAEdgeMapGeneration::OldGen);
+									heap.Insert(currentEdge);
+								}
 							}
 						}
-						else // unvisited vertex. create new and insert into heap
+						else
 						{
-							neighbor = vcache->New(ipCurrentJunction, ipNetworkQuery);
-							neighbor->SetBehindEdge(currentEdge);
-							neighbor->GVal = newCost;
-							neighbor->Previous = myVertex;
-							heap.Insert(currentEdge);
+							if (!closedList->Exist(currentEdge, NAEdgeMapGeneration::NewGen))
+							{
+								if (heap.IsVisited(currentEdge)) // vertex has been visited before. update vertex and decrease key.
+								{
+									neighbor = currentEdge->ToVertex;
+									if (neighbor->GVal > newCost)
+									{
+										neighbor->SetBehindEdge(currentEdge);
+										neighbor->GVal = newCost;
+										neighbor->Previous = myVertex;
+										heap.UpdateKey(currentEdge);
+									}
+								}
+								else // unvisited vertex. create new and insert into heap
+								{
+									neighbor = vcache->New(ipCurrentJunction, ipNetworkQuery);
+									neighbor->SetBehindEdge(currentEdge);
+									neighbor->GVal = newCost;
+									neighbor->Previous = myVertex;
+									heap.Insert(currentEdge);
+								}
+							}
 						}
 					}
 				}
 			}
-		}
-		#ifdef DEBUG
-		std::wostringstream os2;
-		os2 << "CARMA Extract Count = " << CARMAExtractCount << std::endl;
-		OutputDebugStringW(os2.str().c_str());
-		#endif
+			#ifdef DEBUG
+			std::wostringstream os2;
+			os2 << "CARMA Extract Count = " << CARMAExtractCount << std::endl;
+			OutputDebugStringW(os2.str().c_str());
+			#endif
 
-		_ASSERT_EXPR(EvacueePairs.empty(), L"Carma loop ended after scanning all the graph");
+			_ASSERT_EXPR(EvacueePairs.empty(), L"Carma loop ended after scanning all the graph");
 
-		// set new default heuristic value
-		vcache->UpdateHeuristicForOutsideVertices(SearchRadius, CARMAExtractCounts.empty());
-		CARMAExtractCounts.push_back(CARMAExtractCount);
+			// set new default heuristic value
+			vcache->UpdateHeuristicForOutsideVertices(SearchRadius);
+			CARMAExtractCounts.push_back(CARMAExtractCount);
+		}
 	}
 
 	// load discovered evacuees into sorted list
 	EvacueePairs.LoadSortedEvacuees(SortedEvacuees);
 
-	std::sort(SortedEvacuees->begin(), SortedEvacuees->end(), SortFunctions[RevisedCarmaSortCriteria]);
+	std::sort(SortedEvacuees->begin(), SortedEvacuees->end(), CARMASortFunctions[RevisedCarmaSortCriteria]);
 	UpdatePeakMemoryUsage();
 	closedSize = closedList->Size();
 	
@@ -618,6 +1019,569 @@ HRESULT EvcSolver::CARMALoop(INetworkQueryPtr ipNetworkQuery, IStepProgressorPtr
 	return hr;
 }
 
+// Full SPT round of CARMA on the parallel delta-stepping search. The search hands back the distance and the parent arc of every junction.
+// The tree is then built in one pass from the safe zones without a heap: the backward edges of a junction hang off the edge that settled
+// it, which is exactly what the sequential Dijkstra would have extracted. Junctions beyond the radius that empties the evacuee table are not
+// expanded and the edges extracted after that point become the leafs. Like the other graph searches, this one ignores the U-turn policy.
+HRESULT EvcSolver::BuildParallelCARMATree(INetworkQueryPtr ipNetworkQuery, IGPMessages* pMessages, std::shared_ptr<NAVertexCache> vcache, std::shared_ptr<NAEdgeCache> ecache,
+	std::shared_ptr<SafeZoneTable> safeZoneList, std::shared_ptr<NAEdgeMapTwoGen> closedList, std::shared_ptr<NAEdgeContainer> leafs, NAEvacueeVertexTable & EvacueePairs,
+	std::shared_ptr<std::vector<EvacueePtr>> SortedEvacuees, double minPop2Route, unsigned int & CARMAExtractCount, double & SearchRadius)
+{
+	HRESULT hr = S_OK;
+	std::vector<std::pair<long, double>> targets;
+	std::vector<double> dist, cost;
+	std::vector<GraphArc> parents;
+	std::vector<NAEdgePtr> readyEdges, treeEdges, extractedEdges;
+	std::vector<long> expand;
+	std::unordered_set<NAEdgePtr, NAEdgePtrHasher, NAEdgePtrEqual> built;
+	const GraphArc * first = nullptr, * last = nullptr;
+	const NetworkGraph * graph = ecache->GetGraph();
+	INetworkElementPtr ipJunctionElement = nullptr;
+	INetworkJunctionPtr ipCurrentJunction = nullptr;
+	NAVertexPtr myVertex = nullptr, neighbor = nullptr;
+	NAEdgePtr myEdge = nullptr, currentEdge = nullptr;
+	double radius, edgeCost;
+	size_t c;
+	long j;
+
+	if (FAILED(hr = ipNetworkQuery->CreateNetworkElement(esriNETJunction, &ipJunctionElement))) return hr;
+	ipCurrentJunction = ipJunctionElement;
+
+	targets.reserve(safeZoneList->size());
+	for (const auto & z : *safeZoneList)
+	{
+		myEdge = z.second->VertexAndRatio->GetBehindEdge();
+		edgeCost = myEdge ? myEdge->GetCost(minPop2Route, solverMethod) : 0.0;
+		if (edgeCost >= CASPER_INFINITY) continue;
+		targets.push_back(std::pair<long, double>(z.first, z.second->VertexAndRatio->GVal * edgeCost));
+	}
+	ecache->QueryParallelSearch(minPop2Route, solverMethod, targets, dist, cost, &parents);
+	radius = EvacueePairs.DiscoveryRadius(dist);
+	treeEdges.assign(dist.size(), nullptr);
+
+	// the safe zone edges are the roots, just like the sequential search. A safe zone junction that got a parent arc from another safe zone
+	// hangs off that arc instead.
+	for (const auto & z : *safeZoneList)
+	{
+		if (FAILED(hr = PrepareVerticesForHeap(z.second->VertexAndRatio, vcache, ecache, closedList->oldGen, readyEdges, minPop2Route, solverMethod, 0.0, 0.0, QueryDirection::Forward))) return hr;
+	}
+	for (const auto & h : readyEdges)
+	{
+		h->TreePrevious = nullptr;
+		if (h->ToVertex->GVal >= CASPER_INFINITY || !built.insert(h).second) continue;
+		extractedEdges.push_back(h);
+		j = h->ToVertex->EID;
+		if (j < 0 || (size_t)j >= treeEdges.size() || parents[j].EID >= 0) continue;
+		if (!treeEdges[j]) expand.push_back(j);
+		if (!treeEdges[j] || treeEdges[j]->ToVertex->GVal > h->ToVertex->GVal) treeEdges[j] = h;
+	}
+
+	// every junction comes after its parent so the vertex at the other end of each backward edge is already in place
+	for (size_t i = 0; i < expand.size(); ++i)
+	{
+		myVertex = treeEdges[expand[i]]->ToVertex;
+		if (myVertex->GVal > radius || !graph->GetAdjacencies(expand[i], false, first, last)) continue;
+		for (; first != last; ++first)
+		{
+			c = (size_t)first->EID * 2 + first->Dir - 1;
+			edgeCost = c < cost.size() ? cost[c] : CASPER_INFINITY;
+			if (edgeCost >= CASPER_INFINITY) continue;
+			if (!(currentEdge = ecache->New(first->EID, (esriNetworkEdgeDirection)first->Dir))) return E_FAIL;
+			if (!built.insert(currentEdge).second) continue;
+
+			if (FAILED(hr = currentEdge->NetEdge->QueryJunctions(ipCurrentJunction, nullptr))) return hr;
+			neighbor = vcache->New(ipCurrentJunction, ipNetworkQuery);
+			neighbor->SetBehindEdge(currentEdge);
+			neighbor->GVal = myVertex->GVal + edgeCost;
+			neighbor->Previous = myVertex;
+			extractedEdges.push_back(currentEdge);
+
+			const GraphArc & parent = parents[first->Junction];
+			if (parent.EID == first->EID && parent.Dir == first->Dir)
+			{
+				treeEdges[first->Junction] = currentEdge;
+				expand.push_back(first->Junction);
+			}
+		}
+	}
+
+	// the edges go into the closed list in the order the sequential search would have extracted them
+	std::stable_sort(extractedEdges.begin(), extractedEdges.end(), [](NAEdgePtr a, NAEdgePtr b) { return a->ToVertex->GVal < b->ToVertex->GVal; });
+	for (const auto & e : extractedEdges)
+	{
+		if (FAILED(hr = closedList->Insert(e)))
+		{
+			// closedList violation happened
+			pMessages->AddError(-e->EID, ATL::CComBSTR(L"CARMA ClosedList Violation."));
+			return ATL::AtlReportError(this->GetObjectCLSID(), _T("CARMA ClosedList Violation."), IID_INASolver);
+		}
+		myVertex = e->ToVertex;
+		CARMAExtractCount++;
+
+		// Code to build the CARMA Tree
+		if (myVertex->Previous)
+		{
+			if (e->TreePrevious) e->TreePrevious->TreeNext.unordered_erase(e, NAEdge::IsEqualNAEdgePtr);
+			e->TreePrevious = myVertex->Previous->GetBehindEdge();
+			e->TreePrevious->TreeNext.push_back(e);
+		}
+		myVertex->UpdateYourHeuristic();
+		e->SetClean(this->solverMethod, minPop2Route);
+
+		if (EvacueePairs.empty())
+		{
+			leafs->Insert(e);
+			SearchRadius = min(SearchRadius, myVertex->GVal);
+			continue;
+		}
+		EvacueePairs.RemoveDiscoveredEvacuees(myVertex, e, SortedEvacuees, minPop2Route, solverMethod);
+	}
+	UpdatePeakMemoryUsage();
+	return hr;
+}
+
+// SP routes never change the cost of an edge so one backward search from all the safe zones gives the shortest route of every evacuee
+// that is left. The routes are read off this single tree and reserved in one pass. The dirty state of the reserved edges is updated once at the end.
+HRESULT EvcSolver::SingleTreeLoop(INetworkQueryPtr ipNetworkQuery, IStepProgressorPtr ipStepProgressor, IGPMessages* pMessages, ITrackCancel* pTrackCancel, std::shared_ptr<EvacueeList> Evacuees,
+	CARMASort RevisedCarmaSortCriteria, std::shared_ptr<NAVertexCache> vcache, std::shared_ptr<NAEdgeCache> ecache, std::shared_ptr<SafeZoneTable> safeZoneList,
+	std::vector<unsigned int> & CARMAExtractCounts, int & pathGenerationCount, int & EvacueeProcessOrder, double & MaxPathCostSoFar)
+{
+	HRESULT hr = S_OK;
+	CARMAHeap heap;
+	NAEdgeMap closedList;
+	NAVertexPtr neighbor = nullptr, myVertex = nullptr, treeVertex = nullptr, startVertex = nullptr, evcVertex = nullptr;
+	NAEdgePtr myEdge = nullptr;
+	INetworkElementPtr ipJunctionElement = nullptr;
+	INetworkJunctionPtr ipCurrentJunction = nullptr;
+	VARIANT_BOOL keepGoing;
+	ATL::CString statusMsg;
+	std::vector<NAEdgePtr> readyEdges, treeEdges;
+	std::vector<EvacueePtr> routedEvacuees;
+	std::unordered_map<long, NAVertexPtr> startVertices; // first tree vertex settled at each evacuee junction
+	std::unordered_set<NAEdgePtr, NAEdgePtrHasher, NAEdgePtrEqual> touchedEdges;
+	ArrayList<NAEdgePtr> * adj = nullptr;
+	TrafficBatch costBatch;
+	size_t batchIndex = 0, junctionsLeft = 0;
+	unsigned int extractCount = 0;
+	double newCost, populationLeft;
+	SafeZonePtr zone = nullptr;
+	EvcPath * path = nullptr;
+	const double minPop2Route = 1.0; // SP edge costs do not depend on the population
+
+	// the best start of an evacuee is the vertex with the lowest tree cost plus the cost of the edge portion that leads to it
+	auto findStart = [&startVertices, minPop2Route, this](EvacueePtr evc, NAVertexPtr & bestVertex, NAVertexPtr & bestTreeVertex) -> double
+	{
+		double best = CASPER_INFINITY, cost;
+		bestVertex = bestTreeVertex = nullptr;
+		for (const auto & v : *evc->VerticesAndRatio)
+		{
+			const auto s = startVertices.find(v->EID);
+			if (s == startVertices.end() || !s->second) continue;
+			cost = v->GetBehindEdge() ? v->GetBehindEdge()->GetCost(minPop2Route, solverMethod) : 0.0;
+			if (cost >= CASPER_INFINITY) continue;
+			cost = s->second->GVal + v->GVal * cost;
+			if (cost < best)
+			{
+				best = cost;
+				bestVertex = v;
+				bestTreeVertex = s->second;
+			}
+		}
+		return best;
+	};
+
+	for (const auto & evc : *Evacuees)
+	{
+		if (evc->Status != EvacueeStatus::Unprocessed || evc->Population <= 0.0) continue;
+		routedEvacuees.push_back(evc);
+		for (const auto & v : *evc->VerticesAndRatio) startVertices.insert(std::pair<long, NAVertexPtr>(v->EID, nullptr));
+	}
+	if (routedEvacuees.empty()) return hr;
+	junctionsLeft = startVertices.size();
+
+	if (FAILED(hr = ipNetworkQuery->CreateNetworkElement(esriNETJunction, &ipJunctionElement))) return hr;
+	ipCurrentJunction = ipJunctionElement;
+
+	if (ipStepProgressor)
+	{
+		statusMsg.Format(_T("CARMA Loop %d: Single SP Tree"), CARMAExtractCounts.size() + 1);
+		if (FAILED(hr = ipStepProgressor->put_Message(ATL::CComBSTR(statusMsg)))) return hr;
+	}
+
+	// the safe zones are the roots of the tree
+	for (const auto & z : *safeZoneList)
+	{
+		if (FAILED(hr = PrepareVerticesForHeap(z.second->VertexAndRatio, vcache, ecache, &closedList, readyEdges, minPop2Route, solverMethod, 0.0, 0.0, QueryDirection::Forward))) return hr;
+	}
+	for (const auto & h : readyEdges) heap.Insert(h);
+
+	// backward Dijkstra until every evacuee junction is settled
+	while (!heap.empty() && junctionsLeft > 0)
+	{
+		myEdge = heap.DeleteMin();
+		if (FAILED(hr = closedList.Insert(myEdge)))
+		{
+			// closedList violation happened
+			pMessages->AddError(-myEdge->EID, ATL::CComBSTR(L"SP Tree ClosedList Violation."));
+			return ATL::AtlReportError(this->GetObjectCLSID(), _T("SP Tree ClosedList Violation."), IID_INASolver);
+		}
+		myVertex = myEdge->ToVertex;
+		++extractCount;
+
+		// Check to see if the user wishes to continue or cancel the solve
+		if (pTrackCancel)
+		{
+			if (FAILED(hr = pTrackCancel->Continue(&keepGoing))) return hr;
+			if (keepGoing == VARIANT_FALSE) return E_ABORT;
+		}
+
+		const auto s = startVertices.find(myVertex->EID);
+		if (s != startVertices.end() && !s->second)
+		{
+			s->second = myVertex;
+			--junctionsLeft;
+		}
+
+		if (FAILED(hr = ecache->QueryAdjacencies(myVertex, myEdge, QueryDirection::Backward, &adj))) return hr;
+		NAEdge::GetCosts(*adj, minPop2Route, batchCostKernel, costBatch, false);
+		batchIndex = 0;
+
+		for (const auto & currentEdge : *adj)
+		{
+			newCost = myVertex->GVal + costBatch.Cost[batchIndex++];
+			if (newCost >= CASPER_INFINITY || closedList.Exist(currentEdge)) continue;
+
+			if (heap.IsVisited(currentEdge)) // vertex has been visited before. update vertex and decrease key.
+			{
+				neighbor = currentEdge->ToVertex;
+				if (neighbor->GVal > newCost)
+				{
+					neighbor->GVal = newCost;
+					neighbor->Previous = myVertex;
+					heap.UpdateKey(currentEdge);
+				}
+			}
+			else // unvisited vertex. create new and insert into heap
+			{
+				if (FAILED(hr = currentEdge->NetEdge->QueryJunctions(ipCurrentJunction, nullptr))) return hr;
+				neighbor = vcache->New(ipCurrentJunction, ipNetworkQuery);
+				neighbor->SetBehindEdge(currentEdge);
+				neighbor->GVal = newCost;
+				neighbor->Previous = myVertex;
+				heap.Insert(currentEdge);
+			}
+		}
+	}
+	CARMAExtractCounts.push_back(extractCount);
+	UpdatePeakMemoryUsage();
+
+	// the predicted cost is exact here so it is also the processing order
+	for (const auto & evc : routedEvacuees)
+	{
+		newCost = findStart(evc, evcVertex, startVertex);
+		if (evcVertex) evc->PredictedCost = newCost + evc->StartingCost;
+		else evc->Status = EvacueeStatus::Unreachable;
+	}
+	std::sort(routedEvacuees.begin(), routedEvacuees.end(), CARMASortFunctions[RevisedCarmaSortCriteria]);
+
+	// walk the tree from each evacuee to its safe zone and reserve the route. Segments are added from the safe zone end like GeneratePath does.
+	for (const auto & evc : routedEvacuees)
+	{
+		if (evc->Status != EvacueeStatus::Unprocessed) continue;
+		if (ipStepProgressor) ipStepProgressor->Step();
+		evc->ProcessOrder = ++EvacueeProcessOrder;
+		findStart(evc, evcVertex, startVertex);
+
+		treeEdges.clear();
+		for (treeVertex = startVertex; treeVertex->Previous; treeVertex = treeVertex->Previous) treeEdges.push_back(treeVertex->GetBehindEdge());
+		zone = safeZoneList->find(treeVertex->EID)->second;
+		populationLeft = evc->Population;
+		if (!GenerateTreePath(zone, treeEdges, evcVertex, populationLeft, pathGenerationCount, evc, evc->Population, false, true))
+		{
+			evc->Status = EvacueeStatus::Unreachable;
+			continue;
+		}
+		path = evc->Paths->front();
+		for (auto seg = path->cbegin(); seg != path->cend(); ++seg) touchedEdges.insert((*seg)->Edge);
+		MaxPathCostSoFar = max(MaxPathCostSoFar, path->GetReserveEvacuationCost());
+		evc->Status = EvacueeStatus::Processed;
+	}
+	NAEdge::HowDirtyExhaustive(touchedEdges.begin(), touchedEdges.end(), solverMethod, minPop2Route);
+
+	// the tree vertices are not needed anymore
+	UpdatePeakMemoryUsage();
+	vcache->CollectAndRelease();
+	return hr;
+}
+
+// Routes the next part of the population of an evacuee off the bucket tree. The tree grows until nothing left in its heap can beat the
+// best start of the evacuee. The route is then reserved and the part of the tree behind it is repaired for the next evacuee of the bucket.
+HRESULT EvcSolver::RouteFromBucketTree(INetworkQueryPtr ipNetworkQuery, IGPMessages* pMessages, EvacueePtr currentEvacuee, std::shared_ptr<NAVertexCache> vcache,
+	std::shared_ptr<NAEdgeCache> ecache, std::shared_ptr<SafeZoneTable> safeZoneList, BucketTree & tree, INetworkJunctionPtr ipCurrentJunction, double & populationLeft,
+	int & pathGenerationCount, double population2Route, bool separationRequired, unsigned int & visitedDirtyEdge, size_t & visitedEdge, bool & routed)
+{
+	HRESULT hr = S_OK;
+	NAVertexPtr myVertex = nullptr, neighbor = nullptr, evcVertex = nullptr, startVertex = nullptr, treeVertex = nullptr;
+	NAEdgePtr myEdge = nullptr;
+	ArrayList<NAEdgePtr> * adj = nullptr;
+	TrafficBatch costBatch;
+	std::vector<NAEdgePtr> treeEdges, changedEdges;
+	std::vector<std::pair<NAEdgePtr, double>> pathEdgeCosts;
+	std::unordered_set<long> evcJunctions;
+	SafeZonePtr zone = nullptr;
+	size_t batchIndex = 0;
+	double best = CASPER_INFINITY, newCost, zoneCost, globalDeltaCost = 0.0;
+
+	routed = false;
+	visitedDirtyEdge = 0;
+	visitedEdge = 0;
+
+	// the edge costs depend on the population so the tree of another population is no good
+	if (tree.Population != population2Route)
+	{
+		tree.Clear();
+		vcache->CollectAndRelease();
+		tree.Population = population2Route;
+		for (const auto & z : *safeZoneList)
+			if (FAILED(hr = SeedBucketTree(vcache, ecache, tree, z.second))) return hr;
+	}
+
+	// the best start of the evacuee is the closed tree vertex with the lowest cost plus the cost of the edge portion that leads to it
+	auto findStart = [&tree, &best, &evcVertex, &startVertex, currentEvacuee, population2Route, this]()
+	{
+		double cost;
+		best = CASPER_INFINITY;
+		evcVertex = startVertex = nullptr;
+		for (const auto & v : *currentEvacuee->VerticesAndRatio)
+		{
+			const auto j = tree.JunctionEdges.find(v->EID);
+			if (j == tree.JunctionEdges.end()) continue;
+			cost = v->GetBehindEdge() ? v->GetBehindEdge()->GetCost(population2Route, solverMethod) : 0.0;
+			if (cost >= CASPER_INFINITY) continue;
+			for (const auto & e : j->second)
+			{
+				if (!tree.ClosedList.Exist(e) || e->ToVertex->GVal + v->GVal * cost >= best) continue;
+				best = e->ToVertex->GVal + v->GVal * cost;
+				evcVertex = v;
+				startVertex = e->ToVertex;
+			}
+		}
+	};
+
+	for (const auto & v : *currentEvacuee->VerticesAndRatio) evcJunctions.insert(v->EID);
+	findStart();
+
+	// the keys come out of the heap in order so once the last extract is not below the best start nothing in the heap can beat it
+	while (!tree.Heap.empty() && best > tree.LastKey)
+	{
+		myEdge = tree.Heap.DeleteMin();
+		if (FAILED(hr = tree.ClosedList.Insert(myEdge)))
+		{
+			// closedList violation happened
+			pMessages->AddError(-myEdge->EID, ATL::CComBSTR(L"Bucket Tree ClosedList Violation."));
+			return ATL::AtlReportError(this->GetObjectCLSID(), _T("Bucket Tree ClosedList Violation."), IID_INASolver);
+		}
+		myVertex = myEdge->ToVertex;
+		tree.LastKey = myVertex->GVal;
+		tree.JunctionEdges[myVertex->EID].push_back(myEdge);
+		currentEvacuee->SearchExtractCount++;
+		++visitedEdge;
+		if (myEdge->GetDirtyState() != EdgeDirtyState::CleanState) ++visitedDirtyEdge;
+		if (evcJunctions.find(myVertex->EID) != evcJunctions.end()) findStart();
+
+		if (FAILED(hr = ecache->QueryAdjacencies(myVertex, myEdge, QueryDirection::Backward, &adj))) return hr;
+		NAEdge::GetCosts(*adj, population2Route, batchCostKernel, costBatch, false);
+		batchIndex = 0;
+
+		for (const auto & currentEdge : *adj)
+		{
+			newCost = myVertex->GVal + costBatch.Cost[batchIndex++];
+			if (newCost >= CASPER_INFINITY || tree.ClosedList.Exist(currentEdge)) continue;
+
+			if (tree.Heap.IsVisited(currentEdge)) // vertex has been visited before. update vertex and decrease key.
+			{
+				neighbor = currentEdge->ToVertex;
+				if (neighbor->GVal > newCost)
+				{
+					neighbor->GVal = newCost;
+					neighbor->Previous = myVertex;
+					tree.Heap.UpdateKey(currentEdge);
+				}
+			}
+			else // unvisited vertex. create new and insert into heap
+			{
+				if (FAILED(hr = currentEdge->NetEdge->QueryJunctions(ipCurrentJunction, nullptr))) return hr;
+				neighbor = vcache->New(ipCurrentJunction, ipNetworkQuery);
+				neighbor->SetBehindEdge(currentEdge);
+				neighbor->GVal = newCost;
+				neighbor->Previous = myVertex;
+				tree.Heap.Insert(currentEdge);
+				tree.OpenEdges.push_back(currentEdge);
+			}
+		}
+	}
+	UpdatePeakMemoryUsage();
+
+	// no safe zone can be reached so we assume the rest of the population at this location has no path either
+	if (!evcVertex)
+	{
+		populationLeft = 0.0;
+		return hr;
+	}
+
+	for (treeVertex = startVertex; treeVertex->Previous; treeVertex = treeVertex->Previous) treeEdges.push_back(treeVertex->GetBehindEdge());
+	zone = safeZoneList->find(treeVertex->EID)->second;
+
+	// remember the costs that the route is about to change
+	for (const auto & e : treeEdges) pathEdgeCosts.push_back(std::pair<NAEdgePtr, double>(e, e->GetCost(population2Route, solverMethod)));
+	if (evcVertex->GetBehindEdge()) pathEdgeCosts.push_back(std::pair<NAEdgePtr, double>(evcVertex->GetBehindEdge(), evcVertex->GetBehindEdge()->GetCost(population2Route, solverMethod)));
+	if (zone->getBehindEdge()) pathEdgeCosts.push_back(std::pair<NAEdgePtr, double>(zone->getBehindEdge(), zone->getBehindEdge()->GetCost(population2Route, solverMethod)));
+	zoneCost = zone->SafeZoneCost(population2Route, solverMethod, costPerDensity, &globalDeltaCost);
+
+	routed = GenerateTreePath(zone, treeEdges, evcVertex, populationLeft, pathGenerationCount, currentEvacuee, population2Route, separationRequired, false);
+	if (!routed) return hr;
+
+	NAEdge::GetChangedEdges(pathEdgeCosts, population2Route, solverMethod, false, [&ecache](NAEdgePtr e) { return ecache->GetTwin(e); }, changedEdges);
+	globalDeltaCost = 0.0;
+	if (zone->SafeZoneCost(population2Route, solverMethod, costPerDensity, &globalDeltaCost) == zoneCost) zone = nullptr;
+	if (changedEdges.empty() && !zone) return hr;
+	return RepairBucketTree(vcache, ecache, safeZoneList, tree, changedEdges, zone);
+}
+
+// The roots of the bucket tree at one safe zone. Their cost starts with the cost of the safe zone itself.
+HRESULT EvcSolver::SeedBucketTree(std::shared_ptr<NAVertexCache> vcache, std::shared_ptr<NAEdgeCache> ecache, BucketTree & tree, SafeZonePtr zone) const
+{
+	HRESULT hr = S_OK;
+	std::vector<NAEdgePtr> readyEdges;
+	double globalDeltaCost = 0.0;
+	const double zoneCost = zone->SafeZoneCost(tree.Population, solverMethod, costPerDensity, &globalDeltaCost);
+
+	if (zoneCost >= CASPER_INFINITY) return hr;
+	if (zone->VertexAndRatio->GetBehindEdge() && tree.ClosedList.Exist(zone->VertexAndRatio->GetBehindEdge())) return hr;
+	if (FAILED(hr = PrepareVerticesForHeap(zone->VertexAndRatio, vcache, ecache, &tree.ClosedList, readyEdges, tree.Population, solverMethod, 0.0, 0.0, QueryDirection::Forward))) return hr;
+
+	for (const auto & e : readyEdges)
+	{
+		if (e->ToVertex->GVal >= CASPER_INFINITY) continue;
+		e->ToVertex->GVal += zoneCost + globalDeltaCost;
+		if (tree.Heap.IsVisited(e)) tree.Heap.UpdateKey(e);
+		else
+		{
+			tree.Heap.Insert(e);
+			tree.OpenEdges.push_back(e);
+		}
+	}
+	return hr;
+}
+
+// The tree vertices behind the changed edges and behind the changed safe zone are not exact anymore so they leave the tree and are relaxed
+// again from their valid neighbors. A reservation only adds flow so the costs only went up, and 'changedEdges' lists every edge whose cost
+// did, including the other direction of a two-way road that shares its capacity with a reserved edge. So the rest of the tree is still
+// exact. The heap is rebuilt because the keys of the open edges behind the changes went up too.
+HRESULT EvcSolver::RepairBucketTree(std::shared_ptr<NAVertexCache> vcache, std::shared_ptr<NAEdgeCache> ecache, std::shared_ptr<SafeZoneTable> safeZoneList, BucketTree & tree,
+	const std::vector<NAEdgePtr> & changedEdges, SafeZonePtr changedZone) const
+{
+	HRESULT hr = S_OK;
+	std::vector<NAEdgePtr> closedEdges, openEdges, invalidEdges;
+	std::vector<NAVertexPtr> chain;
+	std::unordered_set<NAEdgePtr, NAEdgePtrHasher, NAEdgePtrEqual> changed(changedEdges.begin(), changedEdges.end());
+	std::unordered_set<SafeZonePtr> zones; // safe zones to seed again
+	std::unordered_map<NAVertexPtr, bool> valid;
+	ArrayList<NAEdgePtr> * adj = nullptr;
+	NAVertexPtr parent = nullptr;
+	const long zoneJunction = changedZone ? changedZone->VertexAndRatio->EID : -1;
+
+	// a tree vertex is still exact if no edge on its way to the safe zone has changed and neither has the safe zone
+	auto isValid = [&valid, &changed, &chain, zoneJunction](NAVertexPtr vertex) -> bool
+	{
+		bool result = true;
+		chain.clear();
+		for (NAVertexPtr v = vertex; v; v = v->Previous)
+		{
+			const auto m = valid.find(v);
+			if (m != valid.end())
+			{
+				result = m->second;
+				break;
+			}
+			chain.push_back(v);
+			if ((v->GetBehindEdge() && changed.find(v->GetBehindEdge()) != changed.end()) || (!v->Previous && v->EID == zoneJunction))
+			{
+				result = false;
+				break;
+			}
+		}
+		for (const auto & v : chain) valid[v] = result;
+		return result;
+	};
+
+	auto relax = [&tree, this](NAVertexPtr myVertex, NAEdgePtr edge)
+	{
+		const double edgeCost = edge->GetCost(tree.Population, solverMethod);
+		if (edgeCost >= CASPER_INFINITY) return;
+		const double newCost = myVertex->GVal + edgeCost;
+		if (tree.Heap.IsVisited(edge))
+		{
+			if (edge->ToVertex->GVal <= newCost) return;
+			edge->ToVertex->GVal = newCost;
+			edge->ToVertex->Previous = myVertex;
+			tree.Heap.UpdateKey(edge);
+		}
+		else
+		{
+			edge->ToVertex->GVal = newCost;
+			edge->ToVertex->Previous = myVertex;
+			tree.Heap.Insert(edge);
+			tree.OpenEdges.push_back(edge);
+		}
+	};
+
+	for (const auto & e : tree.OpenEdges) if (tree.Heap.IsVisited(e)) openEdges.push_back(e);
+	tree.Heap.Clear();
+	tree.OpenEdges.clear();
+	tree.LastKey = -1.0;
+	if (changedZone) zones.insert(changedZone);
+
+	tree.ClosedList.GetEdges(closedEdges);
+	for (const auto & e : closedEdges) if (!isValid(e->ToVertex)) invalidEdges.push_back(e);
+	for (const auto & e : invalidEdges) tree.ClosedList.Erase(e);
+
+	// the open edges keep their key if they still hang off a valid vertex. Only their own cost may have changed.
+	for (const auto & e : openEdges)
+	{
+		parent = e->ToVertex->Previous;
+		if (!parent)
+		{
+			if (!isValid(e->ToVertex)) zones.insert(safeZoneList->find(e->ToVertex->EID)->second);
+			else
+			{
+				tree.Heap.Insert(e);
+				tree.OpenEdges.push_back(e);
+			}
+		}
+		else if (isValid(parent) && tree.ClosedList.Exist(parent->GetBehindEdge())) relax(parent, e);
+		else invalidEdges.push_back(e);
+	}
+
+	// the rest is relaxed from all the valid closed edges that lead into it
+	for (const auto & h : invalidEdges)
+	{
+		parent = h->ToVertex->Previous;
+		if (!parent)
+		{
+			zones.insert(safeZoneList->find(h->ToVertex->EID)->second);
+			continue;
+		}
+		if (FAILED(hr = ecache->QueryAdjacencies(parent, h, QueryDirection::Forward, &adj))) return hr;
+		for (const auto & g : *adj)
+			if (tree.ClosedList.Exist(g) && g->ToVertex && isValid(g->ToVertex)) relax(g->ToVertex, h);
+	}
+
+	for (const auto & z : zones)
+		if (FAILED(hr = SeedBucketTree(vcache, ecache, tree, z))) return hr;
+	return hr;
+}
+
 void EvcSolver::MarkDirtyEdgesAsUnVisited(NAEdgeMap * closedList, std::shared_ptr<NAEdgeContainer> oldLeafs, std::vector<NAEdgePtr> & removedDirty, bool & ShouldCARMACheckForDecreasedCost) const
 {
 	std::vector<NAEdgePtr> dirtyVisited;
@@ -685,7 +1649,7 @@ void EvcSolver::NonRecursiveMarkAndRemove(NAEdgePtr head, NAEdgeMap * closedList
 	}
 }
 
-HRESULT InsertLeafEdgeToHeap(INetworkQueryPtr ipNetworkQuery, std::shared_ptr<NAVertexCache> vcache, MyFibonacciHeap<NAEdgePtr, NAEdgePtrHasher, NAEdgePtrEqual> & heap, NAEdge * leaf)
+HRESULT InsertLeafEdgeToHeap(INetworkQueryPtr ipNetworkQuery, std::shared_ptr<NAVertexCache> vcache, CARMAHeap & heap, NAEdge * leaf)
 {
 	HRESULT hr = S_OK;
 	INetworkElementPtr fe, te;
@@ -714,7 +1678,7 @@ HRESULT InsertLeafEdgeToHeap(INetworkQueryPtr ipNetworkQuery, std::shared_ptr<NA
 	return hr;
 }
 
-HRESULT InsertLeafEdgesToHeap(INetworkQueryPtr ipNetworkQuery, std::shared_ptr<NAVertexCache> vcache, std::shared_ptr<NAEdgeCache> ecache, MyFibonacciHeap<NAEdgePtr, NAEdgePtrHasher, NAEdgePtrEqual> & heap,
+HRESULT InsertLeafEdgesToHeap(INetworkQueryPtr ipNetworkQuery, std::shared_ptr<NAVertexCache> vcache, std::shared_ptr<NAEdgeCache> ecache, CARMAHeap & heap,
 								std::shared_ptr<NAEdgeContainer> leafs)
 {
 	HRESULT hr = S_OK;
@@ -843,13 +1807,14 @@ bool EvcSolver::GeneratePath(SafeZonePtr BetterSafeZone, NAVertexPtr finalVertex
 
 		if (this->solverMethod == EvcSolverMethod::CCRPSolver)
 		{
+			// route as many evacuees as the bottleneck of the path can take. If the path is already saturated there is no better one so the rest goes on it.
 			if (separationRequired)
 			{
-				population2Route = 0.0;
+				population2Route = CASPER_INFINITY;
 				while (temp->Previous)
 				{
-					leftCap = temp->GetBehindEdge()->LeftCapacity();
-					if (this->solverMethod == EvcSolverMethod::CCRPSolver || leftCap > 0.0) population2Route = min(population2Route, leftCap);
+					leftCap = temp->GetBehindEdge()->LeftCapacity(solverMethod);
+					population2Route = min(population2Route, leftCap);
 					temp = temp->Previous;
 				}
 				if (population2Route <= 0.0) population2Route = populationLeft;
@@ -917,6 +1882,57 @@ bool EvcSolver::GeneratePath(SafeZonePtr BetterSafeZone, NAVertexPtr finalVertex
 	return path != nullptr;
 }
 
+// Same as GeneratePath but the route is read off a backward tree. 'treeEdges' go from the evacuee junction to the safe zone junction and
+// 'evcVertex' is the evacuee vertex that starts the route. Segments are added from the safe zone end like GeneratePath does.
+bool EvcSolver::GenerateTreePath(SafeZonePtr zone, const std::vector<NAEdgePtr> & treeEdges, NAVertexPtr evcVertex, double & populationLeft, int & pathGenerationCount,
+	EvacueePtr currentEvacuee, double population2Route, bool separationRequired, bool delayedDirtyState) const
+{
+	double edgePortion;
+	EvcPath * path = nullptr;
+	PathSegmentPtr lastAdded = nullptr;
+
+	if (this->solverMethod == EvcSolverMethod::CCRPSolver)
+	{
+		if (separationRequired)
+		{
+			population2Route = CASPER_INFINITY;
+			for (const auto & e : treeEdges) population2Route = min(population2Route, e->LeftCapacity(solverMethod));
+			if (population2Route <= 0.0) population2Route = populationLeft;
+			population2Route = min(population2Route, populationLeft);
+		}
+		else population2Route = populationLeft;
+	}
+	populationLeft -= population2Route;
+	path = new DEBUG_NEW_PLACEMENT EvcPath(initDelayCostPerPop, population2Route, ++pathGenerationCount, currentEvacuee, zone);
+
+	// special case for the last edge. We have to sub-curve it based on the safe point location along the edge
+	if (zone->getBehindEdge())
+	{
+		edgePortion = zone->getPositionAlong();
+		if (edgePortion > 0.0) path->AddSegment(solverMethod, new DEBUG_NEW_PLACEMENT PathSegment(zone->getBehindEdge(), 0.0, edgePortion), delayedDirtyState);
+	}
+	for (auto e = treeEdges.crbegin(); e != treeEdges.crend(); ++e) path->AddSegment(solverMethod, new DEBUG_NEW_PLACEMENT PathSegment(*e), delayedDirtyState);
+
+	// special case for the first edge. We have to curve it based on the evacuee point location along the edge
+	if (evcVertex->GetBehindEdge())
+	{
+		edgePortion = evcVertex->GVal;
+		lastAdded = path->empty() ? nullptr : path->front();
+		if (lastAdded && NAEdge::IsEqualNAEdgePtr(lastAdded->Edge, evcVertex->GetBehindEdge())) lastAdded->SetFromRatio(1.0 - edgePortion);
+		else if (edgePortion > 0.0) path->AddSegment(solverMethod, new DEBUG_NEW_PLACEMENT PathSegment(evcVertex->GetBehindEdge(), 1.0 - edgePortion, 1.0), delayedDirtyState);
+	}
+
+	if (path->empty())
+	{
+		delete path;
+		return false;
+	}
+	path->shrink_to_fit();
+	currentEvacuee->Paths->push_front(path);
+	zone->Reserve(path->GetRoutedPop());
+	return true;
+}
+
 // This is where i figure out what is the smallest population that I should route (or try to route)
 // at each CASPER loop. Obviously this globalMinPop2Route has to be less than the population of any evacuee point.
 // Also CASPER and CARMA should be in sync at this number otherwise all the h values are useless.
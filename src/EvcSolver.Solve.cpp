@@ -13,6 +13,8 @@
 #include "stdafx.h"
 #include "NameConstants.h"
 #include "EvcSolver.h"
+#include "NetworkSnapshot.h"
+#include "Benchmark.h"
 #include "FibonacciHeap.h"
 #include "Flocking.h"
 
@@ -91,6 +93,10 @@ STDMETHODIMP EvcSolver::Solve(INAContext* pNAContext, IGPMessages* pMessages, IT
 	}
 	#endif
 
+	#ifdef BENCHMARK
+	RunSolverBenchmarks();
+	#endif
+
 	HRESULT hr = S_OK;
 	double globalEvcCost = -1.0, carmaSec = 0.0;
 	unsigned int EvacueesWithRestrictedSafezone = 0;
@@ -218,7 +224,9 @@ STDMETHODIMP EvcSolver::Solve(INAContext* pNAContext, IGPMessages* pMessages, IT
 		if (FAILED(hr = LoadBarriers(ipBarriersTable, ipNetworkQuery, ipBackwardStar))) return hr;
 	}
 	INetworkAttribute2Ptr networkAttrib = nullptr;
-	VARIANT_BOOL useRestriction;
+	VARIANT_BOOL useRestriction, supportsTurns = VARIANT_FALSE;
+	std::vector<INetworkAttribute2Ptr> usedRestrictions;
+	long barrierCount = 0, junctionCount = 0, edgeCount = 0;
 
 	// loading restriction attributes into the forward star. this will enforce all available restrictions.
 	for (std::vector<INetworkAttribute2Ptr>::const_iterator Iter = turnAttribs.begin(); Iter != turnAttribs.end(); Iter++)
@@ -229,6 +237,7 @@ STDMETHODIMP EvcSolver::Solve(INAContext* pNAContext, IGPMessages* pMessages, IT
 		{
 			if (FAILED(hr = ipForwardStar->AddRestrictionAttribute(networkAttrib))) return hr;
 			if (FAILED(hr = ipBackwardStar->AddRestrictionAttribute(networkAttrib))) return hr;
+			usedRestrictions.push_back(networkAttrib);
 		}
 	}
 
@@ -264,8 +273,54 @@ STDMETHODIMP EvcSolver::Solve(INAContext* pNAContext, IGPMessages* pMessages, IT
 		                                                                           initDelayCostPerPop, trafficModel, ipForwardStar, ipBackwardStar, ipNetworkQuery, hr));
 	if (FAILED(hr)) return hr;
 
+	// Preload the whole network into CSR adjacency arrays so that the searches do not have to go through the forward star.
+	// Turn restrictions depend on the previous edge and can not be sliced per junction, so in that case we keep using the forward star.
+	// Barriers are baked into the graph as well, so the on-disk snapshot is only used (and written) when there are no barriers.
+	if (preloadNetworkGraph == VARIANT_TRUE)
+	{
+		if (FAILED(hr = ipNetworkDataset->get_SupportsTurns(&supportsTurns))) return hr;
+		if (supportsTurns == VARIANT_FALSE || usedRestrictions.empty())
+		{
+			std::shared_ptr<NetworkGraph> graph = nullptr;
+			std::wstring snapshotKey, snapshotPath;
+			if (ipBarriersTable) { if (FAILED(hr = ipBarriersTable->RowCount(nullptr, &barrierCount))) return hr; }
+			if (barrierCount == 0)
+			{
+				if (FAILED(hr = MappedNetworkGraph::BuildKey(ipNetworkDataset, capAttributeID, costAttributeID, usedRestrictions, snapshotKey))) return hr;
+				snapshotPath = MappedNetworkGraph::GetSnapshotPath(snapshotKey);
+				auto mappedGraph = std::shared_ptr<MappedNetworkGraph>(new DEBUG_NEW_PLACEMENT MappedNetworkGraph());
+				if (mappedGraph->Open(snapshotPath, snapshotKey) == S_OK) graph = mappedGraph;
+			}
+			if (!graph)
+			{
+				auto arcGraph = std::shared_ptr<ArcNetworkGraph>(new DEBUG_NEW_PLACEMENT ArcNetworkGraph());
+				if (FAILED(hr = arcGraph->Load(ipNetworkQuery, ipForwardStar, capAttributeID, costAttributeID))) return hr;
+
+				// failing to write the snapshot only costs us the warm start of the next solve
+				if (barrierCount == 0) MappedNetworkGraph::Write(snapshotPath, snapshotKey, *arcGraph);
+				graph = arcGraph;
+			}
+			ecache->SetGraph(graph);
+
+			// the hierarchy only depends on the topology, so it is built once per solve and every CARMA loop re-customizes it
+			if (hierarchyCARMA == VARIANT_TRUE && graph->IsLoaded())
+			{
+				auto hierarchy = std::shared_ptr<ContractionHierarchy>(new DEBUG_NEW_PLACEMENT ContractionHierarchy());
+				hierarchy->Build(*graph);
+				ecache->SetHierarchy(hierarchy);
+			}
+
+			// the worker threads of the delta-stepping search stay up for the whole solve. The hierarchy takes precedence if both are on.
+			if (parallelCARMA == VARIANT_TRUE && hierarchyCARMA == VARIANT_FALSE && graph->IsLoaded())
+				ecache->SetParallelSearch(std::shared_ptr<DeltaStepping>(new DEBUG_NEW_PLACEMENT DeltaStepping(ecache->GetThreadPool())));
+		}
+	}
+
 	// since some vertices inside the cache will point to edges, it's safer to create this object last so that it gets destroyed (pop out of function stack) before ecache
 	auto vcache = std::shared_ptr<NAVertexCache>(new DEBUG_NEW_PLACEMENT NAVertexCache());
+	if (FAILED(hr = ipNetworkQuery->get_ElementCount(esriNETJunction, &junctionCount))) return hr;
+	if (FAILED(hr = ipNetworkQuery->get_ElementCount(esriNETEdge, &edgeCount))) return hr;
+	vcache->Reserve((size_t)junctionCount + 1, (size_t)edgeCount + 1);
 
 	// Vertex table structures
 	auto safeZoneList = std::shared_ptr<SafeZoneTable>(new DEBUG_NEW_PLACEMENT SafeZoneTable(100));
@@ -555,6 +610,13 @@ STDMETHODIMP EvcSolver::Solve(INAContext* pNAContext, IGPMessages* pMessages, IT
 	std::shared_ptr<DynamicDisaster> disasterTable(new DEBUG_NEW_PLACEMENT DynamicDisaster(ipDynamicTable, CASPERDynamicMode, flagBadDynamicChangeSnapping, solverMethod));
 
 	Evacuees->FinilizeGroupings(5.0 * costPerSec, disasterTable->GetDynamicMode()); // five seconds diameter for clustering
+	size_t evacueePointCount = Evacuees->size(), clusteredEvacuees = 0;
+	bool evacueeClusteringUsed = evacueeClusterTime > 0.0f && ecache->IsGraphLoaded();
+	if (evacueeClusteringUsed) clusteredEvacuees = Evacuees->ClusterGroupings(*(ecache->GetGraph()), evacueeClusterTime * costPerSec);
+
+	// the coarse pass routes the pooled groups and SolveMethod refines them. Evacuees that move with dynamic changes cannot be pooled.
+	bool coarseToFineUsed = coarseClusterTime > 0.0f && ecache->IsGraphLoaded() && disasterTable->GetDynamicMode() == DynamicMode::Disabled;
+	if (coarseToFineUsed) Evacuees->ClusterGroupings(*(ecache->GetGraph()), coarseClusterTime * costPerSec, true);
 
 	// timing
 	c = GetProcessTimes(GetCurrentProcess(), &createTime, &exitTime, &sysTimeE, &cpuTimeE);
@@ -566,13 +628,14 @@ STDMETHODIMP EvcSolver::Solve(INAContext* pNAContext, IGPMessages* pMessages, IT
 
 	if (ipStepProgressor) if (FAILED(hr = ipStepProgressor->Show())) return hr;
 	std::vector<unsigned int> CARMAExtractCounts;
+	CoarseToFineStats coarseStats;
 
 	//******************************************************************************************/
 	// this will call the core part of the algorithm.
 	hr = S_OK;
 	UpdatePeakMemoryUsage();
 	if (FAILED(hr = SolveMethod(ipNetworkQuery, pMessages, pTrackCancel, ipStepProgressor, Evacuees, vcache, ecache, safeZoneList, carmaSec, CARMAExtractCounts,
-		ipNetworkDataset, EvacueesWithRestrictedSafezone, GlobalEvcCostAtIteration, EffectiveIterationCount, disasterTable))) return hr;
+		ipNetworkDataset, EvacueesWithRestrictedSafezone, GlobalEvcCostAtIteration, EffectiveIterationCount, disasterTable, coarseStats))) return hr;
 
 	// timing
 	c = GetProcessTimes(GetCurrentProcess(), &createTime, &exitTime, &sysTimeE, &cpuTimeE);
@@ -602,7 +665,7 @@ STDMETHODIMP EvcSolver::Solve(INAContext* pNAContext, IGPMessages* pMessages, IT
 	std::vector<EvcPathPtr>::const_iterator pit;
 	bool sourceNotFoundFlag = false;
 	IFeatureClassContainerPtr ipFeatureClassContainer(ipNetworkDataset);
-	size_t StuckEvacuee = 0;
+	size_t StuckEvacuee = 0, RouteCount = 0;
 
 	// load the Mercator projection and analysis projection
 	ISpatialReferencePtr ipNAContextSR;
@@ -623,12 +686,13 @@ STDMETHODIMP EvcSolver::Solve(INAContext* pNAContext, IGPMessages* pMessages, IT
 			if (currentEvacuee->Population > 0.0)
 			{
 				*pIsPartialSolution = VARIANT_TRUE;
-				++StuckEvacuee;
+				StuckEvacuee += 1 + currentEvacuee->Members->size(); // every clustered member is stuck with its group
 			}
 		}
 		else
 		{
 			for (tpit = currentEvacuee->Paths->begin(); tpit != currentEvacuee->Paths->end(); tpit++) tempPathList.push_back(*tpit);
+			RouteCount += currentEvacuee->Paths->size() * (1 + currentEvacuee->Members->size()); // one route per evacuee point
 		}
 	}
 
@@ -683,7 +747,7 @@ STDMETHODIMP EvcSolver::Solve(INAContext* pNAContext, IGPMessages* pMessages, IT
 	for (const auto & p : tempPathList)
 	{
 		if (FAILED(hr = p->AddPathToFeatureBuffers(pTrackCancel, ipNetworkDataset, ipFeatureClassContainer, sourceNotFoundFlag, ipStepProgressor, globalEvcCost, ipFeatureBufferR,
-			ipFeatureCursorR, evNameFieldIndex, evacTimeFieldIndex, orgTimeFieldIndex, popFieldIndex, zoneNameFieldIndex))) return hr;
+			ipFeatureCursorR, evNameFieldIndex, evacTimeFieldIndex, orgTimeFieldIndex, popFieldIndex, zoneNameFieldIndex, ecache.get(), solverMethod))) return hr;
 	}
 
 	// flush the insert buffer
@@ -732,7 +796,7 @@ STDMETHODIMP EvcSolver::Solve(INAContext* pNAContext, IGPMessages* pMessages, IT
 		if (FAILED(hr = ipEdgesFC->FindField(ATL::CComBSTR(CS_FIELD_ReservPop2), &resPopFieldIndex))) return hr;
 		if (resPopFieldIndex < 1) { if (FAILED(hr = ipEdgesFC->FindField(ATL::CComBSTR(CS_FIELD_ReservPop1), &resPopFieldIndex))) return hr; }
 
-		for (NAEdgeTableItr it = ecache->AlongBegin(); it != ecache->AlongEnd(); it++)
+		for (NAEdgeCacheItr it = ecache->Begin(); it != ecache->End(); it++)
 		{
 			if (ipStepProgressor) ipStepProgressor->Step();
 			// Check to see if the user wishes to continue or cancel the solve (i.e., check whether or not the user has hit the ESC key to stop processing)
@@ -742,22 +806,7 @@ STDMETHODIMP EvcSolver::Solve(INAContext* pNAContext, IGPMessages* pMessages, IT
 				if (keepGoing == VARIANT_FALSE) return E_ABORT;
 			}
 
-			edge = it->second;
-			if (FAILED(hr = edge->InsertEdgeToFeatureCursor(ipNetworkDataset, ipFeatureClassContainer, ipFeatureBuffer, ipFeatureCursor, eidFieldIndex, sourceIDFieldIndex, sourceOIDFieldIndex, dirFieldIndex,
-				                                            resPopFieldIndex, travCostFieldIndex, orgCostFieldIndex, congestionFieldIndex, sourceNotFoundFlag))) return hr;
-		}
-
-		for (NAEdgeTableItr it = ecache->AgainstBegin(); it != ecache->AgainstEnd(); it++)
-		{
-			if (ipStepProgressor) ipStepProgressor->Step();
-			// Check to see if the user wishes to continue or cancel the solve (i.e., check whether or not the user has hit the ESC key to stop processing)
-			if (pTrackCancel)
-			{
-				if (FAILED(hr = pTrackCancel->Continue(&keepGoing))) return hr;
-				if (keepGoing == VARIANT_FALSE) return E_ABORT;
-			}
-
-			edge = it->second;
+			edge = *it;
 			if (FAILED(hr = edge->InsertEdgeToFeatureCursor(ipNetworkDataset, ipFeatureClassContainer, ipFeatureBuffer, ipFeatureCursor, eidFieldIndex, sourceIDFieldIndex, sourceOIDFieldIndex, dirFieldIndex,
 				                                            resPopFieldIndex, travCostFieldIndex, orgCostFieldIndex, congestionFieldIndex, sourceNotFoundFlag))) return hr;
 		}
@@ -967,12 +1016,41 @@ STDMETHODIMP EvcSolver::Solve(INAContext* pNAContext, IGPMessages* pMessages, IT
 
 	//******************************************************************************************/
 	// Close it and clean it
-	ATL::CString performanceMsg, CARMALoopMsg, ZeroHurMsg, CARMAExtractsMsg, CacheHitMsg, initMsg, iterationMsg1, iterationMsg2;
-	size_t mem = (peakMemoryUsage - baseMemoryUsage) / 1048576;
+	ATL::CString performanceMsg, CARMALoopMsg, ZeroHurMsg, CARMAExtractsMsg, SearchExtractsMsg, RepairedExtractsMsg, ClusterMsg, CoarseToFineMsg, HierarchyMsg, ParallelCARMAMsg, VertexArenaMsg, initMsg, iterationMsg1, iterationMsg2;
+	size_t mem = (peakMemoryUsage - baseMemoryUsage) / 1048576, searchedEvacuees = 0, totalExtracts = 0, maxExtracts = 0, repairedEvacuees = 0, repairedExtracts = 0;
+	bool lowerBoundsUsed = landmarkHeuristic == VARIANT_TRUE && ecache->IsGraphLoaded();
+	bool hierarchyUsed = hierarchyCARMA == VARIANT_TRUE && ecache->IsHierarchyBuilt();
+	bool parallelCARMAUsed = !hierarchyUsed && parallelCARMA == VARIANT_TRUE && ecache->IsParallelSearchReady();
 
-	initMsg.Format(_T("%s(%s) version %s. %d routes are generated from the evacuee points. %d evacuee(s) were unreachable."), PROJ_NAME, PROJ_ARCH, _T(GIT_DESCRIBE), tempPathList.size(), StuckEvacuee);
+	initMsg.Format(_T("%s(%s) version %s. %d routes are generated from the evacuee points. %d evacuee(s) were unreachable."), PROJ_NAME, PROJ_ARCH, _T(GIT_DESCRIBE), RouteCount, StuckEvacuee);
 	CARMALoopMsg.Format(_T("The algorithm performed %d CARMA loop(s) in %.2f seconds. Peak memory usage (exclude flocking) was %d MB."), CARMAExtractCounts.size(), carmaSec, max(0, mem));
-	CacheHitMsg.Format(_T("Traffic model calculation had %.2f%% cache hit."), ecache->GetCacheHitPercentage());
+	VertexArenaMsg.Format(_T("Vertex cache allocated %d junction vertices and %d arena block(s) for %d search copies over %d searches."),
+		vcache->GetMasterCount(), vcache->GetBucketAllocCount(), vcache->GetShadowCount(), vcache->GetResetCount());
+	if (evacueeClusteringUsed) ClusterMsg.Format(_T("Evacuee clustering within %.2f seconds merged %Iu evacuee points into %Iu routed groups."),
+		evacueeClusterTime, evacueePointCount, evacueePointCount - clusteredEvacuees);
+	if (coarseToFineUsed && coarseStats.Groups > 0) CoarseToFineMsg.Format(_T("The coarse pass routed %Iu pooled groups. %Iu pooled evacuee points kept their share of the group route and %Iu were searched on their own."),
+		coarseStats.Groups, coarseStats.Followed, coarseStats.Searched);
+	if (hierarchyUsed) HierarchyMsg.Format(_T("CARMA loops swept a contraction hierarchy of %Iu junctions with %Iu arcs and %Iu lower triangles."),
+		ecache->GetHierarchy()->JunctionCount(), ecache->GetHierarchy()->ArcCount(), ecache->GetHierarchy()->TriangleCount());
+	if (parallelCARMAUsed && ecache->GetParallelSearch()->QueryCount() > 0)
+		ParallelCARMAMsg.Format(_T("Full SPT CARMA loops ran %Iu delta-stepping searches on %u threads in %Iu buckets and %Iu relax rounds (last bucket width %.2f)."),
+		ecache->GetParallelSearch()->QueryCount(), ecache->GetParallelSearch()->ThreadCount(), ecache->GetParallelSearch()->BucketCount(),
+		ecache->GetParallelSearch()->PhaseCount(), ecache->GetParallelSearch()->Delta());
+
+	for (const auto & currentEvacuee : *Evacuees)
+	{
+		if (currentEvacuee->SearchExtractCount == 0) continue;
+		++searchedEvacuees;
+		totalExtracts += currentEvacuee->SearchExtractCount;
+		maxExtracts = max(maxExtracts, currentEvacuee->SearchExtractCount);
+		if (currentEvacuee->RepairedExtracts == 0) continue;
+		++repairedEvacuees;
+		repairedExtracts += currentEvacuee->RepairedExtracts;
+	}
+	if (searchedEvacuees > 0) SearchExtractsMsg.Format(_T("Route searches made %.1f heap extracts per evacuee on average (maximum %Iu, total %Iu) %s landmark lower bounds."),
+		(double)totalExtracts / searchedEvacuees, maxExtracts, totalExtracts, lowerBoundsUsed ? _T("with") : _T("without"));
+	if (repairedEvacuees > 0) RepairedExtractsMsg.Format(_T("Route repairs kept %.1f heap extracts per repaired evacuee on average (total %Iu) that searches from scratch would have made again."),
+		(double)repairedExtracts / repairedEvacuees, repairedExtracts);
 
 	performanceMsg.Format(_T("Timing: Input = %.2f (kernel), %.2f (user); Calculation = %.2f (kernel), %.2f (user); Output = %.2f (kernel), %.2f (user); Flocking = %.2f (kernel), %.2f (user); Total = %.2f"),
 		inputSecSys, inputSecCpu, calcSecSys, calcSecCpu, outputSecSys, outputSecCpu, flockSecSys, flockSecCpu,
@@ -1008,9 +1086,15 @@ STDMETHODIMP EvcSolver::Solve(INAContext* pNAContext, IGPMessages* pMessages, IT
 	pMessages->AddMessage(ATL::CComBSTR(performanceMsg));
 	pMessages->AddMessage(ATL::CComBSTR(CARMALoopMsg));
 	if (!CARMAExtractsMsg.IsEmpty()) pMessages->AddMessage(ATL::CComBSTR(CARMAExtractsMsg));
+	if (!SearchExtractsMsg.IsEmpty()) pMessages->AddMessage(ATL::CComBSTR(SearchExtractsMsg));
+	if (!RepairedExtractsMsg.IsEmpty()) pMessages->AddMessage(ATL::CComBSTR(RepairedExtractsMsg));
+	if (!ClusterMsg.IsEmpty()) pMessages->AddMessage(ATL::CComBSTR(ClusterMsg));
+	if (!CoarseToFineMsg.IsEmpty()) pMessages->AddMessage(ATL::CComBSTR(CoarseToFineMsg));
+	if (!HierarchyMsg.IsEmpty()) pMessages->AddMessage(ATL::CComBSTR(HierarchyMsg));
+	if (!ParallelCARMAMsg.IsEmpty()) pMessages->AddMessage(ATL::CComBSTR(ParallelCARMAMsg));
 	pMessages->AddMessage(ATL::CComBSTR(iterationMsg1));
 	if (!iterationMsg2.IsEmpty()) pMessages->AddMessage(ATL::CComBSTR(iterationMsg2));
-	if (ecache->GetCacheHitPercentage() < 80.0) pMessages->AddMessage(ATL::CComBSTR(CacheHitMsg));
+	pMessages->AddMessage(ATL::CComBSTR(VertexArenaMsg));
 
 	if (EvacueesWithRestrictedSafezone > 0)
 	{
@@ -1020,6 +1104,16 @@ STDMETHODIMP EvcSolver::Solve(INAContext* pNAContext, IGPMessages* pMessages, IT
 	}
 
 	if (!(simulationIncompleteEndingMsg.IsEmpty())) pMessages->AddWarning(ATL::CComBSTR(simulationIncompleteEndingMsg));
+	if (landmarkHeuristic == VARIANT_TRUE && !lowerBoundsUsed) pMessages->AddWarning(ATL::CComBSTR(
+		L"Landmark lower bounds need the preloaded network graph, which is turned off or not available when the network has turns and restrictions are in use. The search ran without them."));
+	if (evacueeClusterTime > 0.0f && !evacueeClusteringUsed) pMessages->AddWarning(ATL::CComBSTR(
+		L"Evacuee clustering needs the preloaded network graph, which is turned off or not available when the network has turns and restrictions are in use. Every evacuee point was routed on its own."));
+	if (coarseClusterTime > 0.0f && !coarseToFineUsed) pMessages->AddWarning(ATL::CComBSTR(
+		L"The coarse-to-fine solve needs the preloaded network graph and cannot be used with dynamic changes. Every evacuee point was routed on its own."));
+	if (hierarchyCARMA == VARIANT_TRUE && !hierarchyUsed) pMessages->AddWarning(ATL::CComBSTR(
+		L"The contraction hierarchy needs the preloaded network graph, which is turned off or not available when the network has turns and restrictions are in use. CARMA used its Dijkstra search instead."));
+	if (parallelCARMA == VARIANT_TRUE && !hierarchyUsed && !parallelCARMAUsed) pMessages->AddWarning(ATL::CComBSTR(
+		L"The parallel CARMA search needs the preloaded network graph, which is turned off or not available when the network has turns and restrictions are in use. CARMA used its Dijkstra search instead."));
 	if (IsSafeZoneMissed) pMessages->AddWarning(ATL::CComBSTR(
 		L"One or more safe zones where snapped into the same network junction and hence they were merged into one safe zone. If this is not OK, use a different Network Location setting."));
 
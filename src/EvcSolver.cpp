@@ -237,6 +237,11 @@ STDMETHODIMP EvcSolver::CreateContext(IDENetworkDataset* pNetwork, BSTR contextN
 	flockingEnabled = VARIANT_FALSE;
 	twoWayShareCapacity = VARIANT_TRUE;
 	ThreeGenCARMA = VARIANT_TRUE;
+	preloadNetworkGraph = VARIANT_TRUE;
+	landmarkHeuristic = VARIANT_FALSE;
+	hierarchyCARMA = VARIANT_FALSE;
+	parallelCARMA = VARIANT_FALSE;
+	bucketTreeSearch = VARIANT_FALSE;
 
 	flockingSnapInterval = 0.1f;
 	flockingSimulationInterval = 0.01;
@@ -244,6 +249,8 @@ STDMETHODIMP EvcSolver::CreateContext(IDENetworkDataset* pNetwork, BSTR contextN
 	CARMAPerformanceRatio = 0.1f;
 	selfishRatio = 0.0f;
 	iterateRatio = 0.6f;
+	evacueeClusterTime = 0.0f;
+	coarseClusterTime = 0.0f;
 
 	backtrack = esriNFSBAllowBacktrack;
 	CarmaSortCriteria = CARMASort::BWCont;
@@ -375,10 +382,100 @@ STDMETHODIMP EvcSolver::Load(IStream* pStm)
 		CASPERDynamicMode = DynamicMode::Disabled;
 		savedVersion = 8;
 	}
+
+	//version 9
+	if (savedVersion >= 9)
+	{
+		if (FAILED(hr = pStm->Read(&preloadNetworkGraph, sizeof(preloadNetworkGraph), &numBytes))) return hr;
+	}
+	else
+	{
+		preloadNetworkGraph = VARIANT_TRUE;
+		savedVersion = 9;
+	}
+
+	//version 10
+	if (savedVersion >= 10)
+	{
+		if (FAILED(hr = pStm->Read(&landmarkHeuristic, sizeof(landmarkHeuristic), &numBytes))) return hr;
+	}
+	else
+	{
+		landmarkHeuristic = VARIANT_FALSE;
+		savedVersion = 10;
+	}
+
+	//version 11
+	if (savedVersion >= 11)
+	{
+		if (FAILED(hr = pStm->Read(&hierarchyCARMA, sizeof(hierarchyCARMA), &numBytes))) return hr;
+	}
+	else
+	{
+		hierarchyCARMA = VARIANT_FALSE;
+		savedVersion = 11;
+	}
+
+	//version 12. the speculative batch size was dropped in version 17 and is skipped in the versions that have it
+	if (savedVersion >= 12 && savedVersion < 17)
+	{
+		unsigned int speculativeBatchSize;
+		if (FAILED(hr = pStm->Read(&speculativeBatchSize, sizeof(speculativeBatchSize), &numBytes))) return hr;
+	}
+	else if (savedVersion < 12)
+	{
+		savedVersion = 12;
+	}
+
+	//version 13
+	if (savedVersion >= 13)
+	{
+		if (FAILED(hr = pStm->Read(&parallelCARMA, sizeof(parallelCARMA), &numBytes))) return hr;
+	}
+	else
+	{
+		parallelCARMA = VARIANT_FALSE;
+		savedVersion = 13;
+	}
+
+	//version 14
+	if (savedVersion >= 14)
+	{
+		if (FAILED(hr = pStm->Read(&evacueeClusterTime, sizeof(evacueeClusterTime), &numBytes))) return hr;
+	}
+	else
+	{
+		evacueeClusterTime = 0.0f;
+		savedVersion = 14;
+	}
+
+	//version 15
+	if (savedVersion >= 15)
+	{
+		if (FAILED(hr = pStm->Read(&coarseClusterTime, sizeof(coarseClusterTime), &numBytes))) return hr;
+	}
+	else
+	{
+		coarseClusterTime = 0.0f;
+		savedVersion = 15;
+	}
+
+	//version 16
+	if (savedVersion >= 16)
+	{
+		if (FAILED(hr = pStm->Read(&bucketTreeSearch, sizeof(bucketTreeSearch), &numBytes))) return hr;
+	}
+	else
+	{
+		bucketTreeSearch = VARIANT_FALSE;
+		savedVersion = 16;
+	}
 	
 	CARMAPerformanceRatio = min(max(CARMAPerformanceRatio, 0.0f), 1.0f);
 	selfishRatio = min(max(selfishRatio, 0.0f), 1.0f);
 	iterateRatio = min(max(iterateRatio, 0.0f), 1.0f);
+	evacueeClusterTime = min(max(evacueeClusterTime, 0.0f), 3600.0f);
+	coarseClusterTime = min(max(coarseClusterTime, 0.0f), 3600.0f);
 	m_bPersistDirty = false;
 
 	return S_OK;
@@ -423,6 +520,13 @@ STDMETHODIMP EvcSolver::Save(IStream* pStm, BOOL fClearDirty)
 	if (FAILED(hr = pStm->Write(&CarmaSortCriteria, sizeof(CarmaSortCriteria), &numBytes))) return hr;
 	if (FAILED(hr = pStm->Write(&iterateRatio, sizeof(iterateRatio), &numBytes))) return hr;
 	if (FAILED(hr = pStm->Write(&CASPERDynamicMode, sizeof(CASPERDynamicMode), &numBytes))) return hr;
+	if (FAILED(hr = pStm->Write(&preloadNetworkGraph, sizeof(preloadNetworkGraph), &numBytes))) return hr;
+	if (FAILED(hr = pStm->Write(&landmarkHeuristic, sizeof(landmarkHeuristic), &numBytes))) return hr;
+	if (FAILED(hr = pStm->Write(&hierarchyCARMA, sizeof(hierarchyCARMA), &numBytes))) return hr;
+	if (FAILED(hr = pStm->Write(&parallelCARMA, sizeof(parallelCARMA), &numBytes))) return hr;
+	if (FAILED(hr = pStm->Write(&evacueeClusterTime, sizeof(evacueeClusterTime), &numBytes))) return hr;
+	if (FAILED(hr = pStm->Write(&coarseClusterTime, sizeof(coarseClusterTime), &numBytes))) return hr;
+	if (FAILED(hr = pStm->Write(&bucketTreeSearch, sizeof(bucketTreeSearch), &numBytes))) return hr;
 
 	return S_OK;
 }
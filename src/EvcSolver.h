@@ -28,6 +28,8 @@
 #include "NAVertex.h"
 #include "Flocking.h"
 #include "FibonacciHeap.h"
+#include "IndexedHeap.h"
+#include "Benchmark.h"
 #include "Dynamic.h"
 
 #if defined(_WIN32_WCE) && !defined(_CE_DCOM) && !defined(_CE_ALLOW_SINGLE_THREADED_OBJECTS_IN_MTA)
@@ -125,6 +127,34 @@ __interface IEvcSolver : IUnknown
 		HRESULT IterativeRatio([in] BSTR value);
 	[propget, helpstring("Gets the ratio of iterative solver")]
 		HRESULT IterativeRatio([out, retval] BSTR * value);
+	[propput, helpstring("Sets the preload network graph flag")]
+		HRESULT PreloadNetworkGraph([in] VARIANT_BOOL value);
+	[propget, helpstring("Gets the preload network graph flag")]
+		HRESULT PreloadNetworkGraph([out, retval] VARIANT_BOOL * value);
+	[propput, helpstring("Sets the landmark lower bound flag")]
+		HRESULT LandmarkHeuristic([in] VARIANT_BOOL value);
+	[propget, helpstring("Gets the landmark lower bound flag")]
+		HRESULT LandmarkHeuristic([out, retval] VARIANT_BOOL * value);
+	[propput, helpstring("Sets the contraction hierarchy CARMA flag")]
+		HRESULT HierarchyCARMA([in] VARIANT_BOOL value);
+	[propget, helpstring("Gets the contraction hierarchy CARMA flag")]
+		HRESULT HierarchyCARMA([out, retval] VARIANT_BOOL * value);
+	[propput, helpstring("Sets the parallel delta-stepping CARMA flag")]
+		HRESULT ParallelCARMA([in] VARIANT_BOOL value);
+	[propget, helpstring("Gets the parallel delta-stepping CARMA flag")]
+		HRESULT ParallelCARMA([out, retval] VARIANT_BOOL * value);
+	[propput, helpstring("Sets the free-flow travel time in seconds within which evacuees are clustered into one routed group")]
+		HRESULT EvacueeClusterTime([in] BSTR value);
+	[propget, helpstring("Gets the free-flow travel time in seconds within which evacuees are clustered into one routed group")]
+		HRESULT EvacueeClusterTime([out, retval] BSTR * value);
+	[propput, helpstring("Sets the free-flow travel time in seconds within which evacuees are pooled for the coarse pass of a coarse-to-fine solve")]
+		HRESULT CoarseClusterTime([in] BSTR value);
+	[propget, helpstring("Gets the free-flow travel time in seconds within which evacuees are pooled for the coarse pass of a coarse-to-fine solve")]
+		HRESULT CoarseClusterTime([out, retval] BSTR * value);
+	[propput, helpstring("Sets the flag to route the evacuees of a CARMA bucket from one repaired backward tree")]
+		HRESULT BucketTreeSearch([in] VARIANT_BOOL value);
+	[propget, helpstring("Gets the flag to route the evacuees of a CARMA bucket from one repaired backward tree")]
+		HRESULT BucketTreeSearch([out, retval] VARIANT_BOOL * value);
 
 	/// replacement for ISolverSetting2 functionality until I found that bug
 	[propput, helpstring("Sets the selected cost attribute index")]
@@ -135,6 +165,70 @@ __interface IEvcSolver : IUnknown
 		HRESULT CostAttributes([out] unsigned __int3264 & count, [out, retval] BSTR ** names);
 };
 
+// Heap key and index functors for the searches. They are inlined by the heaps instead of being called through a std::function.
+struct NAEdgeHeapKeyHur
+{
+	static const wchar_t * TraceName() { return L"casper"; }
+	inline double operator()(const NAEdge * e) const { return e->ToVertex->GVal + e->ToVertex->GlobalPenaltyCost + e->ToVertex->GetMinHOrZero(); }
+};
+
+struct NAEdgeHeapKeyNonHur
+{
+	static const wchar_t * TraceName() { return L"carma"; }
+	inline double operator()(const NAEdge * e) const { return e->ToVertex->GVal; }
+};
+
+struct NAEdgeHeapIndex
+{
+	inline size_t operator()(const NAEdge * e) const { return (size_t)e->EID * 2 + e->Direction - 1; }
+};
+
+// Heap policy of each search. Any heap from IndexedHeap.h can be plugged in here. The CARMA search has no heuristic and
+// non-negative costs so the extracted keys never go down and it can use the monotone radix heap.
+#ifdef BENCHMARK
+typedef HeapTraceRecorder<QuaternaryHeap<NAEdgePtr, NAEdgeHeapKeyHur, NAEdgeHeapIndex>> CASPERHeap;
+typedef HeapTraceRecorder<RadixHeap<NAEdgePtr, NAEdgeHeapKeyNonHur, NAEdgeHeapIndex>>   CARMAHeap;
+typedef HeapTraceRecorder<QuaternaryHeap<NAEdgePtr, NAEdgeHeapKeyNonHur, NAEdgeHeapIndex>> BucketTreeHeap;
+#else
+typedef QuaternaryHeap<NAEdgePtr, NAEdgeHeapKeyHur, NAEdgeHeapIndex> CASPERHeap;
+typedef RadixHeap<NAEdgePtr, NAEdgeHeapKeyNonHur, NAEdgeHeapIndex>   CARMAHeap;
+typedef QuaternaryHeap<NAEdgePtr, NAEdgeHeapKeyNonHur, NAEdgeHeapIndex> BucketTreeHeap; // keys go down again after a repair so no radix heap here
+#endif
+
+// Backward search tree from all the safe zones that serves the evacuees of one CARMA bucket. It only grows as far as the next evacuee
+// needs and the part behind the last route is repaired after each commit so the later evacuees of the bucket extend it instead of
+// searching from scratch. The vertices of the tree live in the vertex cache until the tree is cleared.
+struct BucketTree
+{
+	BucketTreeHeap                                   Heap;
+	NAEdgeMap                                        ClosedList;
+	std::vector<NAEdgePtr>                           OpenEdges;      // edges inserted to the heap since the last repair
+	std::unordered_map<long, std::vector<NAEdgePtr>> JunctionEdges;  // closed edges by the junction of their tree vertex. Entries that were reopened are skipped.
+	double                                           Population;     // population the edge costs are evaluated for. Negative while the tree is empty.
+	double                                           LastKey;        // key of the last extract since the last repair. Nothing left in the heap is below it.
+
+	BucketTree(void) : Population(-1.0), LastKey(-1.0) { }
+
+	void Clear()
+	{
+		Heap.Clear();
+		ClosedList.Clear();
+		OpenEdges.clear();
+		JunctionEdges.clear();
+		Population = LastKey = -1.0;
+	}
+};
+
+// coarse-to-fine counters of a solve
+struct CoarseToFineStats
+{
+	size_t Groups;   // coarse groups routed before the refinement pass
+	size_t Followed; // pooled evacuees that kept their share of the group route
+	size_t Searched; // pooled evacuees that left the group route and were searched on their own
+
+	CoarseToFineStats(void) : Groups(0), Followed(0), Searched(0) { }
+};
+
 // EvcSolver
 [
 	coclass,
@@ -157,7 +251,7 @@ public:
 	EvcSolver() :
 		  m_outputLineType(esriNAOutputLineTrueShape),
 		  m_bPersistDirty(false),
-		  c_version(8),
+		  c_version(17),
 		  c_featureRetrievalInterval(500)
 	  {
 	  }
@@ -227,6 +321,20 @@ public:
 	STDMETHOD(get_SelfishRatio)(BSTR * value); 
 	STDMETHOD(put_IterativeRatio)(BSTR   value);
 	STDMETHOD(get_IterativeRatio)(BSTR * value);
+	STDMETHOD(put_PreloadNetworkGraph)(VARIANT_BOOL   value);
+	STDMETHOD(get_PreloadNetworkGraph)(VARIANT_BOOL * value);
+	STDMETHOD(put_LandmarkHeuristic)(VARIANT_BOOL   value);
+	STDMETHOD(get_LandmarkHeuristic)(VARIANT_BOOL * value);
+	STDMETHOD(put_HierarchyCARMA)(VARIANT_BOOL   value);
+	STDMETHOD(get_HierarchyCARMA)(VARIANT_BOOL * value);
+	STDMETHOD(put_ParallelCARMA)(VARIANT_BOOL   value);
+	STDMETHOD(get_ParallelCARMA)(VARIANT_BOOL * value);
+	STDMETHOD(put_EvacueeClusterTime)(BSTR   value);
+	STDMETHOD(get_EvacueeClusterTime)(BSTR * value);
+	STDMETHOD(put_CoarseClusterTime)(BSTR   value);
+	STDMETHOD(get_CoarseClusterTime)(BSTR * value);
+	STDMETHOD(put_BucketTreeSearch)(VARIANT_BOOL   value);
+	STDMETHOD(get_BucketTreeSearch)(VARIANT_BOOL * value);
 
 	/// replacement for ISolverSetting2 functionality until I found that bug
 	STDMETHOD(put_CostAttribute)(unsigned __int3264 index);
@@ -301,10 +409,34 @@ public:
 private:
 
 	HRESULT SolveMethod(INetworkQueryPtr, IGPMessages *, ITrackCancel *, IStepProgressorPtr, std::shared_ptr<EvacueeList>, std::shared_ptr<NAVertexCache>, std::shared_ptr<NAEdgeCache>,
-		    std::shared_ptr<SafeZoneTable>, double &, std::vector<unsigned int> &, INetworkDatasetPtr, unsigned int &, std::vector<double> &, std::vector<size_t> &, std::shared_ptr<DynamicDisaster>);
+		    std::shared_ptr<SafeZoneTable>, double &, std::vector<unsigned int> &, INetworkDatasetPtr, unsigned int &, std::vector<double> &, std::vector<size_t> &, std::shared_ptr<DynamicDisaster>, CoarseToFineStats &);
+	HRESULT FindEvacueeRoute(INetworkQueryPtr ipNetworkQuery, IGPMessages* pMessages, EvacueePtr currentEvacuee, std::shared_ptr<NAVertexCache> vcache, std::shared_ptr<NAEdgeCache> ecache,
+		    std::shared_ptr<SafeZoneTable> safeZoneList, CASPERHeap & heap, NAEdgeMap & closedList, INetworkJunctionPtr ipCurrentJunction, double population2Route, double MaxPathCostSoFar,
+		    NAVertexPtr & finalVertex, SafeZonePtr & BetterSafeZone, bool & foundRestrictedSafezone, unsigned int & visitedDirtyEdge, std::vector<NAVertexPtr> * prunedVertices = nullptr);
+	HRESULT RepairEvacueeRoute(INetworkQueryPtr ipNetworkQuery, IGPMessages* pMessages, EvacueePtr currentEvacuee, std::shared_ptr<NAVertexCache> vcache, std::shared_ptr<NAEdgeCache> ecache,
+		    std::shared_ptr<SafeZoneTable> safeZoneList, CASPERHeap & heap, NAEdgeMap & closedList, INetworkJunctionPtr ipCurrentJunction, double population2Route, double MaxPathCostSoFar,
+		    const std::vector<NAEdgePtr> & changedEdges, std::vector<NAVertexPtr> & prunedVertices, NAVertexPtr & finalVertex, SafeZonePtr & BetterSafeZone, bool & foundRestrictedSafezone,
+		    unsigned int & visitedDirtyEdge);
+	HRESULT ExpandEvacueeRoute(INetworkQueryPtr ipNetworkQuery, IGPMessages* pMessages, EvacueePtr currentEvacuee, std::shared_ptr<NAVertexCache> vcache, std::shared_ptr<NAEdgeCache> ecache,
+		    std::shared_ptr<SafeZoneTable> safeZoneList, CASPERHeap & heap, NAEdgeMap & closedList, INetworkJunctionPtr ipCurrentJunction, double population2Route, double MaxPathCostSoFar,
+		    double & TimeToBeat, NAVertexPtr & finalVertex, SafeZonePtr & BetterSafeZone, bool & foundRestrictedSafezone, unsigned int & visitedDirtyEdge, std::vector<NAVertexPtr> * prunedVertices);
+	HRESULT RelaxEvacueeEdge(INetworkQueryPtr ipNetworkQuery, std::shared_ptr<NAVertexCache> vcache, CASPERHeap & heap, INetworkJunctionPtr ipCurrentJunction, NAVertexPtr myVertex,
+		    NAEdgePtr currentEdge, double newCost, double globalDeltaCost, double MaxPathCostSoFar, double TimeToBeat, std::vector<NAVertexPtr> * prunedVertices) const;
 	HRESULT CARMALoop(INetworkQueryPtr ipNetworkQuery, IStepProgressorPtr ipStepProgressor, IGPMessages* pMessages, ITrackCancel* pTrackCancel, std::shared_ptr<EvacueeList> Evacuees, CARMASort RevisedCarmaSortCriteria,
 		    std::shared_ptr<std::vector<EvacueePtr>> SortedEvacuees, std::shared_ptr<NAVertexCache> vcache, std::shared_ptr<NAEdgeCache> ecache, std::shared_ptr<SafeZoneTable> safeZoneList, size_t & closedSize,
 		    std::shared_ptr<NAEdgeMapTwoGen> closedList, std::shared_ptr<NAEdgeContainer> leafs, std::vector<unsigned int> & CARMAExtractCounts, double globalMinPop2Route, double & minPop2Route, bool separationRequired);
+	HRESULT BuildParallelCARMATree(INetworkQueryPtr ipNetworkQuery, IGPMessages* pMessages, std::shared_ptr<NAVertexCache> vcache, std::shared_ptr<NAEdgeCache> ecache,
+		    std::shared_ptr<SafeZoneTable> safeZoneList, std::shared_ptr<NAEdgeMapTwoGen> closedList, std::shared_ptr<NAEdgeContainer> leafs, NAEvacueeVertexTable & EvacueePairs,
+		    std::shared_ptr<std::vector<EvacueePtr>> SortedEvacuees, double minPop2Route, unsigned int & CARMAExtractCount, double & SearchRadius);
+	HRESULT RouteFromBucketTree(INetworkQueryPtr ipNetworkQuery, IGPMessages* pMessages, EvacueePtr currentEvacuee, std::shared_ptr<NAVertexCache> vcache, std::shared_ptr<NAEdgeCache> ecache,
+		    std::shared_ptr<SafeZoneTable> safeZoneList, BucketTree & tree, INetworkJunctionPtr ipCurrentJunction, double & populationLeft, int & pathGenerationCount, double population2Route,
+		    bool separationRequired, unsigned int & visitedDirtyEdge, size_t & visitedEdge, bool & routed);
+	HRESULT SeedBucketTree(std::shared_ptr<NAVertexCache> vcache, std::shared_ptr<NAEdgeCache> ecache, BucketTree & tree, SafeZonePtr zone) const;
+	HRESULT RepairBucketTree(std::shared_ptr<NAVertexCache> vcache, std::shared_ptr<NAEdgeCache> ecache, std::shared_ptr<SafeZoneTable> safeZoneList, BucketTree & tree,
+		    const std::vector<NAEdgePtr> & changedEdges, SafeZonePtr changedZone) const;
+	HRESULT SingleTreeLoop(INetworkQueryPtr ipNetworkQuery, IStepProgressorPtr ipStepProgressor, IGPMessages* pMessages, ITrackCancel* pTrackCancel, std::shared_ptr<EvacueeList> Evacuees,
+		    CARMASort RevisedCarmaSortCriteria, std::shared_ptr<NAVertexCache> vcache, std::shared_ptr<NAEdgeCache> ecache, std::shared_ptr<SafeZoneTable> safeZoneList,
+		    std::vector<unsigned int> & CARMAExtractCounts, int & pathGenerationCount, int & EvacueeProcessOrder, double & MaxPathCostSoFar);
 	HRESULT BuildClassDefinitions(ISpatialReference* pSpatialRef, INamedSet** ppDefinitions, IDENetworkDataset* pDENDS);
 	HRESULT CreateSideOfEdgeDomain(IDomain** ppDomain);
 	HRESULT CreateCurbApproachDomain(IDomain** ppDomain);
@@ -318,9 +450,12 @@ private:
 	HRESULT LoadBarriers(ITable* pTable, INetworkQuery* pNetworkQuery, INetworkForwardStarEx* pNetworkForwardStarEx);
 	HRESULT DeterminMinimumPop2Route(std::shared_ptr<EvacueeList>, INetworkDatasetPtr, double &, bool &) const;
 	size_t  FindPathsThatNeedToBeProcessedInIteration(std::shared_ptr<EvacueeList>, std::shared_ptr<std::vector<EvcPathPtr>>, std::vector<double> &, size_t &) const;
+	size_t  RefineCoarseGroups(std::shared_ptr<EvacueeList>, const NetworkGraph &, int &, CoarseToFineStats &) const;
 	void    MarkDirtyEdgesAsUnVisited(NAEdgeMap *, std::shared_ptr<NAEdgeContainer>, std::vector<NAEdgePtr> &, bool &) const;
 	void    NonRecursiveMarkAndRemove(NAEdgePtr, NAEdgeMap *, std::vector<NAEdgePtr> &) const;
 	bool    GeneratePath(SafeZonePtr, NAVertexPtr, double &, int &, EvacueePtr, double, bool) const;
+	bool    GenerateTreePath(SafeZonePtr, const std::vector<NAEdgePtr> &, NAVertexPtr, double &, int &, EvacueePtr, double, bool, bool) const;
+	double  GetPopulation2Route(double populationLeft, double globalMinPop2Route, bool separationRequired) const;
 	void    UpdatePeakMemoryUsage();
 
 	esriNAOutputLineType	m_outputLineType;
@@ -341,8 +476,11 @@ private:
 	float                   CARMAPerformanceRatio;
 	float                   selfishRatio;
 	float                   iterateRatio;
+	float                   evacueeClusterTime;
+	float                   coarseClusterTime;
 	SIZE_T					peakMemoryUsage;
 	HANDLE					hProcessPeakMemoryUsage;
+	TrafficModel::BatchCostFunction batchCostKernel; // edge cost kernel of this solve's method and traffic model. Set by SolveMethod. The relax loops that call it are not specialized.
 	CARMASort               CarmaSortCriteria;
 	EvacueeGrouping         evacueeGroupingOption;
 	DynamicMode             CASPERDynamicMode;
@@ -350,6 +488,11 @@ private:
 	VARIANT_BOOL twoWayShareCapacity;
 	VARIANT_BOOL ThreeGenCARMA;
 	VARIANT_BOOL VarExportEdgeStat;
+	VARIANT_BOOL preloadNetworkGraph;
+	VARIANT_BOOL landmarkHeuristic;
+	VARIANT_BOOL hierarchyCARMA;
+	VARIANT_BOOL parallelCARMA;
+	VARIANT_BOOL bucketTreeSearch;
 	VARIANT_BOOL m_CreateTraversalResult;
 	VARIANT_BOOL m_FindBestSequence;
 	VARIANT_BOOL m_PreserveFirstStop;
@@ -404,4 +547,4 @@ HRESULT PrepareUnvisitedVertexForHeap(INetworkJunctionPtr, NAEdgePtr edge, NAEdg
 HRESULT FindDirtyEdgesWithACleanParent(std::shared_ptr<NAEdgeCache>, std::shared_ptr<NAVertexCache>, INetworkQueryPtr, std::shared_ptr<NAEdgeMapTwoGen>, std::shared_ptr<NAEdgeContainer> Leafs, std::vector<NAEdgePtr> & removedDirty);
 double  GetUnitPerDay(esriNetworkAttributeUnits unit, double assumedSpeed);
 HRESULT PrepareVerticesForHeap(NAVertexPtr point, std::shared_ptr<NAVertexCache>, std::shared_ptr<NAEdgeCache>, NAEdgeMap *, std::vector<NAEdgePtr> &, double pop, EvcSolverMethod, double selfishRatio, double MaxEvacueeCostSoFar, QueryDirection);
-HRESULT InsertLeafEdgesToHeap(INetworkQueryPtr ipNetworkQuery, std::shared_ptr<NAVertexCache> vcache, std::shared_ptr<NAEdgeCache> ecache, MyFibonacciHeap<NAEdgePtr, NAEdgePtrHasher, NAEdgePtrEqual> & heap, std::shared_ptr<NAEdgeContainer> leafs);
+HRESULT InsertLeafEdgesToHeap(INetworkQueryPtr ipNetworkQuery, std::shared_ptr<NAVertexCache> vcache, std::shared_ptr<NAEdgeCache> ecache, CARMAHeap & heap, std::shared_ptr<NAEdgeContainer> leafs);
@@ -0,0 +1,358 @@
+// ===============================================================================================
+// Evacuation Solver: Indexed heaps
+// Description: Priority queues for the graph searches. Each item maps to a dense integer index
+// (EID * 2 + Direction - 1 for edges) so a heap finds its items without a side hash table, and
+// keys come from an inlined functor instead of a std::function. All heaps have the same interface
+// as MyFibonacciHeap so the solver can switch between them with a typedef.
+//
+// Copyright (C) 2014 Kaveh Shahabi
+// Distributed under the Apache Software License, Version 2.0. (See accompanying file LICENSE.txt)
+//
+// Author: Kaveh Shahabi
+// URL: http://github.com/spatial-computing/CASPER
+// ===============================================================================================
+
+#pragma once
+
+#include "StdAfx.h"
+
+// grows an index table geometrically so that a search discovering increasing indices does not reallocate on every insert
+template<class V> inline void GrowIndexTable(std::vector<V> & table, size_t index)
+{
+	if (index >= table.size()) table.resize(max(index + 1, table.size() * 2), 0);
+}
+
+// Indexed 4-ary heap. The position table makes UpdateKey a direct sift and the wide nodes keep the tree shallow.
+template<class T, class KeyFunc, class IndexFunc>
+class QuaternaryHeap
+{
+private:
+	struct Node
+	{
+		double key;
+		T      data;
+	};
+
+	std::vector<Node>   nodes;
+	std::vector<size_t> position; // heap position + 1 for each index, zero if the item is not in the heap
+	KeyFunc             GetHeapKey;
+	IndexFunc           GetIndex;
+
+	inline void Place(size_t i, const Node & n)
+	{
+		nodes[i] = n;
+		position[GetIndex(n.data)] = i + 1;
+	}
+
+	void SiftUp(size_t i)
+	{
+		Node n = nodes[i];
+		while (i > 0)
+		{
+			size_t parent = (i - 1) / 4;
+			if (!(n.key < nodes[parent].key)) break;
+			Place(i, nodes[parent]);
+			i = parent;
+		}
+		Place(i, n);
+	}
+
+	void SiftDown(size_t i)
+	{
+		Node n = nodes[i];
+		size_t count = nodes.size(), child, best, last;
+		while ((child = i * 4 + 1) < count)
+		{
+			best = child;
+			last = min(child + 4, count);
+			for (++child; child < last; ++child) if (nodes[child].key < nodes[best].key) best = child;
+			if (!(nodes[best].key < n.key)) break;
+			Place(i, nodes[best]);
+			i = best;
+		}
+		Place(i, n);
+	}
+
+public:
+	typedef T         value_type;
+	typedef KeyFunc   key_func;
+	typedef IndexFunc index_func;
+
+	QuaternaryHeap(const KeyFunc & key = KeyFunc(), const IndexFunc & index = IndexFunc()) : GetHeapKey(key), GetIndex(index) { }
+
+	size_t size()  const { return nodes.size();  }
+	bool   empty() const { return nodes.empty(); }
+
+	bool IsVisited(const T & node) const
+	{
+		size_t i = GetIndex(node);
+		return i < position.size() && position[i] != 0;
+	}
+
+	void Clear()
+	{
+		for (const auto & n : nodes) position[GetIndex(n.data)] = 0;
+		nodes.clear();
+	}
+
+	void Insert(const T & value)
+	{
+		size_t i = GetIndex(value);
+		GrowIndexTable(position, i);
+		if (position[i] != 0) throw std::logic_error("node already exists in heap");
+		Node n = { GetHeapKey(value), value };
+		nodes.push_back(n);
+		position[i] = nodes.size();
+		SiftUp(nodes.size() - 1);
+	}
+
+	void UpdateKey(const T & value)
+	{
+		if (!IsVisited(value)) throw std::logic_error("node does not exist in heap");
+		size_t i = position[GetIndex(value)] - 1;
+		double oldKey = nodes[i].key;
+		nodes[i].key = GetHeapKey(value);
+		if (nodes[i].key < oldKey) SiftUp(i);
+		else SiftDown(i);
+	}
+
+	T DeleteMin()
+	{
+		if (nodes.empty()) throw std::logic_error("heap is empty");
+		T ret = nodes[0].data;
+		position[GetIndex(ret)] = 0;
+		if (nodes.size() > 1)
+		{
+			Place(0, nodes.back());
+			nodes.pop_back();
+			SiftDown(0);
+		}
+		else nodes.pop_back();
+		return ret;
+	}
+};
+
+// Binary heap with lazy deletion. UpdateKey pushes a new copy and bumps the item version so the old copy is skipped when it surfaces.
+// Versions are odd while the item is in the heap and even otherwise.
+template<class T, class KeyFunc, class IndexFunc>
+class LazyBinaryHeap
+{
+private:
+	struct Node
+	{
+		double       key;
+		unsigned int version;
+		T            data;
+
+		// greater than so that the std heap functions build a min heap
+		bool operator<(const Node & rhs) const { return key > rhs.key; }
+	};
+
+	std::vector<Node>         nodes;
+	std::vector<unsigned int> version;
+	size_t                    count;
+	KeyFunc                   GetHeapKey;
+	IndexFunc                 GetIndex;
+
+	void Push(const T & value, unsigned int v)
+	{
+		Node n = { GetHeapKey(value), v, value };
+		nodes.push_back(n);
+		std::push_heap(nodes.begin(), nodes.end());
+	}
+
+public:
+	typedef T         value_type;
+	typedef KeyFunc   key_func;
+	typedef IndexFunc index_func;
+
+	LazyBinaryHeap(const KeyFunc & key = KeyFunc(), const IndexFunc & index = IndexFunc()) : count(0), GetHeapKey(key), GetIndex(index) { }
+
+	size_t size()  const { return count;      }
+	bool   empty() const { return count == 0; }
+
+	bool IsVisited(const T & node) const
+	{
+		size_t i = GetIndex(node);
+		return i < version.size() && (version[i] & 1);
+	}
+
+	void Clear()
+	{
+		for (const auto & n : nodes)
+		{
+			unsigned int & v = version[GetIndex(n.data)];
+			if (v & 1) ++v;
+		}
+		nodes.clear();
+		count = 0;
+	}
+
+	void Insert(const T & value)
+	{
+		size_t i = GetIndex(value);
+		GrowIndexTable(version, i);
+		if (version[i] & 1) throw std::logic_error("node already exists in heap");
+		Push(value, ++version[i]);
+		++count;
+	}
+
+	void UpdateKey(const T & value)
+	{
+		if (!IsVisited(value)) throw std::logic_error("node does not exist in heap");
+		Push(value, version[GetIndex(value)] += 2);
+	}
+
+	T DeleteMin()
+	{
+		if (count == 0) throw std::logic_error("heap is empty");
+		while (true)
+		{
+			Node n = nodes.front();
+			std::pop_heap(nodes.begin(), nodes.end());
+			nodes.pop_back();
+			unsigned int & v = version[GetIndex(n.data)];
+			if (v != n.version) continue;
+			++v;
+			--count;
+			return n.data;
+		}
+	}
+};
+
+// Monotone radix heap for searches whose extracted keys never go down, like the CARMA Dijkstra (no heuristic, non-negative costs).
+// Non-negative doubles compare the same as their bit patterns, so an item sits in the bucket of the highest bit where its key differs
+// from the last extracted key. DeleteMin only has to redistribute the first non-empty bucket. UpdateKey is lazy like LazyBinaryHeap.
+template<class T, class KeyFunc, class IndexFunc>
+class RadixHeap
+{
+private:
+	struct Node
+	{
+		unsigned long long key;
+		unsigned int       version;
+		T                  data;
+	};
+
+	std::vector<Node>         buckets[65];
+	std::vector<unsigned int> version;
+	unsigned long long        last;
+	size_t                    count;
+	KeyFunc                   GetHeapKey;
+	IndexFunc                 GetIndex;
+
+	static inline unsigned long long ToBits(double key)
+	{
+		unsigned long long bits = 0;
+		if (key > 0.0) memcpy(&bits, &key, sizeof(double));
+		return bits;
+	}
+
+	static inline size_t BucketOf(unsigned long long key, unsigned long long last)
+	{
+		unsigned long long x = key ^ last;
+		size_t b = 0;
+		if (x == 0) return 0;
+		if (x >> 32) { x >>= 32; b += 32; }
+		if (x >> 16) { x >>= 16; b += 16; }
+		if (x >>  8) { x >>=  8; b +=  8; }
+		if (x >>  4) { x >>=  4; b +=  4; }
+		if (x >>  2) { x >>=  2; b +=  2; }
+		if (x >>  1) {           b +=  1; }
+		return b + 1;
+	}
+
+	void Push(const T & value, unsigned int v)
+	{
+		Node n = { ToBits(GetHeapKey(value)), v, value };
+		_ASSERT_EXPR(n.key >= last, L"radix heap is monotone: key is less than the last extracted key");
+		if (n.key < last) n.key = last;
+		buckets[BucketOf(n.key, last)].push_back(n);
+	}
+
+	inline bool IsCurrent(const Node & n) const { return version[GetIndex(n.data)] == n.version; }
+
+	// moves the live items of the first non-empty bucket down after setting last to their minimum key
+	void Redistribute()
+	{
+		size_t b = 1;
+		while (b < 65)
+		{
+			auto & bucket = buckets[b];
+			bucket.erase(std::remove_if(bucket.begin(), bucket.end(), [this](const Node & n) { return !IsCurrent(n); }), bucket.end());
+			if (!bucket.empty()) break;
+			++b;
+		}
+		if (b == 65) return;
+
+		auto & bucket = buckets[b];
+		last = bucket.front().key;
+		for (const auto & n : bucket) last = min(last, n.key);
+		for (const auto & n : bucket) buckets[BucketOf(n.key, last)].push_back(n);
+		bucket.clear();
+	}
+
+public:
+	typedef T         value_type;
+	typedef KeyFunc   key_func;
+	typedef IndexFunc index_func;
+
+	RadixHeap(const KeyFunc & key = KeyFunc(), const IndexFunc & index = IndexFunc()) : last(0), count(0), GetHeapKey(key), GetIndex(index) { }
+
+	size_t size()  const { return count;      }
+	bool   empty() const { return count == 0; }
+
+	bool IsVisited(const T & node) const
+	{
+		size_t i = GetIndex(node);
+		return i < version.size() && (version[i] & 1);
+	}
+
+	void Clear()
+	{
+		for (auto & bucket : buckets)
+		{
+			for (const auto & n : bucket)
+			{
+				unsigned int & v = version[GetIndex(n.data)];
+				if (v & 1) ++v;
+			}
+			bucket.clear();
+		}
+		last = 0;
+		count = 0;
+	}
+
+	void Insert(const T & value)
+	{
+		size_t i = GetIndex(value);
+		GrowIndexTable(version, i);
+		if (version[i] & 1) throw std::logic_error("node already exists in heap");
+
+		// once the heap runs empty a new search can start from any key
+		if (count == 0) Clear();
+		Push(value, ++version[i]);
+		++count;
+	}
+
+	void UpdateKey(const T & value)
+	{
+		if (!IsVisited(value)) throw std::logic_error("node does not exist in heap");
+		Push(value, version[GetIndex(value)] += 2);
+	}
+
+	T DeleteMin()
+	{
+		if (count == 0) throw std::logic_error("heap is empty");
+		while (true)
+		{
+			if (buckets[0].empty()) Redistribute();
+			Node n = buckets[0].back();
+			buckets[0].pop_back();
+			if (!IsCurrent(n)) continue;
+			++version[GetIndex(n.data)];
+			--count;
+			return n.data;
+		}
+	}
+};
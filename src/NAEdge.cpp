@@ -22,7 +22,11 @@ EdgeReservations::EdgeReservations(float capacity, TrafficModel * trafficModel)
 	ReservedPop = 0.0;
 	Capacity = capacity;
 	myTrafficModel = trafficModel;
+	coefficients = myTrafficModel->GetCoefficients(Capacity);
 	dirtyState = EdgeDirtyState::CostIncreased;
+	removedCount = 0;
+	inOrder = true;
+	allPathsDirty = true;
 }
 
 EdgeReservations::EdgeReservations(const EdgeReservations& cpy)
@@ -30,34 +34,96 @@ EdgeReservations::EdgeReservations(const EdgeReservations& cpy)
 	ReservedPop = cpy.ReservedPop;
 	Capacity = cpy.Capacity;
 	myTrafficModel = cpy.myTrafficModel;
+	coefficients = cpy.coefficients;
 	dirtyState = cpy.dirtyState;
+	removedCount = 0;
+	inOrder = true;
+	allPathsDirty = true;
+}
+
+EdgeReservations::Entry * EdgeReservations::Find(EvcPathPtr path)
+{
+	if (entries.size() > IndexThreshold)
+	{
+		auto i = index.find(path->GetKey());
+		return i == index.end() ? nullptr : &(entries[i->second]);
+	}
+	// recently added paths are the most likely ones to be removed or swapped
+	for (auto e = entries.rbegin(); e != entries.rend(); ++e) if (*(e->Path) == *path) return &(*e);
+	return nullptr;
+}
+
+void EdgeReservations::Insert(EvcPathPtr path, unsigned int count)
+{
+	Entry * e = Find(path);
+	if (e)
+	{
+		if (e->Count == 0) --removedCount;
+		e->Count += count;
+		e->Path = path;
+	}
+	else
+	{
+		if (!entries.empty() && !EvcPath::LessThanPathOrder2(entries.back().Path, path)) inOrder = false;
+		Entry n = { path, count };
+		entries.push_back(n);
+		if (entries.size() == IndexThreshold + 1) for (size_t i = 0; i < entries.size(); ++i) index[entries[i].Path->GetKey()] = i;
+		else if (entries.size() > IndexThreshold) index[path->GetKey()] = entries.size() - 1;
+	}
+	if (allPathsDirty) path->MarkCostDirty();
+}
+
+// the entry pointer is not valid after this call
+void EdgeReservations::Release(Entry * entry)
+{
+	entry->Count = 0;
+	++removedCount;
+	if (removedCount > IndexThreshold && removedCount * 2 > entries.size()) Compact(false);
+}
+
+void EdgeReservations::Compact(bool sort)
+{
+	entries.erase(std::remove_if(entries.begin(), entries.end(), [](const Entry & e)->bool { return e.Count == 0; }), entries.end());
+	removedCount = 0;
+	if (sort && !inOrder)
+	{
+		std::sort(entries.begin(), entries.end(), [](const Entry & e1, const Entry & e2)->bool { return EvcPath::LessThanPathOrder2(e1.Path, e2.Path); });
+		inOrder = true;
+	}
+	index.clear();
+	if (entries.size() > IndexThreshold) for (size_t i = 0; i < entries.size(); ++i) index[entries[i].Path->GetKey()] = i;
 }
 
 void EdgeReservations::AddReservation(double newFlow, EvcPathPtr path)
 {
-	push_back(path);
+	Insert(path, 1);
 	ReservedPop += newFlow;
+	MarkPathCostsDirty();
 }
 
 void EdgeReservations::RemoveReservation(double flow, EvcPathPtr path)
-{	
-	size_t orgSize = size();
-	erase(std::remove_if(begin(), end(), [&path](const EvcPathPtr & myPath)->bool { return *path == *myPath; }), end());
-	size_t removedCount = orgSize - size();
-	ReservedPop -= flow * removedCount;
+{
+	Entry * e = Find(path);
+	unsigned int removed = e ? e->Count : 0;
+	if (removed > 0) Release(e);
+	ReservedPop -= flow * removed;
 	ReservedPop = max(0.0, ReservedPop);
+	if (removed > 0) MarkPathCostsDirty();
 }
 
 void EdgeReservations::SwapReservation(const EvcPathPtr oldPath, const EvcPathPtr newPath)
 {
-	int last = (int)size() - 1;
-	bool found = false;
-	for (int i = last; i >= 0; --i) if (*oldPath == *at(i))
-	{
-		// this->operator[](i) = newPath;
-		at(i) = newPath;
-		found = true;
-	}
+	Entry * e = Find(oldPath);
+	unsigned int count = e ? e->Count : 0;
+	if (count == 0) return;
+	Release(e);
+	Insert(newPath, count);
+}
+
+void EdgeReservations::GetUniquePaths(std::vector<EvcPathPtr> & paths)
+{
+	if (removedCount > 0 || !inOrder) Compact(true);
+	for (const auto & e : entries) paths.push_back(e.Path);
 }
 
 //******************************************************************************************/
@@ -74,10 +140,12 @@ NAEdge::NAEdge(const NAEdge& cpy) : TreeNext(cpy.TreeNext), AdjacentForward(cpy.
 	CleanCost = cpy.CleanCost;
 	TreePrevious = cpy.TreePrevious;
 	myGeometry = cpy.myGeometry;
+	myGraph = cpy.myGraph;
 }
 
 NAEdge::NAEdge(INetworkEdgePtr edge, long capacityAttribID, long costAttribID, const NAEdge * otherEdge, bool twoWayRoadsShareCap, std::list<EdgeReservationsPtr> & ResTable, TrafficModel * model)
 {
+	myGraph = nullptr;
 	myGeometry = nullptr;
 	TreePrevious = nullptr;
 	CleanCost = -1.0;
@@ -108,24 +176,46 @@ NAEdge::NAEdge(INetworkEdgePtr edge, long capacityAttribID, long costAttribID, c
 	}
 	else
 	{
-		_ASSERT(vcost.dblVal >= 0.0);
-		OriginalCost = max(FLT_MIN, vcost.dblVal);
-		if (vcap.vt == VT_R8) capacity = max(1.0f, (float)(vcap.dblVal));
-		else if (vcap.vt == VT_I4) capacity = max(1.0f, (float)(vcap.intVal));
+		if (vcap.vt == VT_R8) capacity = (float)(vcap.dblVal);
+		else if (vcap.vt == VT_I4) capacity = (float)(vcap.intVal);
+		Init(vcost.dblVal, capacity, otherEdge, twoWayRoadsShareCap, ResTable, model);
+	}
+}
 
-		// now deal with reservation list
-		if (twoWayRoadsShareCap && otherEdge) reservations = otherEdge->reservations;
-		else
-		{
-			reservations = new DEBUG_NEW_PLACEMENT EdgeReservations(capacity, model);
-			ResTable.push_back(reservations);
-		}
+// this constructor is used when the cost and capacity are already known (preloaded graph) so no attribute has to be evaluated
+NAEdge::NAEdge(INetworkEdgePtr edge, long eid, esriNetworkEdgeDirection dir, double cost, float capacity, const NetworkGraph * graph, const NAEdge * otherEdge, bool twoWayRoadsShareCap,
+			   std::list<EdgeReservationsPtr> & ResTable, TrafficModel * model)
+{
+	myGraph = graph;
+	myGeometry = nullptr;
+	TreePrevious = nullptr;
+	CleanCost = -1.0;
+	ToVertex = nullptr;
+	NetEdge = edge;
+	EID = eid;
+	Direction = dir;
+	Init(cost, capacity, otherEdge, twoWayRoadsShareCap, ResTable, model);
+}
+
+void NAEdge::Init(double cost, float capacity, const NAEdge * otherEdge, bool twoWayRoadsShareCap, std::list<EdgeReservationsPtr> & ResTable, TrafficModel * model)
+{
+	_ASSERT(cost >= 0.0);
+	OriginalCost = max(FLT_MIN, cost);
+	capacity = max(1.0f, capacity);
+
+	// now deal with reservation list
+	if (twoWayRoadsShareCap && otherEdge) reservations = otherEdge->reservations;
+	else
+	{
+		reservations = new DEBUG_NEW_PLACEMENT EdgeReservations(capacity, model);
+		ResTable.push_back(reservations);
 	}
 }
 
 HRESULT NAEdge::QuerySourceStuff(long * sourceOID, long * sourceID, double * fromPosition, double * toPosition) const
 {
 	HRESULT hr = S_OK;
+	if (myGraph && myGraph->GetEdgeSource(EID, (unsigned char)Direction, *sourceID, *sourceOID, *fromPosition, *toPosition)) return hr;
 	if (FAILED(hr = NetEdge->get_OID(sourceOID))) return hr;
 	if (FAILED(hr = NetEdge->get_SourceID(sourceID))) return hr;
 	if (FAILED(hr = NetEdge->QueryPositions(fromPosition, toPosition))) return hr;
@@ -215,6 +305,8 @@ bool NAEdge::ApplyNewOriginalCostAndCapacity(double NewOriginalCost, double NewO
 	bool changed = OriginalCost != NewOriginalCost || reservations->Capacity != NewOriginalCapacity;
 	OriginalCost = NewOriginalCost;
 	reservations->Capacity = NewOriginalCapacity;
+	if (changed) reservations->coefficients = reservations->myTrafficModel->GetCoefficients(NewOriginalCapacity);
+	if (changed) reservations->MarkPathCostsDirty();
 	if (changed && !DelayHowDirty) HowDirty(method, 1.0, true);
 	return changed;
 }
@@ -226,11 +318,7 @@ double NAEdge::GetCurrentCost(EvcSolverMethod method) const { return GetCost(0.0
 // new travel cost based on number of reserved spots by previous evacuees.
 double NAEdge::GetTrafficSpeedRatio(double allPop, EvcSolverMethod method) const
 {
-	double speedPercent = 1.0;
-	if      (method == EvcSolverMethod::CASPERSolver) speedPercent = reservations->myTrafficModel->GetCongestionPercentage(reservations->Capacity, allPop);
-	else if (method == EvcSolverMethod::CCRPSolver  ) speedPercent = allPop > reservations->myTrafficModel->CriticalDensPerCap * reservations->Capacity ? 0.0 : 1.0;
-	speedPercent = min(1.0, max(0.0001, speedPercent));
-	return speedPercent;
+	return reservations->myTrafficModel->GetSpeedRatio(reservations->coefficients, allPop, method);
 }
 
 double NAEdge::GetCost(double newPop, EvcSolverMethod method, double * globalDeltaCost) const
@@ -253,13 +341,39 @@ double NAEdge::GetCost(double newPop, EvcSolverMethod method, double * globalDel
 	return OriginalCost / speedPercent;
 }
 
+// the edge data is gathered into contiguous arrays first so the traffic model can evaluate the block with its vector kernels
+void NAEdge::GetCosts(const ArrayList<NAEdge *> & edges, double newPop, TrafficModel::BatchCostFunction kernel, TrafficBatch & batch, bool globalDelta)
+{
+	const TrafficModel * model = nullptr;
+	const EdgeReservations * r = nullptr;
+	double pop;
+	size_t i = 0;
+
+	batch.Resize(edges.size());
+	for (const auto & e : edges)
+	{
+		r = e->reservations;
+		model = r->myTrafficModel;
+		pop = newPop;
+		if (model->InitDelayCostPerPop > 0.0) pop = min(pop, e->OriginalCost / model->InitDelayCostPerPop);
+		batch.OriginalCost[i] = r->Capacity <= 0.0 || e->OriginalCost >= CASPER_INFINITY ? CASPER_INFINITY : e->OriginalCost;
+		batch.ReservedPop[i]  = r->ReservedPop;
+		batch.Flow[i]         = r->ReservedPop + pop;
+		batch.CriticalFlow[i] = r->coefficients.CriticalFlow;
+		batch.ModelRatio[i]   = r->coefficients.ModelRatio;
+		batch.ExpGamma[i]     = r->coefficients.ExpGamma;
+		++i;
+	}
+	kernel(batch, globalDelta, true);
+}
+
 double NAEdge::MaxAddedCostOnReservedPathsWithNewFlow(double deltaCostOfNewFlow, double longestPathSoFar, double currentPathSoFar, double selfishRatio) const
 {
 	double AddedGlobalCost = 0.0;
 	double cutoffCost = max(longestPathSoFar, currentPathSoFar);
 
 	if (deltaCostOfNewFlow > 0.0 && selfishRatio > 0.0)
-		for(const auto & p: *reservations) AddedGlobalCost = max(AddedGlobalCost, p->GetReserveEvacuationCost() + deltaCostOfNewFlow - cutoffCost);		
+		reservations->ForEachPath([&](EvcPathPtr p) { AddedGlobalCost = max(AddedGlobalCost, p->GetReserveEvacuationCost() + deltaCostOfNewFlow - cutoffCost); });
 	else return 0.0;
 
 	return selfishRatio * min(AddedGlobalCost, deltaCostOfNewFlow);
@@ -313,24 +427,21 @@ void NAEdge::RemoveReservation(EvcPathPtr path, EvcSolverMethod method, bool del
 void NAEdge::GetUniqeCrossingPaths(std::vector<EvcPathPtr> & crossings, bool cleanVectorFirst)
 {
 	if (cleanVectorFirst) crossings.clear();
-	crossings.push_back(reservations->front());
-	for (const auto & p : *reservations)
-	{
-		if (*p != *crossings.back()) crossings.push_back(p);
-		_ASSERT_EXPR(!EvcPath::LessThanPathOrder2(p, crossings.back()), L"Path reservations are not in increasing order");
-	}
+	size_t first = crossings.size();
+	reservations->GetUniquePaths(crossings);
+	for (size_t i = first + 1; i < crossings.size(); ++i)
+		_ASSERT_EXPR(EvcPath::LessThanPathOrder2(crossings[i - 1], crossings[i]), L"Path reservations are not in increasing order");
 }
 
 void NAEdge::DynamicStep_ExtractAffectedPaths(std::unordered_set<EvcPathPtr, EvcPath::PtrHasher, EvcPath::PtrEqual> & AffectedPaths, const std::unordered_set<NAEdge *, NAEdgePtrHasher, NAEdgePtrEqual> & DynamicallyAffectedEdges)
 {
 	for (auto edge : DynamicallyAffectedEdges)
-		for (auto path : *(edge->reservations))
-			if (path->IsActive()) AffectedPaths.insert(path);
+		edge->reservations->ForEachPath([&AffectedPaths](EvcPathPtr path) { if (path->IsActive()) AffectedPaths.insert(path); });
 }
 
 // Special function for CCRP: to check how much capacity is left on this edge.
 // Will be used to get max capacity available on a path
-double NAEdge::LeftCapacity() const { return reservations->myTrafficModel->LeftCapacityOnEdge(reservations->Capacity, reservations->ReservedPop, OriginalCost); }
+double NAEdge::LeftCapacity(EvcSolverMethod method) const { return reservations->myTrafficModel->LeftCapacityOnEdge(reservations->Capacity, reservations->ReservedPop, OriginalCost, method); }
 
 double NAEdge::GetHeapKeyHur   (const NAEdge * e)                     { return e->ToVertex->GVal + e->ToVertex->GlobalPenaltyCost + e->ToVertex->GetMinHOrZero(); }
 double NAEdge::GetHeapKeyNonHur(const NAEdge * e)                     { return e->ToVertex->GVal; }
@@ -342,35 +453,31 @@ bool   NAEdge::IsEqualNAEdgePtr(const NAEdge * n1, const NAEdge * n2) { return n
 NAEdgePtr NAEdgeCache::New(long EID, esriNetworkEdgeDirection dir)
 {
 	NAEdgePtr n = nullptr;
-	NAEdgeTable * cache = nullptr;
-	esriNetworkEdgeDirection otherDir;
+	esriNetworkEdgeDirection otherDir = dir == esriNEDAlongDigitized ? esriNEDAgainstDigitized : esriNEDAlongDigitized;
 	INetworkElementPtr ipEdgeElement;
 	INetworkEdgePtr edgeClone;
-	if (dir == esriNEDAlongDigitized)
-	{
-		cache = cacheAlong;
-		otherDir = esriNEDAgainstDigitized;
-	}
-	else
-	{
-		cache = cacheAgainst;
-		otherDir = esriNEDAlongDigitized;
-	}
+	long fromJunction, toJunction;
+	double cost;
+	float capacity;
+	size_t index = IndexOf(EID, dir);
 
-	std::unordered_map<long, NAEdgePtr>::const_iterator it = cache->find(EID);
+	if (EID < 0) return nullptr;
+	if (index >= cacheIndex->size()) cacheIndex->resize(IndexOf(EID + 1, esriNEDAlongDigitized), nullptr);
+	n = cacheIndex->at(index);
 
-	if (it == cache->end())
+	if (!n)
 	{
 		if (FAILED(ipNetworkQuery->CreateNetworkElement(esriNETEdge, &ipEdgeElement))) return nullptr;
 		edgeClone = ipEdgeElement;
 		if (FAILED(ipNetworkQuery->QueryEdge(EID, dir, edgeClone))) return nullptr;
 
-		n = new DEBUG_NEW_PLACEMENT NAEdge(edgeClone, capacityAttribID, costAttribID, Get(EID, otherDir), twoWayRoadsShareCap, ResTable, myTrafficModel);
-		cache->insert(NAEdgeTablePair(n));
-	}
-	else
-	{
-		n = it->second;
+		// if the graph is preloaded then we already have the cost and capacity of this edge
+		if (IsGraphLoaded() && graph->GetEdge(EID, (unsigned char)dir, fromJunction, toJunction, cost, capacity))
+			n = new DEBUG_NEW_PLACEMENT NAEdge(edgeClone, EID, dir, cost, capacity, graph.get(), Get(EID, otherDir), twoWayRoadsShareCap, ResTable, myTrafficModel);
+		else
+			n = new DEBUG_NEW_PLACEMENT NAEdge(edgeClone, capacityAttribID, costAttribID, Get(EID, otherDir), twoWayRoadsShareCap, ResTable, myTrafficModel);
+		(*cacheIndex)[index] = n;
+		cacheList->push_back(n);
 	}
 	return n;
 }
@@ -388,38 +495,129 @@ NAEdgePtr NAEdgeCache::New(INetworkEdgePtr edge)
 
 void NAEdgeCache::CleanAllEdgesAndRelease(double minPop2Route, EvcSolverMethod solver)
 {
-	for (NAEdgeTableItr cit = cacheAlong->begin();   cit != cacheAlong->end();   cit++) cit->second->SetClean(solver, minPop2Route);
-	for (NAEdgeTableItr cit = cacheAgainst->begin(); cit != cacheAgainst->end(); cit++) cit->second->SetClean(solver, minPop2Route);
+	for (NAEdgeCacheItr cit = cacheList->begin(); cit != cacheList->end(); cit++) (*cit)->SetClean(solver, minPop2Route);
 }
 
-void NAEdgeCache::Clear()
+// Cleans all cached edges and brings the contraction hierarchy up to the clean cost of every directed edge, the same costs
+// GetCleanGraphCosts hands to the parallel search. That covers the edges that are not cached yet (graph cost through the traffic
+// model at minPop2Route) and the twins that share capacity with a cached edge, so the sweeps answer the exact CARMA h-values.
+// The first call customizes every arc. Later calls only re-customize the arcs whose edges changed cost.
+// Returns the number of arcs that were computed.
+size_t NAEdgeCache::CustomizeHierarchy(double minPop2Route, EvcSolverMethod solver)
 {
-	for(NAEdgeTableItr cit = cacheAlong->begin(); cit != cacheAlong->end(); cit++)
+	std::vector<double> cost;
+	size_t index;
+
+	if (!IsHierarchyBuilt() || !IsGraphLoaded()) return 0;
+	GetCleanGraphCosts(minPop2Route, solver, cost);
+
+	if (!hierarchy->IsCustomized())
 	{
-		NAEdgePtr e = (*cit).second;
-		delete e;
+		hierarchy->Customize([&cost](long eid, unsigned char dir) -> double
+		{
+			size_t i = IndexOf(eid, (esriNetworkEdgeDirection)dir);
+			return i < cost.size() ? cost[i] : CASPER_INFINITY;
+		}, CASPER_INFINITY);
+		return hierarchy->ArcCount();
 	}
-	for(NAEdgeTableItr cit = cacheAgainst->begin(); cit != cacheAgainst->end(); cit++)
+
+	for (long eid = 0; (index = IndexOf(eid, esriNEDAlongDigitized)) < cost.size(); ++eid)
 	{
-		NAEdgePtr e = (*cit).second;
-		delete e;
+		hierarchy->UpdateEdgeCost(eid, (unsigned char)esriNEDAlongDigitized, cost[index], CASPER_INFINITY);
+		if (index + 1 < cost.size()) hierarchy->UpdateEdgeCost(eid, (unsigned char)esriNEDAgainstDigitized, cost[index + 1], CASPER_INFINITY);
 	}
+	return hierarchy->Recustomize();
+}
+
+// Cleans all cached edges and lists the clean cost of every directed edge of the graph at EID * 2 + Dir - 1, which is what the CARMA
+// Dijkstra would see. Edges that are not cached have no reservation, so their cost comes straight from the graph and the traffic model,
+// unless they share capacity with a cached edge in the other direction. Returns the number of edges with a finite cost.
+size_t NAEdgeCache::GetCleanGraphCosts(double minPop2Route, EvcSolverMethod solver, std::vector<double> & cost)
+{
+	long from, to;
+	double c, pop, speedPercent;
+	float capacity;
+	size_t count = 0;
+	NAEdgePtr edge = nullptr;
+	esriNetworkEdgeDirection dir;
+
+	cost.clear();
+	if (!IsGraphLoaded()) return 0;
+	CleanAllEdgesAndRelease(minPop2Route, solver);
+	cost.assign(cacheIndex->size(), CASPER_INFINITY);
+
+	for (long eid = 0; IndexOf(eid, esriNEDAgainstDigitized) < cost.size(); ++eid)
+		for (unsigned char d = 1; d <= 2; ++d)
+		{
+			dir = (esriNetworkEdgeDirection)d;
+			if (!graph->GetEdge(eid, d, from, to, c, capacity)) continue;
+			edge = Get(eid, dir);
+			if (!edge && twoWayRoadsShareCap && Get(eid, dir == esriNEDAlongDigitized ? esriNEDAgainstDigitized : esriNEDAlongDigitized))
+			{
+				edge = New(eid, dir);
+				if (edge) edge->SetClean(solver, minPop2Route);
+			}
+			if (edge) c = edge->GetCleanCost();
+			else if (capacity <= 0.0f || c >= CASPER_INFINITY) c = CASPER_INFINITY;
+			else
+			{
+				// same as NAEdge::GetCost with nothing reserved
+				pop = minPop2Route;
+				if (myTrafficModel->InitDelayCostPerPop > 0.0) pop = min(pop, c / myTrafficModel->InitDelayCostPerPop);
+				speedPercent = 1.0;
+				if      (solver == EvcSolverMethod::CASPERSolver) speedPercent = myTrafficModel->GetCongestionPercentage(capacity, pop);
+				else if (solver == EvcSolverMethod::CCRPSolver  ) speedPercent = pop > myTrafficModel->CriticalDensPerCap * capacity ? 0.0 : 1.0;
+				c /= min(1.0, max(0.0001, speedPercent));
+			}
+			cost[IndexOf(eid, dir)] = c;
+			if (c < CASPER_INFINITY) ++count;
+		}
+	return count;
+}
+
+// One pool of worker threads for every parallel step of the solve. It is started on first use and stays up with the edge cache.
+std::shared_ptr<ThreadPool> NAEdgeCache::GetThreadPool()
+{
+	if (!threadPool) threadPool = std::shared_ptr<ThreadPool>(new DEBUG_NEW_PLACEMENT ThreadPool());
+	return threadPool;
+}
+
+// Cleans all cached edges and runs the parallel delta-stepping search from the targets over the clean costs ('cost' keeps them
+// at EID * 2 + Dir - 1). Returns the number of junctions that can reach a target. 'tree' gets the parent arc of each junction.
+size_t NAEdgeCache::QueryParallelSearch(double minPop2Route, EvcSolverMethod solver, const std::vector<std::pair<long, double>> & targets, std::vector<double> & dist,
+	std::vector<double> & cost, std::vector<GraphArc> * tree)
+{
+	dist.clear();
+	cost.clear();
+	if (!IsParallelSearchReady()) return 0;
+	GetCleanGraphCosts(minPop2Route, solver, cost);
+	return parallelSearch->QueryToTargets(*graph, cost, targets, dist, CASPER_INFINITY, tree);
+}
+
+void NAEdgeCache::Clear()
+{
+	for (auto e : *cacheList) delete e;
 	for (auto r : ResTable) delete r;
 	for (auto n : GarbageNeighborList) delete n;
 
 	GarbageNeighborList.clear();
-	cacheAlong->clear();
-	cacheAgainst->clear();
+	std::fill(cacheIndex->begin(), cacheIndex->end(), nullptr);
+	cacheList->clear();
 	ResTable.clear();
 }
 
 NAEdgePtr NAEdgeCache::Get(long eid, esriNetworkEdgeDirection dir) const
 {
-	NAEdgeTable * cache = cacheAgainst;
-	if (dir == esriNEDAlongDigitized) cache = cacheAlong;
-	NAEdgeTableItr i = cache->find(eid);
-	if (i != cache->end()) return i->second;
-	else return nullptr;
+	size_t index = IndexOf(eid, dir);
+	if (eid < 0 || index >= cacheIndex->size()) return nullptr;
+	return (*cacheIndex)[index];
+}
+
+// the cached edge of the other direction if the two directions of the road share their capacity
+NAEdgePtr NAEdgeCache::GetTwin(NAEdgePtr edge) const
+{
+	if (!twoWayRoadsShareCap || !edge) return nullptr;
+	return Get(edge->EID, edge->Direction == esriNEDAlongDigitized ? esriNEDAgainstDigitized : esriNEDAlongDigitized);
 }
 
 HRESULT NAEdgeCache::QueryAdjacencies(NAVertexPtr ToVertex, NAEdgePtr Edge, QueryDirection dir, ArrayList<NAEdgePtr> ** returnNeighbors)
@@ -443,6 +641,11 @@ HRESULT NAEdgeCache::QueryAdjacencies(NAVertexPtr ToVertex, NAEdgePtr Edge, Quer
 	}
 	if (neighbors->empty())
 	{
+		if (IsGraphLoaded())
+		{
+			*returnNeighbors = neighbors;
+			return QueryGraphAdjacencies(ToVertex, Edge, dir, neighbors);
+		}
 		star = dir == QueryDirection::Forward ? ipForwardStar: ipBackwardStar;
 
 		if (FAILED(hr = star->QueryAdjacencies(ToVertex->Junction, netEdge, nullptr, ipAdjacencies))) return hr;
@@ -458,81 +661,167 @@ HRESULT NAEdgeCache::QueryAdjacencies(NAVertexPtr ToVertex, NAEdgePtr Edge, Quer
 	return hr;
 }
 
+// Same as QueryAdjacencies but the list is sliced out of the preloaded graph. The forward star applies the U-turn
+// policy based on the previous edge, so we have to do the same here since the graph slices are per junction.
+HRESULT NAEdgeCache::QueryGraphAdjacencies(NAVertexPtr ToVertex, NAEdgePtr Edge, QueryDirection dir, ArrayList<NAEdgePtr> * neighbors)
+{
+	const GraphArc * first = nullptr, * last = nullptr;
+	const GraphArc * arc = nullptr;
+	size_t count = 0, degree = 0;
+	bool allowBacktrack = true;
+	NAEdgePtr n = nullptr;
+
+	if (!graph->GetAdjacencies(ToVertex->EID, dir == QueryDirection::Forward, first, last)) return E_FAIL;
+	degree = (size_t)(last - first);
+
+	if (Edge && backtrack != esriNFSBAllowBacktrack)
+	{
+		if      (backtrack == esriNFSBNoBacktrack)                      allowBacktrack = false;
+		else if (backtrack == esriNFSBAtDeadEndsOnly)                   allowBacktrack = degree <= 1;
+		else if (backtrack == esriNFSBAtDeadEndsAndIntersections)       allowBacktrack = degree != 2;
+	}
+
+	for (arc = first; arc != last; ++arc) if (allowBacktrack || !Edge || arc->EID != Edge->EID) ++count;
+	neighbors->Init((UINT8)count);
+	count = 0;
+	for (arc = first; arc != last; ++arc)
+	{
+		if (!allowBacktrack && Edge && arc->EID == Edge->EID) continue;
+		if (!(n = this->New(arc->EID, (esriNetworkEdgeDirection)arc->Dir))) return E_FAIL;
+		neighbors->at((UINT8)count++, n);
+	}
+	return S_OK;
+}
+
 //******************************************************************************************/
-// NAEdgeMap Methods
+// ArcNetworkGraph Methods
 
-bool NAEdgeMap::Exist(long eid, esriNetworkEdgeDirection dir)
+HRESULT ArcNetworkGraph::Load(INetworkQueryPtr ipNetworkQuery, INetworkForwardStarExPtr ipForwardStar, long capacityAttribID, long costAttribID)
 {
-	NAEdgeTable * cache = nullptr;
+	HRESULT hr = S_OK;
+	long junctionCount = 0, adjacentEdgeCount = 0;
+	double fromPosition, toPosition;
+	VARIANT vcost, vcap;
+	INetworkElementPtr ipJunctionElement, ipToElement, ipEdgeElement;
+	INetworkForwardStarAdjacenciesPtr ipAdjacencies;
+	std::vector<EdgeRecord> records;
+	EdgeRecord r;
+	esriNetworkEdgeDirection dir;
 
-	if (dir == esriNEDAlongDigitized) cache = cacheAlong;
-	else cache = cacheAgainst;
+	Clear();
+	if (FAILED(hr = ipNetworkQuery->get_ElementCount(esriNETJunction, &junctionCount))) return hr;
+	if (FAILED(hr = ipNetworkQuery->CreateForwardStarAdjacencies(&ipAdjacencies))) return hr;
+	if (FAILED(hr = ipNetworkQuery->CreateNetworkElement(esriNETJunction, &ipJunctionElement))) return hr;
+	if (FAILED(hr = ipNetworkQuery->CreateNetworkElement(esriNETJunction, &ipToElement))) return hr;
+	if (FAILED(hr = ipNetworkQuery->CreateNetworkElement(esriNETEdge, &ipEdgeElement))) return hr;
+	INetworkJunctionPtr ipJunction(ipJunctionElement), ipToJunction(ipToElement);
+	INetworkEdgePtr ipEdge(ipEdgeElement);
+	records.reserve(junctionCount * 3);
+
+	// junction EIDs are dense and start from one
+	for (long j = 1; j <= junctionCount; ++j)
+	{
+		if (FAILED(ipNetworkQuery->QueryJunction(j, ipJunction))) continue;
+		if (FAILED(hr = ipForwardStar->QueryAdjacencies(ipJunction, nullptr, nullptr, ipAdjacencies))) return hr;
+		if (FAILED(hr = ipAdjacencies->get_Count(&adjacentEdgeCount))) return hr;
 
-	return cache->find(eid) != cache->end();
+		for (long i = 0; i < adjacentEdgeCount; ++i)
+		{
+			if (FAILED(hr = ipAdjacencies->QueryEdge(i, ipEdge, &fromPosition, &toPosition))) return hr;
+			if (FAILED(hr = ipEdge->get_EID(&r.EID))) return hr;
+			if (FAILED(hr = ipEdge->get_Direction(&dir))) return hr;
+			if (FAILED(hr = ipEdge->QueryJunctions(nullptr, ipToJunction))) return hr;
+			if (FAILED(hr = ipToJunction->get_EID(&r.ToJunction))) return hr;
+
+			if (FAILED(ipEdge->get_AttributeValue(costAttribID, &vcost))) { vcost.vt = VT_R8; vcost.dblVal = 1.0; }
+			if (FAILED(ipEdge->get_AttributeValue(capacityAttribID, &vcap))) { vcap.vt = VT_R8; vcap.dblVal = 1.0; }
+
+			if (FAILED(hr = ipEdge->get_SourceID(&r.SourceID))) return hr;
+			if (FAILED(hr = ipEdge->get_OID(&r.SourceOID))) return hr;
+			if (FAILED(hr = ipEdge->QueryPositions(&r.FromPosition, &r.ToPosition))) return hr;
+
+			r.Dir = (unsigned char)dir;
+			r.FromJunction = j;
+			r.Cost = vcost.dblVal;
+			r.Capacity = 1.0f;
+			if (vcap.vt == VT_R8) r.Capacity = (float)(vcap.dblVal);
+			else if (vcap.vt == VT_I4) r.Capacity = (float)(vcap.intVal);
+			records.push_back(r);
+		}
+	}
+	Build(records, (size_t)junctionCount);
+	return hr;
 }
 
-const NAEdgePtr NAEdgeMap::Find(const NAEdgePtr edge) const
+//******************************************************************************************/
+// NAEdgeStampTable Methods
+
+void NAEdgeStampTable::Stamp(NAEdgePtr edge, unsigned int stamp)
 {
-	std::unordered_map<long, NAEdgePtr> * cache = nullptr;
-	if (edge->Direction == esriNEDAlongDigitized) cache = cacheAlong;
-	else cache = cacheAgainst;
+	size_t i = IndexOf(edge->EID, edge->Direction);
+	if (i >= Stamps.size()) Stamps.resize(IndexOf(edge->EID + 1, esriNEDAlongDigitized), 0);
+	if (Stamps[i] < MembersFloor) Members.push_back(edge);
+	Stamps[i] = stamp;
+}
 
-	std::unordered_map<long, NAEdgePtr>::const_iterator it = cache->find(edge->EID);
-	NAEdgePtr o = nullptr;
-	if (it != cache->end()) o = it->second;
-	return o;
+void NAEdgeStampTable::Reset()
+{
+	// after two billion resets the epoch wraps around and only then do we have to touch every stamp
+	if (Epoch >= UINT_MAX - 4)
+	{
+		std::fill(Stamps.begin(), Stamps.end(), 0);
+		Epoch = 0;
+	}
+	Members.clear();
+	MembersFloor = NextEpoch();
 }
 
+//******************************************************************************************/
+// NAEdgeMap Methods
+
 void NAEdgeMap::GetDirtyEdges(std::vector<NAEdgePtr> & dirty) const
 {
-	for (const auto i : *cacheAlong)   if (i.second->GetDirtyState() != EdgeDirtyState::CleanState) dirty.push_back(i.second);
-	for (const auto i : *cacheAgainst) if (i.second->GetDirtyState() != EdgeDirtyState::CleanState) dirty.push_back(i.second);
+	for (const auto e : table->Members) if (Exist(e) && e->GetDirtyState() != EdgeDirtyState::CleanState) dirty.push_back(e);
 }
 
-void NAEdgeMap::Erase(long eid, esriNetworkEdgeDirection dir)
+void NAEdgeMap::GetEdges(std::vector<NAEdgePtr> & edges) const
 {
-	NAEdgeTable * cache = nullptr;
-	if (dir == esriNEDAlongDigitized) cache = cacheAlong;
-	else cache = cacheAgainst;
-
-	NAEdgeTableItr i = cache->find(eid);
-	if (i != cache->end()) cache->erase(i);
+	for (const auto e : table->Members) if (Exist(e)) edges.push_back(e);
 }
 
-HRESULT NAEdgeMap::Insert(NAEdgePtr edge)
+void NAEdgeMap::Erase(long eid, esriNetworkEdgeDirection dir)
 {
-	NAEdgeTable * cache = nullptr;
-
-	if (edge->Direction == esriNEDAlongDigitized) cache = cacheAlong;
-	else cache = cacheAgainst;
-
-	if (cache->find(edge->EID) != cache->end()) return E_FAIL;
-	cache->insert(NAEdgeTablePair(edge));
-
-	return S_OK;
+	if (!Exist(eid, dir)) return;
+	table->Kill(eid, dir);
+	--count;
 }
 
-HRESULT NAEdgeMap::Insert(NAEdgeMap * edges)
+HRESULT NAEdgeMap::Insert(NAEdgePtr edge)
 {
-	cacheAlong->rehash(cacheAlong->size() + edges->cacheAlong->size());
-	cacheAgainst->rehash(cacheAgainst->size() + edges->cacheAgainst->size());
-	NAEdgeTableItr i;
-	for(i = edges->cacheAlong->begin(); i != edges->cacheAlong->end(); i++)
-		if (cacheAlong->find(i->first) == cacheAlong->end()) cacheAlong->insert(NAEdgeTablePair(i->second));
-	for(i = edges->cacheAgainst->begin(); i != edges->cacheAgainst->end(); i++)
-		if (cacheAgainst->find(i->first) == cacheAgainst->end()) cacheAgainst->insert(NAEdgeTablePair(i->second));
+	if (Exist(edge)) return E_FAIL;
+	table->Stamp(edge, high);
+	++count;
 	return S_OK;
 }
 
 void NAEdgeMap::Clear(bool destroyTreePrevious)
 {
-	if (destroyTreePrevious)
+	// a list that shares its table can not start a new epoch on its own, so it has to erase its edges one by one
+	if (destroyTreePrevious || !ownsTable)
 	{
-		for (auto e : *cacheAlong)   e.second->TreePrevious = nullptr;
-		for (auto e : *cacheAgainst) e.second->TreePrevious = nullptr;
+		for (auto e : table->Members)
+		{
+			if (!Exist(e)) continue;
+			if (destroyTreePrevious) e->TreePrevious = nullptr;
+			if (!ownsTable) table->Kill(e->EID, e->Direction);
+		}
+	}
+	count = 0;
+	if (ownsTable)
+	{
+		table->Reset();
+		low = high = table->Epoch;
 	}
-	cacheAlong->clear();
-	cacheAgainst->clear();
 }
 
 //******************************************************************************************/
@@ -540,17 +829,31 @@ void NAEdgeMap::Clear(bool destroyTreePrevious)
 
 void NAEdgeMapTwoGen::MarkAllAsOldGen()
 {
-	oldGen->Insert(newGen);
-	newGen->Clear();
+	oldGen->high = newGen->high;
+	oldGen->count += newGen->count;
+	newGen->count = 0;
+	newGen->low = newGen->high = table->NextEpoch();
 }
 
 void NAEdgeMapTwoGen::Clear(NAEdgeMapGeneration gen, bool destroyTreePrevious)
 {
-	if (CheckFlag(gen, NAEdgeMapGeneration::OldGen)) oldGen->Clear(destroyTreePrevious);
-	if (CheckFlag(gen, NAEdgeMapGeneration::NewGen)) newGen->Clear(destroyTreePrevious);
+	if (gen == NAEdgeMapGeneration::AllGens)
+	{
+		if (destroyTreePrevious) for (auto e : table->Members) if (Exist(e)) e->TreePrevious = nullptr;
+		table->Reset();
+		oldGen->low = table->Epoch;
+		oldGen->high = table->Epoch - 2;
+		newGen->low = newGen->high = table->Epoch;
+		oldGen->count = newGen->count = 0;
+	}
+	else
+	{
+		if (CheckFlag(gen, NAEdgeMapGeneration::OldGen)) oldGen->Clear(destroyTreePrevious);
+		if (CheckFlag(gen, NAEdgeMapGeneration::NewGen)) newGen->Clear(destroyTreePrevious);
+	}
 }
 
-size_t NAEdgeMapTwoGen::Size(NAEdgeMapGeneration gen)
+size_t NAEdgeMapTwoGen::Size(NAEdgeMapGeneration gen) const
 {
 	size_t t = 0;
 	if (CheckFlag(gen, NAEdgeMapGeneration::OldGen)) t += oldGen->Size();
@@ -558,20 +861,18 @@ size_t NAEdgeMapTwoGen::Size(NAEdgeMapGeneration gen)
 	return t;
 }
 
-HRESULT NAEdgeMapTwoGen::Insert(NAEdgePtr edge, NAEdgeMapGeneration gen)
+// an edge has only one stamp so inserting an old generation edge moves it to the new generation
+HRESULT NAEdgeMapTwoGen::Insert(NAEdgePtr edge)
 {
-	HRESULT hr = S_OK;
-	if (CheckFlag(gen, NAEdgeMapGeneration::OldGen)) if (FAILED(hr = oldGen->Insert(edge))) return hr;
-	if (CheckFlag(gen, NAEdgeMapGeneration::NewGen)) if (FAILED(hr = newGen->Insert(edge))) return hr;
-	return hr;
+	if (newGen->Exist(edge)) return E_FAIL;
+	if (oldGen->Exist(edge)) --oldGen->count;
+	return newGen->Insert(edge);
 }
 
-bool NAEdgeMapTwoGen::Exist(long eid, esriNetworkEdgeDirection dir, NAEdgeMapGeneration gen)
+bool NAEdgeMapTwoGen::Exist(long eid, esriNetworkEdgeDirection dir, NAEdgeMapGeneration gen) const
 {
-	bool e = false;
-	if (CheckFlag(gen, NAEdgeMapGeneration::OldGen)) e |= oldGen->Exist(eid, dir);
-	if (CheckFlag(gen, NAEdgeMapGeneration::NewGen)) e |= newGen->Exist(eid, dir);
-	return e;
+	unsigned int stamp = table->Get(eid, dir);
+	return (CheckFlag(gen, NAEdgeMapGeneration::OldGen) && oldGen->IsLive(stamp)) || (CheckFlag(gen, NAEdgeMapGeneration::NewGen) && newGen->IsLive(stamp));
 }
 
 void NAEdgeMapTwoGen::Erase(NAEdgePtr edge, NAEdgeMapGeneration gen)
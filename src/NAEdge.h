@@ -15,15 +15,49 @@
 #include "StdAfx.h"
 #include "Evacuee.h"
 #include "TrafficModel.h"
+#include "NetworkGraph.h"
+#include "ContractionHierarchy.h"
+#include "DeltaStepping.h"
 #include "utils.h"
 
-class EdgeReservations : private std::vector<EvcPathPtr>
+// The paths that reserved some population on an edge. Each path keeps one entry with the number of times it crosses the edge.
+// Paths are found through an index on their order once the edge gets busy so adding, removing, and swapping a path does not
+// scan the whole edge. A removed path leaves an empty entry behind (so it can come back in place) until too many of them pile
+// up. The entries are kept in path order lazily: a path added out of order only sorts them on the next GetUniquePaths call.
+class EdgeReservations
 {
 private:
-	double         ReservedPop;
-	double         Capacity;
-	EdgeDirtyState dirtyState;
-	TrafficModel   * myTrafficModel;
+	struct Entry
+	{
+		EvcPathPtr   Path;
+		unsigned int Count; // zero means the path was removed
+	};
+
+	std::vector<Entry>              entries;
+	std::unordered_map<int, size_t> index;       // path order to entry position. Only built when there are more than IndexThreshold entries.
+	size_t                          removedCount; // entries with zero count
+	bool                            inOrder;
+	bool                            allPathsDirty; // every reserved path is already marked dirty so marking them again would not change anything
+	double                          ReservedPop;
+	double                          Capacity;
+	EdgeDirtyState                  dirtyState;
+	TrafficModel                    * myTrafficModel;
+	TrafficCoefficients             coefficients;  // the capacity dependent part of the traffic model. Has to follow any change to Capacity.
+
+	// below this many entries a linear scan is cheaper than keeping the index up to date
+	static const size_t IndexThreshold = 32;
+
+	Entry * Find(EvcPathPtr path);
+	void    Insert(EvcPathPtr path, unsigned int count);
+	void    Release(Entry * entry);
+	void    Compact(bool sort);
+
+	// the reserved paths are the ones that depend on the cost of this edge
+	void MarkPathCostsDirty()
+	{
+		if (!allPathsDirty) ForEachPath([](EvcPathPtr p) { p->MarkCostDirty(); });
+		allPathsDirty = true;
+	}
 
 public:
 	EdgeReservations(float capacity, TrafficModel * trafficModel);
@@ -33,6 +67,15 @@ public:
 	void RemoveReservation(double flow, EvcPathPtr path);
 	void SwapReservation(const EvcPathPtr oldPath, const EvcPathPtr newPath);
 
+	// appends each reserved path once and in increasing path order
+	void GetUniquePaths(std::vector<EvcPathPtr> & paths);
+
+	// one of the reserved paths recalculated its cost so the next change has to mark the paths again
+	inline void PathCostCleaned() { allPathsDirty = false; }
+
+	// visits each reserved path once in no particular order
+	template <class F> void ForEachPath(F f) const { for (const auto & e : entries) if (e.Count > 0) f(e.Path); }
+
 	friend class NAEdge;
 };
 
@@ -47,9 +90,11 @@ class NAEdge
 {
 private:
 	IGeometryPtr myGeometry;
+	const NetworkGraph * myGraph;
 	EdgeReservations * reservations;
 	double CleanCost;
 	double GetTrafficSpeedRatio(double allPop, EvcSolverMethod method) const;
+	void Init(double cost, float capacity, const NAEdge * otherEdge, bool twoWayRoadsShareCap, std::list<EdgeReservationsPtr> & ResTable, TrafficModel * model);
 
 public:
 	double OriginalCost;
@@ -64,17 +109,42 @@ public:
 
 	EdgeDirtyState HowDirty(EvcSolverMethod method, double minPop2Route = 1.0, bool exhaustive = false);
 	double GetCost(double newPop, EvcSolverMethod method, double * globalDeltaCost = nullptr) const;
+
+	// GetCost of a whole adjacency block in one call. The answer for the i-th edge is in batch.Cost[i] and batch.GlobalDeltaCost[i].
+	// The kernel comes from TrafficModel::GetBatchCostFunction and fixes the solver method and the traffic model.
+	static void GetCosts(const ArrayList<NAEdge *> & edges, double newPop, TrafficModel::BatchCostFunction kernel, TrafficBatch & batch, bool globalDelta);
 	double GetCurrentCost(EvcSolverMethod method = EvcSolverMethod::CASPERSolver) const;
-	double LeftCapacity() const;
+	double LeftCapacity(EvcSolverMethod method) const;
 	bool ApplyNewOriginalCostAndCapacity(double NewOriginalCost, double NewOriginalCapacity, bool DelayHowDirty, EvcSolverMethod method);
 	bool IsNewOriginalCostAndCapacityDifferent(double NewOriginalCost, double NewOriginalCapacity) const;
 
 	// Special function for Flocking: to check how much capacity the edge had originally
 	double OriginalCapacity() const { return reservations->Capacity; }
 
+	// called by a reserved path right after it recalculated its cost
+	inline void ReservedPathCostCleaned() { reservations->PathCostCleaned(); }
+
+	// true for the other direction of a two-way road that shares the capacity with this one
+	inline bool SharesReservations(const NAEdge * other) const { return other && other != this && other->reservations == reservations; }
+
+	// The edges whose cost is not what it was before a route got reserved on them ('oldCosts'). The other direction of a two-way road
+	// that shares its capacity changes along with the edge, so it is listed too if 'twinOf' finds it in the cache.
+	template <class TwinOf> static void GetChangedEdges(const std::vector<std::pair<NAEdge *, double>> & oldCosts, double newPop, EvcSolverMethod method,
+		bool allChanged, TwinOf twinOf, std::vector<NAEdge *> & changed)
+	{
+		NAEdge * twin = nullptr;
+		for (const auto & p : oldCosts)
+		{
+			if (!allChanged && p.first->GetCost(newPop, method) == p.second) continue;
+			changed.push_back(p.first);
+			if ((twin = twinOf(p.first)) && p.first->SharesReservations(twin)) changed.push_back(twin);
+		}
+	}
+
 	HRESULT QuerySourceStuff(long * sourceOID, long * sourceID, double * fromPosition, double * toPosition) const;
 	void AddReservation(EvcPath * path, EvcSolverMethod method, bool delayedDirtyState = false);
 	NAEdge(INetworkEdgePtr, long capacityAttribID, long costAttribID, const NAEdge * otherEdge, bool twoWayRoadsShareCap, std::list<EdgeReservationsPtr> & ResTable, TrafficModel * model);
+	NAEdge(INetworkEdgePtr, long eid, esriNetworkEdgeDirection dir, double cost, float capacity, const NetworkGraph * graph, const NAEdge * otherEdge, bool twoWayRoadsShareCap, std::list<EdgeReservationsPtr> & ResTable, TrafficModel * model);
 	NAEdge(const NAEdge & cpy);
 	NAEdge & operator=(const NAEdge &) = delete;
 
@@ -146,48 +216,88 @@ struct NAedgePairEqual : public std::binary_function<std::pair<long, esriNetwork
 	}
 };
 
-typedef public std::unordered_map<long, NAEdgePtr> NAEdgeTable;
-typedef std::unordered_map<long, NAEdgePtr>::const_iterator NAEdgeTableItr;
-typedef std::pair<long, NAEdgePtr> _NAEdgeTablePair;
-#define NAEdgeTablePair(a) _NAEdgeTablePair(a->EID, a)
+typedef std::vector<NAEdgePtr>::const_iterator NAEdgeCacheItr;
+
+// Per-edge stamps shared by the closed lists. A closed list owns a range of epochs and an edge is in the list if its
+// stamp falls in that range, so lookups are one array read and clearing a list is just moving on to a new epoch.
+// Epochs are even numbers; an odd stamp marks an edge that was erased. Members records every edge stamped since the
+// last reset exactly once so the lists can still be walked (i.e. to collect dirty edges or reset the tree).
+class NAEdgeStampTable
+{
+public:
+	std::vector<unsigned int> Stamps;  // indexed by EID * 2 + Direction - 1, same as the edge cache
+	std::vector<NAEdgePtr>    Members;
+	unsigned int              Epoch;
+	unsigned int              MembersFloor;
+
+	NAEdgeStampTable(void) : Epoch(2), MembersFloor(2) { }
+	NAEdgeStampTable(const NAEdgeStampTable & that) = delete;
+	NAEdgeStampTable & operator=(const NAEdgeStampTable &) = delete;
 
+	static inline size_t IndexOf(long eid, esriNetworkEdgeDirection dir) { return (size_t)eid * 2 + dir - 1; }
+	inline unsigned int Get(long eid, esriNetworkEdgeDirection dir) const
+	{
+		size_t i = IndexOf(eid, dir);
+		return i < Stamps.size() ? Stamps[i] : 0;
+	}
+	inline void Kill(long eid, esriNetworkEdgeDirection dir)
+	{
+		size_t i = IndexOf(eid, dir);
+		if (i < Stamps.size()) Stamps[i] |= 1;
+	}
+	inline unsigned int NextEpoch() { return Epoch += 2; }
+	void Stamp(NAEdgePtr edge, unsigned int stamp);
+	void Reset();
+};
+
+// Closed list of one search. Insert, Exist, and Erase are constant time and Clear starts a new epoch instead of freeing anything.
 class NAEdgeMap
 {
 private:
-	NAEdgeTable * cacheAlong;
-	NAEdgeTable * cacheAgainst;
+	NAEdgeStampTable * table;
+	bool               ownsTable;
+	unsigned int       low;   // edges stamped with an even number in [low, high] are in this list
+	unsigned int       high;
+	size_t             count;
+
+	NAEdgeMap(NAEdgeStampTable * sharedTable, unsigned int _low, unsigned int _high) : table(sharedTable), ownsTable(false), low(_low), high(_high), count(0) { }
+	inline bool IsLive(unsigned int stamp) const { return stamp >= low && stamp <= high && !(stamp & 1); }
 
 public:
 	NAEdgeMap(const NAEdgeMap & that) = delete;
 	NAEdgeMap & operator=(const NAEdgeMap &) = delete;
 
-	NAEdgeMap(void)
+	NAEdgeMap(void) : ownsTable(true), count(0)
 	{
-		cacheAlong = new DEBUG_NEW_PLACEMENT std::unordered_map<long, NAEdgePtr>();
-		cacheAgainst = new DEBUG_NEW_PLACEMENT std::unordered_map<long, NAEdgePtr>();
+		table = new DEBUG_NEW_PLACEMENT NAEdgeStampTable();
+		low = high = table->Epoch;
 	}
 
 	virtual ~NAEdgeMap(void)
 	{
-		Clear();
-		delete cacheAlong;
-		delete cacheAgainst;
+		if (ownsTable) delete table;
 	}
 	
 	void GetDirtyEdges(std::vector<NAEdgePtr> & dirty) const;
+	void GetEdges(std::vector<NAEdgePtr> & edges) const;
 	void Erase(NAEdgePtr edge) {        Erase(edge->EID, edge->Direction)  ; }
-	bool Exist(NAEdgePtr edge) { return Exist(edge->EID, edge->Direction)  ; }
+	bool Exist(NAEdgePtr edge) const { return Exist(edge->EID, edge->Direction); }
 	void Clear(bool destroyTreePrevious = false);
-	size_t Size()              { return cacheAlong->size() + cacheAgainst->size(); }
-	HRESULT Insert(NAEdgePtr   edge );
-	HRESULT Insert(NAEdgeMap * edges);
-	bool Exist(long eid, esriNetworkEdgeDirection dir);
+	size_t Size() const        { return count; }
+	HRESULT Insert(NAEdgePtr edge);
+	bool Exist(long eid, esriNetworkEdgeDirection dir) const { return IsLive(table->Get(eid, dir)); }
 	void Erase(long eid, esriNetworkEdgeDirection dir);
-	const NAEdgePtr Find(const NAEdgePtr edge) const;
+
+	friend class NAEdgeMapTwoGen;
 };
 
+// Both generations share one stamp table. The new generation owns the current epoch and the old generation owns all
+// epochs since the last full clear, so moving every edge to the old generation is just an epoch increment.
 class NAEdgeMapTwoGen
 {
+private:
+	NAEdgeStampTable * table;
+
 public:
 	NAEdgeMap * oldGen;
 	NAEdgeMap * newGen;
@@ -197,24 +307,25 @@ public:
 
 	NAEdgeMapTwoGen(void)
 	{
-		oldGen = new DEBUG_NEW_PLACEMENT NAEdgeMap();
-		newGen = new DEBUG_NEW_PLACEMENT NAEdgeMap();
+		table = new DEBUG_NEW_PLACEMENT NAEdgeStampTable();
+		oldGen = new DEBUG_NEW_PLACEMENT NAEdgeMap(table, table->Epoch, table->Epoch - 2);
+		newGen = new DEBUG_NEW_PLACEMENT NAEdgeMap(table, table->Epoch, table->Epoch);
 	}
 
 	virtual ~NAEdgeMapTwoGen(void)
 	{
-		Clear(NAEdgeMapGeneration::AllGens);
 		delete oldGen;
 		delete newGen;
+		delete table;
 	}
 
 	void MarkAllAsOldGen();
-	bool Exist(NAEdgePtr edge, NAEdgeMapGeneration gen = NAEdgeMapGeneration::AllGens) { return Exist(edge->EID, edge->Direction, gen); }
+	bool Exist(NAEdgePtr edge, NAEdgeMapGeneration gen = NAEdgeMapGeneration::AllGens) const { return Exist(edge->EID, edge->Direction, gen); }
 	void Erase(NAEdgePtr edge, NAEdgeMapGeneration gen = NAEdgeMapGeneration::AllGens);
 	void Clear(NAEdgeMapGeneration gen, bool destroyTreePrevious = false);
-	size_t Size(NAEdgeMapGeneration gen = NAEdgeMapGeneration::NewGen);
-	HRESULT Insert(NAEdgePtr edge, NAEdgeMapGeneration gen = NAEdgeMapGeneration::NewGen);
-	bool Exist(long eid, esriNetworkEdgeDirection dir, NAEdgeMapGeneration gen = NAEdgeMapGeneration::AllGens);
+	size_t Size(NAEdgeMapGeneration gen = NAEdgeMapGeneration::NewGen) const;
+	HRESULT Insert(NAEdgePtr edge);
+	bool Exist(long eid, esriNetworkEdgeDirection dir, NAEdgeMapGeneration gen = NAEdgeMapGeneration::AllGens) const;
 };
 
 typedef std::pair<long, unsigned char> NAEdgeContainerPair;
@@ -257,6 +368,15 @@ public:
 	bool IsEmpty() const { return cache->empty(); }
 };
 
+// Loads the CSR graph from the network dataset. It walks the forward star once per junction so barriers and
+// restriction attributes already loaded into the forward star are honored. Turn restrictions depend on the
+// previous edge and can not be stored per junction, hence the solver should not use this graph when turns are restricted.
+class ArcNetworkGraph : public CSRNetworkGraph
+{
+public:
+	HRESULT Load(INetworkQueryPtr ipNetworkQuery, INetworkForwardStarExPtr ipForwardStar, long capacityAttribID, long costAttribID);
+};
+
 // This collection object has two jobs:
 // it makes sure that there exist only one copy of an edge in it that is connected to each INetworkEdge.
 // this will be helpful to avoid duplicate copies pointing to the same edge structure. So data attached
@@ -270,8 +390,8 @@ private:
 	long			costAttribID;
 	bool			twoWayRoadsShareCap;
 	mutable bool	IsSourceCache;
-	NAEdgeTable		* cacheAlong;
-	NAEdgeTable		* cacheAgainst;
+	std::vector<NAEdgePtr> * cacheIndex; // dense lookup table indexed by EID * 2 + Direction - 1
+	std::vector<NAEdgePtr> * cacheList;  // every cached edge in the order they were created
 	std::list<ArrayList<NAEdgePtr> *> GarbageNeighborList;
 	std::list<EdgeReservationsPtr> ResTable;
 	TrafficModel    * myTrafficModel;
@@ -280,6 +400,14 @@ private:
 	INetworkForwardStarExPtr          ipForwardStar;
 	INetworkForwardStarExPtr          ipBackwardStar;
 	INetworkForwardStarAdjacenciesPtr ipAdjacencies;
+	std::shared_ptr<NetworkGraph>     graph;
+	std::shared_ptr<ContractionHierarchy> hierarchy;
+	std::shared_ptr<DeltaStepping>    parallelSearch;
+	std::shared_ptr<ThreadPool>       threadPool;
+	esriNetworkForwardStarBacktrack   backtrack;
+
+	HRESULT QueryGraphAdjacencies(NAVertexPtr ToVertex, NAEdgePtr Edge, QueryDirection dir, ArrayList<NAEdgePtr> * neighbors);
+	static inline size_t IndexOf(long eid, esriNetworkEdgeDirection dir) { return (size_t)eid * 2 + dir - 1; }
 
 public:
 
@@ -289,19 +417,30 @@ public:
 		IsSourceCache = false;
 		capacityAttribID = CapacityAttribID;
 		costAttribID = CostAttribID;
-		cacheAlong = new DEBUG_NEW_PLACEMENT std::unordered_map<long, NAEdgePtr>();
-		cacheAgainst = new DEBUG_NEW_PLACEMENT std::unordered_map<long, NAEdgePtr>();
+		cacheIndex = new DEBUG_NEW_PLACEMENT std::vector<NAEdgePtr>();
+		cacheList = new DEBUG_NEW_PLACEMENT std::vector<NAEdgePtr>();
 		myTrafficModel = new DEBUG_NEW_PLACEMENT TrafficModel(model, CriticalDensPerCap, SaturationPerCap, InitDelayCostPerPop);
 		twoWayRoadsShareCap = TwoWayRoadsShareCap;
+		backtrack = esriNFSBAllowBacktrack;
+		graph = nullptr;
+		hierarchy = nullptr;
+		parallelSearch = nullptr;
+		threadPool = nullptr;
 
 		// network variables init
 		INetworkElementPtr ipEdgeElement;
+		long edgeCount = 0;
 		ipNetworkQuery = _ipNetworkQuery;
 		ipForwardStar = _ipForwardStar;
 		ipBackwardStar = _ipBackwardStar;
 		if (FAILED(hr = ipNetworkQuery->CreateForwardStarAdjacencies(&ipAdjacencies))) return;
 		if (FAILED(hr = ipNetworkQuery->CreateNetworkElement(esriNETEdge, &ipEdgeElement))) return;
+		if (FAILED(hr = ipForwardStar->get_BacktrackPolicy(&backtrack))) return;
 		ipCurrentEdge = ipEdgeElement;
+
+		// edge EIDs are dense so we can size the lookup table once and skip hashing altogether
+		if (FAILED(hr = ipNetworkQuery->get_ElementCount(esriNETEdge, &edgeCount))) return;
+		cacheIndex->assign(IndexOf(edgeCount + 1, esriNEDAlongDigitized), nullptr);
 	}
 
 	void InitSourceCache() const
@@ -329,8 +468,8 @@ public:
 		Clear();
 		if (IsSourceCache) ipNetworkQuery->ClearIDCache();
 		delete myTrafficModel;
-		delete cacheAlong;
-		delete cacheAgainst;
+		delete cacheIndex;
+		delete cacheList;
 	}
 
 	NAEdgeCache(const NAEdgeCache & that) = delete;
@@ -340,15 +479,27 @@ public:
 	NAEdgePtr New(INetworkEdgePtr edge);
 
 	INetworkQueryPtr GetNetworkQuery()  { return ipNetworkQuery;        }
-	NAEdgeTableItr AlongBegin()   const { return cacheAlong->begin();   }
-	NAEdgeTableItr AlongEnd()     const { return cacheAlong->end();     }
-	NAEdgeTableItr AgainstBegin() const { return cacheAgainst->begin(); }
-	NAEdgeTableItr AgainstEnd()   const { return cacheAgainst->end();   }
+	void SetGraph(std::shared_ptr<NetworkGraph> _graph) { graph = _graph; }
+	bool IsGraphLoaded()          const { return graph && graph->IsLoaded(); }
+	const NetworkGraph * GetGraph() const { return graph.get(); }
+	void SetHierarchy(std::shared_ptr<ContractionHierarchy> _hierarchy) { hierarchy = _hierarchy; }
+	bool IsHierarchyBuilt()       const { return hierarchy && hierarchy->IsBuilt(); }
+	const ContractionHierarchy * GetHierarchy() const { return hierarchy.get(); }
+	void SetParallelSearch(std::shared_ptr<DeltaStepping> _search) { parallelSearch = _search; }
+	bool IsParallelSearchReady()  const { return parallelSearch && IsGraphLoaded(); }
+	const DeltaStepping * GetParallelSearch() const { return parallelSearch.get(); }
+	std::shared_ptr<ThreadPool> GetThreadPool();
+	NAEdgeCacheItr Begin()        const { return cacheList->begin();  }
+	NAEdgeCacheItr End()          const { return cacheList->end();    }
 	double GetInitDelayPerPop()   const { return myTrafficModel->InitDelayCostPerPop;  }
 	NAEdgePtr Get(long eid, esriNetworkEdgeDirection dir) const;
-	size_t Size() const { return cacheAlong->size() + cacheAgainst->size(); }
+	NAEdgePtr GetTwin(NAEdgePtr edge) const;
+	size_t Size() const { return cacheList->size(); }
 	void Clear();
 	void CleanAllEdgesAndRelease(double minPop2Route, EvcSolverMethod solver);
-	double GetCacheHitPercentage() const { return myTrafficModel->GetCacheHitPercentage(); }
+	size_t CustomizeHierarchy(double minPop2Route, EvcSolverMethod solver);
+	size_t GetCleanGraphCosts(double minPop2Route, EvcSolverMethod solver, std::vector<double> & cost);
+	size_t QueryParallelSearch(double minPop2Route, EvcSolverMethod solver, const std::vector<std::pair<long, double>> & targets, std::vector<double> & dist,
+		std::vector<double> & cost, std::vector<GraphArc> * tree = nullptr);
 	HRESULT QueryAdjacencies(NAVertexPtr ToVertex, NAEdgePtr Edge, QueryDirection dir, ArrayList<NAEdgePtr> ** neighbors);
 };
@@ -13,6 +13,7 @@
 #include "NAVertex.h"
 #include "NAEdge.h"
 #include "Evacuee.h"
+#include "IndexedHeap.h"
 
 //******************************************************************************************/
 // NAVertex methods
@@ -21,12 +22,11 @@ void NAVertex::Clone(NAVertex * cpy)
 {
 	GVal = cpy->GVal;
 	GlobalPenaltyCost = cpy->GlobalPenaltyCost;
-	h = cpy->h;
+	hCache = cpy->hCache;
 	Junction = cpy->Junction;
 	BehindEdge = nullptr; // cpy->BehindEdge;
 	Previous = cpy->Previous;
 	EID = cpy->EID;
-	isShadowCopy = true;
 }
 
 NAVertex::NAVertex(void)
@@ -37,17 +37,15 @@ NAVertex::NAVertex(void)
 	Previous = nullptr;
 	GVal = 0.0;
 	GlobalPenaltyCost = 0.0;
-	h = nullptr;
-	isShadowCopy = true;
+	hCache = nullptr;
 }
 
 NAVertex::NAVertex(INetworkJunctionPtr junction, NAEdge * behindEdge)
 {
 	Previous = nullptr;
-	isShadowCopy = false;
 	GVal = 0.0;
 	GlobalPenaltyCost = 0.0;
-	h = new DEBUG_NEW_PLACEMENT MinimumArrayList<long, double>();
+	hCache = nullptr;
 	BehindEdge = behindEdge;
 
 	if (!FAILED(junction->get_EID(&EID)))
@@ -69,17 +67,129 @@ inline void NAVertex::SetBehindEdge(NAEdge * behindEdge)
 }
 
 void NAVertex::UpdateYourHeuristic() { UpdateHeuristic(BehindEdge ? BehindEdge->EID : -1, GVal); }
-void NAVertex::UpdateHeuristic(long edgeid, double hur) { h->InsertOrUpdate(edgeid, hur); }
 
-void NAVertexCache::UpdateHeuristicForOutsideVertices(double hur, bool goDeep)
+//******************************************************************************************/
+// NAVertexCache methods
+
+void NAVertexCache::Reserve(size_t junctionSlots, size_t edgeSlots)
+{
+	if (cacheIndex->size() < junctionSlots) cacheIndex->resize(junctionSlots, nullptr);
+	if (vertexH->size() < junctionSlots) vertexH->resize(junctionSlots);
+	if (edgeH->size() < edgeSlots * 2) edgeH->resize(edgeSlots * 2);
+}
+
+double NAVertexCache::GetH(long vertexEID, long edgeEID) const
 {
-	if (heuristicForOutsideVertices < hur)
+	if (edgeEID < 0) return heuristicForOutsideVertices;
+	size_t i = (size_t)edgeEID * 2;
+	if (i + 1 < edgeH->size())
+	{
+		if ((*edgeH)[i].Vertex != vertexEID) ++i;
+		if ((*edgeH)[i].Vertex == vertexEID) return (*edgeH)[i].Value;
+	}
+	throw std::out_of_range("no h-value for this vertex and edge");
+}
+
+// The h-value through an outside edge (edge id -1) is the global default so it is not stored per vertex.
+// The cached minimum is lowered directly and only rescanned when the slot holding it went up.
+void NAVertexCache::UpdateHeuristic(long vertexEID, long edgeEID, double hur)
+{
+	if (edgeEID < 0) return;
+	size_t i = (size_t)edgeEID * 2;
+	if (i + 1 >= edgeH->size()) edgeH->resize(max(i + 2, edgeH->size() * 2));
+
+	NAEdgeHeuristic * slot = &((*edgeH)[i]);
+	NAVertexHeuristic & v = (*vertexH)[vertexEID];
+	if (slot->Vertex != vertexEID && (slot[1].Vertex == vertexEID || slot->Vertex != -1)) ++slot;
+	_ASSERT_EXPR(slot->Vertex == vertexEID || slot->Vertex == -1, L"an edge cannot have more than two end junctions");
+
+	double oldValue = slot->Value;
+	if (slot->Vertex != vertexEID)
+	{
+		slot->Vertex = vertexEID;
+		slot->Next = v.First;
+		v.First = (long)(slot - &((*edgeH)[0]));
+		oldValue = CASPER_INFINITY;
+	}
+	slot->Value = hur;
+
+	if (hur <= v.MinH) v.MinH = hur;
+	else if (oldValue <= v.MinH)
 	{
-		heuristicForOutsideVertices = hur;
-		if (goDeep) for(NAVertexTableItr it = cache->begin(); it != cache->end(); it++) it->second->UpdateHeuristic(-1, hur);
+		v.MinH = CASPER_INFINITY;
+		for (long j = v.First; j != -1; j = (*edgeH)[j].Next) v.MinH = min(v.MinH, (*edgeH)[j].Value);
 	}
 }
 
+struct JunctionDistanceKey
+{
+	const std::vector<double> * dist;
+	JunctionDistanceKey(const std::vector<double> * _dist = nullptr) : dist(_dist) { }
+	inline double operator()(long junction) const { return (*dist)[junction]; }
+};
+
+struct JunctionIndex
+{
+	inline size_t operator()(long junction) const { return (size_t)junction; }
+};
+
+// Multi-source backward Dijkstra from all safe zones over the original (free-flow) edge costs of the preloaded graph.
+// Traffic can only slow an edge down, so the distance stays a lower bound of the CASPER cost to safety no matter how much
+// population is reserved. Every landmark bound of the same metric is below this exact distance, hence no other landmarks are needed.
+HRESULT NAVertexCache::LoadLowerBounds(std::shared_ptr<NAEdgeCache> ecache, const std::vector<long> & safeZoneJunctions)
+{
+	const NetworkGraph * graph = ecache->GetGraph();
+	std::vector<double> dist;
+	JunctionDistanceKey distKey(&dist);
+	QuaternaryHeap<long, JunctionDistanceKey, JunctionIndex> heap(distKey);
+	const GraphArc * first = nullptr, * last = nullptr;
+	NAEdgePtr edge = nullptr;
+	long junction, from, to;
+	double cost;
+	float capacity;
+
+	if (!graph || !graph->IsLoaded()) return E_FAIL;
+	dist.resize(max(vertexH->size(), graph->JunctionCount()), CASPER_INFINITY);
+	for (auto z : safeZoneJunctions)
+	{
+		if (z < 0 || (size_t)z >= dist.size() || dist[z] == 0.0) continue;
+		dist[z] = 0.0;
+		heap.Insert(z);
+	}
+
+	while (!heap.empty())
+	{
+		junction = heap.DeleteMin();
+		if (!graph->GetAdjacencies(junction, false, first, last)) continue;
+		for (; first != last; ++first)
+		{
+			// dynamic changes are applied to the cached edges so their cost is more recent than the graph
+			edge = ecache->Get(first->EID, (esriNetworkEdgeDirection)first->Dir);
+			if (edge) cost = edge->OriginalCost;
+			else if (!graph->GetEdge(first->EID, first->Dir, from, to, cost, capacity)) continue;
+			cost += dist[junction];
+			if (cost >= dist[first->Junction]) continue;
+			dist[first->Junction] = cost;
+			if (heap.IsVisited(first->Junction)) heap.UpdateKey(first->Junction);
+			else heap.Insert(first->Junction);
+		}
+	}
+
+	// junctions that can not reach any safe zone get no bound at all
+	Reserve(dist.size(), 0);
+	for (size_t i = 0; i < dist.size(); ++i) (*vertexH)[i].LowerBound = dist[i] < CASPER_INFINITY ? dist[i] : 0.0;
+	return S_OK;
+}
+
+// Takes the h-value of every junction from a contraction hierarchy sweep instead of the CARMA Dijkstra. The sweep covers the whole
+// graph so no junction is outside of the search and the outside default can not lower any of them.
+void NAVertexCache::LoadHierarchyHeuristic(const std::vector<double> & dist)
+{
+	Reserve(dist.size(), 0);
+	for (size_t i = 0; i < dist.size(); ++i) (*vertexH)[i].MinH = dist[i];
+	heuristicForOutsideVertices = CASPER_INFINITY;
+}
+
 NAVertexPtr NAVertexCache::New(INetworkJunctionPtr junction, INetworkQueryPtr ipNetworkQuery)
 {
 	NAVertexPtr n = nullptr;
@@ -87,9 +197,11 @@ NAVertexPtr NAVertexCache::New(INetworkJunctionPtr junction, INetworkQueryPtr ip
 	INetworkJunctionPtr junctionClone;
 	long JunctionEID;
 	if (FAILED(junction->get_EID(&JunctionEID))) return nullptr;
-	NAVertexTableItr it = cache->find(JunctionEID);
+	if (JunctionEID < 0) return nullptr;
+	if ((size_t)JunctionEID >= cacheIndex->size()) Reserve(max((size_t)JunctionEID + 1, cacheIndex->size() * 2), 0);
+	NAVertexPtr master = (*cacheIndex)[JunctionEID];
 
-	if (it == cache->end())
+	if (!master)
 	{
 		if (ipNetworkQuery)
 		{
@@ -102,12 +214,14 @@ NAVertexPtr NAVertexCache::New(INetworkJunctionPtr junction, INetworkQueryPtr ip
 			junctionClone = junction;
 		}
 		n = new DEBUG_NEW_PLACEMENT NAVertex(junctionClone, nullptr);
-		n->UpdateHeuristic(-1, heuristicForOutsideVertices);
-		cache->insert(NAVertexTablePair(n));
+		n->hCache = this;
+		(*cacheIndex)[JunctionEID] = n;
+		cacheList->push_back(n);
+		++masterCount;
 	}
 	else
 	{
-		n = NewFromBucket(it->second);
+		n = NewFromBucket(master);
 	}
 	return n;
 }
@@ -115,16 +229,20 @@ NAVertexPtr NAVertexCache::New(INetworkJunctionPtr junction, INetworkQueryPtr ip
 NAVertexPtr NAVertexCache::NewFromBucket(NAVertexPtr clone)
 {
 	NAVertex * n = nullptr;
-	if (currentBucketIndex >= NAVertexCache_BucketSize) currentBucket = nullptr;
-	if (!currentBucket)
+	if (currentBucketIndex >= NAVertexCache_BucketSize)
 	{
-		currentBucket = new DEBUG_NEW_PLACEMENT NAVertex[NAVertexCache_BucketSize];
+		++currentBucket;
 		currentBucketIndex = 0;
-		bucketCache->push_back(currentBucket);
+	}
+	if (currentBucket >= bucketCache->size())
+	{
+		bucketCache->push_back(new DEBUG_NEW_PLACEMENT NAVertex[NAVertexCache_BucketSize]);
+		++bucketAllocCount;
 	}
 
-	n = &(currentBucket[currentBucketIndex]);
+	n = &((*bucketCache)[currentBucket][currentBucketIndex]);
 	++currentBucketIndex;
+	++shadowCount;
 	n->Clone(clone);
 
 	return n;
@@ -139,44 +257,53 @@ NAVertexPtr NAVertexCache::Get(INetworkJunctionPtr junction)
 
 NAVertexPtr NAVertexCache::Get(long eid)
 {
-	NAVertexPtr n = nullptr;
-	NAVertexTableItr it = cache->find(eid);
-	if (it != cache->end()) n = it->second;
-	return n;
+	if (eid < 0 || (size_t)eid >= cacheIndex->size()) return nullptr;
+	return (*cacheIndex)[eid];
 }
 
 void NAVertexCache::Clear()
 {
 	CollectAndRelease();
-	for(NAVertexTableItr cit = cache->begin(); cit != cache->end(); cit++) delete cit->second;
-	cache->clear();
+	for (auto bucket : *bucketCache) delete [] bucket;
+	bucketCache->clear();
+	for(auto v : *cacheList) delete v;
+	std::fill(cacheIndex->begin(), cacheIndex->end(), nullptr);
+	std::fill(vertexH->begin(), vertexH->end(), NAVertexHeuristic());
+	std::fill(edgeH->begin(), edgeH->end(), NAEdgeHeuristic());
+	cacheList->clear();
+	heuristicForOutsideVertices = 0.0;
 }
 
 void NAVertexCache::PrintVertexHeuristicFeq()
 {
 	std::wostringstream os_;
-	size_t freq[20] = {0};
+	size_t freq[20] = {0}, count;
 
-	for(NAVertexTableItr cit = cache->begin(); cit != cache->end(); cit++) freq[cit->second->HCount()]++;
+	// one h-value per edge slot plus the outside default
+	for(auto v : *cacheList)
+	{
+		count = 1;
+		for (long j = (*vertexH)[v->EID].First; j != -1; j = (*edgeH)[j].Next) ++count;
+		freq[min(count, (size_t)19)]++;
+	}
 	os_ << "PrintVertexHeuristicFeq:" << std::endl;
 	for(size_t i = 0; i < 20; i++)	if (freq[i] > 0) os_ << i << '=' << freq[i] << std::endl;
 	OutputDebugStringW( os_.str().c_str() );
 }
 
+// Resets the arena after a search. Only the vertices handed out since the last reset are detached from their edges
+// and the blocks are kept so the next search reuses the same memory instead of allocating new ones.
 void NAVertexCache::CollectAndRelease()
 {
-	int count = 0;
-	NAVertexPtr temp = nullptr;
-	size_t j = 0;
-	for(std::vector<NAVertexPtr>::const_iterator i = bucketCache->begin(); i != bucketCache->end(); i++)
+	size_t used = 0, j = 0;
+	for (size_t i = 0; i < bucketCache->size() && i <= currentBucket; ++i)
 	{
-		temp = (*i);
-		for (j = 0; j < NAVertexCache_BucketSize; ++j) temp[j].SetBehindEdge(nullptr);
-		delete [] temp;
-		count++;
+		used = i < currentBucket ? NAVertexCache_BucketSize : currentBucketIndex;
+		for (j = 0; j < used; ++j) (*bucketCache)[i][j].SetBehindEdge(nullptr);
 	}
-	currentBucket = nullptr;
-	bucketCache->clear();
+	currentBucket = 0;
+	currentBucketIndex = 0;
+	++resetCount;
 }
 
 NAVertexPtr NAVertexCollector::New(INetworkJunctionPtr junction)
@@ -17,6 +17,8 @@
 
 class Evacuee;
 class NAEdge;
+class NAEdgeCache;
+class NAVertexCache;
 
 // The NAVertex class is what sits on top of the INetworkJunction interface and holds extra
 // information about each junction/vertex which are helpful for CASPER algorithm.
@@ -25,30 +27,34 @@ class NAEdge;
 // Edge: the previous edge leading to this vertex
 // Previous: the previous vertex leading to this vertex
 
-struct HValue
+// h-value of a junction through one of its edges. Every edge has two slots (EID * 2 and EID * 2 + 1), one per end
+// junction, and the slots of the same junction are chained together so its minimum can be recomputed.
+struct NAEdgeHeuristic
 {
-public:
-	double   Value;
-	long     EdgeID;
+	long   Vertex;
+	long   Next;
+	double Value;
 
-	HValue(long edgeID, double value)
-	{
-		EdgeID = edgeID;
-		Value = value;
-	}
+	NAEdgeHeuristic(void) : Vertex(-1), Next(-1), Value(CASPER_INFINITY) { }
+};
 
-	static inline bool LessThan(HValue & a, HValue & b)
-	{
-		return a.Value < b.Value;
-	}
+// cached minimum h-value of a junction, the head of its chain of edge slots, and its free-flow distance to the nearest safe zone
+struct NAVertexHeuristic
+{
+	double MinH;
+	double LowerBound;
+	long   First;
+
+	NAVertexHeuristic(void) : MinH(CASPER_INFINITY), LowerBound(0.0), First(-1) { }
 };
 
 class NAVertex
 {
 private:
 	NAEdge * BehindEdge;
-	MinimumArrayList<long, double> * h;
-	bool     isShadowCopy;
+	NAVertexCache * hCache; // owner of the h-values. null for vertices that are not made by a vertex cache
+
+	friend class NAVertexCache;
 
 public:
 	double GVal;
@@ -57,14 +63,12 @@ public:
 	NAVertex * Previous;
 	long EID;
 
-	double GetMinHOrZero() const { return h->GetMinValueOrDefault(0.0); }
-	double GetH(long eid) const { return h->GetByKey(eid); }
-	size_t HCount() const { return h->size(); }
+	inline double GetMinHOrZero() const;
+	inline double GetH(long eid) const;
 
 	inline void SetBehindEdge(NAEdge * behindEdge);
 	NAEdge * GetBehindEdge() { return BehindEdge; }
-	inline bool IsHEmpty()   const { return h->empty(); }
-	void UpdateHeuristic(long edgeid, double hur);
+	inline void UpdateHeuristic(long edgeid, double hur);
 	void UpdateYourHeuristic();
 
 	inline void Clone (NAVertex * cpy);
@@ -72,15 +76,10 @@ public:
 	NAVertex(const NAVertex& cpy) = delete;
 	NAVertex & operator=(const NAVertex &) = delete;
 	NAVertex(INetworkJunctionPtr junction, NAEdge * behindEdge);
-	virtual ~NAVertex(void) { if (!isShadowCopy) delete h; }
+	virtual ~NAVertex(void) { }
 };
 
 typedef NAVertex * NAVertexPtr;
-typedef std::unordered_map<long, NAVertexPtr> NAVertexTable;
-typedef std::unordered_map<long, NAVertexPtr>::_Pairib NAVertexTableInsertReturn;
-typedef std::unordered_map<long, NAVertexPtr>::const_iterator NAVertexTableItr;
-typedef std::pair<long, NAVertexPtr> _NAVertexTablePair;
-#define NAVertexTablePair(a) _NAVertexTablePair(a->EID, a)
 
 // This collection object has two jobs:
 // it makes sure that there exist only one copy of a vertex in it that is connected to each INetworkJunction.
@@ -94,11 +93,15 @@ typedef std::pair<long, NAVertexPtr> _NAVertexTablePair;
 class NAVertexCache
 {
 private:
-	NAVertexTable * cache;
-	std::vector<NAVertex *> * bucketCache;
-	NAVertex * currentBucket;
-	size_t currentBucketIndex;
-	double heuristicForOutsideVertices;
+	std::vector<NAVertexPtr> * cacheIndex; // dense lookup table indexed by junction EID
+	std::vector<NAVertexPtr> * cacheList;  // every master vertex in the order they were created
+	std::vector<NAVertex *> * bucketCache; // arena blocks for the search copies. kept between searches and only freed on Clear
+	std::vector<NAVertexHeuristic> * vertexH; // cached minimum h-value indexed by junction EID
+	std::vector<NAEdgeHeuristic> * edgeH;     // h-value slots indexed by edge EID * 2 + end
+	size_t currentBucket;                   // block that is currently handing out vertices
+	size_t currentBucketIndex;              // next unused vertex in that block
+	double heuristicForOutsideVertices; // h-value of every junction through edges outside of the CARMA search. applied when the minimum is read
+	size_t masterCount, shadowCount, bucketAllocCount, resetCount;
 
 public:
 	NAVertexCache(const NAVertexCache & that) = delete;
@@ -106,28 +109,53 @@ public:
 
 	NAVertexCache(void)
 	{
-		cache = new DEBUG_NEW_PLACEMENT std::unordered_map<long, NAVertexPtr>();
+		cacheIndex = new DEBUG_NEW_PLACEMENT std::vector<NAVertexPtr>();
+		cacheList = new DEBUG_NEW_PLACEMENT std::vector<NAVertexPtr>();
 		bucketCache = new DEBUG_NEW_PLACEMENT std::vector<NAVertex *>();
+		vertexH = new DEBUG_NEW_PLACEMENT std::vector<NAVertexHeuristic>();
+		edgeH = new DEBUG_NEW_PLACEMENT std::vector<NAEdgeHeuristic>();
 		heuristicForOutsideVertices = 0.0;
-		currentBucket = nullptr;
+		currentBucket = 0;
 		currentBucketIndex = 0;
+		masterCount = shadowCount = bucketAllocCount = resetCount = 0;
 	}
 
 	virtual ~NAVertexCache(void)
 	{
 		Clear();
-		delete cache;
+		delete cacheIndex;
+		delete cacheList;
 		delete bucketCache;
+		delete vertexH;
+		delete edgeH;
 	}
 
+	void Reserve(size_t junctionSlots, size_t edgeSlots);
 	void PrintVertexHeuristicFeq();
 	NAVertexPtr New(INetworkJunctionPtr junction, INetworkQueryPtr ipNetworkQuery = nullptr);
-	void UpdateHeuristicForOutsideVertices(double hur, bool goDeep);
+	void UpdateHeuristicForOutsideVertices(double hur) { heuristicForOutsideVertices = max(heuristicForOutsideVertices, hur); }
+	double GetH(long vertexEID, long edgeEID) const;
+	void UpdateHeuristic(long vertexEID, long edgeEID, double hur);
+	HRESULT LoadLowerBounds(std::shared_ptr<NAEdgeCache> ecache, const std::vector<long> & safeZoneJunctions);
+	void LoadHierarchyHeuristic(const std::vector<double> & dist);
+
+	// CARMA h-value, never below the free-flow lower bound (zero unless LoadLowerBounds was called)
+	inline double GetMinH(long vertexEID) const
+	{
+		const NAVertexHeuristic & v = (*vertexH)[vertexEID];
+		return max(min(v.MinH, heuristicForOutsideVertices), v.LowerBound);
+	}
 	NAVertexPtr Get(long eid);
 	NAVertexPtr Get(INetworkJunctionPtr junction);
 	NAVertexPtr NewFromBucket(NAVertexPtr clone);
 	void Clear();
 	void CollectAndRelease();
+
+	// allocation counters for the whole solve: master vertices, search copies, arena blocks allocated, and arena resets
+	size_t GetMasterCount()      const { return masterCount;      }
+	size_t GetShadowCount()      const { return shadowCount;      }
+	size_t GetBucketAllocCount() const { return bucketAllocCount; }
+	size_t GetResetCount()       const { return resetCount;       }
 };
 
 class NAVertexCollector
@@ -154,3 +182,7 @@ public:
 	size_t Size() { return cache->size(); }
 	void Clear();
 };
+
+double NAVertex::GetMinHOrZero() const { return hCache ? hCache->GetMinH(EID) : 0.0; }
+double NAVertex::GetH(long eid) const { return hCache->GetH(EID, eid); }
+void NAVertex::UpdateHeuristic(long edgeid, double hur) { if (hCache) hCache->UpdateHeuristic(EID, edgeid, hur); }
@@ -0,0 +1,137 @@
+// ===============================================================================================
+// Evacuation Solver: Network clustering of points implementation
+// Description: Junction hash and the bounded leader searches
+//
+// Copyright (C) 2014 Kaveh Shahabi
+// Distributed under the Apache Software License, Version 2.0. (See accompanying file LICENSE.txt)
+//
+// Author: Kaveh Shahabi
+// URL: http://github.com/spatial-computing/CASPER
+// ===============================================================================================
+
+#include "StdAfx.h"
+#include "NetworkClustering.h"
+
+// bounded free-flow Dijkstra from the leader. Every unassigned point hashed on a settled junction joins the group if
+// its own cost to that junction keeps the total within the threshold.
+void NetworkClustering::Grow(const NetworkGraph & graph, const std::vector<Start> & leaderStarts, size_t leader, double maxCost, std::vector<size_t> & leaders)
+{
+	typedef std::pair<double, long> Label;
+	std::priority_queue<Label, std::vector<Label>, std::greater<Label>> heap;
+	const GraphArc * first = nullptr, * last = nullptr;
+	long from, to;
+	double cost, d;
+	float capacity;
+
+	dist.clear();
+	for (const auto & s : leaderStarts)
+	{
+		if (s.Cost > maxCost) continue;
+		auto i = dist.find(s.Junction);
+		if (i != dist.end() && i->second <= s.Cost) continue;
+		dist[s.Junction] = s.Cost;
+		heap.push(Label(s.Cost, s.Junction));
+	}
+
+	while (!heap.empty())
+	{
+		Label top = heap.top();
+		heap.pop();
+		if (top.first > dist[top.second]) continue;
+		++settledCount;
+
+		auto b = buckets.find(top.second);
+		if (b != buckets.end())
+			for (const auto & m : b->second)
+				if (m.Point > leader && leaders[m.Point] == m.Point && top.first + m.Cost <= maxCost) leaders[m.Point] = leader;
+
+		if (!graph.GetAdjacencies(top.second, true, first, last) || !first) continue;
+		for (; first != last; ++first)
+		{
+			if (!graph.GetEdge(first->EID, first->Dir, from, to, cost, capacity) || cost < 0.0) continue;
+			d = top.first + cost;
+			if (d > maxCost) continue;
+			auto i = dist.find(first->Junction);
+			if (i != dist.end() && i->second <= d) continue;
+			dist[first->Junction] = d;
+			heap.push(Label(d, first->Junction));
+		}
+	}
+}
+
+size_t NetworkClustering::Cluster(const NetworkGraph & graph, const std::vector<std::vector<Start>> & starts, double maxCost, std::vector<size_t> & leaders)
+{
+	leaders.resize(starts.size());
+	for (size_t i = 0; i < starts.size(); ++i) leaders[i] = i;
+	groupCount = starts.size();
+	buckets.clear();
+	if (!(maxCost > 0.0)) return groupCount;
+
+	for (size_t i = 0; i < starts.size(); ++i)
+		for (const auto & s : starts[i])
+		{
+			Member m = { i, s.Cost };
+			if (s.Cost <= maxCost) buckets[s.Junction].push_back(m);
+		}
+
+	// a point that was taken never leads a group of its own, so each point is visited at most once as a leader
+	for (size_t i = 0; i < starts.size(); ++i) if (leaders[i] == i) Grow(graph, starts[i], i, maxCost, leaders);
+
+	groupCount = 0;
+	for (size_t i = 0; i < leaders.size(); ++i) if (leaders[i] == i) ++groupCount;
+	buckets.clear();
+	dist.clear();
+	return groupCount;
+}
+
+long NetworkClustering::JoinPath(const NetworkGraph & graph, const std::vector<Start> & starts, const std::unordered_set<long> & targets, std::vector<GraphArc> & arcs, size_t & start)
+{
+	typedef std::pair<double, long> Label;
+	std::priority_queue<Label, std::vector<Label>, std::greater<Label>> heap;
+	std::unordered_map<long, double> dist;
+	std::unordered_map<long, std::pair<long, GraphArc>> parent;  // tail junction and arc into each junction
+	std::unordered_map<long, size_t> origin;                     // start index of each start junction
+	const GraphArc * first = nullptr, * last = nullptr;
+	long from, to, j;
+	double cost, d;
+	float capacity;
+
+	arcs.clear();
+	for (size_t i = 0; i < starts.size(); ++i)
+	{
+		auto k = dist.find(starts[i].Junction);
+		if (k != dist.end() && k->second <= starts[i].Cost) continue;
+		dist[starts[i].Junction] = starts[i].Cost;
+		origin[starts[i].Junction] = i;
+		heap.push(Label(starts[i].Cost, starts[i].Junction));
+	}
+
+	while (!heap.empty())
+	{
+		Label top = heap.top();
+		heap.pop();
+		if (top.first > dist[top.second]) continue;
+
+		if (targets.find(top.second) != targets.end())
+		{
+			// a start junction that was reached cheaper from another start has a parent and is not where the path leaves from
+			for (j = top.second; parent.find(j) != parent.end(); j = parent[j].first) arcs.push_back(parent[j].second);
+			std::reverse(arcs.begin(), arcs.end());
+			start = origin[j];
+			return top.second;
+		}
+
+		if (!graph.GetAdjacencies(top.second, true, first, last) || !first) continue;
+		for (; first != last; ++first)
+		{
+			if (!graph.GetEdge(first->EID, first->Dir, from, to, cost, capacity) || cost < 0.0 || cost >= CASPER_INFINITY) continue;
+			d = top.first + cost;
+			auto i = dist.find(first->Junction);
+			if (i != dist.end() && i->second <= d) continue;
+			dist[first->Junction] = d;
+			parent[first->Junction] = std::pair<long, GraphArc>(top.second, *first);
+			heap.push(Label(d, first->Junction));
+		}
+	}
+	return -1;
+}
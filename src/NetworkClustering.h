@@ -0,0 +1,64 @@
+// ===============================================================================================
+// Evacuation Solver: Network clustering of points
+// Description: Groups points of the network whose free-flow network distance is within a threshold.
+// The points are hashed by the junctions they can reach so a bounded search from a group leader
+// only looks at the buckets of the junctions it settles. Like NetworkGraph.h, this header does not
+// depend on ArcObjects.
+//
+// Copyright (C) 2014 Kaveh Shahabi
+// Distributed under the Apache Software License, Version 2.0. (See accompanying file LICENSE.txt)
+//
+// Author: Kaveh Shahabi
+// URL: http://github.com/spatial-computing/CASPER
+// ===============================================================================================
+
+#pragma once
+
+#include <vector>
+#include <unordered_map>
+#include <unordered_set>
+#include <queue>
+#include <functional>
+#include "NetworkGraph.h"
+
+class NetworkClustering
+{
+public:
+	struct Start
+	{
+		long   Junction;
+		double Cost; // cost from the point to the junction
+	};
+
+private:
+	struct Member
+	{
+		size_t Point;
+		double Cost;
+	};
+
+	std::unordered_map<long, std::vector<Member>> buckets; // spatial hash of the points over network junctions
+	std::unordered_map<long, double>              dist;
+	size_t                                         groupCount;
+	size_t                                         settledCount;
+
+	void Grow(const NetworkGraph & graph, const std::vector<Start> & leaderStarts, size_t leader, double maxCost, std::vector<size_t> & leaders);
+
+public:
+	NetworkClustering(void) : groupCount(0), settledCount(0) { }
+	virtual ~NetworkClustering(void) { }
+	NetworkClustering(const NetworkClustering & that) = delete;
+	NetworkClustering & operator=(const NetworkClustering &) = delete;
+
+	size_t GroupCount()   const { return groupCount;   }
+	size_t SettledCount() const { return settledCount; } // junctions settled by all the leader searches
+
+	// 'starts[i]' lists the junctions point i sits on. Points are visited in order and every point not yet taken becomes a leader
+	// and takes every point that can meet it at a common junction within 'maxCost' in total. 'leaders[i]' is the leader index of
+	// point i (i itself for a leader). Returns the number of groups.
+	size_t Cluster(const NetworkGraph & graph, const std::vector<std::vector<Start>> & starts, double maxCost, std::vector<size_t> & leaders);
+
+	// Free-flow shortest path from any of the 'starts' of one point to the nearest junction in 'targets'. 'arcs' gets the arcs of the
+	// path in travel order and 'start' the index of the start it leaves from. Returns the junction it reached or -1 if there is none.
+	static long JoinPath(const NetworkGraph & graph, const std::vector<Start> & starts, const std::unordered_set<long> & targets, std::vector<GraphArc> & arcs, size_t & start);
+};
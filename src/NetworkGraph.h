@@ -0,0 +1,289 @@
+// ===============================================================================================
+// Evacuation Solver: Preloaded road network graph
+// Description: Compressed-sparse-row (CSR) adjacency arrays of the whole road network so that
+// an adjacency query becomes an array slice instead of a forward star COM call. This header
+// intentionally does not depend on ArcObjects; the network dataset loader lives with NAEdgeCache.
+//
+// Copyright (C) 2014 Kaveh Shahabi
+// Distributed under the Apache Software License, Version 2.0. (See accompanying file LICENSE.txt)
+//
+// Author: Kaveh Shahabi
+// URL: http://github.com/spatial-computing/CASPER
+// ===============================================================================================
+
+#pragma once
+
+#include <vector>
+#include <string>
+#include <fstream>
+#include <sstream>
+#include <algorithm>
+
+// One directed arc inside a junction adjacency slice. Dir uses the same values as esriNetworkEdgeDirection
+// (1 = along digitized, 2 = against digitized) so it can be casted back without any lookup.
+struct GraphArc
+{
+	long          EID;
+	long          Junction; // the junction on the other side of the arc: to-junction in forward slices, from-junction in backward slices
+	unsigned char Dir;
+};
+
+// Read-only view of the road network topology and the initial cost/capacity of each directed edge.
+// The solver only needs adjacency slices and edge attributes, so any graph source (network dataset,
+// binary snapshot, plain text file) can stand behind this interface.
+class NetworkGraph
+{
+public:
+	virtual ~NetworkGraph(void) { }
+
+	virtual bool   IsLoaded()      const = 0;
+	virtual size_t JunctionCount() const = 0;
+	virtual size_t EdgeCount()     const = 0;
+
+	// forward slice lists the directed edges leaving the junction and backward slice lists the directed edges entering it
+	virtual bool GetAdjacencies(long junctionEID, bool forward, const GraphArc * & first, const GraphArc * & last) const = 0;
+	virtual bool GetEdge(long eid, unsigned char dir, long & fromJunction, long & toJunction, double & cost, float & capacity) const = 0;
+
+	// source feature of the edge and the portion of it covered by this edge. Not every graph source knows about it.
+	virtual bool GetEdgeSource(long eid, unsigned char dir, long & sourceID, long & sourceOID, double & fromPosition, double & toPosition) const = 0;
+};
+
+// In-memory CSR implementation of the graph. Directed edge attributes are kept in flat arrays indexed by EID * 2 + Dir - 1.
+// All queries go through raw array views so that a derived class can point them to memory it does not own (e.g. a mapped file).
+class CSRNetworkGraph : public NetworkGraph
+{
+public:
+	struct EdgeRecord
+	{
+		long          EID;
+		unsigned char Dir;
+		long          FromJunction;
+		long          ToJunction;
+		double        Cost;
+		float         Capacity;
+		long          SourceID;
+		long          SourceOID;
+		double        FromPosition;
+		double        ToPosition;
+	};
+
+protected:
+	// array views
+	const unsigned int * forwardOffset;
+	const unsigned int * backwardOffset;
+	const GraphArc     * forwardArcs;
+	const GraphArc     * backwardArcs;
+	const long         * edgeFrom;
+	const long         * edgeTo;
+	const double       * edgeCost;
+	const float        * edgeCapacity;
+	const long         * edgeSourceID;
+	const long         * edgeSourceOID;
+	const double       * edgeFromPosition;
+	const double       * edgeToPosition;
+	size_t               junctionSlots;
+	size_t               edgeSlots;
+	size_t               arcCount;
+	size_t               directedEdgeCount;
+	bool                 loaded;
+
+	static inline size_t EdgeIndex(long eid, unsigned char dir) { return (size_t)eid * 2 + dir - 1; }
+
+	void ResetViews()
+	{
+		forwardOffset = backwardOffset = nullptr;
+		forwardArcs = backwardArcs = nullptr;
+		edgeFrom = edgeTo = edgeSourceID = edgeSourceOID = nullptr;
+		edgeCost = edgeFromPosition = edgeToPosition = nullptr;
+		edgeCapacity = nullptr;
+		junctionSlots = edgeSlots = arcCount = directedEdgeCount = 0;
+		loaded = false;
+	}
+
+private:
+	// owned storage when the graph is built in memory
+	std::vector<unsigned int> ownForwardOffset, ownBackwardOffset;
+	std::vector<GraphArc>     ownForwardArcs, ownBackwardArcs;
+	std::vector<long>         ownEdgeFrom, ownEdgeTo, ownEdgeSourceID, ownEdgeSourceOID;
+	std::vector<double>       ownEdgeCost, ownEdgeFromPosition, ownEdgeToPosition;
+	std::vector<float>        ownEdgeCapacity;
+
+	static void BuildSlices(const std::vector<EdgeRecord> & edges, size_t slots, bool forward, std::vector<unsigned int> & offset, std::vector<GraphArc> & arcs)
+	{
+		offset.assign(slots + 1, 0);
+		arcs.resize(edges.size());
+		for (const auto & e : edges) ++offset[(forward ? e.FromJunction : e.ToJunction) + 1];
+		for (size_t j = 1; j <= slots; ++j) offset[j] += offset[j - 1];
+
+		std::vector<unsigned int> fill(offset.begin(), offset.end() - 1);
+		for (const auto & e : edges)
+		{
+			GraphArc & arc = arcs[fill[forward ? e.FromJunction : e.ToJunction]++];
+			arc.EID = e.EID;
+			arc.Dir = e.Dir;
+			arc.Junction = forward ? e.ToJunction : e.FromJunction;
+		}
+	}
+
+public:
+	CSRNetworkGraph(void) { ResetViews(); }
+	virtual ~CSRNetworkGraph(void) { Clear(); }
+
+	CSRNetworkGraph(const CSRNetworkGraph & that) = delete;
+	CSRNetworkGraph & operator=(const CSRNetworkGraph &) = delete;
+
+	bool   IsLoaded()      const { return loaded; }
+	size_t JunctionCount() const { return junctionSlots; }
+	size_t EdgeCount()     const { return directedEdgeCount; }
+	size_t EdgeSlotCount() const { return edgeSlots; }
+	size_t ArcCount()      const { return arcCount; }
+
+	virtual void Clear()
+	{
+		ownForwardOffset.clear();  ownForwardArcs.clear();
+		ownBackwardOffset.clear(); ownBackwardArcs.clear();
+		ownEdgeFrom.clear(); ownEdgeTo.clear(); ownEdgeCost.clear(); ownEdgeCapacity.clear();
+		ownEdgeSourceID.clear(); ownEdgeSourceOID.clear(); ownEdgeFromPosition.clear(); ownEdgeToPosition.clear();
+		ResetViews();
+	}
+
+	// Builds both forward and backward slices with a counting sort over the junction IDs. Records with
+	// invalid IDs are dropped. The last record wins if the same directed edge shows up more than once.
+	// 'junctionCount' is the highest junction EID of the source so isolated junctions still get an (empty) slice.
+	void Build(const std::vector<EdgeRecord> & records, size_t junctionCount = 0)
+	{
+		std::vector<EdgeRecord> edges;
+		long maxJunction = -1, maxEID = -1;
+		size_t count = 0;
+
+		Clear();
+		edges.reserve(records.size());
+		for (const auto & r : records)
+		{
+			if (r.EID < 0 || r.FromJunction < 0 || r.ToJunction < 0 || (r.Dir != 1 && r.Dir != 2)) continue;
+			edges.push_back(r);
+			maxJunction = (std::max)(maxJunction, (std::max)(r.FromJunction, r.ToJunction));
+			maxEID = (std::max)(maxEID, r.EID);
+		}
+
+		size_t slots = (std::max)((size_t)(maxJunction + 1), junctionCount + 1);
+		size_t eslots = EdgeIndex(maxEID + 1, 1);
+		ownEdgeFrom.assign(eslots, -1);
+		ownEdgeTo.assign(eslots, -1);
+		ownEdgeCost.assign(eslots, 0.0);
+		ownEdgeCapacity.assign(eslots, 0.0f);
+		ownEdgeSourceID.assign(eslots, -1);
+		ownEdgeSourceOID.assign(eslots, -1);
+		ownEdgeFromPosition.assign(eslots, 0.0);
+		ownEdgeToPosition.assign(eslots, 1.0);
+
+		for (const auto & e : edges)
+		{
+			size_t i = EdgeIndex(e.EID, e.Dir);
+			if (ownEdgeFrom[i] < 0) ++count;
+			ownEdgeFrom[i] = e.FromJunction;
+			ownEdgeTo[i] = e.ToJunction;
+			ownEdgeCost[i] = e.Cost;
+			ownEdgeCapacity[i] = e.Capacity;
+			ownEdgeSourceID[i] = e.SourceID;
+			ownEdgeSourceOID[i] = e.SourceOID;
+			ownEdgeFromPosition[i] = e.FromPosition;
+			ownEdgeToPosition[i] = e.ToPosition;
+		}
+
+		BuildSlices(edges, slots, true,  ownForwardOffset,  ownForwardArcs);
+		BuildSlices(edges, slots, false, ownBackwardOffset, ownBackwardArcs);
+
+		forwardOffset    = ownForwardOffset.data();
+		backwardOffset   = ownBackwardOffset.data();
+		forwardArcs      = ownForwardArcs.data();
+		backwardArcs     = ownBackwardArcs.data();
+		edgeFrom         = ownEdgeFrom.data();
+		edgeTo           = ownEdgeTo.data();
+		edgeCost         = ownEdgeCost.data();
+		edgeCapacity     = ownEdgeCapacity.data();
+		edgeSourceID     = ownEdgeSourceID.data();
+		edgeSourceOID    = ownEdgeSourceOID.data();
+		edgeFromPosition = ownEdgeFromPosition.data();
+		edgeToPosition   = ownEdgeToPosition.data();
+		junctionSlots    = slots;
+		edgeSlots        = eslots;
+		arcCount         = edges.size();
+		directedEdgeCount = count;
+		loaded = true;
+	}
+
+	bool GetAdjacencies(long junctionEID, bool forward, const GraphArc * & first, const GraphArc * & last) const
+	{
+		const unsigned int * offset = forward ? forwardOffset : backwardOffset;
+		const GraphArc * arcs = forward ? forwardArcs : backwardArcs;
+		first = last = nullptr;
+		if (junctionEID < 0) return false;
+
+		// a junction past the last slot has no edge in the graph, so it is just a junction with no neighbors
+		if ((size_t)junctionEID >= junctionSlots || offset[junctionEID] == offset[junctionEID + 1]) return true;
+		first = arcs + offset[junctionEID];
+		last  = arcs + offset[junctionEID + 1];
+		return true;
+	}
+
+	bool GetEdge(long eid, unsigned char dir, long & fromJunction, long & toJunction, double & cost, float & capacity) const
+	{
+		if (eid < 0 || (dir != 1 && dir != 2)) return false;
+		size_t i = EdgeIndex(eid, dir);
+		if (i >= edgeSlots || edgeFrom[i] < 0) return false;
+		fromJunction = edgeFrom[i];
+		toJunction = edgeTo[i];
+		cost = edgeCost[i];
+		capacity = edgeCapacity[i];
+		return true;
+	}
+
+	bool GetEdgeSource(long eid, unsigned char dir, long & sourceID, long & sourceOID, double & fromPosition, double & toPosition) const
+	{
+		if (eid < 0 || (dir != 1 && dir != 2)) return false;
+		size_t i = EdgeIndex(eid, dir);
+		if (i >= edgeSlots || edgeFrom[i] < 0 || edgeSourceID[i] < 0) return false;
+		sourceID = edgeSourceID[i];
+		sourceOID = edgeSourceOID[i];
+		fromPosition = edgeFromPosition[i];
+		toPosition = edgeToPosition[i];
+		return true;
+	}
+
+	friend class MappedNetworkGraph;
+};
+
+// Loads the graph from a plain text file. Each non-empty line that does not start with '#' is one directed edge:
+// EID Dir FromJunction ToJunction Cost Capacity [SourceID SourceOID FromPosition ToPosition]
+// This is the loader used to run the graph code outside of ArcGIS (e.g. unit tests and profiling on other platforms).
+class FileNetworkGraph : public CSRNetworkGraph
+{
+public:
+	bool Load(const std::string & path)
+	{
+		std::ifstream file(path);
+		std::vector<EdgeRecord> records;
+		std::string line;
+		EdgeRecord r;
+		int dir;
+
+		if (!file.is_open()) return false;
+		while (std::getline(file, line))
+		{
+			if (line.empty() || line[0] == '#') continue;
+			std::istringstream row(line);
+			if (!(row >> r.EID >> dir >> r.FromJunction >> r.ToJunction >> r.Cost >> r.Capacity)) return false;
+			if (!(row >> r.SourceID >> r.SourceOID >> r.FromPosition >> r.ToPosition))
+			{
+				r.SourceID = r.SourceOID = -1;
+				r.FromPosition = 0.0;
+				r.ToPosition = 1.0;
+			}
+			r.Dir = (unsigned char)dir;
+			records.push_back(r);
+		}
+		Build(records);
+		return true;
+	}
+};
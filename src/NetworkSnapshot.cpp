@@ -0,0 +1,194 @@
+// ===============================================================================================
+// Evacuation Solver: Network snapshot implementation
+// Description: Writes the preloaded network graph to disk and maps it back read-only
+//
+// Copyright (C) 2014 Kaveh Shahabi
+// Distributed under the Apache Software License, Version 2.0. (See accompanying file LICENSE.txt)
+//
+// Author: Kaveh Shahabi
+// URL: http://github.com/spatial-computing/CASPER
+// ===============================================================================================
+
+#include "StdAfx.h"
+#include "NetworkSnapshot.h"
+
+#define SNAPSHOT_BLOCKS 12
+
+// computes where each array starts in the file and returns the total file size
+static size_t SnapshotLayout(const NetworkSnapshotHeader & header, size_t offsets[SNAPSHOT_BLOCKS])
+{
+	const size_t J = (size_t)header.JunctionSlots + 1, A = header.ArcCount, E = header.EdgeSlots;
+	const size_t sizes[SNAPSHOT_BLOCKS] =
+	{
+		J * sizeof(unsigned int), J * sizeof(unsigned int), A * sizeof(GraphArc), A * sizeof(GraphArc),
+		E * sizeof(long), E * sizeof(long), E * sizeof(double), E * sizeof(float),
+		E * sizeof(long), E * sizeof(long), E * sizeof(double), E * sizeof(double)
+	};
+	size_t offset = (sizeof(NetworkSnapshotHeader) + 7) & ~((size_t)7);
+	offset = (offset + header.KeyLength * sizeof(wchar_t) + 7) & ~((size_t)7);
+	for (size_t i = 0; i < SNAPSHOT_BLOCKS; ++i)
+	{
+		offsets[i] = offset;
+		offset = (offset + sizes[i] + 7) & ~((size_t)7);
+	}
+	return offset;
+}
+
+void MappedNetworkGraph::Clear()
+{
+	CSRNetworkGraph::Clear();
+	if (view) UnmapViewOfFile(view);
+	if (hMapping) CloseHandle(hMapping);
+	if (hFile != INVALID_HANDLE_VALUE) CloseHandle(hFile);
+	view = nullptr;
+	hMapping = nullptr;
+	hFile = INVALID_HANDLE_VALUE;
+}
+
+HRESULT MappedNetworkGraph::Open(const std::wstring & path, const std::wstring & key)
+{
+	LARGE_INTEGER fileSize;
+	size_t offsets[SNAPSHOT_BLOCKS];
+	const NetworkSnapshotHeader * header = nullptr;
+
+	Clear();
+	hFile = CreateFileW(path.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL | FILE_FLAG_RANDOM_ACCESS, nullptr);
+	if (hFile == INVALID_HANDLE_VALUE) return S_FALSE;
+	if (!GetFileSizeEx(hFile, &fileSize) || fileSize.QuadPart < (LONGLONG)sizeof(NetworkSnapshotHeader)) goto STALE_SNAPSHOT;
+	if (!(hMapping = CreateFileMappingW(hFile, nullptr, PAGE_READONLY, 0, 0, nullptr))) goto STALE_SNAPSHOT;
+	if (!(view = (const char *)MapViewOfFile(hMapping, FILE_MAP_READ, 0, 0, 0))) goto STALE_SNAPSHOT;
+
+	// check version, key, and size before trusting any of the arrays
+	header = (const NetworkSnapshotHeader *)view;
+	if (memcmp(header->Magic, "CASPERNG", 8) != 0 || header->Version != SnapshotVersion || header->KeyLength != key.size()) goto STALE_SNAPSHOT;
+	if (wmemcmp((const wchar_t *)(view + Align(sizeof(NetworkSnapshotHeader))), key.c_str(), key.size()) != 0) goto STALE_SNAPSHOT;
+	if ((LONGLONG)SnapshotLayout(*header, offsets) != fileSize.QuadPart) goto STALE_SNAPSHOT;
+
+	forwardOffset     = (const unsigned int *)(view + offsets[0]);
+	backwardOffset    = (const unsigned int *)(view + offsets[1]);
+	forwardArcs       = (const GraphArc     *)(view + offsets[2]);
+	backwardArcs      = (const GraphArc     *)(view + offsets[3]);
+	edgeFrom          = (const long         *)(view + offsets[4]);
+	edgeTo            = (const long         *)(view + offsets[5]);
+	edgeCost          = (const double       *)(view + offsets[6]);
+	edgeCapacity      = (const float        *)(view + offsets[7]);
+	edgeSourceID      = (const long         *)(view + offsets[8]);
+	edgeSourceOID     = (const long         *)(view + offsets[9]);
+	edgeFromPosition  = (const double       *)(view + offsets[10]);
+	edgeToPosition    = (const double       *)(view + offsets[11]);
+	junctionSlots     = header->JunctionSlots;
+	edgeSlots         = header->EdgeSlots;
+	arcCount          = header->ArcCount;
+	directedEdgeCount = header->DirectedEdgeCount;
+	loaded = true;
+	return S_OK;
+
+STALE_SNAPSHOT:
+	Clear();
+	return S_FALSE;
+}
+
+HRESULT MappedNetworkGraph::Write(const std::wstring & path, const std::wstring & key, const CSRNetworkGraph & graph)
+{
+	NetworkSnapshotHeader header;
+	size_t offsets[SNAPSHOT_BLOCKS], total, J, A, E;
+	std::wstring tempPath = path + L".tmp";
+	const char zeros[8] = { 0 };
+
+	if (!graph.IsLoaded()) return E_INVALIDARG;
+	J = graph.junctionSlots + 1;
+	A = graph.arcCount;
+	E = graph.edgeSlots;
+
+	memcpy(header.Magic, "CASPERNG", 8);
+	header.Version = SnapshotVersion;
+	header.KeyLength = (unsigned int)key.size();
+	header.JunctionSlots = (unsigned int)graph.junctionSlots;
+	header.EdgeSlots = (unsigned int)graph.edgeSlots;
+	header.ArcCount = (unsigned int)graph.arcCount;
+	header.DirectedEdgeCount = (unsigned int)graph.directedEdgeCount;
+	total = SnapshotLayout(header, offsets);
+
+	const std::pair<const void *, size_t> blocks[SNAPSHOT_BLOCKS] =
+	{
+		std::make_pair(graph.forwardOffset, J * sizeof(unsigned int)), std::make_pair(graph.backwardOffset, J * sizeof(unsigned int)),
+		std::make_pair(graph.forwardArcs, A * sizeof(GraphArc)),       std::make_pair(graph.backwardArcs, A * sizeof(GraphArc)),
+		std::make_pair(graph.edgeFrom, E * sizeof(long)),              std::make_pair(graph.edgeTo, E * sizeof(long)),
+		std::make_pair(graph.edgeCost, E * sizeof(double)),            std::make_pair(graph.edgeCapacity, E * sizeof(float)),
+		std::make_pair(graph.edgeSourceID, E * sizeof(long)),          std::make_pair(graph.edgeSourceOID, E * sizeof(long)),
+		std::make_pair(graph.edgeFromPosition, E * sizeof(double)),    std::make_pair(graph.edgeToPosition, E * sizeof(double))
+	};
+
+	// write to a temp file first and then swap it in, so a concurrent solve never maps a half written snapshot
+	std::ofstream f(tempPath, std::ios_base::out | std::ios_base::binary | std::ios_base::trunc);
+	if (!f.is_open()) return E_FAIL;
+	f.write((const char *)&header, sizeof(header));
+	f.write(zeros, Align(sizeof(header)) - sizeof(header));
+	f.write((const char *)key.c_str(), key.size() * sizeof(wchar_t));
+	for (size_t i = 0; i < SNAPSHOT_BLOCKS; ++i)
+	{
+		f.write(zeros, offsets[i] - (size_t)f.tellp());
+		f.write((const char *)blocks[i].first, blocks[i].second);
+	}
+	f.write(zeros, total - (size_t)f.tellp());
+	f.close();
+	if (f.fail()) { DeleteFileW(tempPath.c_str()); return E_FAIL; }
+
+	if (!MoveFileExW(tempPath.c_str(), path.c_str(), MOVEFILE_REPLACE_EXISTING))
+	{
+		DeleteFileW(tempPath.c_str());
+		return HRESULT_FROM_WIN32(GetLastError());
+	}
+	return S_OK;
+}
+
+// The key identifies the network dataset (workspace path, name, element counts, last write time of the workspace files)
+// and every setting that is baked into the graph: cost/capacity attributes and the restriction attributes in use.
+HRESULT MappedNetworkGraph::BuildKey(INetworkDatasetPtr ipNetworkDataset, long capacityAttribID, long costAttribID, const std::vector<INetworkAttribute2Ptr> & restrictions, std::wstring & key)
+{
+	HRESULT hr = S_OK;
+	IDatasetPtr ipDataset(ipNetworkDataset);
+	INetworkQueryPtr ipNetworkQuery(ipNetworkDataset);
+	IWorkspacePtr ipWorkspace;
+	ATL::CComBSTR datasetName, workspacePath, restrictionName;
+	long junctionCount = 0, edgeCount = 0;
+	ULONGLONG lastWrite = 0;
+	WIN32_FIND_DATAW findData;
+	HANDLE hFind;
+	std::wostringstream os;
+
+	if (!ipDataset || !ipNetworkQuery) return E_NOINTERFACE;
+	if (FAILED(hr = ipDataset->get_Name(&datasetName))) return hr;
+	if (FAILED(hr = ipDataset->get_Workspace(&ipWorkspace))) return hr;
+	if (FAILED(hr = ipWorkspace->get_PathName(&workspacePath))) return hr;
+	if (FAILED(hr = ipNetworkQuery->get_ElementCount(esriNETJunction, &junctionCount))) return hr;
+	if (FAILED(hr = ipNetworkQuery->get_ElementCount(esriNETEdge, &edgeCount))) return hr;
+
+	// rebuilding the network touches the files inside a file-based workspace
+	std::wstring pattern = std::wstring(workspacePath) + L"\\*";
+	if ((hFind = FindFirstFileW(pattern.c_str(), &findData)) != INVALID_HANDLE_VALUE)
+	{
+		do lastWrite = max(lastWrite, ((ULONGLONG)findData.ftLastWriteTime.dwHighDateTime << 32) | findData.ftLastWriteTime.dwLowDateTime);
+		while (FindNextFileW(hFind, &findData));
+		FindClose(hFind);
+	}
+
+	os << (LPCWSTR)workspacePath << L'|' << (LPCWSTR)datasetName << L'|' << junctionCount << L'|' << edgeCount << L'|' << lastWrite << L'|' << capacityAttribID << L'|' << costAttribID;
+	for (const auto & r : restrictions)
+	{
+		restrictionName.Empty();
+		if (FAILED(hr = r->get_Name(&restrictionName))) return hr;
+		os << L'|' << (LPCWSTR)restrictionName;
+	}
+	key = os.str();
+	return hr;
+}
+
+std::wstring MappedNetworkGraph::GetSnapshotPath(const std::wstring & key)
+{
+	WCHAR tempFolder[MAX_PATH + 1] = { 0 };
+	std::wostringstream os;
+	GetTempPathW(MAX_PATH, tempFolder);
+	os << tempFolder << L"CASPER_" << std::hex << std::hash<std::wstring>()(key) << L".graph";
+	return os.str();
+}
@@ -0,0 +1,56 @@
+// ===============================================================================================
+// Evacuation Solver: Network snapshot
+// Description: Versioned binary copy of the preloaded network graph on disk. The file is mapped
+// read-only into memory so repeated solves on the same network skip the forward star walk and
+// attribute evaluation altogether.
+//
+// Copyright (C) 2014 Kaveh Shahabi
+// Distributed under the Apache Software License, Version 2.0. (See accompanying file LICENSE.txt)
+//
+// Author: Kaveh Shahabi
+// URL: http://github.com/spatial-computing/CASPER
+// ===============================================================================================
+
+#pragma once
+
+#include "StdAfx.h"
+#include "NetworkGraph.h"
+
+// File layout: header, key string (wide chars), then the graph arrays in a fixed order. Every block starts at an 8-byte boundary.
+struct NetworkSnapshotHeader
+{
+	char         Magic[8];
+	unsigned int Version;
+	unsigned int KeyLength;
+	unsigned int JunctionSlots;
+	unsigned int EdgeSlots;
+	unsigned int ArcCount;
+	unsigned int DirectedEdgeCount;
+};
+
+class MappedNetworkGraph : public CSRNetworkGraph
+{
+private:
+	HANDLE       hFile;
+	HANDLE       hMapping;
+	const char * view;
+
+	static const unsigned int SnapshotVersion = 1;
+	static size_t Align(size_t offset) { return (offset + 7) & ~((size_t)7); }
+
+public:
+	MappedNetworkGraph(void) : hFile(INVALID_HANDLE_VALUE), hMapping(nullptr), view(nullptr) { }
+	virtual ~MappedNetworkGraph(void) { Clear(); }
+
+	MappedNetworkGraph(const MappedNetworkGraph & that) = delete;
+	MappedNetworkGraph & operator=(const MappedNetworkGraph &) = delete;
+
+	void Clear();
+
+	// maps the snapshot file and checks that it belongs to the same network and settings. returns S_FALSE if the file is missing or stale.
+	HRESULT Open(const std::wstring & path, const std::wstring & key);
+
+	static HRESULT Write(const std::wstring & path, const std::wstring & key, const CSRNetworkGraph & graph);
+	static HRESULT BuildKey(INetworkDatasetPtr ipNetworkDataset, long capacityAttribID, long costAttribID, const std::vector<INetworkAttribute2Ptr> & restrictions, std::wstring & key);
+	static std::wstring GetSnapshotPath(const std::wstring & key);
+};
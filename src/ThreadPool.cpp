@@ -0,0 +1,85 @@
+// ===============================================================================================
+// Evacuation Solver: Thread pool implementation
+// Description: Worker loop and the two ways of running a job on the pool
+//
+// Copyright (C) 2014 Kaveh Shahabi
+// Distributed under the Apache Software License, Version 2.0. (See accompanying file LICENSE.txt)
+//
+// Author: Kaveh Shahabi
+// URL: http://github.com/spatial-computing/CASPER
+// ===============================================================================================
+
+#include "StdAfx.h"
+#include "ThreadPool.h"
+
+ThreadPool::ThreadPool(unsigned int threads) : task(nullptr), generation(0), pending(0), stopping(false)
+{
+	if (threads == 0) threads = (std::max)(std::thread::hardware_concurrency(), 1u);
+	for (unsigned int id = 1; id < threads; ++id) workers.push_back(std::thread(&ThreadPool::WorkerLoop, this, id));
+}
+
+ThreadPool::~ThreadPool(void)
+{
+	{
+		std::lock_guard<std::mutex> guard(poolLock);
+		stopping = true;
+	}
+	wake.notify_all();
+	for (auto & w : workers) w.join();
+}
+
+void ThreadPool::WorkerLoop(unsigned int id)
+{
+	unsigned int seen = 0;
+	const std::function<void(unsigned int)> * job = nullptr;
+
+	while (true)
+	{
+		{
+			std::unique_lock<std::mutex> guard(poolLock);
+			wake.wait(guard, [&]() { return stopping || generation != seen; });
+			if (stopping) return;
+			seen = generation;
+			job = task;
+		}
+		(*job)(id);
+		{
+			std::lock_guard<std::mutex> guard(poolLock);
+			if (--pending == 0) done.notify_one();
+		}
+	}
+}
+
+void ThreadPool::RunOnAll(size_t work, const std::function<void(unsigned int)> & job)
+{
+	if (workers.empty() || work < MinParallelWork)
+	{
+		for (unsigned int id = 0; id < ThreadCount(); ++id) job(id);
+		return;
+	}
+
+	std::lock_guard<std::mutex> run(runLock);
+	{
+		std::lock_guard<std::mutex> guard(poolLock);
+		task = &job;
+		pending = workers.size();
+		++generation;
+	}
+	wake.notify_all();
+	job(0);
+
+	std::unique_lock<std::mutex> guard(poolLock);
+	done.wait(guard, [this]() { return pending == 0; });
+}
+
+void ThreadPool::RunOnSlices(size_t count, const std::function<void(size_t, size_t)> & job)
+{
+	const size_t threads = ThreadCount();
+
+	if (workers.empty() || count < MinParallelWork)
+	{
+		job(0, count);
+		return;
+	}
+	RunOnAll(count, [&](unsigned int id) { job(count * id / threads, count * (id + 1) / threads); });
+}
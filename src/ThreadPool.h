@@ -0,0 +1,57 @@
+// ===============================================================================================
+// Evacuation Solver: Thread pool
+// Description: A small pool of worker threads that stay up between jobs. A job either runs once per
+// thread id and splits its own work, or runs over slices of an index range. Jobs that are too small
+// to pay for waking up the workers run on the calling thread. Like NetworkGraph.h, this header does
+// not depend on ArcObjects.
+//
+// Copyright (C) 2014 Kaveh Shahabi
+// Distributed under the Apache Software License, Version 2.0. (See accompanying file LICENSE.txt)
+//
+// Author: Kaveh Shahabi
+// URL: http://github.com/spatial-computing/CASPER
+// ===============================================================================================
+
+#pragma once
+
+#include <vector>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+#include <algorithm>
+
+class ThreadPool
+{
+private:
+	std::vector<std::thread>                   workers;
+	std::mutex                                 runLock;  // one job at a time, even if two solves share the pool
+	std::mutex                                 poolLock;
+	std::condition_variable                    wake;
+	std::condition_variable                    done;
+	const std::function<void(unsigned int)> *  task;
+	unsigned int                               generation;
+	size_t                                     pending;
+	bool                                       stopping;
+
+	void WorkerLoop(unsigned int id);
+
+public:
+	// jobs smaller than this are not worth waking up the workers
+	static const size_t MinParallelWork = 256;
+
+	// 'threads' counts the calling thread too. Zero picks the number of hardware threads.
+	ThreadPool(unsigned int threads = 0);
+	virtual ~ThreadPool(void);
+	ThreadPool(const ThreadPool & that) = delete;
+	ThreadPool & operator=(const ThreadPool &) = delete;
+
+	unsigned int ThreadCount() const { return (unsigned int)workers.size() + 1; }
+
+	// runs job(id) for every thread id and returns once all of them are done. The job splits its work by the thread id
+	// so a small job simply runs every slice on the calling thread.
+	void RunOnAll(size_t work, const std::function<void(unsigned int)> & job);
+
+	// runs job(from, to) over one slice of [0, count) per thread
+	void RunOnSlices(size_t count, const std::function<void(size_t, size_t)> & job);
+};
@@ -11,58 +11,32 @@
 
 #include "StdAfx.h"
 #include "TrafficModel.h"
+#include <intrin.h>
+#include <immintrin.h>
 
 TrafficModel::TrafficModel(EvcTrafficModel Model, double _criticalDensPerCap, double _saturationDensPerCap, double _initDelayCostPerPop)
 	: model(Model), CriticalDensPerCap(_criticalDensPerCap), saturationDensPerCap(_saturationDensPerCap), InitDelayCostPerPop(_initDelayCostPerPop)
 {
 	if (saturationDensPerCap <= CriticalDensPerCap) saturationDensPerCap += CriticalDensPerCap;
-	myCache.max_load_factor(0.3);
-	cacheHit = 0;
-	cacheMiss = 0;
 }
 
-double TrafficModel::LeftCapacityOnEdge(double capacity, double reservedFlow, double originalEdgeCost) const
+// CCRP always runs as the STEP model so it gets the STEP capacity too
+double TrafficModel::LeftCapacityOnEdge(double capacity, double reservedFlow, double originalEdgeCost, EvcSolverMethod method) const
 {
 	double newPop = 0.0;
-	if (model == EvcTrafficModel::STEPModel) newPop = (CriticalDensPerCap * capacity) - reservedFlow;
+	if (model == EvcTrafficModel::STEPModel || method == EvcSolverMethod::CCRPSolver) newPop = (CriticalDensPerCap * capacity) - reservedFlow;
 	else newPop = (CriticalDensPerCap * capacity) - (saturationDensPerCap * capacity);
 	if ((InitDelayCostPerPop > 0.0) && (newPop > originalEdgeCost / InitDelayCostPerPop)) newPop = 2147483647.0; // max_int
 	newPop = max(newPop, 0.0);
 	return newPop;
 }
 
-double TrafficModel::GetCongestionPercentage(double capacity, double flow)
+TrafficCoefficients TrafficModel::GetCoefficients(double capacity) const
 {
-	double percentage = 1.0;
-	if (flow > CriticalDensPerCap * capacity)
-	{
-		const auto i = myCache.find(TrafficModelCacheNode(capacity, flow));
-		if (i != myCache.end())
-		{
-			percentage = i->second;
-			++cacheHit;
-		}
-		else
-		{
-			percentage = internalGetCongestionPercentage(capacity, flow);
-			myCache.insert(std::pair<TrafficModelCacheNode, double>(TrafficModelCacheNode(capacity, flow), percentage));
-			++cacheMiss;
-		}
-	}
-	else
-	{
-		++cacheHit;
-	}
-	return percentage;
-}
-
-// This is where the actual capacity aware part is happening:
-// We take the original values of the edge and recalculate the
-// new travel cost based on number of reserved spots by previous evacuees.
-double TrafficModel::internalGetCongestionPercentage(double capacity, double flow) const
-{
-	double a, b, modelRatio, expGamma, speedPercent = 1.0;
+	TrafficCoefficients c;
+	double a, b;
 
+	c.CriticalFlow = CriticalDensPerCap * capacity;
 	switch (model)
 	{
 	case EvcTrafficModel::EXPModel:
@@ -70,28 +44,204 @@ double TrafficModel::internalGetCongestionPercentage(double capacity, double flo
 			a = flow of normal speed, 	b = flow where the speed is dropped to half
 			(modelRatio) beta  = b * lane - 1;
 			(expGamma)   gamma = (log(log(0.96) / log(0.5))) / log((a * lane - 1) / (b * lane - 1));
+			the power is evaluated as exp(gamma * (log(flow - 1) - log(beta))) so only log(beta) is kept
 		*/
 		a = 2.0;
 		b = max(a + 1.0, saturationDensPerCap);
-		modelRatio  = b * capacity - 1.0;
-		expGamma    = (log(log(0.9) / log(0.5))) / log((a * capacity - 1.0) / (b * capacity - 1.0));
-		speedPercent = exp(-pow(((flow - 1.0) / modelRatio), expGamma) * log(2.0));
+		c.ModelRatio = log(b * capacity - 1.0);
+		c.ExpGamma   = (log(log(0.9) / log(0.5))) / log((a * capacity - 1.0) / (b * capacity - 1.0));
 		break;
 	case EvcTrafficModel::POWERModel:
 		/* Power model z = 1.0 - 0.0202 * sqrt(x) * exp(-0.01127 * y)
 			modelRatio = 0.0202 * exp(-0.01127 * reservations->Capacity);
 		*/
-		modelRatio  = 0.5 / (sqrt(saturationDensPerCap) * exp(-0.01127));
-		modelRatio *= exp(-0.01127 * capacity);
-		speedPercent = 1.0 - modelRatio * sqrt(flow);
+		c.ModelRatio  = 0.5 / (sqrt(saturationDensPerCap) * exp(-0.01127));
+		c.ModelRatio *= exp(-0.01127 * capacity);
 		break;
 	case EvcTrafficModel::LINEARModel:
-		speedPercent = 1.0 - (flow - CriticalDensPerCap * capacity) / (2.0 * (saturationDensPerCap * capacity - CriticalDensPerCap * capacity));
-		break;
-	case EvcTrafficModel::STEPModel:
-		speedPercent = 0.0;
+		c.ModelRatio = 1.0 / (2.0 * (saturationDensPerCap * capacity - CriticalDensPerCap * capacity));
 		break;
 	}
+	return c;
+}
+
+//******************************************************************************************/
+// Batch cost evaluation
+
+void TrafficBatch::Resize(size_t size)
+{
+	size_t padded = (size + Lanes - 1) / Lanes * Lanes;
+	count = size;
+
+	// the padding lanes are blocked edges with no flow so they never need the scalar fallback
+	OriginalCost.assign(padded, CASPER_INFINITY);
+	ReservedPop.assign(padded, 0.0);
+	Flow.assign(padded, 0.0);
+	CriticalFlow.assign(padded, 1.0);
+	ModelRatio.assign(padded, 1.0);
+	ExpGamma.assign(padded, 1.0);
+	Cost.resize(padded);
+	GlobalDeltaCost.resize(padded);
+}
+
+bool TrafficModel::IsAVX2Supported()
+{
+	static const bool supported = []() -> bool
+	{
+		int info[4] = { 0 };
+		__cpuid(info, 0);
+		if (info[0] < 7) return false;
+
+		// the OS has to save the upper halves of the ymm registers too
+		__cpuid(info, 1);
+		bool osxsave = (info[2] & (1 << 27)) != 0, avx = (info[2] & (1 << 28)) != 0;
+		if (!osxsave || !avx || (_xgetbv(0) & 0x6) != 0x6) return false;
+
+		__cpuidex(info, 7, 0);
+		return (info[1] & (1 << 5)) != 0;
+	}();
+	return supported;
+}
+
+// Double precision exp: x = n * log(2) + r with |r| <= log(2) / 2, exp(r) from its Taylor series up to r^11, and 2^n
+// straight into the exponent bits. The input is clamped so the result stays a normal number.
+static inline __m256d Exp4(__m256d x)
+{
+	const __m256d magic = _mm256_set1_pd(6755399441055744.0); // 2^52 + 2^51 rounds a double to an integer in its low bits
+	const double coef[] = { 1.0 / 39916800.0, 1.0 / 3628800.0, 1.0 / 362880.0, 1.0 / 40320.0, 1.0 / 5040.0, 1.0 / 720.0,
+		1.0 / 120.0, 1.0 / 24.0, 1.0 / 6.0, 0.5, 1.0, 1.0 };
+	__m256d n, r, p;
+	__m256i e;
+
+	x = _mm256_min_pd(_mm256_max_pd(x, _mm256_set1_pd(-708.0)), _mm256_set1_pd(708.0));
+	n = _mm256_round_pd(_mm256_mul_pd(x, _mm256_set1_pd(1.4426950408889634)), _MM_FROUND_TO_NEAREST_INT | _MM_FROUND_NO_EXC);
+	r = _mm256_sub_pd(x, _mm256_mul_pd(n, _mm256_set1_pd(6.93147180369123816490e-01)));
+	r = _mm256_sub_pd(r, _mm256_mul_pd(n, _mm256_set1_pd(1.90821492927058770002e-10)));
+
+	p = _mm256_set1_pd(coef[0]);
+	for (int i = 1; i < 12; ++i) p = _mm256_add_pd(_mm256_mul_pd(p, r), _mm256_set1_pd(coef[i]));
+
+	e = _mm256_sub_epi64(_mm256_castpd_si256(_mm256_add_pd(n, magic)), _mm256_castpd_si256(magic));
+	e = _mm256_slli_epi64(_mm256_add_epi64(e, _mm256_set1_epi64x(1023)), 52);
+	return _mm256_mul_pd(p, _mm256_castsi256_pd(e));
+}
+
+// Double precision natural log of positive normal numbers: x = 2^e * m with m in [sqrt(2)/2, sqrt(2)) and
+// log(m) = 2 * atanh(s) with s = (m - 1) / (m + 1), which is an odd series in s up to s^21.
+static inline __m256d Log4(__m256d x)
+{
+	const __m256d magic = _mm256_set1_pd(6755399441055744.0);
+	const __m256d one = _mm256_set1_pd(1.0);
+	const double coef[] = { 1.0 / 19.0, 1.0 / 17.0, 1.0 / 15.0, 1.0 / 13.0, 1.0 / 11.0, 1.0 / 9.0, 1.0 / 7.0, 1.0 / 5.0, 1.0 / 3.0, 1.0 };
+	__m256i bits = _mm256_castpd_si256(x);
+	__m256d e, m, big, s, s2, p;
+
+	e = _mm256_castsi256_pd(_mm256_add_epi64(_mm256_sub_epi64(_mm256_srli_epi64(bits, 52), _mm256_set1_epi64x(1023)), _mm256_castpd_si256(magic)));
+	e = _mm256_sub_pd(e, magic);
+	m = _mm256_castsi256_pd(_mm256_or_si256(_mm256_and_si256(bits, _mm256_set1_epi64x(0x000FFFFFFFFFFFFFLL)), _mm256_set1_epi64x(0x3FF0000000000000LL)));
 
-	return speedPercent;
-}
\ No newline at end of file
+	big = _mm256_cmp_pd(m, _mm256_set1_pd(1.4142135623730951), _CMP_GT_OQ);
+	m = _mm256_blendv_pd(m, _mm256_mul_pd(m, _mm256_set1_pd(0.5)), big);
+	e = _mm256_add_pd(e, _mm256_and_pd(big, one));
+
+	s = _mm256_div_pd(_mm256_sub_pd(m, one), _mm256_add_pd(m, one));
+	s2 = _mm256_mul_pd(s, s);
+	p = _mm256_set1_pd(1.0 / 21.0);
+	for (int i = 0; i < 10; ++i) p = _mm256_add_pd(_mm256_mul_pd(p, s2), _mm256_set1_pd(coef[i]));
+	p = _mm256_mul_pd(_mm256_mul_pd(p, s), _mm256_set1_pd(2.0));
+
+	return _mm256_add_pd(_mm256_mul_pd(e, _mm256_set1_pd(6.93147180369123816490e-01)), _mm256_add_pd(p, _mm256_mul_pd(e, _mm256_set1_pd(1.90821492927058770002e-10))));
+}
+
+// Speed ratio of four edges, clamped like SpeedRatio. Lanes that the polynomials can not handle (EXP with flow - 1 <= 0)
+// are flagged in 'fallback' and have to be evaluated by the scalar code. CCRP runs as the STEP model and SP as the FLAT model.
+template <EvcTrafficModel Model> static inline __m256d SpeedRatio4(__m256d flow, __m256d critical, __m256d ratio, __m256d gamma, __m256d & fallback)
+{
+	const __m256d one = _mm256_set1_pd(1.0);
+	__m256d congested = _mm256_cmp_pd(flow, critical, _CMP_GT_OQ), speed = one;
+
+	fallback = _mm256_setzero_pd();
+	if (Model == EvcTrafficModel::FLATModel) return one;
+	if (Model == EvcTrafficModel::EXPModel)
+	{
+		fallback = _mm256_and_pd(congested, _mm256_cmp_pd(_mm256_sub_pd(flow, one), _mm256_setzero_pd(), _CMP_LE_OQ));
+		speed = _mm256_mul_pd(_mm256_sub_pd(Log4(_mm256_max_pd(_mm256_sub_pd(flow, one), _mm256_set1_pd(DBL_MIN))), ratio), gamma);
+		speed = Exp4(_mm256_mul_pd(Exp4(speed), _mm256_set1_pd(-0.69314718055994531)));
+	}
+	else if (Model == EvcTrafficModel::POWERModel)  speed = _mm256_sub_pd(one, _mm256_mul_pd(ratio, _mm256_sqrt_pd(flow)));
+	else if (Model == EvcTrafficModel::LINEARModel) speed = _mm256_sub_pd(one, _mm256_mul_pd(_mm256_sub_pd(flow, critical), ratio));
+	else speed = _mm256_setzero_pd();
+
+	speed = _mm256_blendv_pd(one, speed, congested);
+	return _mm256_min_pd(one, _mm256_max_pd(_mm256_set1_pd(0.0001), speed));
+}
+
+template <EvcTrafficModel Model> static void GetCostsAVX2(TrafficBatch & b, bool globalDelta, size_t & first, size_t & last)
+{
+	const __m256d infinity = _mm256_set1_pd(CASPER_INFINITY);
+	__m256d cost, flow, critical, ratio, gamma, speed, reservedSpeed, blocked, fallback, reservedFallback;
+
+	for (; first < last; first += TrafficBatch::Lanes)
+	{
+		cost     = _mm256_loadu_pd(&(b.OriginalCost[first]));
+		flow     = _mm256_loadu_pd(&(b.Flow[first]));
+		critical = _mm256_loadu_pd(&(b.CriticalFlow[first]));
+		ratio    = _mm256_loadu_pd(&(b.ModelRatio[first]));
+		gamma    = _mm256_loadu_pd(&(b.ExpGamma[first]));
+		blocked  = _mm256_cmp_pd(cost, infinity, _CMP_GE_OQ);
+
+		speed = SpeedRatio4<Model>(flow, critical, ratio, gamma, fallback);
+		reservedFallback = _mm256_setzero_pd();
+		if (globalDelta) reservedSpeed = SpeedRatio4<Model>(_mm256_loadu_pd(&(b.ReservedPop[first])), critical, ratio, gamma, reservedFallback);
+		if (_mm256_movemask_pd(_mm256_andnot_pd(blocked, _mm256_or_pd(fallback, reservedFallback))) != 0) break;
+
+		_mm256_storeu_pd(&(b.Cost[first]), _mm256_blendv_pd(_mm256_div_pd(cost, speed), infinity, blocked));
+		if (globalDelta)
+			_mm256_storeu_pd(&(b.GlobalDeltaCost[first]), _mm256_andnot_pd(blocked, _mm256_mul_pd(cost, _mm256_sub_pd(reservedSpeed, speed))));
+	}
+	_mm256_zeroupper();
+}
+
+template <EvcSolverMethod Method, EvcTrafficModel Model> void TrafficModel::GetCosts(TrafficBatch & b, bool globalDelta, bool allowSIMD)
+{
+	const EvcTrafficModel vectorModel = Method == EvcSolverMethod::CASPERSolver ? Model :
+		(Method == EvcSolverMethod::CCRPSolver ? EvcTrafficModel::STEPModel : EvcTrafficModel::FLATModel);
+	TrafficCoefficients c;
+	size_t i = 0, last = b.Cost.size();
+	double speed;
+
+	while (i < last)
+	{
+		// the vector kernel stops at the first block that needs the scalar code and picks up again after it
+		if (allowSIMD && IsAVX2Supported()) GetCostsAVX2<vectorModel>(b, globalDelta, i, last);
+		for (size_t blockEnd = min(i + TrafficBatch::Lanes, last); i < blockEnd; ++i)
+		{
+			if (b.OriginalCost[i] >= CASPER_INFINITY)
+			{
+				b.Cost[i] = CASPER_INFINITY;
+				b.GlobalDeltaCost[i] = 0.0;
+				continue;
+			}
+			c.CriticalFlow = b.CriticalFlow[i];
+			c.ModelRatio   = b.ModelRatio[i];
+			c.ExpGamma     = b.ExpGamma[i];
+			speed = SpeedRatio<Method, Model>(c, b.Flow[i]);
+			b.Cost[i] = b.OriginalCost[i] / speed;
+			if (globalDelta) b.GlobalDeltaCost[i] = b.OriginalCost[i] * (SpeedRatio<Method, Model>(c, b.ReservedPop[i]) - speed);
+		}
+	}
+}
+
+TrafficModel::BatchCostFunction TrafficModel::GetBatchCostFunction(EvcSolverMethod method, EvcTrafficModel model)
+{
+	if (method == EvcSolverMethod::CCRPSolver) return &TrafficModel::GetCosts<EvcSolverMethod::CCRPSolver, EvcTrafficModel::STEPModel>;
+	if (method != EvcSolverMethod::CASPERSolver) return &TrafficModel::GetCosts<EvcSolverMethod::SPSolver, EvcTrafficModel::FLATModel>;
+	switch (model)
+	{
+	case EvcTrafficModel::EXPModel:    return &TrafficModel::GetCosts<EvcSolverMethod::CASPERSolver, EvcTrafficModel::EXPModel   >;
+	case EvcTrafficModel::POWERModel:  return &TrafficModel::GetCosts<EvcSolverMethod::CASPERSolver, EvcTrafficModel::POWERModel >;
+	case EvcTrafficModel::LINEARModel: return &TrafficModel::GetCosts<EvcSolverMethod::CASPERSolver, EvcTrafficModel::LINEARModel>;
+	case EvcTrafficModel::STEPModel:   return &TrafficModel::GetCosts<EvcSolverMethod::CASPERSolver, EvcTrafficModel::STEPModel  >;
+	default:                           return &TrafficModel::GetCosts<EvcSolverMethod::CASPERSolver, EvcTrafficModel::FLATModel  >;
+	}
+}
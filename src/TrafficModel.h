@@ -14,37 +14,41 @@
 #include "StdAfx.h"
 #include "utils.h"
 
-struct TrafficModelCacheNode
+// The parts of a traffic model that only depend on the capacity of a road. Each edge computes them once (see EdgeReservations)
+// so the speed at a given flow is a closed form over these and the flow.
+struct TrafficCoefficients
 {
-public:
-	double Capacity;
-	double Flow;
-	TrafficModelCacheNode(double capacity, double flow) : Capacity(capacity), Flow(flow) { }
+	double CriticalFlow; // the road runs at full speed up to this flow
+	double ModelRatio;   // EXP: log of beta, POWER: the factor of sqrt(flow), LINEAR: the slope of the speed drop
+	double ExpGamma;     // EXP: gamma
+	TrafficCoefficients() : CriticalFlow(0.0), ModelRatio(0.0), ExpGamma(0.0) { }
+};
 
-	inline bool friend operator<(const TrafficModelCacheNode& lhs, const TrafficModelCacheNode& rhs)
-	{
-		if (lhs.Capacity == rhs.Capacity) return lhs.Flow < rhs.Flow;
-		else return lhs.Capacity < rhs.Capacity;
-	}
+// Structure of arrays for the cost of a block of edges (see NAEdge::GetCosts). The arrays are padded up to a multiple of
+// Lanes with blocked edges so the kernels never run a scalar tail.
+class TrafficBatch
+{
+private:
+	size_t count;
 
-	inline bool friend operator==(const TrafficModelCacheNode& lhs, const TrafficModelCacheNode& rhs)
-	{
-		if (lhs.Capacity == rhs.Capacity) return lhs.Flow == rhs.Flow;
-		else return lhs.Capacity == rhs.Capacity;
-	}
+public:
+	static const size_t Lanes = 4;
 
-	inline bool friend operator!=(const TrafficModelCacheNode& lhs, const TrafficModelCacheNode& rhs){ return !(lhs == rhs); }
-	inline bool friend operator> (const TrafficModelCacheNode& lhs, const TrafficModelCacheNode& rhs){ return rhs < lhs;     }
-	inline bool friend operator<=(const TrafficModelCacheNode& lhs, const TrafficModelCacheNode& rhs){ return !(lhs > rhs);  }
-	inline bool friend operator>=(const TrafficModelCacheNode& lhs, const TrafficModelCacheNode& rhs){ return !(lhs < rhs);  }
+	// inputs
+	std::vector<double> OriginalCost; // CASPER_INFINITY if the edge is blocked
+	std::vector<double> ReservedPop;
+	std::vector<double> Flow;         // reserved plus the new population
+	std::vector<double> CriticalFlow;
+	std::vector<double> ModelRatio;
+	std::vector<double> ExpGamma;
 
-	struct Hasher : public std::hash<double>
-	{
-		size_t operator()(const TrafficModelCacheNode & e) const
-		{
-			return std::hash<double>::operator()(e.Capacity * 100.0 * e.Flow);
-		}
-	};
+	// outputs
+	std::vector<double> Cost;
+	std::vector<double> GlobalDeltaCost;
+
+	TrafficBatch(void) : count(0) { }
+	void   Resize(size_t size);
+	size_t Size() const { return count; }
 };
 
 class TrafficModel
@@ -52,11 +56,8 @@ class TrafficModel
 private:
 	EvcTrafficModel model;
 	double saturationDensPerCap;
-	std::unordered_map<TrafficModelCacheNode, double, TrafficModelCacheNode::Hasher> myCache;
-	unsigned int cacheMiss;
-	unsigned int cacheHit;
 
-	double internalGetCongestionPercentage(double capacity, double flow) const;
+	template <EvcSolverMethod Method, EvcTrafficModel Model> static void GetCosts(TrafficBatch & batch, bool globalDelta, bool allowSIMD);
 
 public:
 	double InitDelayCostPerPop;
@@ -66,8 +67,64 @@ public:
 	virtual ~TrafficModel(void) { }
 	TrafficModel(const TrafficModel & that) = delete;
 	TrafficModel & operator=(const TrafficModel &) = delete;
-	double GetCongestionPercentage(double capacity, double flow);
-	double LeftCapacityOnEdge(double capacity, double reservedFlow, double originalEdgeCost) const;
-	double GetCacheHitPercentage() const { return 100.0 * cacheHit / (cacheHit + cacheMiss); }
-};
+	double LeftCapacityOnEdge(double capacity, double reservedFlow, double originalEdgeCost, EvcSolverMethod method) const;
+	EvcTrafficModel GetModel() const { return model; }
+	TrafficCoefficients GetCoefficients(double capacity) const;
+
+	// the batch cost kernel of one solver method and traffic model pair (see GetCosts)
+	typedef void (*BatchCostFunction)(TrafficBatch & batch, bool globalDelta, bool allowSIMD);
+
+	// This is where the actual capacity aware part is happening:
+	// We take the original values of the edge and recalculate the
+	// new travel cost based on number of reserved spots by previous evacuees.
+	// The model is a template argument so the checks below fold away once it is instantiated.
+	template <EvcTrafficModel Model> static inline double CongestionPercentage(const TrafficCoefficients & c, double flow)
+	{
+		if (Model == EvcTrafficModel::FLATModel || flow <= c.CriticalFlow) return 1.0;
+		if (Model == EvcTrafficModel::EXPModel)    return exp(-exp(c.ExpGamma * (log(flow - 1.0) - c.ModelRatio)) * 0.69314718055994531); // log(2)
+		if (Model == EvcTrafficModel::POWERModel)  return 1.0 - c.ModelRatio * sqrt(flow);
+		if (Model == EvcTrafficModel::LINEARModel) return 1.0 - (flow - c.CriticalFlow) * c.ModelRatio;
+		return 0.0;
+	}
+
+	// the ratio of the original speed that is left at this flow. CCRP only checks the critical flow and SP ignores the traffic.
+	template <EvcSolverMethod Method, EvcTrafficModel Model> static inline double SpeedRatio(const TrafficCoefficients & c, double flow)
+	{
+		double speedPercent = 1.0;
+		if      (Method == EvcSolverMethod::CASPERSolver) speedPercent = CongestionPercentage<Model>(c, flow);
+		else if (Method == EvcSolverMethod::CCRPSolver  ) speedPercent = flow > c.CriticalFlow ? 0.0 : 1.0;
+		return min(1.0, max(0.0001, speedPercent));
+	}
+
+	inline double GetCongestionPercentage(const TrafficCoefficients & c, double flow) const
+	{
+		switch (model)
+		{
+		case EvcTrafficModel::EXPModel:    return CongestionPercentage<EvcTrafficModel::EXPModel   >(c, flow);
+		case EvcTrafficModel::POWERModel:  return CongestionPercentage<EvcTrafficModel::POWERModel >(c, flow);
+		case EvcTrafficModel::LINEARModel: return CongestionPercentage<EvcTrafficModel::LINEARModel>(c, flow);
+		case EvcTrafficModel::STEPModel:   return CongestionPercentage<EvcTrafficModel::STEPModel  >(c, flow);
+		default:                           return CongestionPercentage<EvcTrafficModel::FLATModel  >(c, flow);
+		}
+	}
+
+	double GetCongestionPercentage(double capacity, double flow) const { return GetCongestionPercentage(GetCoefficients(capacity), flow); }
+
+	inline double GetSpeedRatio(const TrafficCoefficients & c, double flow, EvcSolverMethod method) const
+	{
+		if      (method == EvcSolverMethod::CASPERSolver) return min(1.0, max(0.0001, GetCongestionPercentage(c, flow)));
+		else if (method == EvcSolverMethod::CCRPSolver  ) return SpeedRatio<EvcSolverMethod::CCRPSolver, EvcTrafficModel::STEPModel>(c, flow);
+		else return 1.0;
+	}
 
+	// Fills the cost and (if asked) the global delta cost of every edge in the batch, the same as NAEdge::GetCost would.
+	// On a CPU with AVX2 the edges are evaluated four at a time. The FLAT, STEP, LINEAR, and POWER models then give the exact
+	// scalar answer. The EXP model uses polynomial exp and log and stays within 1e-12 relative error of the scalar answer.
+	void GetCosts(TrafficBatch & batch, EvcSolverMethod method, bool globalDelta, bool allowSIMD = true) const { GetBatchCostFunction(method, model)(batch, globalDelta, allowSIMD); }
+
+	// The one run-time dispatch over the solver method and the traffic model. Pairs that behave the same share a kernel:
+	// SP ignores the traffic model and CCRP always behaves like the STEP model. Only the cost kernels are specialized; the
+	// CASPER and CARMA relax loops are not templates and call the kernel once per adjacency block through this pointer.
+	static BatchCostFunction GetBatchCostFunction(EvcSolverMethod method, EvcTrafficModel model);
+	static bool IsAVX2Supported();
+};
@@ -134,6 +134,8 @@ using ATL::CRegistryVirtualMachine;
 #include <functional>
 #include <memory>
 #include <iterator>
+#include <chrono>
+#include <cfloat>
 
 #pragma warning(push)
 #pragma warning(disable : 4521) /* Ignore warning for boost::heap multiple copy constructors  */
@@ -185,6 +185,14 @@ public:
 		data[index] = data[--_size];
 	}
 
+	// removes all the matching items in one sweep and keeps the order of the rest
+	void remove_if(std::function<bool(const T &)> isRemoved)
+	{
+		S last = ZeroSize;
+		for (S i = ZeroSize; i < _size; ++i) if (!isRemoved(data[i])) data[last++] = data[i];
+		_size = last;
+	}
+
 	/// TODO this iterator is still bugy if you use it with std::sort ... or maybe other STL functions. Be careful.
 	class iterator : public virtual std::iterator<std::random_access_iterator_tag, T>
 	{